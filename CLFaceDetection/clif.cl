@@ -9,10 +9,8 @@ kernel void bgrToGrayscale(global uchar* src,
 {
     int coord = (get_global_id(1) * stride) + (get_global_id(0) * 3);
     
-    uint temp = (uint)(rgb_to_grayscale_coeff[2] * src[coord] +
-                       rgb_to_grayscale_coeff[1] * src[coord + 1] +
-                       rgb_to_grayscale_coeff[0] * src[coord + 2]);
-    temp = clamp((uint)temp, (uint)0, (uint)255);
+    // Fixed point coefficients of cvCvtColor (CV_BGR2GRAY), so that device and host integral images match
+    uint temp = (src[coord] * 1868 + src[coord + 1] * 9617 + src[coord + 2] * 4899 + (1 << 13)) >> 14;
     
     dst[(get_global_id(1) * width) + get_global_id(0)] = (uchar)temp;
 }
@@ -75,31 +73,33 @@ kernel void bgrToGrayscalePerRow(global uchar3* src,
 
 
 // Input is grayscale 8U image
-// Output is a (width + 1) * (height + 1) 32U image
+// Output are the row sums and square row sums of a (width + 1) * (height + 1)
+// image, rows 1..height (row 0 is not used by integralImageSumCols)
 kernel void integralImageSumRows(global uchar* src,
                                  global uint* dst,
                                  global ulong* dst_square,
                                  uint width,
                                  uint stride)
 {
-    // First row is 0
     int src_start = get_global_id(0) * stride;
     int dst_start = (get_global_id(0) + 1) * (width + 1);
     
     dst[dst_start] = 0;
+    dst_square[dst_start] = 0;
     uint sum = 0;
-    uint sum_square = 0;
+    ulong sum_square = 0;
     for(uint col = 0; col < width; col++) {
         uchar src_el = src[src_start + col];
         sum += src_el;
-        sum_square += (src_el * src_el);
+        sum_square += (uint)(src_el * src_el);
         dst[dst_start + col + 1] = sum;
         dst_square[dst_start + col + 1] = sum_square;
     }
 }
 
-// Input is a 32U image
-// Output is a 32U image
+// Input are the row sums of integralImageSumRows, a work item per column 1..width
+// Output is the integral image and square integral image (same as cvIntegral),
+// first row and column are 0
 kernel void integralImageSumCols(global uint* src,
                                  global ulong* src_square,
                                  global uint* dst,
@@ -107,15 +107,73 @@ kernel void integralImageSumCols(global uint* src,
                                  uint width,
                                  uint height)
 {
-    // First columns is 0
-    int start = (get_global_id(0) + 1);
+    int col = get_global_id(0) + 1;
+    
+    dst[col] = 0;
+    dst_square[col] = 0;
+    if(col == 1) {
+        for(uint row = 0; row <= height; row++) {
+            dst[row * (width + 1)] = 0;
+            dst_square[row * (width + 1)] = 0;
+        }
+    }
     
     uint sum = 0;
-    for(uint row = 0; row < height; row ++) {
-        uint src_el = src[start + (row * (width + 1))];
-        sum += src_el;
-        dst[start + (row * (width + 1))] = sum;
-        dst_square[start + (row * (width + 1))] = sum;
+    ulong sum_square = 0;
+    for(uint row = 1; row <= height; row++) {
+        sum += src[col + (row * (width + 1))];
+        sum_square += src_square[col + (row * (width + 1))];
+        dst[col + (row * (width + 1))] = sum;
+        dst_square[col + (row * (width + 1))] = sum_square;
+    }
+}
+
+// Tilted integral image (the tilted sum of cvIntegral), it follows the
+// (width + 1) * (height + 1) integral image in dst. Input are the row sums
+// of integralImageSumRows. An element is the running sum of the row sums
+// along its x + y diagonal minus the one along its x - y diagonal, one work
+// item per diagonal (width + height of each)
+kernel void tiltedIntegralSumDiagonals(global uint* src,
+                                       global uint* dst,
+                                       uint width,
+                                       uint height)
+{
+    // x + y - 1 of the diagonal, first row is 0
+    int line = get_global_id(0);
+    global uint* tilted = dst + ((width + 1) * (height + 1));
+    if(line <= (int)width)
+        tilted[line] = 0;
+
+    uint sum = 0;
+    for(int y = 1; y <= (int)height; y++) {
+        int x = line - y + 1;
+        if(x < 0)
+            break;
+        sum += src[(y * (width + 1)) + min(x, (int)width)];
+        if(x <= (int)width)
+            tilted[(y * (width + 1)) + x] = sum;
+    }
+}
+
+// After tiltedIntegralSumDiagonals
+kernel void tiltedIntegralSubDiagonals(global uint* src,
+                                       global uint* dst,
+                                       uint width,
+                                       uint height)
+{
+    // x - y of the diagonal
+    int line = (int)get_global_id(0) - (int)height;
+    global uint* tilted = dst + ((width + 1) * (height + 1));
+
+    uint sum = 0;
+    for(int y = 1; y <= (int)height; y++) {
+        int x = line + y;
+        if(x > (int)width)
+            break;
+        if(x > 0)
+            sum += src[(y * (width + 1)) + x - 1];
+        if(x >= 0)
+            tilted[(y * (width + 1)) + x] -= sum;
     }
 }
 
@@ -135,3 +193,93 @@ kernel void invert(global uchar* bmp,
     pix = bmp[coord + 2];
     temp[coord + 2] = 255 - pix;
 }
+
+// Input is grayscale 8U image
+// Output is 1 where |dx| + |dy| of the 3x3 sobel is at least threshold, 0 elsewhere (and on borders)
+kernel void sobelEdges(global uchar* src,
+                       global uchar* dst,
+                       uint width,
+                       uint height,
+                       int threshold)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    if(x >= width || y >= height)
+        return;
+    
+    uchar edge = 0;
+    if(x > 0 && y > 0 && x < width - 1 && y < height - 1) {
+        global uchar* above = &src[(y - 1) * width];
+        global uchar* row = &src[y * width];
+        global uchar* below = &src[(y + 1) * width];
+        int dx = (above[x + 1] + 2 * row[x + 1] + below[x + 1]) - (above[x - 1] + 2 * row[x - 1] + below[x - 1]);
+        int dy = (below[x - 1] + 2 * below[x] + below[x + 1]) - (above[x - 1] + 2 * above[x] + above[x + 1]);
+        edge = (abs(dx) + abs(dy)) >= threshold;
+    }
+    dst[(y * width) + x] = edge;
+}
+
+// Input is the 8U edge mask
+// Output is a (width + 1) * (height + 1) 32U image, rows summed
+kernel void edgeIntegralSumRows(global uchar* src,
+                                global uint* dst,
+                                uint width)
+{
+    int src_start = get_global_id(0) * width;
+    int dst_start = (get_global_id(0) + 1) * (width + 1);
+    
+    dst[dst_start] = 0;
+    uint sum = 0;
+    for(uint col = 0; col < width; col++) {
+        sum += src[src_start + col];
+        dst[dst_start + col + 1] = sum;
+    }
+}
+
+// Input is the row summed 32U image
+// Output is the 32U integral image, first row and column are 0
+kernel void edgeIntegralSumCols(global uint* src,
+                                global uint* dst,
+                                uint width,
+                                uint height)
+{
+    int col = get_global_id(0);
+    
+    dst[col] = 0;
+    uint sum = 0;
+    for(uint row = 1; row <= height; row++) {
+        sum += src[col + (row * (width + 1))];
+        dst[col + (row * (width + 1))] = sum;
+    }
+}
+
+// Input is the grayscale 8U image and the previous one, a work item per block
+// Output is 1 for blocks where a pixel changed by more than threshold, the previous image is replaced
+kernel void motionBlocks(global uchar* src,
+                         global uchar* previous,
+                         global uchar* motion,
+                         uint width,
+                         uint height,
+                         uint block_size,
+                         int threshold)
+{
+    uint block_x = get_global_id(0);
+    uint block_y = get_global_id(1);
+    uint block_columns = (width + block_size - 1) / block_size;
+    uint block_rows = (height + block_size - 1) / block_size;
+    if(block_x >= block_columns || block_y >= block_rows)
+        return;
+    
+    uchar moved = 0;
+    uint end_y = min((block_y + 1) * block_size, height);
+    uint end_x = min((block_x + 1) * block_size, width);
+    for(uint y = block_y * block_size; y < end_y; y++) {
+        for(uint x = block_x * block_size; x < end_x; x++) {
+            uint i = (y * width) + x;
+            if(abs((int)src[i] - (int)previous[i]) > threshold)
+                moved = 1;
+            previous[i] = src[i];
+        }
+    }
+    motion[(block_y * block_columns) + block_x] = moved;
+}
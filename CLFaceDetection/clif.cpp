@@ -1,10 +1,29 @@
 #include "clif.h"
+#include "clodprogram.h"
+// Generated in the build tree by the CMake build, the committed copy otherwise
+#ifdef CLOD_KERNELS_HEADER
+#include CLOD_KERNELS_HEADER
+#else
+#include "clodkernels.h"
+#endif
 
 #define matp(matrix,stride,x,y) (matrix + ((stride) * (y)) + (x))
 #define mate(matrix,stride,x,y) (*(matp(matrix,stride,x,y)))
 
+const char* clif_kernel_functions[] = { "bgrToGrayscale", "integralImageSumRows", "integralImageSumCols",
+                                        "sobelEdges", "edgeIntegralSumRows", "edgeIntegralSumCols",
+                                        "motionBlocks", "tiltedIntegralSumDiagonals", "tiltedIntegralSubDiagonals" };
+#define CLIF_KERNEL_COUNT (sizeof(clif_kernel_functions) / sizeof(const char*))
+
 
 // Private computations start
+/* Local size argument of an enqueue, NULL (driver choice) for 0 */
+static inline const size_t*
+localSize(const size_t* local_size)
+{
+    return local_size[0] != 0 ? local_size : NULL;
+}
+
 /*
 void
 ifIntegralImage(const cl_uchar* source,
@@ -79,31 +98,34 @@ ifBgrToGrayScale(const cl_uchar* source,
 // Init and release OpenCLIF environment
 CLIFEnvironmentData*
 clifInitEnvironment(const cl_uint device_index)
+{
+    return clifInitDeviceEnvironment(clodGetDevice(device_index));
+}
+
+CLIFEnvironmentData*
+clifInitDeviceEnvironment(cl_device_id device)
 {
     CLIFEnvironmentData* data = (CLIFEnvironmentData*)malloc(sizeof(CLIFEnvironmentData));
+    data->image_width = data->image_height = 0;
+    data->image_stride = data->image_channels = 0;
+    data->profile = NULL;
+    clodDefaultTuning(&(data->tuning));
+    clodLoadTuning(device, &(data->tuning));
     
-    // Get available devices
-    cl_uint platform_device_count;
-    CLDeviceInfo* platform_device_list = clGetDeviceList(&platform_device_count);
-    
-    // Get selected device
-    CLDeviceInfo device = platform_device_list[device_index];
-    
-    // Set up kernel file path and functions
-    const char* kernel_path = "/Users/Gabriele/Documents/Projects/CLFaceDetection/CLFaceDetection/clif.cl";
-    const char* kernel_functions[] = { "bgrToGrayscale", "integralImageSumRows", "integralImageSumCols" };
-   
-    // Create device environment
+    // Create device environment, kernels are built from the embedded clif.cl
     char build_options[1024] = { 0 };
-    clCreateDeviceEnvironment(&device, 1, kernel_path, kernel_functions, 3, build_options, 0, 0, &(data->environment));
-    
-    // Release
-    for(cl_uint i = 0; i < platform_device_count; i++)
-        clFreeDeviceInfo(&platform_device_list[i]);
-    free(platform_device_list);
+    clodCreateDeviceEnvironment(device, clif_cl_source, clif_kernel_functions, CLIF_KERNEL_COUNT, build_options, &(data->environment));
     
     return data;
 }
+
+CLIFEnvironmentData*
+clifInitHostEnvironment()
+{
+    CLIFEnvironmentData* data = (CLIFEnvironmentData*)calloc(1, sizeof(CLIFEnvironmentData));
+    clodDefaultTuning(&(data->tuning));
+    return data;
+}
     /*
      // Create source image
      cl_mem source_image = NULL;
@@ -125,6 +147,10 @@ clifInitBuffers(CLIFEnvironmentData* data,
                 const cl_uint image_channels)
 {
     cl_int error = CL_SUCCESS;
+    data->image_width = image_width;
+    data->image_height = image_height;
+    data->image_stride = image_stride;
+    data->image_channels = image_channels;
     
     // Setup bgr to gray buffers
     data->bgr_to_gray_data.buffers[0] =
@@ -159,10 +185,11 @@ clifInitBuffers(CLIFEnvironmentData* data,
                    (image_width + 1) * (image_height + 1) * sizeof(cl_double),
                        NULL, &error);
     clCheckOrExit(error);
+    // Sums followed by the tilted sums
     data->integral_image_data.buffers[3] =
     clCreateBuffer(data->environment.context,
-                   CL_MEM_ALLOC_HOST_PTR | CL_MEM_WRITE_ONLY,
-                   (image_width + 1) * (image_height + 1) * sizeof(cl_uint),
+                   CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_WRITE,
+                   2 * (image_width + 1) * (image_height + 1) * sizeof(cl_uint),
                    NULL, &error);
     clCheckOrExit(error);
     data->integral_image_data.buffers[4] =
@@ -172,69 +199,210 @@ clifInitBuffers(CLIFEnvironmentData* data,
                    NULL, &error);
     clCheckOrExit(error);
     
+    // Setup edge buffers (mask, row sums, integral)
+    data->edge_data.buffers[0] =
+    clCreateBuffer(data->environment.context,
+                   CL_MEM_READ_WRITE,
+                   image_width * image_height,
+                   NULL, &error);
+    clCheckOrExit(error);
+    data->edge_data.buffers[1] =
+    clCreateBuffer(data->environment.context,
+                   CL_MEM_READ_WRITE,
+                   (image_width + 1) * (image_height + 1) * sizeof(cl_uint),
+                   NULL, &error);
+    clCheckOrExit(error);
+    data->edge_data.buffers[2] =
+    clCreateBuffer(data->environment.context,
+                   CL_MEM_ALLOC_HOST_PTR | CL_MEM_WRITE_ONLY,
+                   (image_width + 1) * (image_height + 1) * sizeof(cl_uint),
+                   NULL, &error);
+    clCheckOrExit(error);
+    
+    // Setup motion buffers (previous grayscale, block map)
+    data->motion_data.block_size = CLIF_DEFAULT_MOTION_BLOCK_SIZE;
+    cl_uint block_columns = (image_width + data->motion_data.block_size - 1) / data->motion_data.block_size;
+    cl_uint block_rows = (image_height + data->motion_data.block_size - 1) / data->motion_data.block_size;
+    data->motion_data.buffers[0] =
+    clCreateBuffer(data->environment.context,
+                   CL_MEM_READ_WRITE,
+                   image_width * image_height,
+                   NULL, &error);
+    clCheckOrExit(error);
+    data->motion_data.buffers[1] =
+    clCreateBuffer(data->environment.context,
+                   CL_MEM_ALLOC_HOST_PTR | CL_MEM_WRITE_ONLY,
+                   block_columns * block_rows,
+                   NULL, &error);
+    clCheckOrExit(error);
+    data->motion_data.previous_image = NULL;
+    data->motion_data.has_previous = CL_FALSE;
+    
     // Setup bgr to gray sizes
     data->bgr_to_gray_data.global_size[0] = image_width;
     data->bgr_to_gray_data.global_size[1] = image_height;
-    data->bgr_to_gray_data.local_size[0] = 64;
-    data->bgr_to_gray_data.local_size[1] = 1;
     
     // Setup integral image sizes
     data->integral_image_data.global_size[0] = image_height;
     data->integral_image_data.global_size[1] = image_width;
-    data->integral_image_data.local_size[0] = 32;
-    data->integral_image_data.local_size[1] = 64;
+    
+    // Setup edge sizes (sobel, then rows, then columns)
+    data->edge_data.global_size[0] = image_width;
+    data->edge_data.global_size[1] = image_height;
+    clifApplyTuning(data);
+    
+    // Setup motion sizes (a work item per block)
+    data->motion_data.global_size[0] = block_columns;
+    data->motion_data.global_size[1] = block_rows;
     
     // Setup bgr to gray kernel args
-    clSetKernelArg(data->environment.kernels[0], 0, sizeof(cl_mem), &(data->bgr_to_gray_data.buffers[0]));
+    error = clSetKernelArg(data->environment.kernels[0], 0, sizeof(cl_mem), &(data->bgr_to_gray_data.buffers[0]));
     clCheckOrExit(error);
-    clSetKernelArg(data->environment.kernels[0], 1, sizeof(cl_mem), &(data->bgr_to_gray_data.buffers[1]));
+    error = clSetKernelArg(data->environment.kernels[0], 1, sizeof(cl_mem), &(data->bgr_to_gray_data.buffers[1]));
     clCheckOrExit(error);
-    clSetKernelArg(data->environment.kernels[0], 2, sizeof(cl_uint), &(image_width));
+    error = clSetKernelArg(data->environment.kernels[0], 2, sizeof(cl_uint), &(image_width));
     clCheckOrExit(error);
-    clSetKernelArg(data->environment.kernels[0], 3, sizeof(cl_uint), &(image_height));
+    error = clSetKernelArg(data->environment.kernels[0], 3, sizeof(cl_uint), &(image_height));
     clCheckOrExit(error);
-    clSetKernelArg(data->environment.kernels[0], 4, sizeof(cl_uint), &(image_stride));
+    error = clSetKernelArg(data->environment.kernels[0], 4, sizeof(cl_uint), &(image_stride));
     clCheckOrExit(error);
     
     // Setup integral image (sum rows) kernel args
-    clSetKernelArg(data->environment.kernels[1], 0, sizeof(cl_mem), &(data->integral_image_data.buffers[0]));
+    error = clSetKernelArg(data->environment.kernels[1], 0, sizeof(cl_mem), &(data->integral_image_data.buffers[0]));
     clCheckOrExit(error);
-    clSetKernelArg(data->environment.kernels[1], 1, sizeof(cl_mem), &(data->integral_image_data.buffers[1]));
+    error = clSetKernelArg(data->environment.kernels[1], 1, sizeof(cl_mem), &(data->integral_image_data.buffers[1]));
     clCheckOrExit(error);
-    clSetKernelArg(data->environment.kernels[1], 2, sizeof(cl_mem), &(data->integral_image_data.buffers[2]));
+    error = clSetKernelArg(data->environment.kernels[1], 2, sizeof(cl_mem), &(data->integral_image_data.buffers[2]));
     clCheckOrExit(error);
-    clSetKernelArg(data->environment.kernels[1], 3, sizeof(cl_uint), &(image_width));
+    error = clSetKernelArg(data->environment.kernels[1], 3, sizeof(cl_uint), &(image_width));
     clCheckOrExit(error);
     // NB: Set stride to width because we know window size is multiple of 4
-    clSetKernelArg(data->environment.kernels[1], 4, sizeof(cl_uint), &(image_width));
+    error = clSetKernelArg(data->environment.kernels[1], 4, sizeof(cl_uint), &(image_width));
+    clCheckOrExit(error);
     
-    // Setup integral image (sum rows) kernel args
-    clSetKernelArg(data->environment.kernels[2], 0, sizeof(cl_mem), &(data->integral_image_data.buffers[1]));
+    // Setup integral image (sum cols) kernel args
+    error = clSetKernelArg(data->environment.kernels[2], 0, sizeof(cl_mem), &(data->integral_image_data.buffers[1]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[2], 1, sizeof(cl_mem), &(data->integral_image_data.buffers[2]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[2], 2, sizeof(cl_mem), &(data->integral_image_data.buffers[3]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[2], 3, sizeof(cl_mem), &(data->integral_image_data.buffers[4]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[2], 4, sizeof(cl_uint), &(image_width));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[2], 5, sizeof(cl_uint), &(image_height));
+    clCheckOrExit(error);
+    
+    // Setup sobel kernel args, source is the output of grayscale
+    cl_int edge_threshold = CLIF_DEFAULT_EDGE_THRESHOLD;
+    error = clSetKernelArg(data->environment.kernels[3], 0, sizeof(cl_mem), &(data->bgr_to_gray_data.buffers[1]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[3], 1, sizeof(cl_mem), &(data->edge_data.buffers[0]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[3], 2, sizeof(cl_uint), &(image_width));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[3], 3, sizeof(cl_uint), &(image_height));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[3], 4, sizeof(cl_int), &(edge_threshold));
+    clCheckOrExit(error);
+    
+    // Setup edge integral (sum rows) kernel args
+    error = clSetKernelArg(data->environment.kernels[4], 0, sizeof(cl_mem), &(data->edge_data.buffers[0]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[4], 1, sizeof(cl_mem), &(data->edge_data.buffers[1]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[4], 2, sizeof(cl_uint), &(image_width));
+    clCheckOrExit(error);
+    
+    // Setup edge integral (sum cols) kernel args
+    error = clSetKernelArg(data->environment.kernels[5], 0, sizeof(cl_mem), &(data->edge_data.buffers[1]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[5], 1, sizeof(cl_mem), &(data->edge_data.buffers[2]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[5], 2, sizeof(cl_uint), &(image_width));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[5], 3, sizeof(cl_uint), &(image_height));
     clCheckOrExit(error);
-    clSetKernelArg(data->environment.kernels[2], 1, sizeof(cl_mem), &(data->integral_image_data.buffers[2]));
+    
+    // Setup motion kernel args, source is the output of grayscale
+    cl_int motion_threshold = CLIF_DEFAULT_MOTION_THRESHOLD;
+    error = clSetKernelArg(data->environment.kernels[6], 0, sizeof(cl_mem), &(data->bgr_to_gray_data.buffers[1]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[6], 1, sizeof(cl_mem), &(data->motion_data.buffers[0]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[6], 2, sizeof(cl_mem), &(data->motion_data.buffers[1]));
     clCheckOrExit(error);
-    clSetKernelArg(data->environment.kernels[2], 2, sizeof(cl_mem), &(data->integral_image_data.buffers[3]));
+    error = clSetKernelArg(data->environment.kernels[6], 3, sizeof(cl_uint), &(image_width));
     clCheckOrExit(error);
-    clSetKernelArg(data->environment.kernels[2], 3, sizeof(cl_mem), &(data->integral_image_data.buffers[4]));
+    error = clSetKernelArg(data->environment.kernels[6], 4, sizeof(cl_uint), &(image_height));
     clCheckOrExit(error);
-    clSetKernelArg(data->environment.kernels[2], 4, sizeof(cl_uint), &(image_width));
+    error = clSetKernelArg(data->environment.kernels[6], 5, sizeof(cl_uint), &(data->motion_data.block_size));
     clCheckOrExit(error);
-    clSetKernelArg(data->environment.kernels[2], 5, sizeof(cl_uint), &(image_height));
+    error = clSetKernelArg(data->environment.kernels[6], 6, sizeof(cl_int), &(motion_threshold));
     clCheckOrExit(error);
+    
+    // Setup tilted integral kernel args, source are the row sums
+    for(cl_uint i = 7; i < 9; i++) {
+        error = clSetKernelArg(data->environment.kernels[i], 0, sizeof(cl_mem), &(data->integral_image_data.buffers[1]));
+        clCheckOrExit(error);
+        error = clSetKernelArg(data->environment.kernels[i], 1, sizeof(cl_mem), &(data->integral_image_data.buffers[3]));
+        clCheckOrExit(error);
+        error = clSetKernelArg(data->environment.kernels[i], 2, sizeof(cl_uint), &(image_width));
+        clCheckOrExit(error);
+        error = clSetKernelArg(data->environment.kernels[i], 3, sizeof(cl_uint), &(image_height));
+        clCheckOrExit(error);
+    }
+}
+
+/* Tuned local size if it fits global_size, else 0 */
+static void
+fitLocalSize(cl_kernel kernel,
+             cl_device_id device,
+             const cl_uint dimensions,
+             const size_t* global_size,
+             const size_t* tuned_local_size,
+             size_t* local_size)
+{
+    cl_bool fits = clodFitsLocalSize(kernel, device, dimensions, global_size, tuned_local_size);
+    for(cl_uint i = 0; i < dimensions; i++)
+        local_size[i] = fits ? tuned_local_size[i] : 0;
+}
+
+void
+clifApplyTuning(CLIFEnvironmentData* data)
+{
+    cl_device_id device;
+    cl_int error = clGetCommandQueueInfo(data->environment.queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, NULL);
+    clCheckOrExit(error);
+    
+    // Integral rows and columns are separate 1D launches
+    fitLocalSize(data->environment.kernels[0], device, 2, data->bgr_to_gray_data.global_size, data->tuning.gray_local_size, data->bgr_to_gray_data.local_size);
+    fitLocalSize(data->environment.kernels[1], device, 1, &(data->integral_image_data.global_size[0]), &(data->tuning.integral_local_size[0]), &(data->integral_image_data.local_size[0]));
+    fitLocalSize(data->environment.kernels[2], device, 1, &(data->integral_image_data.global_size[1]), &(data->tuning.integral_local_size[1]), &(data->integral_image_data.local_size[1]));
+    fitLocalSize(data->environment.kernels[3], device, 2, data->edge_data.global_size, data->tuning.edge_local_size, data->edge_data.local_size);
 }
 
 void
 clifReleaseBuffers(CLIFEnvironmentData* data) {
+    data->image_width = data->image_height = 0;
     for(cl_uint i = 0; i < 2; i++)
         clReleaseMemObject(data->bgr_to_gray_data.buffers[i]);
     for(cl_uint i = 0; i < 5; i++)
         clReleaseMemObject(data->integral_image_data.buffers[i]);
+    for(cl_uint i = 0; i < 3; i++)
+        clReleaseMemObject(data->edge_data.buffers[i]);
+    for(cl_uint i = 0; i < 2; i++)
+        clReleaseMemObject(data->motion_data.buffers[i]);
+    if(data->motion_data.previous_image != NULL)
+        cvReleaseImage(&(data->motion_data.previous_image));
 }
     
 void
 clifReleaseEnvironment(CLIFEnvironmentData* data) {
     //clEnqueueUnmapMemObject(data.environment.queue, data.dest_image, data.dest_ptr, 0, NULL, NULL);
-    clFreeDeviceEnvironments(&(data->environment), 1, 0);
+    if(data->environment.context != NULL)
+        clodFreeDeviceEnvironment(&(data->environment), CLIF_KERNEL_COUNT);
 }
 
 // OpenCLIF computations
@@ -253,15 +421,15 @@ clifGrayscale(const IplImage* source,
     cl_int error = CL_SUCCESS;
     
     // Init buffer
-    error = clEnqueueWriteBuffer(data->environment.queue, data->bgr_to_gray_data.buffers[0], CL_FALSE, 0, source->widthStep * source->height, source->imageData, 0, NULL, NULL);
+    error = clEnqueueWriteBuffer(data->environment.queue, data->bgr_to_gray_data.buffers[0], CL_FALSE, 0, source->widthStep * source->height, source->imageData, 0, NULL, clodProfileEvent(data->profile, "write"));
     clCheckOrExit(error);
     
     // Run kernel
-    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[0], 2, NULL, data->bgr_to_gray_data.global_size, data->bgr_to_gray_data.local_size, 0, NULL, NULL);
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[0], 2, NULL, data->bgr_to_gray_data.global_size, localSize(data->bgr_to_gray_data.local_size), 0, NULL, clodProfileEvent(data->profile, clif_kernel_functions[0]));
     clCheckOrExit(error);
     
     // Read result
-    cl_uchar* result = (cl_uchar*)clEnqueueMapBuffer(data->environment.queue, data->bgr_to_gray_data.buffers[1], CL_TRUE, CL_MAP_READ, 0, source->width * source->height, 0, NULL, NULL, &error);
+    cl_uchar* result = (cl_uchar*)clEnqueueMapBuffer(data->environment.queue, data->bgr_to_gray_data.buffers[1], CL_TRUE, CL_MAP_READ, 0, source->width * source->height, 0, NULL, clodProfileEvent(data->profile, "map"), &error);
     clCheckOrExit(error);
     
     // Return
@@ -286,23 +454,30 @@ clifIntegral(const IplImage* source,
     
     cl_int error = CL_SUCCESS;
     
-    // Init buffer
-    error = clEnqueueWriteBuffer(data->environment.queue, data->integral_image_data.buffers[0], CL_FALSE, 0, source->width * source->height, source, 0, NULL, NULL);
+    // Init buffer, source is grayscale
+    error = clEnqueueWriteBuffer(data->environment.queue, data->integral_image_data.buffers[0], CL_FALSE, 0, source->widthStep * source->height, source->imageData, 0, NULL, clodProfileEvent(data->profile, "write"));
+    clCheckOrExit(error);
+    
+    // clifGrayscaleIntegral leaves the output of grayscale as arg
+    cl_uint stride = source->widthStep;
+    error = clSetKernelArg(data->environment.kernels[1], 0, sizeof(cl_mem), &(data->integral_image_data.buffers[0]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[1], 4, sizeof(cl_uint), &stride);
     clCheckOrExit(error);
     
     // Run sum rows kernel
-    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[1], 1, NULL, &(data->integral_image_data.global_size[0]), &(data->integral_image_data.local_size[0]), 0, NULL, NULL);
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[1], 1, NULL, &(data->integral_image_data.global_size[0]), localSize(&(data->integral_image_data.local_size[0])), 0, NULL, clodProfileEvent(data->profile, clif_kernel_functions[1]));
     clCheckOrExit(error);
     
     // Run sum cols kernel
-    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[2], 1, NULL, &(data->integral_image_data.global_size[1]), &(data->integral_image_data.local_size[1]), 0, NULL, NULL);
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[2], 1, NULL, &(data->integral_image_data.global_size[1]), localSize(&(data->integral_image_data.local_size[1])), 0, NULL, clodProfileEvent(data->profile, clif_kernel_functions[2]));
     clCheckOrExit(error);
     
     // Read result
-    cl_uint* result = (cl_uint*)clEnqueueMapBuffer(data->environment.queue, data->integral_image_data.buffers[3], CL_TRUE, CL_MAP_READ, 0, (source->width + 1) * (source->height + 1) * sizeof(cl_uint), 0, NULL, NULL, &error);
+    cl_uint* result = (cl_uint*)clEnqueueMapBuffer(data->environment.queue, data->integral_image_data.buffers[3], CL_TRUE, CL_MAP_READ, 0, (source->width + 1) * (source->height + 1) * sizeof(cl_uint), 0, NULL, clodProfileEvent(data->profile, "map"), &error);
     clCheckOrExit(error);
     
-    cl_ulong* square_result = (cl_ulong*)clEnqueueMapBuffer(data->environment.queue, data->integral_image_data.buffers[4], CL_TRUE, CL_MAP_READ, 0, (source->width + 1) * (source->height + 1) * sizeof(cl_ulong), 0, NULL, NULL, &error);
+    cl_ulong* square_result = (cl_ulong*)clEnqueueMapBuffer(data->environment.queue, data->integral_image_data.buffers[4], CL_TRUE, CL_MAP_READ, 0, (source->width + 1) * (source->height + 1) * sizeof(cl_ulong), 0, NULL, clodProfileEvent(data->profile, "map"), &error);
     clCheckOrExit(error);
     
     data->integral_image_data.ptr = result;
@@ -319,6 +494,7 @@ clifIntegral(const IplImage* source,
 CLIFIntegralResult
 clifGrayscaleIntegral(const IplImage* source,
                       CLIFEnvironmentData* data,
+                      const cl_bool tilted,
                       const cl_bool use_opencl)
 {
     CLIFIntegralResult ret;
@@ -326,9 +502,18 @@ clifGrayscaleIntegral(const IplImage* source,
     if(!use_opencl) {
         IplImage* grayscale = cvCreateImage(cvSize(source->width, source->height), IPL_DEPTH_8U, 1);
         cvCvtColor(source, grayscale, CV_BGR2GRAY);
-        ret.image = cvCreateMat(source->height + 1, source->width + 1, CV_32SC1);
         ret.square_image = cvCreateMat(source->height + 1, source->width + 1, CV_64FC1);
-        cvIntegral(grayscale, ret.image, ret.square_image);
+        if(tilted) {
+            // Allocated with room for the tilted sums, the header only covers the sums
+            ret.image = cvCreateMat(2 * (source->height + 1), source->width + 1, CV_32SC1);
+            ret.image->rows = source->height + 1;
+            CvMat tilted_image = cvMat(source->height + 1, source->width + 1, CV_32SC1, ret.image->data.i + (source->height + 1) * (source->width + 1));
+            cvIntegral(grayscale, ret.image, ret.square_image, &tilted_image);
+        }
+        else {
+            ret.image = cvCreateMat(source->height + 1, source->width + 1, CV_32SC1);
+            cvIntegral(grayscale, ret.image, ret.square_image);
+        }
         cvReleaseImage(&grayscale);
         
         return ret;
@@ -337,38 +522,219 @@ clifGrayscaleIntegral(const IplImage* source,
     cl_int error = CL_SUCCESS;
     
     // Init buffer
-    error = clEnqueueWriteBuffer(data->environment.queue, data->bgr_to_gray_data.buffers[0], CL_FALSE, 0, source->widthStep * source->height, source->imageData, 0, NULL, NULL);
+    error = clEnqueueWriteBuffer(data->environment.queue, data->bgr_to_gray_data.buffers[0], CL_FALSE, 0, source->widthStep * source->height, source->imageData, 0, NULL, clodProfileEvent(data->profile, "write"));
     clCheckOrExit(error);
     
     // Run kernel
-    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[0], 2, NULL, data->bgr_to_gray_data.global_size, data->bgr_to_gray_data.local_size, 0, NULL, NULL);
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[0], 2, NULL, data->bgr_to_gray_data.global_size, localSize(data->bgr_to_gray_data.local_size), 0, NULL, clodProfileEvent(data->profile, clif_kernel_functions[0]));
     clCheckOrExit(error);
     
-    // Set as arg the output of greyscale
-    clSetKernelArg(data->environment.kernels[1], 0, sizeof(cl_mem), &(data->bgr_to_gray_data.buffers[1]));
+    // Set as arg the output of greyscale, rows are width long
+    error = clSetKernelArg(data->environment.kernels[1], 0, sizeof(cl_mem), &(data->bgr_to_gray_data.buffers[1]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(data->environment.kernels[1], 4, sizeof(cl_uint), &(data->image_width));
     clCheckOrExit(error);
     
     // Run sum rows kernel
-    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[1], 1, NULL, &(data->integral_image_data.global_size[0]), &(data->integral_image_data.local_size[0]), 0, NULL, NULL);
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[1], 1, NULL, &(data->integral_image_data.global_size[0]), localSize(&(data->integral_image_data.local_size[0])), 0, NULL, clodProfileEvent(data->profile, clif_kernel_functions[1]));
     clCheckOrExit(error);
     
     // Run sum cols kernel
-    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[2], 1, NULL, &(data->integral_image_data.global_size[1]), &(data->integral_image_data.local_size[1]), 0, NULL, NULL);
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[2], 1, NULL, &(data->integral_image_data.global_size[1]), localSize(&(data->integral_image_data.local_size[1])), 0, NULL, clodProfileEvent(data->profile, clif_kernel_functions[2]));
     clCheckOrExit(error);
     
+    // Run tilted kernels, a work item per diagonal
+    size_t integral_area = (source->width + 1) * (source->height + 1);
+    if(tilted) {
+        size_t diagonals = source->width + source->height;
+        for(cl_uint i = 7; i < 9; i++) {
+            error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[i], 1, NULL, &diagonals, NULL, 0, NULL, clodProfileEvent(data->profile, clif_kernel_functions[i]));
+            clCheckOrExit(error);
+        }
+    }
+    
     // Read result
-    cl_uint* result = (cl_uint*)clEnqueueMapBuffer(data->environment.queue, data->integral_image_data.buffers[3], CL_TRUE, CL_MAP_READ, 0, (source->width + 1) * (source->height + 1) * sizeof(cl_uint), 0, NULL, NULL, &error);
+    cl_uint* result = (cl_uint*)clEnqueueMapBuffer(data->environment.queue, data->integral_image_data.buffers[3], CL_TRUE, CL_MAP_READ, 0, (tilted ? 2 : 1) * integral_area * sizeof(cl_uint), 0, NULL, clodProfileEvent(data->profile, "map"), &error);
     clCheckOrExit(error);
     
-    cl_ulong* square_result = (cl_ulong*)clEnqueueMapBuffer(data->environment.queue, data->integral_image_data.buffers[4], CL_TRUE, CL_MAP_READ, 0, (source->width + 1) * (source->height + 1) * sizeof(cl_ulong), 0, NULL, NULL, &error);
+    cl_ulong* square_result = (cl_ulong*)clEnqueueMapBuffer(data->environment.queue, data->integral_image_data.buffers[4], CL_TRUE, CL_MAP_READ, 0, integral_area * sizeof(cl_ulong), 0, NULL, clodProfileEvent(data->profile, "map"), &error);
     clCheckOrExit(error);
     
     data->integral_image_data.ptr = result;
     
     // Return
     ret.image = cvCreateMatHeader(source->height + 1, source->width + 1, CV_32SC1);
-    cvSetData(ret.image, result, source->width + 1);
+    cvSetData(ret.image, result, (source->width + 1) * sizeof(cl_uint));
     ret.square_image = cvCreateMatHeader(source->height + 1, source->width + 1, CV_64FC1);
-    cvSetData(ret.square_image, square_result, source->width + 1);
+    cvSetData(ret.square_image, square_result, (source->width + 1) * sizeof(cl_ulong));
+    return ret;
+}
+
+CLIFEdgeIntegralResult
+clifEdgeIntegral(const IplImage* source,
+                 CLIFEnvironmentData* data,
+                 const cl_bool use_opencl)
+{
+    CLIFEdgeIntegralResult ret;
+    ret.image = cvCreateMat(source->height + 1, source->width + 1, CV_32SC1);
+    
+    if(!use_opencl) {
+        IplImage* grayscale = cvCreateImage(cvSize(source->width, source->height), IPL_DEPTH_8U, 1);
+        IplImage* edges = cvCreateImage(cvSize(source->width, source->height), IPL_DEPTH_8U, 1);
+        cvCvtColor(source, grayscale, CV_BGR2GRAY);
+        cvZero(edges);
+        
+        // Same as sobelEdges, borders are never edges
+        for(int y = 1; y < source->height - 1; y++) {
+            const cl_uchar* above = (const cl_uchar*)(grayscale->imageData + ((y - 1) * grayscale->widthStep));
+            const cl_uchar* row = (const cl_uchar*)(grayscale->imageData + (y * grayscale->widthStep));
+            const cl_uchar* below = (const cl_uchar*)(grayscale->imageData + ((y + 1) * grayscale->widthStep));
+            cl_uchar* dst = (cl_uchar*)(edges->imageData + (y * edges->widthStep));
+            for(int x = 1; x < source->width - 1; x++) {
+                int dx = (above[x + 1] + 2 * row[x + 1] + below[x + 1]) - (above[x - 1] + 2 * row[x - 1] + below[x - 1]);
+                int dy = (below[x - 1] + 2 * below[x] + below[x + 1]) - (above[x - 1] + 2 * above[x] + above[x + 1]);
+                dst[x] = (abs(dx) + abs(dy)) >= CLIF_DEFAULT_EDGE_THRESHOLD;
+            }
+        }
+        cvIntegral(edges, ret.image);
+        
+        cvReleaseImage(&grayscale);
+        cvReleaseImage(&edges);
+        return ret;
+    }
+    
+    cl_int error = CL_SUCCESS;
+    
+    // Init buffer
+    error = clEnqueueWriteBuffer(data->environment.queue, data->bgr_to_gray_data.buffers[0], CL_FALSE, 0, source->widthStep * source->height, source->imageData, 0, NULL, clodProfileEvent(data->profile, "write"));
+    clCheckOrExit(error);
+    
+    // Run grayscale kernel
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[0], 2, NULL, data->bgr_to_gray_data.global_size, localSize(data->bgr_to_gray_data.local_size), 0, NULL, clodProfileEvent(data->profile, clif_kernel_functions[0]));
+    clCheckOrExit(error);
+    
+    // Run sobel kernel
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[3], 2, NULL, data->edge_data.global_size, localSize(data->edge_data.local_size), 0, NULL, clodProfileEvent(data->profile, clif_kernel_functions[3]));
+    clCheckOrExit(error);
+    
+    // Run sum rows kernel
+    size_t global_size = source->height;
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[4], 1, NULL, &global_size, NULL, 0, NULL, clodProfileEvent(data->profile, clif_kernel_functions[4]));
+    clCheckOrExit(error);
+    
+    // Run sum cols kernel
+    global_size = source->width + 1;
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[5], 1, NULL, &global_size, NULL, 0, NULL, clodProfileEvent(data->profile, clif_kernel_functions[5]));
+    clCheckOrExit(error);
+    
+    // Read result
+    error = clEnqueueReadBuffer(data->environment.queue, data->edge_data.buffers[2], CL_TRUE, 0, (source->width + 1) * (source->height + 1) * sizeof(cl_uint), ret.image->data.ptr, 0, NULL, clodProfileEvent(data->profile, "read"));
+    clCheckOrExit(error);
+    
+    // Return
     return ret;
 }
+
+CLIFMotionResult
+clifMotionMap(const IplImage* source,
+              CLIFEnvironmentData* data,
+              const cl_bool use_opencl)
+{
+    CLIFMotionData* motion_data = &(data->motion_data);
+    CLIFMotionResult ret;
+    ret.block_size = motion_data->block_size;
+    cl_uint block_columns = (source->width + ret.block_size - 1) / ret.block_size;
+    cl_uint block_rows = (source->height + ret.block_size - 1) / ret.block_size;
+    ret.map = cvCreateMat(block_rows, block_columns, CV_8UC1);
+    
+    if(!use_opencl) {
+        IplImage* grayscale = cvCreateImage(cvSize(source->width, source->height), IPL_DEPTH_8U, 1);
+        cvCvtColor(source, grayscale, CV_BGR2GRAY);
+        
+        // Same as motionBlocks
+        if(motion_data->previous_image == NULL) {
+            cvSet(ret.map, cvScalarAll(1));
+        }
+        else {
+            for(cl_uint block_y = 0; block_y < block_rows; block_y++) {
+                for(cl_uint block_x = 0; block_x < block_columns; block_x++) {
+                    cl_uchar moved = 0;
+                    cl_uint end_y = MIN((block_y + 1) * ret.block_size, (cl_uint)source->height);
+                    cl_uint end_x = MIN((block_x + 1) * ret.block_size, (cl_uint)source->width);
+                    for(cl_uint y = block_y * ret.block_size; y < end_y && !moved; y++) {
+                        const cl_uchar* row = (const cl_uchar*)(grayscale->imageData + (y * grayscale->widthStep));
+                        const cl_uchar* previous_row = (const cl_uchar*)(motion_data->previous_image->imageData + (y * motion_data->previous_image->widthStep));
+                        for(cl_uint x = block_x * ret.block_size; x < end_x; x++) {
+                            if(abs(row[x] - previous_row[x]) > CLIF_DEFAULT_MOTION_THRESHOLD) {
+                                moved = 1;
+                                break;
+                            }
+                        }
+                    }
+                    ret.map->data.ptr[(block_y * ret.map->step) + block_x] = moved;
+                }
+            }
+            cvReleaseImage(&(motion_data->previous_image));
+        }
+        motion_data->previous_image = grayscale;
+        return ret;
+    }
+    
+    cl_int error = CL_SUCCESS;
+    
+    // Init buffer
+    error = clEnqueueWriteBuffer(data->environment.queue, data->bgr_to_gray_data.buffers[0], CL_FALSE, 0, source->widthStep * source->height, source->imageData, 0, NULL, clodProfileEvent(data->profile, "write"));
+    clCheckOrExit(error);
+    
+    // Run grayscale kernel
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[0], 2, NULL, data->bgr_to_gray_data.global_size, localSize(data->bgr_to_gray_data.local_size), 0, NULL, clodProfileEvent(data->profile, clif_kernel_functions[0]));
+    clCheckOrExit(error);
+    
+    // First frame, nothing to compare with
+    if(!motion_data->has_previous) {
+        error = clEnqueueCopyBuffer(data->environment.queue, data->bgr_to_gray_data.buffers[1], motion_data->buffers[0], 0, 0, source->width * source->height, 0, NULL, clodProfileEvent(data->profile, "copy"));
+        clCheckOrExit(error);
+        error = clFinish(data->environment.queue);
+        clCheckOrExit(error);
+        motion_data->has_previous = CL_TRUE;
+        cvSet(ret.map, cvScalarAll(1));
+        return ret;
+    }
+    
+    // Run motion kernel, it also replaces the previous image
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[6], 2, NULL, motion_data->global_size, NULL, 0, NULL, clodProfileEvent(data->profile, clif_kernel_functions[6]));
+    clCheckOrExit(error);
+    
+    // Read result
+    error = clEnqueueReadBuffer(data->environment.queue, motion_data->buffers[1], CL_TRUE, 0, block_columns * block_rows, ret.map->data.ptr, 0, NULL, clodProfileEvent(data->profile, "read"));
+    clCheckOrExit(error);
+    
+    // Return
+    return ret;
+}
+
+void
+clifResetMotion(CLIFEnvironmentData* data)
+{
+    data->motion_data.has_previous = CL_FALSE;
+    if(data->motion_data.previous_image != NULL)
+        cvReleaseImage(&(data->motion_data.previous_image));
+}
+
+cl_bool
+clifIsRectMoving(const CLIFMotionResult* motion,
+                 const CvRect* rect)
+{
+    cl_int start_x = MAX(rect->x, 0) / motion->block_size;
+    cl_int start_y = MAX(rect->y, 0) / motion->block_size;
+    cl_int end_x = MIN((rect->x + rect->width - 1) / (cl_int)motion->block_size, motion->map->cols - 1);
+    cl_int end_y = MIN((rect->y + rect->height - 1) / (cl_int)motion->block_size, motion->map->rows - 1);
+    for(cl_int y = start_y; y <= end_y; y++) {
+        const cl_uchar* row = motion->map->data.ptr + (y * motion->map->step);
+        for(cl_int x = start_x; x <= end_x; x++) {
+            if(row[x] != 0)
+                return CL_TRUE;
+        }
+    }
+    return CL_FALSE;
+}
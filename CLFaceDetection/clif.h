@@ -8,6 +8,8 @@ extern "C" {
 #include <stdio.h>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv/cvaux.hpp>
+#include "clodprofile.h"
+#include "clodtune.h"
 
 typedef struct CLIFBgrToGrayData {
     cl_mem buffers[2];
@@ -24,10 +26,47 @@ typedef struct CLIFIntegralImageData {
     size_t local_size[2];
 } CLIFIntegralImageData;
 
+// Sobel |dx| + |dy| at or above which a pixel is an edge
+#define CLIF_DEFAULT_EDGE_THRESHOLD 100
+
+typedef struct CLIFEdgeData {
+    cl_mem buffers[3];
+    size_t global_size[2];
+    size_t local_size[2];
+} CLIFEdgeData;
+
+// A block moved if one of its pixels changed by more than this
+#define CLIF_DEFAULT_MOTION_THRESHOLD 24
+#define CLIF_DEFAULT_MOTION_BLOCK_SIZE 16
+
+/* Previous grayscale frame (on the device in buffers[0], on the host in
+ * previous_image) and block map
+ */
+typedef struct CLIFMotionData {
+    cl_mem buffers[2];
+    IplImage* previous_image;
+    cl_bool has_previous;
+    cl_uint block_size;
+    size_t global_size[2];
+} CLIFMotionData;
+
+/* Image geometry of the last clifInitBuffers (0 before and after the buffers
+ * exist), device computations only work on images matching it. Commands are
+ * recorded in profile if not NULL (see clodEnableProfiling). Local sizes come
+ * from tuning (see clodtune.h)
+ */
 typedef struct CLIFEnvironmentData {
     CLDeviceEnvironment environment;
+    cl_uint image_width;
+    cl_uint image_height;
+    cl_uint image_stride;
+    cl_uint image_channels;
     CLIFBgrToGayData bgr_to_gray_data;
     CLIFIntegralImageData integral_image_data;
+    CLIFEdgeData edge_data;
+    CLIFMotionData motion_data;
+    CLODProfile* profile;
+    CLODTuning tuning;
 } CLIFEnvironmentData;
 
 typedef struct CLIFIntegralResult {
@@ -39,10 +78,32 @@ typedef struct CLIFGrayscaleResult {
     IplImage* image;
 } CLIFGrayscaleResult;
 
+typedef struct CLIFEdgeIntegralResult {
+    CvMat* image;
+} CLIFEdgeIntegralResult;
+
+// One 8U element per block_size * block_size block, non zero if it moved
+typedef struct CLIFMotionResult {
+    CvMat* map;
+    cl_uint block_size;
+} CLIFMotionResult;
+
 // Init and release OpenCLIF environment
 CLIFEnvironmentData*
 clifInitEnvironment(const cl_uint device_index);
 
+// Same on a device (or sub-device) that is not in the platform device list
+CLIFEnvironmentData*
+clifInitDeviceEnvironment(cl_device_id device);
+
+// Host computations only (use_opencl CL_FALSE), no device
+CLIFEnvironmentData*
+clifInitHostEnvironment();
+
+// Device integral images (clifIntegral, clifGrayscaleIntegral) stay in
+// integral_image_data.buffers[3] (sums, then the tilted sums) and [4] (square
+// sums, 64 bit integers), readable by kernels of the same context
+
 void
 clifReleaseEnvironment(CLIFEnvironmentData* data);
 
@@ -56,19 +117,56 @@ clifInitBuffers(CLIFEnvironmentData* data,
 void
 clifReleaseBuffers(CLIFEnvironmentData* data);
 
+// Local sizes of the kernels from data->tuning, each one falls back to the
+// driver choice if it does not fit the image. Done by clifInitBuffers
+void
+clifApplyTuning(CLIFEnvironmentData* data);
+
 // OpenCLIF computations
 CLIFGrayscaleResult
 clifGrayscale(const IplImage* source,
               CLIFEnvironmentData* data,
               const cl_bool use_opencl);
 
+// Integral image of a grayscale image, the same as cvIntegral. On the device
+// the results are mapped buffers, unmap them before the next device integral
 CLIFIntegralResult
 clifIntegral(const IplImage* source,
              CLIFEnvironmentData* data,
              const cl_bool use_opencl);
 
+// Integral image of a BGR image, grayscale is computed as cvCvtColor does so
+// host and device results are the same.
+// With tilted the tilted sums (the tilted_sum of cvIntegral) follow the sums
+// in memory, (width + 1) * (height + 1) elements after image->data.i. They are
+// read by the tilted features of a cascade
 CLIFIntegralResult
 clifGrayscaleIntegral(const IplImage* source,
                       CLIFEnvironmentData* data,
+                      const cl_bool tilted,
                       const cl_bool use_opencl);
+
+// Integral image of the edge mask (1 for edges, 0 elsewhere) of a BGR image.
+// The same on host and device, the device one needs clifInitBuffers
+CLIFEdgeIntegralResult
+clifEdgeIntegral(const IplImage* source,
+                 CLIFEnvironmentData* data,
+                 const cl_bool use_opencl);
+
+// Blocks of a BGR image that changed since the previous call (all of them the
+// first time). The previous grayscale image stays on the device (or on the
+// host without use_opencl), both need clifInitBuffers
+CLIFMotionResult
+clifMotionMap(const IplImage* source,
+              CLIFEnvironmentData* data,
+              const cl_bool use_opencl);
+
+// The next clifMotionMap has no previous image
+void
+clifResetMotion(CLIFEnvironmentData* data);
+
+// True if rect overlaps a block that moved
+cl_bool
+clifIsRectMoving(const CLIFMotionResult* motion,
+                 const CvRect* rect);
 #endif
@@ -1,6 +1,9 @@
 #pragma OPENCL EXTENSION cl_khr_local_int32_base_atomics : enable
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+#pragma OPENCL EXTENSION cl_khr_global_int32_extended_atomics : enable
 
-// Optimized for stump based (each classifier has one only feature)
+// Classifiers are trees (a stump is a one node tree), nodes of a tree are
+// stored one after the other starting from the root
 
 typedef struct KernelOptimizedRect {
     uint left_top_offset;
@@ -14,12 +17,16 @@ typedef struct KernelClassifier {
     float alpha[2];
     KernelOptimizedRect rect[3];
     float threshold;
+    int left;
+    int right;
+    uint node_count;
 } KernelClassifier;
 
 typedef struct KernelStage {
     float threshold;
-    KernelClassifier classifier[MAX_STAGE_CLASSIFIER_COUNT];
     uint count;
+    uint node_count;
+    KernelClassifier classifier[MAX_STAGE_NODE_COUNT];
 } KernelStage;
 
 typedef struct KernelSubwindowData {
@@ -29,15 +36,20 @@ typedef struct KernelSubwindowData {
     float variance;
 } KernelSubwindowData;
     
+// stages holds the current stage of each fused cascade, one for a single
+// cascade. cascade_src and cascade_dst, the cascade of each window among the
+// fused ones, are only given for fused cascades (NULL otherwise)
 kernel void runStage(global uint* integral_image,
-                     global KernelStage* stage,
+                     global KernelStage* stages,
                      global KernelSubwindowData* win_src,
                      global KernelSubwindowData* win_dst,
                      uint win_src_count,
-                     global uint* win_dst_count,
+                     global uint* win_dst_count,          // [0] windows, [1] nodes (CLOD_COUNTERS)
                      uint scaled_window_area,
                      float current_scale,
-                     uint integral_image_width)
+                     uint integral_image_width,
+                     global uint* cascade_src,
+                     global uint* cascade_dst)
 {
     uint gid = get_global_id(0);
     
@@ -47,39 +59,63 @@ kernel void runStage(global uint* integral_image,
     
     if(gid < win_src_count) {
         KernelSubwindowData subwindow = win_src[gid];
+        uint cascade = cascade_src != 0 ? cascade_src[gid] : 0;
+        global KernelStage* stage = &stages[cascade];
         
         // Iterate over classifiers
         float stage_sum = 0;
         
+        uint root = 0;
+#ifdef CLOD_COUNTERS
+        uint node_count = 0;
+#endif
         for(uint classifier_index = 0; classifier_index < stage->count; classifier_index++) {
-            KernelClassifier classifier = stage->classifier[classifier_index];
+            // Walk the tree, left and right are node indices or <= 0 for leaves
+            int node_index = root;
+            int next_index;
+            float alpha;
+            do {
+                global KernelClassifier* classifier = &stage->classifier[node_index];
+                
+                // Compute threshold normalized by window vaiance
+                float norm_threshold = classifier->threshold * subwindow.variance;
+                
+                float rect_sum = 0;
+                
+                // Calculation on rectangles (loop unroll)
+                rect_sum += (float)(integral_image[subwindow.offset + classifier->rect[0].left_top_offset] -
+                                    integral_image[subwindow.offset + classifier->rect[0].right_top_offset] -
+                                    integral_image[subwindow.offset + classifier->rect[0].left_bottom_offset] +
+                                    integral_image[subwindow.offset + classifier->rect[0].right_bottom_offset]) * classifier->rect[0].weight;
+                
+                rect_sum += (float)(integral_image[subwindow.offset + classifier->rect[1].left_top_offset] -
+                                    integral_image[subwindow.offset + classifier->rect[1].right_top_offset] -
+                                    integral_image[subwindow.offset + classifier->rect[1].left_bottom_offset] +
+                                    integral_image[subwindow.offset + classifier->rect[1].right_bottom_offset]) * classifier->rect[1].weight;
+                
+                if(classifier->rect[2].weight != 0) {
+                    rect_sum += (float)(integral_image[subwindow.offset + classifier->rect[2].left_top_offset] -
+                                        integral_image[subwindow.offset + classifier->rect[2].right_top_offset] -
+                                        integral_image[subwindow.offset + classifier->rect[2].left_bottom_offset] +
+                                        integral_image[subwindow.offset + classifier->rect[2].right_bottom_offset]) * classifier->rect[2].weight;
+                }
+                
+                // If rect sum less than threshold go left else right (select, no divergence)
+                int right = rect_sum >= norm_threshold;
+                next_index = select(classifier->left, classifier->right, right);
+                alpha = classifier->alpha[right];
+                node_index = next_index;
+#ifdef CLOD_COUNTERS
+                node_count++;
+#endif
+            } while(next_index > 0);
             
-            // Compute threshold normalized by window vaiance
-            float norm_threshold = classifier.threshold * subwindow.variance;
-            
-            float rect_sum = 0;
-            
-            // Calculation on rectangles (loop unroll)
-            rect_sum += (float)(integral_image[subwindow.offset + classifier.rect[0].left_top_offset] -
-                                integral_image[subwindow.offset + classifier.rect[0].right_top_offset] -
-                                integral_image[subwindow.offset + classifier.rect[0].left_bottom_offset] +
-                                integral_image[subwindow.offset + classifier.rect[0].right_bottom_offset]) * classifier.rect[0].weight;
-            
-            rect_sum += (float)(integral_image[subwindow.offset + classifier.rect[1].left_top_offset] -
-                                integral_image[subwindow.offset + classifier.rect[1].right_top_offset] -
-                                integral_image[subwindow.offset + classifier.rect[1].left_bottom_offset] +
-                                integral_image[subwindow.offset + classifier.rect[1].right_bottom_offset]) * classifier.rect[1].weight;
-            
-            if(classifier.rect[2].weight != 0) {
-                rect_sum += (float)(integral_image[subwindow.offset + classifier.rect[2].left_top_offset] -
-                                    integral_image[subwindow.offset + classifier.rect[2].right_top_offset] -
-                                    integral_image[subwindow.offset + classifier.rect[2].left_bottom_offset] +
-                                    integral_image[subwindow.offset + classifier.rect[2].right_bottom_offset]) * classifier.rect[2].weight;
-            }
-            
-            // If rect sum less than stage_sum updated with threshold left_val else right_val
-            stage_sum += classifier.alpha[rect_sum >= norm_threshold];
+            stage_sum += alpha;
+            root += stage->classifier[root].node_count;
         }
+#ifdef CLOD_COUNTERS
+        atom_add(&win_dst_count[1], node_count);
+#endif
         
         // Add subwindow to accepted list
         if(stage_sum >= stage->threshold) {
@@ -88,9 +124,225 @@ kernel void runStage(global uint* integral_image,
             win_dst[old_dest_count].y = subwindow.y;
             win_dst[old_dest_count].variance = subwindow.variance;
             win_dst[old_dest_count].offset = subwindow.offset;
+            if(cascade_dst != 0)
+                cascade_dst[old_dest_count] = cascade;
         }
     }
 }
 
+/*** Grouping of matches (same result as filterResult on the host) ***/
+
+typedef struct KernelMatch {
+    int x;
+    int y;
+    int width;
+    int height;
+} KernelMatch;
+
+typedef struct KernelGroup {
+    int x;
+    int y;
+    int width;
+    int height;
+    int weight;
+    int root;
+} KernelGroup;
+
+// Uniform grid of the matches of one size class (see buildRectGrid), its
+// cells are numbered after the ones of the previous classes
+typedef struct KernelGridClass {
+    int min_size;
+    int cell_size;
+    uint column_count;
+    uint row_count;
+    uint first_cell;
+} KernelGridClass;
+
+// counters[0] matches, counters[1] set if a label changed, counters[2] groups
+
+int areRectSimilar(KernelMatch r1,
+                   KernelMatch r2,
+                   float eps)
+{
+    float delta = eps * (min(r1.width, r2.width) + min(r1.height, r2.height)) * 0.5f;
+    return (abs(r1.x - r2.x) <= delta) &&
+           (abs(r1.y - r2.y) <= delta) &&
+           (abs(r1.x + r1.width - r2.x - r2.width) <= delta) &&
+           (abs(r1.y + r1.height - r2.y - r2.height) <= delta);
+}
+
+// Size class of a match of width + height size, classes are sorted by size
+uint gridClass(global KernelGridClass* classes,
+               uint class_count,
+               int size)
+{
+    uint c = 0;
+    while(c + 1 < class_count && size >= classes[c + 1].min_size)
+        c++;
+    return c;
+}
+
+// Clamped to the grid, clamping never moves two matches further apart
+uint gridColumn(KernelGridClass grid_class,
+                int x)
+{
+    return min((uint)(x / grid_class.cell_size), grid_class.column_count - 1);
+}
+
+uint gridRow(KernelGridClass grid_class,
+             int y)
+{
+    return min((uint)(y / grid_class.cell_size), grid_class.row_count - 1);
+}
 
+kernel void appendMatches(global KernelSubwindowData* windows,
+                          uint window_count,
+                          int window_width,
+                          int window_height,
+                          global KernelMatch* matches,
+                          global uint* counters,
+                          uint capacity)
+{
+    uint gid = get_global_id(0);
+    
+    if(gid < window_count) {
+        // Overflow is detected on the host comparing counters[0] with capacity
+        uint index = atom_inc(&counters[0]);
+        if(index < capacity) {
+            matches[index].x = windows[gid].x;
+            matches[index].y = windows[gid].y;
+            matches[index].width = window_width;
+            matches[index].height = window_height;
+        }
+    }
+}
+
+kernel void initGroups(global int* labels,
+                       global int* sums,
+                       uint count)
+{
+    uint gid = get_global_id(0);
+    
+    if(gid < count) {
+        labels[gid] = gid;
+        for(uint i = 0; i < 5; i++)
+            sums[(gid * 5) + i] = 0;
+    }
+}
 
+kernel void initCells(global int* cell_heads,
+                      uint cell_count)
+{
+    uint gid = get_global_id(0);
+    
+    if(gid < cell_count)
+        cell_heads[gid] = -1;
+}
+
+// Each cell is a list of matches: cell_heads holds the first, next the
+// following one of the same cell (-1 ends the list)
+kernel void bucketMatches(global KernelMatch* matches,
+                          global KernelGridClass* classes,
+                          uint class_count,
+                          global int* cell_heads,
+                          global int* next,
+                          uint count)
+{
+    uint gid = get_global_id(0);
+    
+    if(gid < count) {
+        KernelMatch r = matches[gid];
+        KernelGridClass grid_class = classes[gridClass(classes, class_count, r.width + r.height)];
+        uint cell = grid_class.first_cell + (gridRow(grid_class, r.y) * grid_class.column_count) + gridColumn(grid_class, r.x);
+        next[gid] = atomic_xchg(&cell_heads[cell], (int)gid);
+    }
+}
+
+// Labels only decrease and always point to a match of the same connected
+// component, at the fixed point every match is labeled with the smallest index
+// of its component (the order partitionData enumerates classes in). Only the
+// cells around the match in its size class and in the ones before and after
+// it are searched, labels are pulled so both sides of a pair look
+kernel void propagateLabels(global KernelMatch* matches,
+                            global int* labels,
+                            global uint* counters,
+                            uint count,
+                            float eps,
+                            global KernelGridClass* classes,
+                            uint class_count,
+                            global int* cell_heads,
+                            global int* next)
+{
+    uint gid = get_global_id(0);
+    
+    if(gid < count) {
+        KernelMatch r = matches[gid];
+        int label = labels[gid];
+        int new_label = labels[label];
+        uint own_class = gridClass(classes, class_count, r.width + r.height);
+        for(uint c = max(own_class, 1u) - 1; c < min(own_class + 2, class_count); c++) {
+            KernelGridClass grid_class = classes[c];
+            int column = gridColumn(grid_class, r.x);
+            int row = gridRow(grid_class, r.y);
+            for(int neighbour_row = max(row - 1, 0); neighbour_row <= min(row + 1, (int)grid_class.row_count - 1); neighbour_row++) {
+                for(int neighbour_column = max(column - 1, 0); neighbour_column <= min(column + 1, (int)grid_class.column_count - 1); neighbour_column++) {
+                    int j = cell_heads[grid_class.first_cell + (neighbour_row * grid_class.column_count) + neighbour_column];
+                    for(; j >= 0; j = next[j]) {
+                        if(j != (int)gid && areRectSimilar(r, matches[j], eps))
+                            new_label = min(new_label, labels[j]);
+                    }
+                }
+            }
+        }
+        
+        if(new_label < label) {
+            // Hook the old root as well, halves the number of iterations
+            atom_min(&labels[gid], new_label);
+            atom_min(&labels[label], new_label);
+            atomic_xchg(&counters[1], 1);
+        }
+    }
+}
+
+kernel void accumulateGroups(global KernelMatch* matches,
+                             global int* labels,
+                             global int* sums,
+                             uint count)
+{
+    uint gid = get_global_id(0);
+    
+    if(gid < count) {
+        KernelMatch r = matches[gid];
+        int root = labels[gid];
+        atom_add(&sums[(root * 5) + 0], r.x);
+        atom_add(&sums[(root * 5) + 1], r.y);
+        atom_add(&sums[(root * 5) + 2], r.width);
+        atom_add(&sums[(root * 5) + 3], r.height);
+        atom_inc(&sums[(root * 5) + 4]);
+    }
+}
+
+kernel void compactGroups(global int* labels,
+                          global int* sums,
+                          global KernelGroup* groups,
+                          global uint* counters,
+                          uint count,
+                          int group_threshold)
+{
+    uint gid = get_global_id(0);
+    
+    if(gid < count && labels[gid] == (int)gid) {
+        int n = sums[(gid * 5) + 4];
+        // Groups at or below the threshold are never part of the result
+        if(n > group_threshold) {
+            float s = 1.f / (float)n;
+            uint index = atom_inc(&counters[2]);
+            groups[index].x = (int)min(sums[(gid * 5) + 0] * s, (float)INT_MAX);
+            groups[index].y = (int)min(sums[(gid * 5) + 1] * s, (float)INT_MAX);
+            groups[index].width = (int)min(sums[(gid * 5) + 2] * s, (float)INT_MAX);
+            groups[index].height = (int)min(sums[(gid * 5) + 3] * s, (float)INT_MAX);
+            groups[index].weight = n;
+            groups[index].root = gid;
+        }
+    }
+}
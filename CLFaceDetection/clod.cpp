@@ -7,10 +7,32 @@
 //
 
 #include "clod.h"
+#include "clodprogram.h"
+// Generated in the build tree by the CMake build, the committed copy otherwise
+#ifdef CLOD_KERNELS_HEADER
+#include CLOD_KERNELS_HEADER
+#else
+#include "clodkernels.h"
+#endif
+#include <stddef.h>
+#include <pthread.h>
 
 #define EPS 0.2
 #define MAX_FEATURE_RECT_COUNT 3
-#define MAX_STAGE_CLASSIFIER_COUNT 220
+// Tree nodes per stage (a stump is a one node tree), alt_tree stages have up to 406
+#define MAX_STAGE_NODE_COUNT 512
+// Merged cascades evaluated by the same stage launches (frontal, profile and mirrored profile)
+#define MAX_FUSED_CASCADE_COUNT 3
+// Label propagation launches of device grouping between two reads of the changed flag
+#define GROUPING_PASS_COUNT 4
+
+// Work counters (see CLODWorkCounters), statement vanishes without CLOD_COUNTERS
+#ifdef CLOD_COUNTERS
+#define CLOD_COUNT(statement) statement
+static __thread cl_ulong host_node_count = 0;
+#else
+#define CLOD_COUNT(statement)
+#endif
 
 #define mato(stride,x,y) (((stride) * (y)) + (x));
 #define matp(matrix,stride,x,y) (matrix + ((stride) * (y)) + (x))
@@ -50,66 +72,134 @@ typedef struct KernelOptimizedRect {
     float weight;
 } KernelOptimizedRect;
 
+/* Tree node. Trees are stored one after the other in the stage, left and
+ * right are absolute node indices in the stage or <= 0 for a leaf, in which
+ * case alpha holds the leaf value ([0] left, [1] right)
+ */
 typedef struct KernelClassifier {
     float alpha[2];
     KernelOptimizedRect rect[3];
     cl_float threshold;
+    cl_int left;
+    cl_int right;
+    cl_uint node_count;
 } KernelClassifier;
 
+/* Only the first node_count classifiers are written to the device */
 typedef struct KernelStage {
     float threshold;
-    KernelClassifier classifier[MAX_STAGE_CLASSIFIER_COUNT];
     cl_uint count;
+    cl_uint node_count;
+    KernelClassifier classifier[MAX_STAGE_NODE_COUNT];
 } KernelStage;
 
+typedef struct KernelMatch {
+    cl_int x;
+    cl_int y;
+    cl_int width;
+    cl_int height;
+} KernelMatch;
+
+typedef struct KernelGroup {
+    cl_int x;
+    cl_int y;
+    cl_int width;
+    cl_int height;
+    cl_int weight;
+    cl_int root;
+} KernelGroup;
+
+typedef struct KernelGridClass {
+    cl_int min_size;
+    cl_int cell_size;
+    cl_uint column_count;
+    cl_uint row_count;
+    cl_uint first_cell;
+} KernelGridClass;
+
 typedef struct KernelCascade {
     KernelStage* stage;
     cl_uint count;
 } KernelCascade;
 
+const char* clod_kernel_functions[] = { "runStage", "appendMatches", "initGroups", "propagateLabels", "accumulateGroups", "compactGroups",
+                                        "initCells", "bucketMatches" };
+#define CLOD_KERNEL_COUNT (sizeof(clod_kernel_functions) / sizeof(const char*))
+
 /* Functions */
 
 CLODEnvironmentData*
 clodInitEnvironment(const cl_uint device_index)
+{
+    return clodInitDeviceEnvironment(clodGetDevice(device_index));
+}
+
+/* Kernels of clod.cl with the variant of the tuning. The context and queue
+ * are the ones of clif, so its buffers feed runStage directly. Kernel args are
+ * set by clodInitBuffers
+ */
+static void
+createKernels(CLODEnvironmentData* data)
+{
+    char build_options[256];
+    sprintf(build_options, "-D MAX_STAGE_NODE_COUNT=%d", MAX_STAGE_NODE_COUNT);
+#ifdef CLOD_COUNTERS
+    strcat(build_options, " -D CLOD_COUNTERS");
+#endif
+    if(data->clif->tuning.variant[0] != '\0') {
+        strcat(build_options, " ");
+        strcat(build_options, data->clif->tuning.variant);
+    }
+    clodCreateSharedDeviceEnvironment(&(data->clif->environment), clod_cl_source, clod_kernel_functions, CLOD_KERNEL_COUNT, build_options, &(data->environment));
+}
+
+/* Everything but the device environments */
+static void
+initEnvironmentData(CLODEnvironmentData* data)
+{
+    memset(&(data->stage_statistics), 0, sizeof(CLODStageStatistics));
+    memset(&(data->scheduler), 0, sizeof(CLODSchedulerData));
+    clodInitProfile(&(data->profile));
+    data->adaptive_window_count = CLOD_DEFAULT_ADAPTIVE_WINDOW_COUNT;
+    data->edge_density = CLOD_DEFAULT_EDGE_DENSITY;
+    data->coarse_stage_count = CLOD_DEFAULT_COARSE_STAGE_COUNT;
+    data->scale_factor = CLOD_DEFAULT_SCALE_FACTOR;
+    data->stage_wait_event = NULL;
+}
+
+CLODEnvironmentData*
+clodInitDeviceEnvironment(cl_device_id device)
 {
     CLODEnvironmentData* data = (CLODEnvironmentData*)malloc(sizeof(CLODEnvironmentData));
-    data->clif = clifInitEnvironment(0);
-        
-    // Get available devices
-    cl_uint platform_device_count;
-    CLDeviceInfo* platform_device_list = clGetDeviceList(&platform_device_count);
-    
-    // Get selected device
-    CLDeviceInfo device = platform_device_list[device_index];
+    data->clif = clifInitDeviceEnvironment(device);
+    initEnvironmentData(data);
     
-    // Set up kernel file path and functions
-    const char* kernel_path = "/Users/Gabriele/Documents/Projects/CLFaceDetection/CLFaceDetection/clod.cl";
-    const char* kernel_functions[] = { "runStage" };
-    
-    // Create device environment
-    char build_options[128];
-    sprintf(build_options, "-D MAX_STAGE_CLASSIFIER_COUNT=%d", MAX_STAGE_CLASSIFIER_COUNT);
-    clCreateDeviceEnvironment(&device, 1, kernel_path, kernel_functions, 1, build_options, 0, 0, &(data->environment));
-    
-    // Release
-    for(cl_uint i = 0; i < platform_device_count; i++)
-        clFreeDeviceInfo(&platform_device_list[i]);
-    free(platform_device_list);
+    // Create device environment, kernels are built from the embedded clod.cl
+    createKernels(data);
     
     return data;
 }
 
+CLODEnvironmentData*
+clodInitHostEnvironment()
+{
+    CLODEnvironmentData* data = (CLODEnvironmentData*)calloc(1, sizeof(CLODEnvironmentData));
+    data->clif = clifInitHostEnvironment();
+    initEnvironmentData(data);
+    return data;
+}
+
 void
 clodInitBuffers(CLODEnvironmentData* data,
                 const CvSize* image_size)
 {
     cl_int error = CL_SUCCESS;
     
-    // Integral image
+    // Integral image, then the tilted one
     data->detect_objects_data.buffers[0] =
     clCreateBuffer(data->environment.context,
                    CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY,
-                   (image_size->width + 1) * (image_size->height + 1) * sizeof(cl_uint),
+                   2 * (image_size->width + 1) * (image_size->height + 1) * sizeof(cl_uint),
                    NULL, &error);
     clCheckOrExit(error);
     // Input stage
@@ -133,32 +223,66 @@ clodInitBuffers(CLODEnvironmentData* data,
                    (image_size->width / 2) * (image_size->height / 2) * sizeof(CLODSubwindowData),
                    NULL, &error);
     clCheckOrExit(error);
-    // Output windows count
+    // Output windows count, then nodes evaluated (CLOD_COUNTERS)
+    cl_uint window_counters[2] = { 0, 0 };
     data->detect_objects_data.buffers[4] =
     clCreateBuffer(data->environment.context,
-                   CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_WRITE,
-                   sizeof(cl_uint),
-                   NULL, &error);
+                   CL_MEM_ALLOC_HOST_PTR | CL_MEM_COPY_HOST_PTR | CL_MEM_READ_WRITE,
+                   sizeof(window_counters),
+                   window_counters, &error);
     clCheckOrExit(error);
     
+    // Grouping buffers, at most one match per window buffer entry
+    CLODGroupingData* grouping_data = &(data->grouping_data);
+    grouping_data->capacity = (image_size->width / 2) * (image_size->height / 2);
+    size_t grouping_sizes[6] = {
+        grouping_data->capacity * sizeof(KernelMatch),
+        grouping_data->capacity * sizeof(cl_int),
+        grouping_data->capacity * 5 * sizeof(cl_int),
+        grouping_data->capacity * sizeof(KernelGroup),
+        3 * sizeof(cl_uint),
+        grouping_data->capacity * sizeof(cl_int)
+    };
+    for(cl_uint i = 0; i < 6; i++) {
+        grouping_data->buffers[i] =
+        clCreateBuffer(data->environment.context,
+                       CL_MEM_READ_WRITE,
+                       grouping_sizes[i],
+                       NULL, &error);
+        clCheckOrExit(error);
+    }
+    
+    // Grid buffers are created by the first groupDeviceMatches
+    grouping_data->class_capacity = 0;
+    grouping_data->cell_capacity = 0;
+    grouping_data->window_sizes = NULL;
+    grouping_data->window_size_count = 0;
+    grouping_data->match_count = 0;
+    
+    // Batch buffers are created by the first clodDetectObjectsBatch, fused
+    // ones by the first fused clodDetectObjectsMulti
+    data->batch_data.capacity = 0;
+    data->fused_data.capacity = 0;
+    data->detect_objects_data.image_size = *image_size;
+    
     cl_uint integral_image_width = image_size->width + 1;
     // Integral image
-    clSetKernelArg(data->environment.kernels[0], 0, sizeof(cl_mem), &(data->detect_objects_data.buffers[0]));
+    error = clSetKernelArg(data->environment.kernels[0], 0, sizeof(cl_mem), &(data->detect_objects_data.buffers[0]));
     clCheckOrExit(error);
     // Kernel stage
-    clSetKernelArg(data->environment.kernels[0], 1, sizeof(cl_mem), &(data->detect_objects_data.buffers[1]));
+    error = clSetKernelArg(data->environment.kernels[0], 1, sizeof(cl_mem), &(data->detect_objects_data.buffers[1]));
     clCheckOrExit(error);
     // Source windows
-    clSetKernelArg(data->environment.kernels[0], 2, sizeof(cl_mem), &(data->detect_objects_data.buffers[2]));
+    error = clSetKernelArg(data->environment.kernels[0], 2, sizeof(cl_mem), &(data->detect_objects_data.buffers[2]));
     clCheckOrExit(error);
     // Dest windows
-    clSetKernelArg(data->environment.kernels[0], 3, sizeof(cl_mem), &(data->detect_objects_data.buffers[3]));
+    error = clSetKernelArg(data->environment.kernels[0], 3, sizeof(cl_mem), &(data->detect_objects_data.buffers[3]));
     clCheckOrExit(error);
     // Dest windows count
-    clSetKernelArg(data->environment.kernels[0], 5, sizeof(cl_mem), &(data->detect_objects_data.buffers[4]));
+    error = clSetKernelArg(data->environment.kernels[0], 5, sizeof(cl_mem), &(data->detect_objects_data.buffers[4]));
     clCheckOrExit(error);
     // Size of integral image
-    clSetKernelArg(data->environment.kernels[0], 8, sizeof(cl_uint), &(integral_image_width));
+    error = clSetKernelArg(data->environment.kernels[0], 8, sizeof(cl_uint), &(integral_image_width));
     clCheckOrExit(error);
 }
 
@@ -166,8 +290,21 @@ void
 clodReleaseBuffers(CLODEnvironmentData* data)
 {
     clifReleaseBuffers(data->clif);
-    for(cl_uint i = 0; i < 4; i++)
+    for(cl_uint i = 0; i < 5; i++)
         clReleaseMemObject(data->detect_objects_data.buffers[i]);
+    for(cl_uint i = 0; i < 6; i++)
+        clReleaseMemObject(data->grouping_data.buffers[i]);
+    if(data->grouping_data.class_capacity != 0)
+        clReleaseMemObject(data->grouping_data.buffers[6]);
+    if(data->grouping_data.cell_capacity != 0)
+        clReleaseMemObject(data->grouping_data.buffers[7]);
+    free(data->grouping_data.window_sizes);
+    for(cl_uint i = 0; i < 3 && data->batch_data.capacity != 0; i++)
+        clReleaseMemObject(data->batch_data.buffers[i]);
+    data->batch_data.capacity = 0;
+    for(cl_uint i = 0; i < 5 && data->fused_data.capacity != 0; i++)
+        clReleaseMemObject(data->fused_data.buffers[i]);
+    data->fused_data.capacity = 0;
 }
 
 void
@@ -176,7 +313,322 @@ clodReleaseEnvironment(CLODFEnvironmentData* data)
     //clEnqueueUnmapMemObject(data.environment.queue, data.dest_image, data.dest_ptr, 0, NULL, NULL);
     clifReleaseEnvironment(data->clif);
     free(data->clif);
-    clFreeDeviceEnvironments(&(data->environment), 1, 0);
+    if(data->environment.context != NULL)
+        clodFreeDeviceEnvironment(&(data->environment), CLOD_KERNEL_COUNT);
+    clodResetStageStatistics(data);
+    clodResetScheduler(data);
+    clodReleaseProfile(&(data->profile));
+}
+
+cl_bool
+clodIsCascadeSupported(const CvHaarClassifierCascade* cascade)
+{
+    for(cl_uint stage_index = 0; stage_index < cascade->count; stage_index++) {
+        const CvHaarStageClassifier* stage = &cascade->stage_classifier[stage_index];
+        cl_uint node_count = 0;
+        for(cl_uint classifier_index = 0; classifier_index < stage->count; classifier_index++)
+            node_count += stage->classifier[classifier_index].count;
+        // Kernel stage has a fixed size
+        if(node_count > MAX_STAGE_NODE_COUNT)
+            return CL_FALSE;
+    }
+    return CL_TRUE;
+}
+
+cl_bool
+clodHasTiltedFeatures(const CvHaarClassifierCascade* cascade)
+{
+    for(cl_uint stage_index = 0; stage_index < cascade->count; stage_index++) {
+        const CvHaarStageClassifier* stage = &cascade->stage_classifier[stage_index];
+        for(cl_uint classifier_index = 0; classifier_index < stage->count; classifier_index++) {
+            const CvHaarClassifier* classifier = &stage->classifier[classifier_index];
+            for(cl_uint node_index = 0; node_index < classifier->count; node_index++)
+                if(classifier->haar_feature[node_index].tilted)
+                    return CL_TRUE;
+        }
+    }
+    return CL_FALSE;
+}
+
+/*** Stage statistics ***/
+const CLODStageStatistics*
+clodGetStageStatistics(const CLODEnvironmentData* data)
+{
+    return &(data->stage_statistics);
+}
+
+void
+clodResetStageStatistics(CLODEnvironmentData* data)
+{
+    CLODStageStatistics* statistics = &(data->stage_statistics);
+    free(statistics->scale);
+    free(statistics->last_window_count);
+    free(statistics->last_skipped_count);
+    free(statistics->last_survivor_count);
+    free(statistics->total_window_count);
+    free(statistics->total_skipped_count);
+    free(statistics->total_survivor_count);
+    memset(statistics, 0, sizeof(CLODStageStatistics));
+}
+
+void
+clodPrintStageStatistics(const CLODStageStatistics* statistics,
+                         FILE* file)
+{
+    fprintf(file, "scale\tskipped\twindows");
+    for(cl_uint stage_index = 0; stage_index < statistics->stage_count; stage_index++)
+        fprintf(file, "\tstage %d", stage_index);
+    fprintf(file, "\n");
+    
+    cl_float frames = (cl_float)MAX(statistics->frame_count, 1);
+    for(cl_uint scale_index = 0; scale_index < statistics->scale_count; scale_index++) {
+        fprintf(file, "%.3f\t%.1f\t%.1f", statistics->scale[scale_index],
+                statistics->total_skipped_count[scale_index] / frames,
+                statistics->total_window_count[scale_index] / frames);
+        for(cl_uint stage_index = 0; stage_index < statistics->stage_count; stage_index++)
+            fprintf(file, "\t%.1f", statistics->total_survivor_count[(scale_index * statistics->stage_count) + stage_index] / frames);
+        fprintf(file, "\n");
+    }
+}
+
+void
+beginStageStatistics(CLODStageStatistics* statistics,
+                     const CvHaarClassifierCascade* cascade,
+                     const cl_uint scale_count,
+                     const cl_float scale_factor)
+{
+    // Different shape or scales, start over
+    if(statistics->scale_count != scale_count || statistics->stage_count != (cl_uint)cascade->count ||
+       (scale_count > 1 && statistics->scale[1] != scale_factor)) {
+        free(statistics->scale);
+        free(statistics->last_window_count);
+        free(statistics->last_skipped_count);
+        free(statistics->last_survivor_count);
+        free(statistics->total_window_count);
+        free(statistics->total_skipped_count);
+        free(statistics->total_survivor_count);
+        statistics->frame_count = 0;
+        statistics->scale_count = scale_count;
+        statistics->stage_count = cascade->count;
+        statistics->scale = (cl_float*)malloc(scale_count * sizeof(cl_float));
+        statistics->last_window_count = (cl_uint*)malloc(scale_count * sizeof(cl_uint));
+        statistics->last_skipped_count = (cl_uint*)malloc(scale_count * sizeof(cl_uint));
+        statistics->last_survivor_count = (cl_uint*)malloc(scale_count * cascade->count * sizeof(cl_uint));
+        statistics->total_window_count = (cl_ulong*)calloc(scale_count, sizeof(cl_ulong));
+        statistics->total_skipped_count = (cl_ulong*)calloc(scale_count, sizeof(cl_ulong));
+        statistics->total_survivor_count = (cl_ulong*)calloc(scale_count * cascade->count, sizeof(cl_ulong));
+        
+        cl_float current_scale = 1;
+        for(cl_uint scale_index = 0; scale_index < scale_count; scale_index++, current_scale *= scale_factor)
+            statistics->scale[scale_index] = current_scale;
+    }
+    
+    memset(statistics->last_window_count, 0, scale_count * sizeof(cl_uint));
+    memset(statistics->last_skipped_count, 0, scale_count * sizeof(cl_uint));
+    memset(statistics->last_survivor_count, 0, scale_count * cascade->count * sizeof(cl_uint));
+    statistics->frame_count++;
+}
+
+inline void
+recordWindowCount(CLODStageStatistics* statistics,
+                  const cl_uint scale_index,
+                  const cl_uint window_count)
+{
+    statistics->last_window_count[scale_index] += window_count;
+    statistics->total_window_count[scale_index] += window_count;
+}
+
+void
+recordSkippedCount(CLODStageStatistics* statistics,
+                   const cl_uint scale_index,
+                   const cl_uint skipped_count)
+{
+    statistics->last_skipped_count[scale_index] += skipped_count;
+    statistics->total_skipped_count[scale_index] += skipped_count;
+}
+
+inline void
+recordStageSurvivors(CLODStageStatistics* statistics,
+                     const cl_uint scale_index,
+                     const cl_uint stage_index,
+                     const cl_uint survivor_count)
+{
+    cl_uint index = (scale_index * statistics->stage_count) + stage_index;
+    statistics->last_survivor_count[index] += survivor_count;
+    statistics->total_survivor_count[index] += survivor_count;
+}
+
+/* stage_exits[s] is the number of windows rejected by stage s, stage_exits[stage_count] the accepted ones */
+void
+recordStageExits(CLODStageStatistics* statistics,
+                 const cl_uint scale_index,
+                 const cl_uint start_stage_index,
+                 const cl_uint* stage_exits)
+{
+    cl_uint survivor_count = stage_exits[statistics->stage_count];
+    for(cl_int stage_index = statistics->stage_count - 1; stage_index >= (cl_int)start_stage_index; stage_index--) {
+        recordStageSurvivors(statistics, scale_index, stage_index, survivor_count);
+        survivor_count += stage_exits[stage_index];
+    }
+}
+
+/* Average windows surviving a stage in the previous frames, -1 if unknown */
+inline cl_float
+predictStageSurvivors(const CLODStageStatistics* statistics,
+                      const cl_uint scale_index,
+                      const cl_uint stage_index)
+{
+    if(statistics->frame_count <= 1 || scale_index >= statistics->scale_count)
+        return -1;
+    // Current frame is already counted in frame_count but not recorded yet
+    cl_uint index = (scale_index * statistics->stage_count) + stage_index;
+    return (cl_float)(statistics->total_survivor_count[index] - statistics->last_survivor_count[index]) / (cl_float)(statistics->frame_count - 1);
+}
+
+#ifdef CLOD_COUNTERS
+/*** Work counters ***/
+void
+beginWorkCounters(CLODEnvironmentData* data)
+{
+    data->node_count = 0;
+    data->host_node_start = host_node_count;
+}
+
+/* Windows and survivors of the frame (stage statistics) and the nodes evaluated since beginWorkCounters */
+void
+endWorkCounters(const CLODEnvironmentData* data,
+                CLODWorkCounters* counters)
+{
+    const CLODStageStatistics* statistics = &(data->stage_statistics);
+    memset(counters, 0, sizeof(CLODWorkCounters));
+    counters->scale_count = MIN(statistics->scale_count, CLOD_COUNTERS_MAX_SCALES);
+    counters->stage_count = MIN(statistics->stage_count, CLOD_COUNTERS_MAX_STAGES);
+    for(cl_uint scale_index = 0; scale_index < counters->scale_count; scale_index++)
+        counters->window_count[scale_index] = statistics->last_window_count[scale_index];
+    for(cl_uint scale_index = 0; scale_index < statistics->scale_count; scale_index++)
+        for(cl_uint stage_index = 0; stage_index < counters->stage_count; stage_index++)
+            counters->survivor_count[stage_index] += statistics->last_survivor_count[(scale_index * statistics->stage_count) + stage_index];
+    counters->node_count = data->node_count + (host_node_count - data->host_node_start);
+}
+#endif
+
+/*** Hybrid scheduler ***/
+const CLODSchedulerData*
+clodGetSchedulerData(const CLODEnvironmentData* data)
+{
+    return &(data->scheduler);
+}
+
+void
+clodResetScheduler(CLODEnvironmentData* data)
+{
+    CLODSchedulerData* scheduler = &(data->scheduler);
+    free(scheduler->host_time);
+    free(scheduler->device_time);
+    free(scheduler->on_device);
+    memset(scheduler, 0, sizeof(CLODSchedulerData));
+}
+
+void
+clodEnableProfiling(CLODEnvironmentData* data,
+                    const cl_bool enable)
+{
+    CLDeviceEnvironment* environment = &(data->environment);
+    cl_command_queue_properties properties = 0;
+    cl_int error = clGetCommandQueueInfo(environment->queue, CL_QUEUE_PROPERTIES, sizeof(cl_command_queue_properties), &properties, NULL);
+    clCheckOrExit(error);
+    
+    // One new queue for clif and clod, each environment holds a reference
+    if(enable && !(properties & CL_QUEUE_PROFILING_ENABLE)) {
+        cl_device_id device;
+        error = clGetCommandQueueInfo(environment->queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, NULL);
+        clCheckOrExit(error);
+        error = clFinish(environment->queue);
+        clCheckOrExit(error);
+        cl_command_queue queue = clCreateCommandQueue(environment->context, device, properties | CL_QUEUE_PROFILING_ENABLE, &error);
+        clCheckOrExit(error);
+        error = clRetainCommandQueue(queue);
+        clCheckOrExit(error);
+        clReleaseCommandQueue(environment->queue);
+        clReleaseCommandQueue(data->clif->environment.queue);
+        environment->queue = queue;
+        data->clif->environment.queue = queue;
+    }
+    data->profile.enabled = enable;
+    data->clif->profile = enable ? &(data->profile) : NULL;
+}
+
+const CLODProfile*
+clodGetProfile(const CLODEnvironmentData* data)
+{
+    return &(data->profile);
+}
+
+/* Assign every scale to the host or the device for the current frame */
+void
+scheduleScales(CLODSchedulerData* scheduler,
+               const cl_uint scale_count)
+{
+    // Different number of scales, times are not comparable anymore
+    if(scheduler->scale_count != scale_count) {
+        free(scheduler->host_time);
+        free(scheduler->device_time);
+        free(scheduler->on_device);
+        scheduler->frame_count = 0;
+        scheduler->scale_count = scale_count;
+        scheduler->host_time = (cl_double*)malloc(scale_count * sizeof(cl_double));
+        scheduler->device_time = (cl_double*)malloc(scale_count * sizeof(cl_double));
+        scheduler->on_device = (cl_bool*)malloc(scale_count * sizeof(cl_bool));
+        for(cl_uint i = 0; i < scale_count; i++)
+            scheduler->host_time[i] = scheduler->device_time[i] = -1;
+    }
+    
+    // Calibration, a whole frame on each engine
+    if(scheduler->frame_count < CLOD_SCHEDULER_CALIBRATION_FRAMES) {
+        for(cl_uint i = 0; i < scale_count; i++)
+            scheduler->on_device[i] = (scheduler->frame_count & 1) == 0;
+        scheduler->frame_count++;
+        return;
+    }
+    scheduler->frame_count++;
+    
+    // Most expensive scales first
+    cl_uint* order = (cl_uint*)malloc(scale_count * sizeof(cl_uint));
+    for(cl_uint i = 0; i < scale_count; i++) {
+        cl_double cost = MAX(scheduler->host_time[i], scheduler->device_time[i]);
+        cl_uint j = i;
+        for(; j > 0 && MAX(scheduler->host_time[order[j - 1]], scheduler->device_time[order[j - 1]]) < cost; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    
+    // Give each scale to the engine that would finish it first given the work already assigned
+    cl_double host_load = 0, device_load = 0;
+    for(cl_uint i = 0; i < scale_count; i++) {
+        cl_uint scale_index = order[i];
+        cl_double host_time = MAX(scheduler->host_time[scale_index], 0);
+        cl_double device_time = MAX(scheduler->device_time[scale_index], 0);
+        if(device_load + device_time <= host_load + host_time) {
+            scheduler->on_device[scale_index] = CL_TRUE;
+            device_load += device_time;
+        }
+        else {
+            scheduler->on_device[scale_index] = CL_FALSE;
+            host_load += host_time;
+        }
+    }
+    
+    free(order);
+}
+
+inline void
+updateScaleTime(cl_double* time,
+                const cl_double measured_time)
+{
+    if(*time < 0)
+        *time = measured_time;
+    else
+        *time = (*time * 0.75) + (measured_time * 0.25);
 }
 
 cl_uint
@@ -191,6 +643,177 @@ areRectSimilar(const CLODWeightedRect* r1,
            (abs(r1->rect.y + r1->rect.height - r2->rect.y - r2->rect.height) <= delta);
 }
 
+/* Spatial index over rectangles. Rectangles are split in size classes (by
+ * width + height), each bucketed in its own uniform grid whose cells are at
+ * least as big as the largest similarity distance in the class, so small
+ * rectangles get small cells whatever the largest ones are. Similar
+ * rectangles differ in size by less than a class, they always lie in the
+ * same or in adjacent cells of the same or of the next class. Entries are
+ * sorted by cell (cells of all the classes are numbered together), a cell is
+ * found by binary search
+ */
+typedef struct CLODGridEntry {
+    cl_uint cell;
+    cl_uint index;
+} CLODGridEntry;
+
+typedef struct CLODGridClass {
+    cl_int min_size;                    // smallest width + height of the class
+    cl_int cell_size;
+    cl_int origin_x;
+    cl_int origin_y;
+    cl_uint column_count;
+    cl_uint row_count;
+    cl_uint first_cell;
+} CLODGridClass;
+
+typedef struct CLODRectGrid {
+    cl_uint class_count;
+    CLODGridClass* size_class;
+    cl_uint* rect_class;                // size class of each rectangle
+    cl_uint count;
+    CLODGridEntry* entry;
+} CLODRectGrid;
+
+int
+compareGridEntries(const void* a,
+                   const void* b)
+{
+    const CLODGridEntry* e1 = (const CLODGridEntry*)a;
+    const CLODGridEntry* e2 = (const CLODGridEntry*)b;
+    if(e1->cell != e2->cell)
+        return e1->cell < e2->cell ? -1 : 1;
+    return e1->index < e2->index ? -1 : (e1->index > e2->index);
+}
+
+/* Largest distance at which areRectSimilar can still match r with anything */
+inline cl_int
+maxSimilarDistance(const CLODWeightedRect* r,
+                   const cl_float eps)
+{
+    return (cl_int)ceil(eps * (r->rect.width + r->rect.height) * 0.5);
+}
+
+/* Column (or row) of coordinate in a grid, rounded down below origin too */
+inline cl_int
+gridCoordinate(const cl_int coordinate,
+               const cl_int origin,
+               const cl_int cell_size)
+{
+    cl_int offset = coordinate - origin;
+    return offset >= 0 ? offset / cell_size : -((cell_size - 1 - offset) / cell_size);
+}
+
+void
+buildRectGrid(const CLODWeightedRect* data,
+              const cl_uint count,
+              const cl_float eps,
+              CLODRectGrid* grid)
+{
+    grid->count = count;
+    grid->class_count = 0;
+    grid->size_class = (CLODGridClass*)malloc(MAX(count, 1) * sizeof(CLODGridClass));
+    grid->rect_class = (cl_uint*)malloc(MAX(count, 1) * sizeof(cl_uint));
+    grid->entry = (CLODGridEntry*)malloc(MAX(count, 1) * sizeof(CLODGridEntry));
+    
+    // Sort by size, similar rectangles differ in size by a factor of at most
+    // 1 + 2 * eps. A class spans a bit more, so the next but one is never similar
+    for(cl_uint i = 0; i < count; i++) {
+        grid->entry[i].cell = data[i].rect.width + data[i].rect.height;
+        grid->entry[i].index = i;
+    }
+    qsort(grid->entry, count, sizeof(CLODGridEntry), compareGridEntries);
+    cl_float class_ratio = 1 + (2 * eps);
+    for(cl_uint i = 0; i < count; i++) {
+        cl_int size = (cl_int)grid->entry[i].cell;
+        CLODGridClass* size_class = &grid->size_class[grid->class_count - 1];
+        if(grid->class_count == 0 || size > size_class->min_size * class_ratio + 1) {
+            size_class = &grid->size_class[grid->class_count++];
+            size_class->min_size = size;
+            size_class->cell_size = 1;
+            size_class->origin_x = size_class->origin_y = INT_MAX;
+            size_class->column_count = size_class->row_count = 0;
+        }
+        const CLODWeightedRect* r = &data[grid->entry[i].index];
+        size_class->cell_size = MAX(size_class->cell_size, maxSimilarDistance(r, eps));
+        size_class->origin_x = MIN(size_class->origin_x, r->rect.x);
+        size_class->origin_y = MIN(size_class->origin_y, r->rect.y);
+        grid->rect_class[grid->entry[i].index] = grid->class_count - 1;
+    }
+    
+    // Extent of each class, then cells are numbered class after class
+    for(cl_uint i = 0; i < count; i++) {
+        CLODGridClass* size_class = &grid->size_class[grid->rect_class[i]];
+        size_class->column_count = MAX(size_class->column_count, (cl_uint)gridCoordinate(data[i].rect.x, size_class->origin_x, size_class->cell_size) + 1);
+        size_class->row_count = MAX(size_class->row_count, (cl_uint)gridCoordinate(data[i].rect.y, size_class->origin_y, size_class->cell_size) + 1);
+    }
+    cl_uint cell_count = 0;
+    for(cl_uint c = 0; c < grid->class_count; c++) {
+        grid->size_class[c].first_cell = cell_count;
+        cell_count += grid->size_class[c].column_count * grid->size_class[c].row_count;
+    }
+    
+    for(cl_uint i = 0; i < count; i++) {
+        const CLODGridClass* size_class = &grid->size_class[grid->rect_class[i]];
+        cl_uint column = gridCoordinate(data[i].rect.x, size_class->origin_x, size_class->cell_size);
+        cl_uint row = gridCoordinate(data[i].rect.y, size_class->origin_y, size_class->cell_size);
+        grid->entry[i].cell = size_class->first_cell + (row * size_class->column_count) + column;
+        grid->entry[i].index = i;
+    }
+    qsort(grid->entry, count, sizeof(CLODGridEntry), compareGridEntries);
+}
+
+void
+releaseRectGrid(CLODRectGrid* grid)
+{
+    free(grid->size_class);
+    free(grid->rect_class);
+    free(grid->entry);
+}
+
+/* Range [*begin, *end) of entries in cell */
+void
+findGridCell(const CLODRectGrid* grid,
+             const cl_uint cell,
+             cl_uint* begin,
+             cl_uint* end)
+{
+    cl_uint low = 0, high = grid->count;
+    while(low < high) {
+        cl_uint middle = (low + high) / 2;
+        if(grid->entry[middle].cell < cell)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    *begin = low;
+    for(high = low; high < grid->count && grid->entry[high].cell == cell; high++);
+    *end = high;
+}
+
+/* Cells of size class c next to (or holding) rectangle r, -1 for the ones
+ * outside the grid
+ */
+void
+findNeighbourCells(const CLODRectGrid* grid,
+                   const cl_uint c,
+                   const CLODWeightedRect* r,
+                   cl_int* cells)
+{
+    const CLODGridClass* size_class = &grid->size_class[c];
+    cl_int column = gridCoordinate(r->rect.x, size_class->origin_x, size_class->cell_size);
+    cl_int row = gridCoordinate(r->rect.y, size_class->origin_y, size_class->cell_size);
+    for(cl_int neighbour = 0; neighbour < 9; neighbour++) {
+        cl_int neighbour_column = column + (neighbour % 3) - 1;
+        cl_int neighbour_row = row + (neighbour / 3) - 1;
+        if(neighbour_column < 0 || neighbour_column >= (cl_int)size_class->column_count ||
+           neighbour_row < 0 || neighbour_row >= (cl_int)size_class->row_count)
+            cells[neighbour] = -1;
+        else
+            cells[neighbour] = size_class->first_cell + (neighbour_row * size_class->column_count) + neighbour_column;
+    }
+}
+
 cl_int
 partitionData(const CLODWeightedRect* data,
               const cl_uint count,
@@ -211,7 +834,12 @@ partitionData(const CLODWeightedRect* data,
         nodes[i][RANK] = 0;
     }
     
-    // The main O(N^2) pass: merge connected components
+    // Only rectangles in the same or adjacent cells can be similar
+    CLODRectGrid grid;
+    buildRectGrid(data, count, eps, &grid);
+    
+    // The main pass: merge connected components. Components (and so labels)
+    // do not depend on the order pairs are visited in
     for(i = 0; i < N; i++)
     {
         int root = i;
@@ -220,42 +848,61 @@ partitionData(const CLODWeightedRect* data,
         while(nodes[root][PARENT] >= 0)
             root = nodes[root][PARENT];
         
-        for(j = 0; j < N; j++)
+        // Same and next size class, a smaller similar rectangle finds this one
+        cl_int cells[18];
+        cl_uint class_index = grid.rect_class[i];
+        findNeighbourCells(&grid, class_index, &data[i], &cells[0]);
+        if(class_index + 1 < grid.class_count)
+            findNeighbourCells(&grid, class_index + 1, &data[i], &cells[9]);
+        else
+            for(cl_int neighbour = 9; neighbour < 18; neighbour++)
+                cells[neighbour] = -1;
+        for(cl_int neighbour = 0; neighbour < 18; neighbour++)
         {
-            if(i == j || !areRectSimilar(&data[i], &data[j], eps))
+            if(cells[neighbour] < 0)
                 continue;
-            int root2 = j;
             
-            while(nodes[root2][PARENT] >= 0)
-                root2 = nodes[root2][PARENT];
-            
-            if(root2 != root) {
-                // Merge trees
-                int rank = nodes[root][RANK], rank2 = nodes[root2][RANK];
-                if(rank > rank2)
-                    nodes[root2][PARENT] = root;
-                else {
-                    nodes[root][PARENT] = root2;
-                    nodes[root2][RANK] += rank == rank2;
-                    root = root2;
-                }
-                int k = j;
-                int parent;
+            cl_uint begin, end;
+            findGridCell(&grid, cells[neighbour], &begin, &end);
+            for(cl_uint candidate = begin; candidate < end; candidate++)
+            {
+                j = grid.entry[candidate].index;
+                if(i == j || !areRectSimilar(&data[i], &data[j], eps))
+                    continue;
+                int root2 = j;
                 
-                // compress the path from node2 to root
-                while((parent = nodes[k][PARENT]) >= 0) {
-                    nodes[k][PARENT] = root;
-                    k = parent;
-                }
-                // compress the path from node to root
-                k = i;
-                while((parent = nodes[k][PARENT]) >= 0) {
-                    nodes[k][PARENT] = root;
-                    k = parent;
+                while(nodes[root2][PARENT] >= 0)
+                    root2 = nodes[root2][PARENT];
+                
+                if(root2 != root) {
+                    // Merge trees
+                    int rank = nodes[root][RANK], rank2 = nodes[root2][RANK];
+                    if(rank > rank2)
+                        nodes[root2][PARENT] = root;
+                    else {
+                        nodes[root][PARENT] = root2;
+                        nodes[root2][RANK] += rank == rank2;
+                        root = root2;
+                    }
+                    int k = j;
+                    int parent;
+                    
+                    // compress the path from node2 to root
+                    while((parent = nodes[k][PARENT]) >= 0) {
+                        nodes[k][PARENT] = root;
+                        k = parent;
+                    }
+                    // compress the path from node to root
+                    k = i;
+                    while((parent = nodes[k][PARENT]) >= 0) {
+                        nodes[k][PARENT] = root;
+                        k = parent;
+                    }
                 }
             }
         }
     }
+    releaseRectGrid(&grid);
     
     *labels = (int*)malloc(N * sizeof(int));
     // Final O(N) pass: enumerate classes
@@ -279,56 +926,33 @@ partitionData(const CLODWeightedRect* data,
     return nclasses;
 }
 
+/* Keeps groups with weight above group_threshold unless they are small
+ * rectangles inside larger ones, result is written to data
+ */
 cl_uint
-filterResult(CLODWeightedRect* data,
-             const cl_uint count,
-             const int group_threshold,
-             const cl_float eps)
+suppressInnerGroups(const CLODWeightedRect* groups,
+                    const cl_uint group_count,
+                    const int group_threshold,
+                    const cl_float eps,
+                    CLODWeightedRect* data)
 {
-    int* labels;
-    int nclasses = partitionData(data, count, eps, &labels);
-    CLODWeightedRect* rrects = (CLODWeightedRect*)malloc(nclasses * sizeof(CLODWeightedRect));
-    int* rweights = (int*)calloc(nclasses, sizeof(int));
-    
     int i, j;
-    int n_labels = (int)count;
-    for(i = 0; i < n_labels; i++) {
-        int cls = labels[i];
-        rrects[cls].rect.x += data[i].rect.x;
-        rrects[cls].rect.y += data[i].rect.y;
-        rrects[cls].rect.width += data[i].rect.width;
-        rrects[cls].rect.height += data[i].rect.height;
-        rweights[cls]++;
-    }
-    
-    for(i = 0; i < nclasses; i++)
-    { 
-        CLODWeightedRect r = rrects[i];
-        float s = 1.f/(float)rweights[i];
-        rrects[i].rect.x = (int)MIN(r.rect.x * s, INT_MAX);
-        rrects[i].rect.y = (int)MIN(r.rect.y * s, INT_MAX);
-        rrects[i].rect.width = (int)MIN(r.rect.width * s, INT_MAX);
-        rrects[i].rect.height = (int)MIN(r.rect.height * s, INT_MAX);
-        rrects[i].weight = rweights[i];
-    }
-    
-    memset(data, 0, count * sizeof(CvRect));
-    
+    int nclasses = (int)group_count;
     cl_uint insertion_point = 0;
     for(i = 0; i < nclasses; i++) {
-        CLODWeightedRect r1 = rrects[i];
-        int n1 = rweights[i];
+        CLODWeightedRect r1 = groups[i];
+        int n1 = (int)groups[i].weight;
         if(n1 <= group_threshold)
             continue;
         
         // filter out small face rectangles inside large rectangles
         for(j = 0; j < nclasses; j++)
         {
-            int n2 = rweights[j];
+            int n2 = (int)groups[j].weight;
             
             if(j == i || n2 <= group_threshold)
                 continue;
-            CLODWeightedRect r2 = rrects[j];
+            CLODWeightedRect r2 = groups[j];
             
             int dx = (int)MAX(r2.rect.width * eps, INT_MAX);
             int dy = (int)MAX(r2.rect.height * eps, INT_MAX);
@@ -347,36 +971,471 @@ filterResult(CLODWeightedRect* data,
         }
     }
     
-    // Release
-    free(rweights);
-    free(labels);
-    free(rrects);
-    
-    // Return
     return insertion_point;
 }
 
-/*** Various implementations below ***/
-void
-setupImage(const IplImage* src,
-           CvMat** sum,
-           CvMat** square_sum,
-           cl_bool use_opencl)
+cl_uint
+filterResult(CLODWeightedRect* data,
+             const cl_uint count,
+             const int group_threshold,
+             const cl_float eps)
 {
-    CLIFIntegralResult result = clifGrayscaleIntegral(src, NULL, use_opencl);
-    *sum = result.image;
-    *square_sum = result.square_image;
-}
-
-cl_int
-setupScale(const cl_float current_scale,
-           const CvSize* image_size,
-           const CvSize* feature_size,
-           const CvSize* min_window_size,
-           const CvSize* max_window_size,
-           CvRect* equ_rect,
-           CvSize* scaled_window_size,
-           cl_uint* scaled_window_area,
+    int* labels;
+    int nclasses = partitionData(data, count, eps, &labels);
+    CLODWeightedRect* rrects = (CLODWeightedRect*)calloc(nclasses, sizeof(CLODWeightedRect));
+    int* rweights = (int*)calloc(nclasses, sizeof(int));
+    
+    int i;
+    int n_labels = (int)count;
+    for(i = 0; i < n_labels; i++) {
+        int cls = labels[i];
+        rrects[cls].rect.x += data[i].rect.x;
+        rrects[cls].rect.y += data[i].rect.y;
+        rrects[cls].rect.width += data[i].rect.width;
+        rrects[cls].rect.height += data[i].rect.height;
+        rweights[cls]++;
+    }
+    
+    for(i = 0; i < nclasses; i++)
+    { 
+        CLODWeightedRect r = rrects[i];
+        float s = 1.f/(float)rweights[i];
+        rrects[i].rect.x = (int)MIN(r.rect.x * s, INT_MAX);
+        rrects[i].rect.y = (int)MIN(r.rect.y * s, INT_MAX);
+        rrects[i].rect.width = (int)MIN(r.rect.width * s, INT_MAX);
+        rrects[i].rect.height = (int)MIN(r.rect.height * s, INT_MAX);
+        rrects[i].weight = rweights[i];
+    }
+    
+    memset(data, 0, count * sizeof(CvRect));
+    
+    cl_uint insertion_point = suppressInnerGroups(rrects, nclasses, group_threshold, eps, data);
+    
+    // Release
+    free(rweights);
+    free(labels);
+    free(rrects);
+    
+    // Return
+    return insertion_point;
+}
+
+/* Groups a copy of the matches found so far and writes the biggest group (or
+ * match, if they are not grouped) to biggest. Returns CL_FALSE if there is none
+ */
+cl_bool
+findBiggestMatch(const CLODWeightedRect* matches,
+                 const cl_uint match_count,
+                 const cl_uint min_neighbors,
+                 CLODWeightedRect* biggest)
+{
+    if(match_count == 0)
+        return CL_FALSE;
+    
+    CLODWeightedRect* groups = (CLODWeightedRect*)malloc(match_count * sizeof(CLODWeightedRect));
+    memcpy(groups, matches, match_count * sizeof(CLODWeightedRect));
+    cl_uint group_count = match_count;
+    if(min_neighbors != 0)
+        group_count = filterResult(groups, match_count, MAX(min_neighbors, 1), EPS);
+    
+    for(cl_uint i = 0; i < group_count; i++) {
+        if(i == 0 || groups[i].rect.width * groups[i].rect.height > biggest->rect.width * biggest->rect.height)
+            *biggest = groups[i];
+    }
+    
+    // Release
+    free(groups);
+    
+    return group_count != 0;
+}
+
+/*** Device grouping ***/
+void
+runGroupingKernel(const CLODEnvironmentData* data,
+                  const cl_uint kernel_index,
+                  const cl_uint work_count)
+{
+    cl_int error = CL_SUCCESS;
+    size_t wavefront_size = 64;
+    size_t global_size = ((work_count / wavefront_size) + 1) * wavefront_size;
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[kernel_index], 1, NULL, &global_size, NULL, 0, NULL, clodProfileEvent(data->clif->profile, clod_kernel_functions[kernel_index]));
+    clCheckOrExit(error);
+}
+
+void
+resetDeviceMatches(CLODEnvironmentData* data)
+{
+    cl_int error = CL_SUCCESS;
+    cl_uint counters[3] = { 0, 0, 0 };
+    error = clEnqueueWriteBuffer(data->environment.queue, data->grouping_data.buffers[4], CL_TRUE, 0, sizeof(counters), counters, 0, NULL, clodProfileEvent(data->clif->profile, "write"));
+    clCheckOrExit(error);
+    data->grouping_data.window_size_count = 0;
+}
+
+/* Remembers the width + height of a match, the grid has a size class for it */
+void
+addGroupingWindowSize(CLODGroupingData* grouping_data,
+                      const cl_int size)
+{
+    for(cl_uint i = 0; i < grouping_data->window_size_count; i++)
+        if(grouping_data->window_sizes[i] == size)
+            return;
+    grouping_data->window_sizes = (cl_int*)realloc(grouping_data->window_sizes, (grouping_data->window_size_count + 1) * sizeof(cl_int));
+    grouping_data->window_sizes[grouping_data->window_size_count++] = size;
+}
+
+/* Append the window_count windows in window_buffer to the device matches */
+void
+appendDeviceMatches(CLODEnvironmentData* data,
+                    cl_mem window_buffer,
+                    const cl_uint window_count,
+                    const CvSize* window_size)
+{
+    cl_int error = CL_SUCCESS;
+    addGroupingWindowSize(&(data->grouping_data), window_size->width + window_size->height);
+    cl_kernel kernel = data->environment.kernels[1];
+    error = clSetKernelArg(kernel, 0, sizeof(cl_mem), &window_buffer);
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 1, sizeof(cl_uint), &window_count);
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 2, sizeof(cl_int), &(window_size->width));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 3, sizeof(cl_int), &(window_size->height));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 4, sizeof(cl_mem), &(data->grouping_data.buffers[0]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 5, sizeof(cl_mem), &(data->grouping_data.buffers[4]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 6, sizeof(cl_uint), &(data->grouping_data.capacity));
+    clCheckOrExit(error);
+    runGroupingKernel(data, 1, window_count);
+}
+
+int
+compareSizes(const void* a,
+             const void* b)
+{
+    return *(const cl_int*)a - *(const cl_int*)b;
+}
+
+/* Size classes of the device grid, the same as the ones of buildRectGrid but
+ * from the sizes alone (origin 0, extent of the image). Cells are at least a
+ * sixteenth of the window, which bounds the cell count for a small eps.
+ * Returns the class count, cell_count is the total number of cells
+ */
+cl_uint
+buildGridClasses(cl_int* sizes,
+                 const cl_uint size_count,
+                 const cl_float eps,
+                 const CvSize* image_size,
+                 KernelGridClass* classes,
+                 cl_uint* cell_count)
+{
+    qsort(sizes, size_count, sizeof(cl_int), compareSizes);
+    cl_float class_ratio = 1 + (2 * eps);
+    cl_uint class_count = 0;
+    for(cl_uint i = 0; i < size_count; i++) {
+        KernelGridClass* grid_class = &classes[class_count - 1];
+        if(class_count == 0 || sizes[i] > grid_class->min_size * class_ratio + 1) {
+            grid_class = &classes[class_count++];
+            grid_class->min_size = sizes[i];
+            grid_class->cell_size = MAX(grid_class->min_size / 16, 1);
+        }
+        grid_class->cell_size = MAX(grid_class->cell_size, (cl_int)ceil(eps * sizes[i] * 0.5));
+    }
+    *cell_count = 0;
+    for(cl_uint c = 0; c < class_count; c++) {
+        classes[c].column_count = (image_size->width / classes[c].cell_size) + 1;
+        classes[c].row_count = (image_size->height / classes[c].cell_size) + 1;
+        classes[c].first_cell = *cell_count;
+        *cell_count += classes[c].column_count * classes[c].row_count;
+    }
+    return class_count;
+}
+
+/* Grows buffers[index] of grouping_data to hold count elements */
+void
+reserveGroupingBuffer(CLODEnvironmentData* data,
+                      const cl_uint index,
+                      const cl_uint count,
+                      const size_t element_size,
+                      cl_uint* capacity)
+{
+    if(*capacity >= count)
+        return;
+    if(*capacity != 0)
+        clReleaseMemObject(data->grouping_data.buffers[index]);
+    cl_int error = CL_SUCCESS;
+    data->grouping_data.buffers[index] = clCreateBuffer(data->environment.context, CL_MEM_READ_WRITE, count * element_size, NULL, &error);
+    clCheckOrExit(error);
+    *capacity = count;
+}
+
+int
+compareGroupRoots(const void* a,
+                  const void* b)
+{
+    return ((const KernelGroup*)a)->root - ((const KernelGroup*)b)->root;
+}
+
+/* Same result as filterResult, for matches appended with appendDeviceMatches
+ * plus host_match_count matches found on the host. Only the groups are read
+ * back, they are written to matches
+ */
+cl_uint
+groupDeviceMatches(CLODEnvironmentData* data,
+                   CLODWeightedRect* matches,
+                   const cl_uint host_match_count,
+                   const int group_threshold,
+                   const cl_float eps)
+{
+    cl_int error = CL_SUCCESS;
+    CLODGroupingData* grouping_data = &(data->grouping_data);
+    cl_uint counters[3];
+    
+    error = clEnqueueReadBuffer(data->environment.queue, grouping_data->buffers[4], CL_TRUE, 0, sizeof(cl_uint), counters, 0, NULL, clodProfileEvent(data->clif->profile, "read"));
+    clCheckOrExit(error);
+    cl_uint match_count = counters[0];
+    if(match_count + host_match_count > grouping_data->capacity) {
+        fprintf(stderr, "groupDeviceMatches: %d matches, only %d are grouped\n", match_count + host_match_count, grouping_data->capacity);
+        match_count = MIN(match_count, grouping_data->capacity);
+    }
+    
+    // Matches of windows finished on the host join the device ones
+    cl_uint upload_count = MIN(host_match_count, grouping_data->capacity - match_count);
+    if(upload_count > 0) {
+        KernelMatch* host_matches = (KernelMatch*)malloc(upload_count * sizeof(KernelMatch));
+        for(cl_uint i = 0; i < upload_count; i++) {
+            host_matches[i].x = matches[i].rect.x;
+            host_matches[i].y = matches[i].rect.y;
+            host_matches[i].width = matches[i].rect.width;
+            host_matches[i].height = matches[i].rect.height;
+            addGroupingWindowSize(grouping_data, matches[i].rect.width + matches[i].rect.height);
+        }
+        error = clEnqueueWriteBuffer(data->environment.queue, grouping_data->buffers[0], CL_TRUE, match_count * sizeof(KernelMatch), upload_count * sizeof(KernelMatch), host_matches, 0, NULL, clodProfileEvent(data->clif->profile, "write"));
+        clCheckOrExit(error);
+        free(host_matches);
+        match_count += upload_count;
+    }
+    grouping_data->match_count = match_count;
+    if(match_count == 0)
+        return 0;
+    
+    // Init labels and sums
+    cl_kernel kernel = data->environment.kernels[2];
+    error = clSetKernelArg(kernel, 0, sizeof(cl_mem), &(grouping_data->buffers[1]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 1, sizeof(cl_mem), &(grouping_data->buffers[2]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 2, sizeof(cl_uint), &match_count);
+    clCheckOrExit(error);
+    runGroupingKernel(data, 2, match_count);
+    
+    // Bucket matches in the cells of their size class
+    KernelGridClass* classes = (KernelGridClass*)malloc(grouping_data->window_size_count * sizeof(KernelGridClass));
+    cl_uint cell_count;
+    cl_uint class_count = buildGridClasses(grouping_data->window_sizes, grouping_data->window_size_count, eps,
+                                           &(data->detect_objects_data.image_size), classes, &cell_count);
+    reserveGroupingBuffer(data, 6, class_count, sizeof(KernelGridClass), &(grouping_data->class_capacity));
+    reserveGroupingBuffer(data, 7, cell_count, sizeof(cl_int), &(grouping_data->cell_capacity));
+    error = clEnqueueWriteBuffer(data->environment.queue, grouping_data->buffers[6], CL_FALSE, 0, class_count * sizeof(KernelGridClass), classes, 0, NULL, clodProfileEvent(data->clif->profile, "write"));
+    clCheckOrExit(error);
+    
+    kernel = data->environment.kernels[6];
+    error = clSetKernelArg(kernel, 0, sizeof(cl_mem), &(grouping_data->buffers[7]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 1, sizeof(cl_uint), &cell_count);
+    clCheckOrExit(error);
+    runGroupingKernel(data, 6, cell_count);
+    
+    kernel = data->environment.kernels[7];
+    error = clSetKernelArg(kernel, 0, sizeof(cl_mem), &(grouping_data->buffers[0]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 1, sizeof(cl_mem), &(grouping_data->buffers[6]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 2, sizeof(cl_uint), &class_count);
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 3, sizeof(cl_mem), &(grouping_data->buffers[7]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 4, sizeof(cl_mem), &(grouping_data->buffers[5]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 5, sizeof(cl_uint), &match_count);
+    clCheckOrExit(error);
+    runGroupingKernel(data, 7, match_count);
+    
+    // Propagate labels until nothing changes, the flag is only read back
+    // every GROUPING_PASS_COUNT launches (passes at the fixed point change nothing)
+    kernel = data->environment.kernels[3];
+    error = clSetKernelArg(kernel, 0, sizeof(cl_mem), &(grouping_data->buffers[0]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 1, sizeof(cl_mem), &(grouping_data->buffers[1]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 2, sizeof(cl_mem), &(grouping_data->buffers[4]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 3, sizeof(cl_uint), &match_count);
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 4, sizeof(cl_float), &eps);
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 5, sizeof(cl_mem), &(grouping_data->buffers[6]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 6, sizeof(cl_uint), &class_count);
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 7, sizeof(cl_mem), &(grouping_data->buffers[7]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 8, sizeof(cl_mem), &(grouping_data->buffers[5]));
+    clCheckOrExit(error);
+    do {
+        counters[1] = 0;
+        error = clEnqueueWriteBuffer(data->environment.queue, grouping_data->buffers[4], CL_FALSE, sizeof(cl_uint), sizeof(cl_uint), &counters[1], 0, NULL, clodProfileEvent(data->clif->profile, "write"));
+        clCheckOrExit(error);
+        for(cl_uint pass = 0; pass < GROUPING_PASS_COUNT; pass++)
+            runGroupingKernel(data, 3, match_count);
+        error = clEnqueueReadBuffer(data->environment.queue, grouping_data->buffers[4], CL_TRUE, sizeof(cl_uint), sizeof(cl_uint), &counters[1], 0, NULL, clodProfileEvent(data->clif->profile, "read"));
+        clCheckOrExit(error);
+    } while(counters[1] != 0);
+    free(classes);
+    
+    // Sum rectangles of each group
+    kernel = data->environment.kernels[4];
+    error = clSetKernelArg(kernel, 0, sizeof(cl_mem), &(grouping_data->buffers[0]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 1, sizeof(cl_mem), &(grouping_data->buffers[1]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 2, sizeof(cl_mem), &(grouping_data->buffers[2]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 3, sizeof(cl_uint), &match_count);
+    clCheckOrExit(error);
+    runGroupingKernel(data, 4, match_count);
+    
+    // Average and compact groups above the threshold
+    kernel = data->environment.kernels[5];
+    error = clSetKernelArg(kernel, 0, sizeof(cl_mem), &(grouping_data->buffers[1]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 1, sizeof(cl_mem), &(grouping_data->buffers[2]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 2, sizeof(cl_mem), &(grouping_data->buffers[3]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 3, sizeof(cl_mem), &(grouping_data->buffers[4]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 4, sizeof(cl_uint), &match_count);
+    clCheckOrExit(error);
+    error = clSetKernelArg(kernel, 5, sizeof(cl_int), &group_threshold);
+    clCheckOrExit(error);
+    runGroupingKernel(data, 5, match_count);
+    
+    // Read back groups only
+    error = clEnqueueReadBuffer(data->environment.queue, grouping_data->buffers[4], CL_TRUE, 2 * sizeof(cl_uint), sizeof(cl_uint), &counters[2], 0, NULL, clodProfileEvent(data->clif->profile, "read"));
+    clCheckOrExit(error);
+    cl_uint group_count = counters[2];
+    KernelGroup* groups = (KernelGroup*)malloc(group_count * sizeof(KernelGroup));
+    if(group_count > 0) {
+        error = clEnqueueReadBuffer(data->environment.queue, grouping_data->buffers[3], CL_TRUE, 0, group_count * sizeof(KernelGroup), groups, 0, NULL, clodProfileEvent(data->clif->profile, "read"));
+        clCheckOrExit(error);
+    }
+    
+    // Groups in the order partitionData numbers them (first match of each group)
+    qsort(groups, group_count, sizeof(KernelGroup), compareGroupRoots);
+    CLODWeightedRect* rrects = (CLODWeightedRect*)malloc(group_count * sizeof(CLODWeightedRect));
+    for(cl_uint i = 0; i < group_count; i++) {
+        rrects[i].rect = cvRect(groups[i].x, groups[i].y, groups[i].width, groups[i].height);
+        rrects[i].weight = groups[i].weight;
+    }
+    cl_uint insertion_point = suppressInnerGroups(rrects, group_count, group_threshold, eps, matches);
+    
+    // Release
+    free(groups);
+    free(rrects);
+    
+    // Return
+    return insertion_point;
+}
+
+/*** Various implementations below ***/
+/* With tilted the tilted sums follow sum (see clifGrayscaleIntegral) */
+void
+setupImage(const IplImage* src,
+           const cl_bool tilted,
+           CvMat** sum,
+           CvMat** square_sum,
+           cl_bool use_opencl)
+{
+    CLIFIntegralResult result = clifGrayscaleIntegral(src, NULL, tilted, use_opencl);
+    *sum = result.image;
+    *square_sum = result.square_image;
+}
+
+/* Integral image for runStage. If the clif buffers were set up for src (see
+ * clifInitBuffers) it is computed on the device and bound where it is,
+ * otherwise it is computed on the host and uploaded. Release it with
+ * releaseDeviceImage
+ */
+cl_mem
+setupDeviceImage(const IplImage* src,
+                 const cl_bool tilted,
+                 CLODEnvironmentData* clod_data,
+                 CvMat** sum,
+                 CvMat** square_sum)
+{
+    cl_int error = CL_SUCCESS;
+    CLIFEnvironmentData* clif = clod_data->clif;
+    if(clif->image_width != (cl_uint)src->width || clif->image_height != (cl_uint)src->height ||
+       clif->image_stride != (cl_uint)src->widthStep || clif->image_channels != (cl_uint)src->nChannels) {
+        setupImage(src, tilted, sum, square_sum, CL_FALSE);
+        error = clEnqueueWriteBuffer(clod_data->environment.queue, clod_data->detect_objects_data.buffers[0], CL_FALSE, 0, (tilted ? 2 : 1) * (*sum)->width * (*sum)->height * sizeof(cl_uint), (*sum)->data.ptr, 0, NULL, clodProfileEvent(clod_data->clif->profile, "write"));
+        clCheckOrExit(error);
+        return clod_data->detect_objects_data.buffers[0];
+    }
+    
+    CLIFIntegralResult result = clifGrayscaleIntegral(src, clif, tilted, CL_TRUE);
+    *sum = result.image;
+    
+    // Square sums come back as integers, the variance is computed from doubles
+    *square_sum = cvCreateMat(result.square_image->rows, result.square_image->cols, CV_64FC1);
+    const cl_ulong* square = (const cl_ulong*)result.square_image->data.ptr;
+    for(cl_int i = 0; i < result.square_image->rows * result.square_image->cols; i++)
+        (*square_sum)->data.db[i] = (cl_double)square[i];
+    error = clEnqueueUnmapMemObject(clif->environment.queue, clif->integral_image_data.buffers[4], result.square_image->data.ptr, 0, NULL, clodProfileEvent(clif->profile, "unmap"));
+    clCheckOrExit(error);
+    cvReleaseMat(&result.square_image);
+    
+    return clif->integral_image_data.buffers[3];
+}
+
+void
+releaseDeviceImage(CLODEnvironmentData* clod_data,
+                   cl_mem integral_buffer,
+                   CvMat** sum,
+                   CvMat** square_sum)
+{
+    if(integral_buffer == clod_data->clif->integral_image_data.buffers[3]) {
+        cl_int error = clEnqueueUnmapMemObject(clod_data->environment.queue, integral_buffer, (*sum)->data.ptr, 0, NULL, clodProfileEvent(clod_data->clif->profile, "unmap"));
+        clCheckOrExit(error);
+    }
+    cvReleaseMat(sum);
+    cvReleaseMat(square_sum);
+}
+
+/* Edge integral image used by CLOD_EDGE_PRUNING, NULL if pruning is off */
+CvMat*
+setupEdges(const IplImage* src,
+           CLIFEnvironmentData* clif_data,
+           const clod_flags flags,
+           cl_bool use_opencl)
+{
+    if(!(flags & CLOD_EDGE_PRUNING))
+        return NULL;
+    return clifEdgeIntegral(src, clif_data, use_opencl).image;
+}
+
+cl_int
+setupScale(const cl_float current_scale,
+           const CvSize* image_size,
+           const CvSize* feature_size,
+           const CvSize* min_window_size,
+           const CvSize* max_window_size,
+           CvRect* equ_rect,
+           CvSize* scaled_window_size,
+           cl_uint* scaled_window_area,
            CvPoint* end_point,
            cl_float* step)
 {
@@ -414,8 +1473,78 @@ setupScale(const cl_float current_scale,
     return 0;
 }
 
+/* Narrows the window indices set by setupScale to windows lying inside roi */
+cl_int
+clipScaleToRect(const CvRect* roi,
+                const CvSize* scaled_window_size,
+                const cl_float step,
+                CvPoint* start_point,
+                CvPoint* end_point)
+{
+    start_point->x = MAX(start_point->x, (int)ceil(roi->x / step));
+    start_point->y = MAX(start_point->y, (int)ceil(roi->y / step));
+    end_point->x = MIN(end_point->x, (int)floor((roi->x + roi->width - scaled_window_size->width) / step) + 1);
+    end_point->y = MIN(end_point->y, (int)floor((roi->y + roi->height - scaled_window_size->height) / step) + 1);
+    
+    if(start_point->x >= end_point->x || start_point->y >= end_point->y)
+        return -1;
+    return 0;
+}
+
+/* Narrows the window indices to the bounding rect of the regions' rois */
+cl_int
+clipScaleToRegions(const CLODScanRegions* regions,
+                   const CvSize* scaled_window_size,
+                   const cl_float step,
+                   CvPoint* start_point,
+                   CvPoint* end_point)
+{
+    if(regions->roi_count == 0)
+        return 0;
+    
+    CvRect bounds = regions->rois[0];
+    for(cl_uint i = 1; i < regions->roi_count; i++) {
+        const CvRect* roi = &regions->rois[i];
+        cl_int right = MAX(bounds.x + bounds.width, roi->x + roi->width);
+        cl_int bottom = MAX(bounds.y + bounds.height, roi->y + roi->height);
+        bounds.x = MIN(bounds.x, roi->x);
+        bounds.y = MIN(bounds.y, roi->y);
+        bounds.width = right - bounds.x;
+        bounds.height = bottom - bounds.y;
+    }
+    return clipScaleToRect(&bounds, scaled_window_size, step, start_point, end_point);
+}
+
+/* The window lies inside one of the rois and its centre is set in the mask */
+inline cl_bool
+isWindowInRegions(const CLODScanRegions* regions,
+                  const CvPoint* point,
+                  const CvSize* scaled_window_size)
+{
+    if(regions->mask != NULL &&
+       regions->mask->data.ptr[(point->y + scaled_window_size->height / 2) * regions->mask->step +
+                               point->x + scaled_window_size->width / 2] == 0)
+        return CL_FALSE;
+    
+    if(regions->motion != NULL) {
+        CvRect window = cvRect(point->x, point->y, scaled_window_size->width, scaled_window_size->height);
+        if(!clifIsRectMoving(regions->motion, &window))
+            return CL_FALSE;
+    }
+    
+    if(regions->roi_count == 0)
+        return CL_TRUE;
+    for(cl_uint i = 0; i < regions->roi_count; i++) {
+        const CvRect* roi = &regions->rois[i];
+        if(point->x >= roi->x && point->x + scaled_window_size->width <= roi->x + roi->width &&
+           point->y >= roi->y && point->y + scaled_window_size->height <= roi->y + roi->height)
+            return CL_TRUE;
+    }
+    return CL_FALSE;
+}
 
-inline cl_float
+
+cl_float
 computeVariance(const CvMat* integral_image,
                 const CvMat* square_integral_image,
                 const CvRect* equ_rect,
@@ -445,6 +1574,74 @@ computeVariance(const CvMat* integral_image,
     return variance;    
 }
 
+/* Too few edges in the window for any object to be there */
+inline cl_bool
+isWindowFlat(const CvMat* edge_integral_image,
+             const CvRect* equ_rect,
+             const CvPoint* point,
+             const cl_uint scaled_window_area,
+             const cl_float edge_density)
+{
+    cl_uint edge_count = mats(edge_integral_image->data.i,
+                              edge_integral_image->width,
+                              point->x + equ_rect->x,
+                              point->y + equ_rect->y,
+                              equ_rect->width, equ_rect->height);
+    return edge_count < edge_density * scaled_window_area;
+}
+
+cl_uint
+countCascadeNodes(const CvHaarClassifierCascade* casc)
+{
+    cl_uint node_count = 0;
+    for(cl_uint stage_index = 0; stage_index < casc->count; stage_index++)
+        for(cl_uint classifier_index = 0; classifier_index < casc->stage_classifier[stage_index].count; classifier_index++)
+            node_count += casc->stage_classifier[stage_index].classifier[classifier_index].count;
+    return node_count;
+}
+
+/* Rect of a feature at current_scale, its weight normalized by the window
+ * area (tilted rects count half, as in cvSetImagesForHaarClassifierCascade)
+ * and the offsets of its corners from the window offset in the integral
+ * image, summed as matsp(left top, right top, left bottom, right bottom).
+ * Corners of tilted rects are in the tilted sums, tilted_offset elements
+ * after the sums (see clifGrayscaleIntegral)
+ */
+inline void
+scaleFeatureRect(const CvHaarFeature* feature,
+                 const cl_uint rect_index,
+                 const cl_float current_scale,
+                 const cl_uint scaled_window_area,
+                 const cl_uint integral_image_width,
+                 const cl_uint tilted_offset,
+                 CvRect* rect,
+                 cl_float* weight,
+                 cl_uint* corner_offset)
+{
+    const CvRect* original_rect = &feature->rect[rect_index].r;
+    rect->x = round(original_rect->x * current_scale);
+    rect->y = round(original_rect->y * current_scale);
+    rect->width = round(original_rect->width * current_scale);
+    rect->height = round(original_rect->height * current_scale);
+    *weight = (feature->rect[rect_index].weight) / (float)scaled_window_area;
+    
+    cl_uint stride = integral_image_width;
+    if(!feature->tilted) {
+        corner_offset[0] = (stride * rect->y) + rect->x;
+        corner_offset[1] = (stride * rect->y) + rect->x + rect->width;
+        corner_offset[2] = (stride * (rect->y + rect->height)) + rect->x;
+        corner_offset[3] = (stride * (rect->y + rect->height)) + rect->x + rect->width;
+        return;
+    }
+    
+    // Top corner, then the left, right and bottom ones of the rotated rect
+    *weight *= 0.5f;
+    corner_offset[0] = tilted_offset + (stride * rect->y) + rect->x;
+    corner_offset[1] = tilted_offset + (stride * (rect->y + rect->height)) + rect->x - rect->height;
+    corner_offset[2] = tilted_offset + (stride * (rect->y + rect->width)) + rect->x + rect->width;
+    corner_offset[3] = tilted_offset + (stride * (rect->y + rect->width + rect->height)) + rect->x + rect->width - rect->height;
+}
+
 inline void
 precomputeFeatures(const CvMat* integral_image,
                    const cl_uint scaled_window_area,
@@ -453,45 +1650,64 @@ precomputeFeatures(const CvMat* integral_image,
                    CLODOptimizedRect* opt_rectangles)
 {
     // Precompute feature rect offset in integral image and square integral image into a new cascade
+    // Every tree node takes MAX_FEATURE_RECT_COUNT rectangles, unused ones have weight 0
     cl_uint opt_rect_index = 0;
     for(cl_uint stage_index = 0; stage_index < casc->count; stage_index++) {
         for(cl_uint classifier_index = 0; classifier_index < casc->stage_classifier[stage_index].count; classifier_index++) {
-            // Optimized for stump based classifier (otherwise loop over features)
-            CvHaarFeature feature = casc->stage_classifier[stage_index].classifier[classifier_index].haar_feature[0];
-            
-            // Normalize rect weight based on window area
-            cl_float first_rect_area;
-            cl_uint first_rect_index = opt_rect_index;
-            cl_float sum_rect_area = 0;
-            for(cl_uint i = 0; i < MAX_FEATURE_RECT_COUNT; i++) {
-                opt_rectangles[opt_rect_index].weight = 0;
-                if(feature.rect[i].weight != 0) {
-                    register CvRect* temp_rect = &feature.rect[i].r;
+            const CvHaarClassifier* classifier = &casc->stage_classifier[stage_index].classifier[classifier_index];
+            for(cl_uint node_index = 0; node_index < classifier->count; node_index++) {
+                const CvHaarFeature* feature = &classifier->haar_feature[node_index];
+                
+                // Normalize rect weight based on window area
+                cl_float first_rect_area;
+                cl_uint first_rect_index = opt_rect_index;
+                cl_float sum_rect_area = 0;
+                for(cl_uint i = 0; i < MAX_FEATURE_RECT_COUNT; i++, opt_rect_index++) {
                     register CLODOptimizedRect* opt_rect = &opt_rectangles[opt_rect_index];
-                    register cl_uint rect_x = round(temp_rect->x * current_scale);
-                    register cl_uint rect_y = round(temp_rect->y * current_scale);
-                    register cl_uint rect_width = round(temp_rect->width * current_scale);
-                    register cl_uint rect_height = round(temp_rect->height * current_scale);
-                    register cl_float rect_weight = (feature.rect[i].weight) / (float)scaled_window_area;
-                    opt_rect->weight = rect_weight;
-                    opt_rect->sum_left_top = matp((cl_uint*)integral_image->data.i, integral_image->width, rect_x, rect_y);
-                    opt_rect->sum_right_top = matp((cl_uint*)integral_image->data.i, integral_image->width, rect_x + rect_width, rect_y);
-                    opt_rect->sum_left_bottom = matp((cl_uint*)integral_image->data.i, integral_image->width, rect_x, rect_y + rect_height);
-                    opt_rect->sum_right_bottom = matp((cl_uint*)integral_image->data.i, integral_image->width, rect_x + rect_width, rect_y + rect_height);
-                    
-                    if(i > 0)
-                        sum_rect_area += rect_weight * rect_width * rect_height;
-                    else
-                        first_rect_area = rect_width * rect_height;
-                    
-                    opt_rect_index++;
+                    if(feature->rect[i].weight != 0) {
+                        CvRect rect;
+                        cl_float rect_weight;
+                        cl_uint corner_offset[4];
+                        scaleFeatureRect(feature, i, current_scale, scaled_window_area, integral_image->width, integral_image->rows * integral_image->cols, &rect, &rect_weight, corner_offset);
+                        opt_rect->weight = rect_weight;
+                        opt_rect->sum_left_top = (cl_uint*)integral_image->data.i + corner_offset[0];
+                        opt_rect->sum_right_top = (cl_uint*)integral_image->data.i + corner_offset[1];
+                        opt_rect->sum_left_bottom = (cl_uint*)integral_image->data.i + corner_offset[2];
+                        opt_rect->sum_right_bottom = (cl_uint*)integral_image->data.i + corner_offset[3];
+                        
+                        if(i > 0)
+                            sum_rect_area += rect_weight * rect.width * rect.height;
+                        else
+                            first_rect_area = rect.width * rect.height;
+                    }
+                    else {
+                        opt_rect->weight = 0;
+                        opt_rect->sum_left_top = opt_rect->sum_right_top = (cl_uint*)integral_image->data.i;
+                        opt_rect->sum_left_bottom = opt_rect->sum_right_bottom = (cl_uint*)integral_image->data.i;
+                    }
                 }
+                opt_rectangles[first_rect_index].weight = (-sum_rect_area/first_rect_area);
             }
-            opt_rectangles[first_rect_index].weight = (-sum_rect_area/first_rect_area);
         }
     }
 }
 
+/* Window data of the window at point */
+inline void
+setupWindow(const CvMat* integral_image,
+            const CvMat* square_integral_image,
+            const CvRect* equ_rect,
+            const CvPoint* point,
+            const cl_uint scaled_window_area,
+            CLODSubwindowData* window)
+{
+    window->x = point->x;
+    window->y = point->y;
+    window->variance = computeVariance(integral_image, square_integral_image, equ_rect, point, scaled_window_area);
+    window->offset = mato(integral_image->width, point->x, point->y);
+}
+
+/* Windows every grid_step indices in x and y */
 inline void
 precomputeWindows(const cl_float step,
                   const CvMat* integral_image,
@@ -499,38 +1715,49 @@ precomputeWindows(const cl_float step,
                   const CvRect* equ_rect,
                   const CvPoint* start_point,
                   const CvPoint* end_point,
+                  const CvSize* scaled_window_size,
                   const cl_uint scaled_window_area,
+                  const CLODScanRegions* regions,
+                  const CvMat* edge_integral_image,
+                  const cl_float edge_density,
+                  const cl_uint grid_step,
                   CLODSubwindowData** psubwindow_data,
-                  cl_uint* subwindow_count)
+                  cl_uint* subwindow_count,
+                  cl_uint* skipped_count)
 {    
     // Precompute x and y vars for each subwindow
     *psubwindow_data = (CLODSubwindowData*)malloc((end_point->y - start_point->y) * (end_point->x - start_point->x) * sizeof(CLODSubwindowData));
     CLODSubwindowData* subwindow_data = *psubwindow_data;
     cl_uint current_subwindow = 0;
+    *skipped_count = 0;
     
-    for(int y_index = start_point->y; y_index < end_point->y; y_index++) {
-        for(int x_index = start_point->x; x_index < end_point->x; x_index++) {
+    for(int y_index = start_point->y; y_index < end_point->y; y_index += grid_step) {
+        for(int x_index = start_point->x; x_index < end_point->x; x_index += grid_step) {
             // Real position
             CvPoint point = cvPoint((cl_uint)lrint(x_index * step), (cl_uint)lrint(y_index * step));
             
-            cl_float variance = computeVariance(integral_image, square_integral_image, equ_rect, &point, scaled_window_area);
-            
-            subwindow_data[current_subwindow].x = point.x;
-            subwindow_data[current_subwindow].y = point.y;
-            subwindow_data[current_subwindow].variance = variance;
-            subwindow_data[current_subwindow].offset = mato(integral_image->width, point.x, point.y);
-            
+            // Never seen by any stage
+            if(regions != NULL && !isWindowInRegions(regions, &point, scaled_window_size)) {
+                (*skipped_count)++;
+                continue;
+            }
+            if(edge_integral_image != NULL && isWindowFlat(edge_integral_image, equ_rect, &point, scaled_window_area, edge_density))
+                continue;
+            
+            setupWindow(integral_image, square_integral_image, equ_rect, &point, scaled_window_area, &subwindow_data[current_subwindow]);
             current_subwindow++;
         }
     }
     *subwindow_count = current_subwindow;
 }
 
+/* Tilted sums are tilted_offset elements after the sums */
 KernelCascade
 precomputeKernelCascade(const CvHaarClassifierCascade* cascade,
                         const cl_float current_scale,
                         const cl_uint scaled_window_area,
-                        const cl_uint integral_image_width)
+                        const cl_uint integral_image_width,
+                        const cl_uint tilted_offset)
 {
     KernelCascade kc;
     kc.count = cascade->count;
@@ -539,77 +1766,98 @@ precomputeKernelCascade(const CvHaarClassifierCascade* cascade,
         kc.stage[s].count = cascade->stage_classifier[s].count;
         kc.stage[s].threshold = cascade->stage_classifier[s].threshold;
         
+        // Flatten trees, root of each tree is followed by its nodes
+        cl_uint n = 0;
         for(cl_uint c = 0; c < cascade->stage_classifier[s].count; c++) {
-            kc.stage[s].classifier[c].alpha[0] = cascade->stage_classifier[s].classifier[c].alpha[0];
-            kc.stage[s].classifier[c].alpha[1] = cascade->stage_classifier[s].classifier[c].alpha[1];
-            kc.stage[s].classifier[c].threshold = *cascade->stage_classifier[s].classifier[c].threshold;
-            
-            cl_float first_rect_area;
-            cl_float sum_rect_area = 0;
-            for(cl_uint r = 0; r < MAX_FEATURE_RECT_COUNT; r++) {
-                cl_float original_weight = cascade->stage_classifier[s].classifier[c].haar_feature[0].rect[r].weight;
-                if(original_weight != 0) {
-                    CvRect original_rect = cascade->stage_classifier[s].classifier[c].haar_feature[0].rect[r].r;
-                    
-                    register cl_uint rect_x = round(original_rect.x * current_scale);
-                    register cl_uint rect_y = round(original_rect.y * current_scale);
-                    register cl_uint rect_width = round(original_rect.width * current_scale);
-                    register cl_uint rect_height = round(original_rect.height * current_scale);
-                    register cl_float rect_weight = (original_weight) / (float)scaled_window_area;
-                    
-                    kc.stage[s].classifier[c].rect[r].left_top_offset = mato(integral_image_width, rect_x, rect_y);
-                    kc.stage[s].classifier[c].rect[r].right_top_offset = mato(integral_image_width, rect_x + rect_width, rect_y);
-                    kc.stage[s].classifier[c].rect[r].left_bottom_offset = mato(integral_image_width, rect_x, rect_y + rect_height);
-                    kc.stage[s].classifier[c].rect[r].right_bottom_offset = mato(integral_image_width, rect_x + rect_width, rect_y + rect_height);
-                    kc.stage[s].classifier[c].rect[r].weight = rect_weight;
-                    
-                    if(r > 0)
-                        sum_rect_area += rect_weight * rect_width * rect_height;
+            const CvHaarClassifier* classifier = &cascade->stage_classifier[s].classifier[c];
+            cl_uint root = n;
+            for(cl_uint node = 0; node < classifier->count; node++, n++) {
+                KernelClassifier* kernel_node = &kc.stage[s].classifier[n];
+                cl_int left = classifier->left[node];
+                cl_int right = classifier->right[node];
+                kernel_node->threshold = classifier->threshold[node];
+                kernel_node->left = left > 0 ? (cl_int)root + left : 0;
+                kernel_node->right = right > 0 ? (cl_int)root + right : 0;
+                kernel_node->alpha[0] = left > 0 ? 0 : classifier->alpha[-left];
+                kernel_node->alpha[1] = right > 0 ? 0 : classifier->alpha[-right];
+                kernel_node->node_count = node == 0 ? classifier->count : 0;
+                
+                cl_float first_rect_area;
+                cl_float sum_rect_area = 0;
+                for(cl_uint r = 0; r < MAX_FEATURE_RECT_COUNT; r++) {
+                    if(classifier->haar_feature[node].rect[r].weight != 0) {
+                        CvRect rect;
+                        cl_float rect_weight;
+                        cl_uint corner_offset[4];
+                        scaleFeatureRect(&classifier->haar_feature[node], r, current_scale, scaled_window_area, integral_image_width, tilted_offset, &rect, &rect_weight, corner_offset);
+                        
+                        kernel_node->rect[r].left_top_offset = corner_offset[0];
+                        kernel_node->rect[r].right_top_offset = corner_offset[1];
+                        kernel_node->rect[r].left_bottom_offset = corner_offset[2];
+                        kernel_node->rect[r].right_bottom_offset = corner_offset[3];
+                        kernel_node->rect[r].weight = rect_weight;
+                        
+                        if(r > 0)
+                            sum_rect_area += rect_weight * rect.width * rect.height;
+                        else
+                            first_rect_area = rect.width * rect.height;
+                    }
                     else
-                        first_rect_area = rect_width * rect_height;
+                        kernel_node->rect[r].weight = 0;
                 }
-                else
-                    kc.stage[s].classifier[c].rect[r].weight = 0;
+                kernel_node->rect[0].weight = (-sum_rect_area/first_rect_area);
             }
-            kc.stage[s].classifier[c].rect[0].weight = (-sum_rect_area/first_rect_area);
         }
+        kc.stage[s].node_count = n;
     }
     return kc;
 }
 
-inline void
-runClassifier(const CvMat* integral_image,
-              const CvHaarClassifier* classifier,
-              const CvPoint* point,
-              const cl_float variance,
-              const cl_float current_scale,
-              const cl_uint scaled_window_area,
-              cl_float* stage_sum)
+/* Size of the used part of a kernel stage */
+inline size_t
+kernelStageSize(const KernelStage* stage)
+{
+    return offsetof(KernelStage, classifier) + stage->node_count * sizeof(KernelClassifier);
+}
+
+/* Appends stages letting every window through up to stage_count, fused
+ * cascades are run for as many stages as the longest one
+ */
+void
+padKernelCascade(KernelCascade* kernel_cascade,
+                 const cl_uint stage_count)
+{
+    if(kernel_cascade->count >= stage_count)
+        return;
+    kernel_cascade->stage = (KernelStage*)realloc(kernel_cascade->stage, stage_count * sizeof(KernelStage));
+    for(cl_uint s = kernel_cascade->count; s < stage_count; s++) {
+        kernel_cascade->stage[s].threshold = -CL_FLT_MAX;
+        kernel_cascade->stage[s].count = 0;
+        kernel_cascade->stage[s].node_count = 0;
+    }
+    kernel_cascade->count = stage_count;
+}
+
+inline cl_float
+computeFeatureSum(const CvMat* integral_image,
+                  const CvHaarFeature* feature,
+                  const CvPoint* point,
+                  const cl_float current_scale,
+                  const cl_uint scaled_window_area)
 {
-    // Compute threshold normalized by window vaiance
-    float norm_threshold = *classifier->threshold * variance;
-    
-    // Iterate over features (optimized for stump)
-    CvHaarFeature feature = classifier->haar_feature[0];
-    
     float rect_sum = 0;
     
     // Precalculation on rectangles (loop unroll)
     float first_rect_area = 0;
     float sum_rect_area = 0;
     CLODWeightedRect final_rect[3];
+    cl_uint corner_offset[3][4];
     
     // Normalize rect size
     for(cl_uint ri = 0; ri < 3; ri++) {
-        if(feature.rect[ri].weight != 0) {
-            register CvRect* temp_rect = &feature.rect[ri].r;
+        if(feature->rect[ri].weight != 0) {
             register CLODWeightedRect* temp_final_rect = &final_rect[ri];
-            temp_final_rect->rect.x = (cl_uint)round(temp_rect->x * current_scale);
-            temp_final_rect->rect.y = (cl_uint)round(temp_rect->y * current_scale);
-            temp_final_rect->rect.width = (cl_uint)round(temp_rect->width * current_scale);
-            temp_final_rect->rect.height = (cl_uint)round(temp_rect->height * current_scale);
-            // Normalize rect weight based on window area
-            temp_final_rect->weight = (float)(feature.rect[ri].weight) / (float)scaled_window_area;
+            scaleFeatureRect(feature, ri, current_scale, scaled_window_area, integral_image->width, integral_image->rows * integral_image->cols, &temp_final_rect->rect, &temp_final_rect->weight, corner_offset[ri]);
             if(ri == 0)
                 first_rect_area = temp_final_rect->rect.width * temp_final_rect->rect.height;
             else
@@ -619,18 +1867,65 @@ runClassifier(const CvMat* integral_image,
     final_rect[0].weight = (float)(-sum_rect_area/first_rect_area);
     
     // Calculation on rectangles (loop unroll)
+    const cl_uint* window = matp((const cl_uint*)integral_image->data.i, integral_image->width, point->x, point->y);
     for(cl_uint ri = 0; ri < 3; ri++) {
-        if(feature.rect[ri].weight != 0) {
-            rect_sum += (cl_float)((mats((cl_uint*)integral_image->data.i,
-                                      integral_image->width,
-                                      point->x + final_rect[ri].rect.x,
-                                      point->y + final_rect[ri].rect.y,
-                                      final_rect[ri].rect.width,
-                                      final_rect[ri].rect.height) * final_rect[ri].weight));
+        if(feature->rect[ri].weight != 0) {
+            rect_sum += (cl_float)((matsp(window + corner_offset[ri][0],
+                                          window + corner_offset[ri][1],
+                                          window + corner_offset[ri][2],
+                                          window + corner_offset[ri][3]) * final_rect[ri].weight));
         }
     }
+    return rect_sum;
+}
+
+inline void
+runClassifier(const CvMat* integral_image,
+              const CvHaarClassifier* classifier,
+              const CvPoint* point,
+              const cl_float variance,
+              const cl_float current_scale,
+              const cl_uint scaled_window_area,
+              cl_float* stage_sum)
+{
+    // Walk the tree (a stump is a one node tree), leaves are <= 0
+    const int* next_node[2] = { classifier->left, classifier->right };
+    int node = 0;
+    do {
+        // Compute threshold normalized by window vaiance
+        float norm_threshold = classifier->threshold[node] * variance;
+        float rect_sum = computeFeatureSum(integral_image, &classifier->haar_feature[node], point, current_scale, scaled_window_area);
+        CLOD_COUNT(host_node_count++);
+        node = next_node[rect_sum >= norm_threshold][node];
+    } while(node > 0);
+    
     // If rect sum less than stage_sum updated with threshold left_val else right_val
-    *stage_sum += classifier->alpha[rect_sum >= norm_threshold];
+    *stage_sum += classifier->alpha[-node];
+}
+
+inline cl_float
+computePrecomputedFeatureSum(const CLODOptimizedRect* rect,
+                             const cl_uint offset)
+{
+    // Calculation on rectangles (loop unroll)
+    cl_float rect_sum =
+    (matsp(rect[0].sum_left_top + offset,
+           rect[0].sum_right_top + offset,
+           rect[0].sum_left_bottom + offset,
+           rect[0].sum_right_bottom + offset) * rect[0].weight);
+    rect_sum +=
+    (matsp(rect[1].sum_left_top + offset,
+           rect[1].sum_right_top + offset,
+           rect[1].sum_left_bottom + offset,
+           rect[1].sum_right_bottom + offset) * rect[1].weight);
+    if(rect[2].weight != 0) {
+        rect_sum +=
+        (matsp(rect[2].sum_left_top + offset,
+               rect[2].sum_right_top + offset,
+               rect[2].sum_left_bottom + offset,
+               rect[2].sum_right_bottom + offset) * rect[2].weight);
+    }
+    return rect_sum;
 }
 
 inline void
@@ -640,42 +1935,23 @@ runClassifierWithPrecomputedFeatures(const CvHaarClassifier* classifier,
                                      const cl_uint offset,
                                      const cl_float variance,
                                      cl_float* stage_sum)
-{    
-    // Compute threshold normalized by window vaiance
-    float norm_threshold = *classifier->threshold * variance;
-    
-    // Iterate over features (optimized for stump)
-    //for(cl_uint feature_index = 0; feature_index < classifier.count; feature_index++) {
-    CvHaarFeature feature = classifier->haar_feature[0];
-    
-    // Calculation on rectangles (loop unroll)
-    cl_float rect_sum =
-    (matsp(opt_rectangles[*opt_rect_index].sum_left_top + offset,
-           opt_rectangles[*opt_rect_index].sum_right_top + offset,
-           opt_rectangles[*opt_rect_index].sum_left_bottom + offset,
-           opt_rectangles[*opt_rect_index].sum_right_bottom + offset) * opt_rectangles[*opt_rect_index].weight);
-    (*opt_rect_index)++;
-    rect_sum +=
-    (matsp(opt_rectangles[*opt_rect_index].sum_left_top + offset,
-           opt_rectangles[*opt_rect_index].sum_right_top + offset,
-           opt_rectangles[*opt_rect_index].sum_left_bottom + offset,
-           opt_rectangles[*opt_rect_index].sum_right_bottom + offset) * opt_rectangles[*opt_rect_index].weight);
-    (*opt_rect_index)++;
-    if(feature.rect[2].weight != 0) {
-        rect_sum +=
-        (matsp(opt_rectangles[*opt_rect_index].sum_left_top + offset,
-               opt_rectangles[*opt_rect_index].sum_right_top + offset,
-               opt_rectangles[*opt_rect_index].sum_left_bottom + offset,
-               opt_rectangles[*opt_rect_index].sum_right_bottom + offset) * opt_rectangles[*opt_rect_index].weight);
-        (*opt_rect_index)++;
-    }
-    
-    if(offset == ((641 * 182) + 114)) {
-        //printf((char const *)"Rect 114-182: rect_sum = %f\n", rect_sum);
-    }
+{
+    // Walk the tree (a stump is a one node tree), leaves are <= 0. Next node is
+    // selected by indexing, like alpha, so the only branch is the loop exit
+    const CLODOptimizedRect* node_rectangles = &opt_rectangles[*opt_rect_index];
+    const int* next_node[2] = { classifier->left, classifier->right };
+    int node = 0;
+    do {
+        // Compute threshold normalized by window vaiance
+        float norm_threshold = classifier->threshold[node] * variance;
+        cl_float rect_sum = computePrecomputedFeatureSum(&node_rectangles[node * MAX_FEATURE_RECT_COUNT], offset);
+        CLOD_COUNT(host_node_count++);
+        node = next_node[rect_sum >= norm_threshold][node];
+    } while(node > 0);
+    *opt_rect_index += classifier->count * MAX_FEATURE_RECT_COUNT;
     
     // If rect sum less than stage_sum updated with threshold left_val else right_val
-    *stage_sum += classifier->alpha[rect_sum >= norm_threshold];
+    *stage_sum += classifier->alpha[-node];
 }
 
 inline void
@@ -737,6 +2013,8 @@ inline cl_int
 runCascade(const CvMat* integral_image,
            const CvHaarClassifierCascade* cascade,
            CLODOptimizedRect* opt_rectangles,
+           const cl_uint start_stage_index,
+           const cl_uint start_rect_index,
            const CvPoint* point,
            const CvSize* scaled_window_size,
            const cl_uint scaled_window_area,
@@ -750,8 +2028,8 @@ runCascade(const CvMat* integral_image,
     
     // Iterate over stages until skip
     cl_int exit_stage = 1;
-    cl_uint opt_rect_index = 0;
-    for(cl_uint stage_index = 0; stage_index < cascade->count; stage_index++)
+    cl_uint opt_rect_index = start_rect_index;
+    for(cl_uint stage_index = start_stage_index; stage_index < cascade->count; stage_index++)
     {
         CvHaarStageClassifier stage = cascade->stage_classifier[stage_index];
         
@@ -786,8 +2064,214 @@ runCascade(const CvMat* integral_image,
     return exit_stage;
 }
 
+/* Windows of a scale for the per-stage paths. With coarse_stage_count != 0
+ * (CLOD_COARSE_TO_FINE) every other window in x and y is tried first, the ones
+ * passing the first coarse_stage_count stages bring in their neighbours and
+ * all of them are evaluated again from stage 0. opt_rectangles may be NULL
+ */
+void
+buildScaleWindows(const cl_float step,
+                  const CvMat* integral_image,
+                  const CvMat* square_integral_image,
+                  const CvHaarClassifierCascade* cascade,
+                  const CLODOptimizedRect* opt_rectangles,
+                  const CvRect* equ_rect,
+                  const CvPoint* start_point,
+                  const CvPoint* end_point,
+                  const CvSize* scaled_window_size,
+                  const cl_uint scaled_window_area,
+                  const cl_float current_scale,
+                  const CLODScanRegions* regions,
+                  const CvMat* edge_integral_image,
+                  const cl_float edge_density,
+                  const cl_uint coarse_stage_count,
+                  CLODSubwindowData** psubwindow_data,
+                  cl_uint* subwindow_count,
+                  cl_uint* skipped_count)
+{
+    if(coarse_stage_count == 0) {
+        precomputeWindows(step, integral_image, square_integral_image,
+                          equ_rect, start_point, end_point,
+                          scaled_window_size,
+                          scaled_window_area, regions, edge_integral_image, edge_density, 1,
+                          psubwindow_data, subwindow_count, skipped_count);
+        return;
+    }
+    
+    // Coarse grid
+    CLODSubwindowData* windows = NULL;
+    cl_uint window_count = 0;
+    precomputeWindows(step, integral_image, square_integral_image,
+                      equ_rect, start_point, end_point,
+                      scaled_window_size,
+                      scaled_window_area, regions, edge_integral_image, edge_density, 2,
+                      &windows, &window_count, skipped_count);
+    
+    // First stages
+    cl_uint start_rect_index = 0;
+    cl_uint end_rect_index = 0;
+    for(cl_uint stage_index = 0; stage_index < MIN(coarse_stage_count, (cl_uint)cascade->count) && window_count > 0; stage_index++) {
+        CLODSubwindowData* survivors = NULL;
+        cl_uint survivor_count = 0;
+        runSubwindow(integral_image,
+                     opt_rectangles,
+                     start_rect_index, &end_rect_index,
+                     &cascade->stage_classifier[stage_index], stage_index,
+                     windows, &survivors,
+                     window_count, &survivor_count,
+                     scaled_window_area, current_scale, opt_rectangles != NULL);
+        free(windows);
+        windows = survivors;
+        window_count = survivor_count;
+        start_rect_index = end_rect_index;
+    }
+    
+    // Survivors and their neighbours, each window once
+    cl_int grid_width = end_point->x - start_point->x;
+    cl_int grid_height = end_point->y - start_point->y;
+    cl_uchar* visited = (cl_uchar*)calloc(grid_width * grid_height, sizeof(cl_uchar));
+    *psubwindow_data = (CLODSubwindowData*)malloc(MAX(window_count * 9, 1) * sizeof(CLODSubwindowData));
+    CLODSubwindowData* subwindow_data = *psubwindow_data;
+    cl_uint current_subwindow = 0;
+    for(cl_uint i = 0; i < window_count; i++) {
+        cl_int x_index = (cl_int)lrint(windows[i].x / step) - start_point->x;
+        cl_int y_index = (cl_int)lrint(windows[i].y / step) - start_point->y;
+        for(cl_int y = MAX(y_index - 1, 0); y <= MIN(y_index + 1, grid_height - 1); y++) {
+            for(cl_int x = MAX(x_index - 1, 0); x <= MIN(x_index + 1, grid_width - 1); x++) {
+                if(visited[(y * grid_width) + x])
+                    continue;
+                visited[(y * grid_width) + x] = 1;
+                
+                CvPoint point = cvPoint((cl_uint)lrint((x + start_point->x) * step), (cl_uint)lrint((y + start_point->y) * step));
+                if(regions != NULL && !isWindowInRegions(regions, &point, scaled_window_size))
+                    continue;
+                if(edge_integral_image != NULL && isWindowFlat(edge_integral_image, equ_rect, &point, scaled_window_area, edge_density))
+                    continue;
+                
+                setupWindow(integral_image, square_integral_image, equ_rect, &point, scaled_window_area, &subwindow_data[current_subwindow]);
+                current_subwindow++;
+            }
+        }
+    }
+    *subwindow_count = current_subwindow;
+    
+    // Release
+    free(visited);
+    free(windows);
+}
+
+/* Windows skipped after one leaving the cascade at exit_stage (see runCascade).
+ * With CLOD_ADAPTIVE_STEP the earlier a window is rejected the bigger the jump
+ */
+inline cl_uint
+windowIncrement(const cl_int exit_stage,
+                const clod_flags flags)
+{
+    if(exit_stage > 0)
+        return 1;
+    if(flags & CLOD_ADAPTIVE_STEP)
+        return MAX(1, CLOD_ADAPTIVE_STEP_MAX + exit_stage);
+    return exit_stage != 0 ? 1 : 2;
+}
+
+/* Index of the first precomputed rectangle of a stage */
+cl_uint
+computeStageRectIndex(const CvHaarClassifierCascade* cascade,
+                      const cl_uint stage_index)
+{
+    cl_uint node_count = 0;
+    for(cl_uint s = 0; s < stage_index; s++)
+        for(cl_uint c = 0; c < cascade->stage_classifier[s].count; c++)
+            node_count += cascade->stage_classifier[s].classifier[c].count;
+    return node_count * MAX_FEATURE_RECT_COUNT;
+}
+
+/* Run stages from start_stage_index on a list of windows (released here) and
+ * add the survivors to matches. When fewer than adaptive_window_count windows
+ * are left (0 disables it) compacting a new list per stage costs more than it
+ * saves, so the remaining stages run window by window
+ */
+void
+runStages(const CvMat* integral_image,
+          const CvHaarClassifierCascade* cascade,
+          CLODOptimizedRect* opt_rectangles,
+          const cl_uint start_stage_index,
+          CLODSubwindowData* input_windows,
+          cl_uint input_window_count,
+          const CvSize* scaled_window_size,
+          const cl_uint scaled_window_area,
+          const cl_float current_scale,
+          const cl_bool precompute_features,
+          const cl_uint adaptive_window_count,
+          CLODStageStatistics* statistics,
+          const cl_uint scale_index,
+          CLODWeightedRect* matches,
+          cl_uint* match_count)
+{
+    CLODSubwindowData* output_windows = NULL;
+    cl_uint output_window_count = 0;
+    cl_uint start_rect_index = computeStageRectIndex(cascade, start_stage_index);
+    cl_uint end_rect_index = start_rect_index;
+    
+    // Iterate over stages
+    cl_uint stage_index = 0;
+    for(stage_index = start_stage_index; stage_index < cascade->count; stage_index++) {
+        if(input_window_count < adaptive_window_count)
+            break;
+        
+        CvHaarStageClassifier stage = cascade->stage_classifier[stage_index];
+        runSubwindow(integral_image,
+                     opt_rectangles,
+                     start_rect_index, &end_rect_index,
+                     &stage, stage_index,
+                     input_windows, &output_windows,
+                     input_window_count, &output_window_count,
+                     scaled_window_area, current_scale, precompute_features);
+        recordStageSurvivors(statistics, scale_index, stage_index, output_window_count);
+        
+        free(input_windows);
+        input_windows = output_windows;
+        input_window_count = output_window_count;
+        start_rect_index = end_rect_index;
+        if(output_window_count == 0)
+            break;
+    }
+    
+    if(stage_index < cascade->count && input_window_count > 0) {
+        // Few windows left, finish them one by one
+        cl_uint* stage_exits = (cl_uint*)calloc(cascade->count + 1, sizeof(cl_uint));
+        for(cl_uint i = 0; i < input_window_count; i++) {
+            CvPoint point = cvPoint(input_windows[i].x, input_windows[i].y);
+            cl_int exit_stage = runCascade(integral_image,
+                                           cascade,
+                                           opt_rectangles,
+                                           stage_index, start_rect_index,
+                                           &point,
+                                           scaled_window_size,
+                                           scaled_window_area,
+                                           input_windows[i].variance, current_scale, precompute_features,
+                                           matches, match_count);
+            stage_exits[exit_stage > 0 ? cascade->count : -exit_stage]++;
+        }
+        recordStageExits(statistics, scale_index, stage_index, stage_exits);
+        free(stage_exits);
+    }
+    else {
+        // Add to matches
+        for(cl_uint i = 0; i < input_window_count; i++) {
+            matches[*match_count].rect.x = input_windows[i].x;
+            matches[*match_count].rect.y = input_windows[i].y;
+            matches[*match_count].rect.width = scaled_window_size->width;
+            matches[*match_count].rect.height = scaled_window_size->height;
+            matches[*match_count].weight = 0;
+            (*match_count)++;
+        }
+    }
+    free(input_windows);
+}
+
 void
-runKernelStage(const CLODEnvironmentData* data,
+runKernelStage(CLODEnvironmentData* data,
                const cl_uint input_window_count,
                const cl_uint scaled_window_area,
                const cl_float current_scale,
@@ -797,45 +2281,177 @@ runKernelStage(const CLODEnvironmentData* data,
     cl_int error = CL_SUCCESS;
         
     // Set source windows count
-    clSetKernelArg(data->environment.kernels[0], 4, sizeof(cl_uint), &(input_window_count));
+    error = clSetKernelArg(data->environment.kernels[0], 4, sizeof(cl_uint), &(input_window_count));
     clCheckOrExit(error);
     
-    // Setup kernel sizes (Global size can be not a multiple of 64, set global size as LCM)
-    size_t wavefront_size = 64;
+    // Setup kernel sizes (Global size can be not a multiple of 64, set global size as LCM
+    // with the tuned local size, 0 lets the driver choose)
+    size_t local_size = data->clif->tuning.stage_local_size;
+    size_t wavefront_size = MAX(local_size, 64);
     size_t global_size = ((input_window_count / wavefront_size) + 1) * wavefront_size;
-    size_t local_size = 1;
     
-    // Run kernel
-    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[0], 1, NULL, &global_size, &local_size, 0, NULL, NULL);
+    // Run kernel, after the integral image upload if it is still pending
+    cl_uint wait_count = data->stage_wait_event != NULL ? 1 : 0;
+    error = clEnqueueNDRangeKernel(data->environment.queue, data->environment.kernels[0], 1, NULL, &global_size, local_size != 0 ? &local_size : NULL, wait_count, wait_count != 0 ? &(data->stage_wait_event) : NULL, clodProfileEvent(data->clif->profile, clod_kernel_functions[0]));
+    clCheckOrExit(error);
+    data->stage_wait_event = NULL;
     clFinish(data->environment.queue);
     
     // Read output window count
-    cl_uint* p_output_window_count = (cl_uint*)clEnqueueMapBuffer(data->environment.queue, data->detect_objects_data.buffers[4], CL_TRUE, CL_MAP_READ, 0, sizeof(cl_uint), 0, NULL, NULL, &error);
+#ifdef CLOD_COUNTERS
+    cl_uint* p_output_window_count = (cl_uint*)clEnqueueMapBuffer(data->environment.queue, data->detect_objects_data.buffers[4], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, 2 * sizeof(cl_uint), 0, NULL, clodProfileEvent(data->clif->profile, "map"), &error);
+    clCheckOrExit(error);
+    data->node_count += p_output_window_count[1];
+    p_output_window_count[1] = 0;
+#else
+    cl_uint* p_output_window_count = (cl_uint*)clEnqueueMapBuffer(data->environment.queue, data->detect_objects_data.buffers[4], CL_TRUE, CL_MAP_READ, 0, sizeof(cl_uint), 0, NULL, clodProfileEvent(data->clif->profile, "map"), &error);
     clCheckOrExit(error);
+#endif
     *output_window_count = *p_output_window_count;
-    clEnqueueUnmapMemObject(data->environment.queue, data->detect_objects_data.buffers[4], p_output_window_count, 0, NULL, NULL);
+    clEnqueueUnmapMemObject(data->environment.queue, data->detect_objects_data.buffers[4], p_output_window_count, 0, NULL, clodProfileEvent(data->clif->profile, "unmap"));
     clCheckOrExit(error);
 }
 
+/* Host detection of a single scale, matches are appended */
+void
+runScale(const CvMat* integral_image,
+         const CvMat* square_integral_image,
+         const CvMat* edge_integral_image,
+         const cl_float edge_density,
+         const CvHaarClassifierCascade* cascade,
+         const CvSize* image_size,
+         const CvSize* min_window_size,
+         const CvSize* max_window_size,
+         const CvRect* scan_roi,
+         const CLODScanRegions* regions,
+         const cl_uint scale_index,
+         const cl_float current_scale,
+         const clod_flags flags,
+         CLODOptimizedRect* opt_rectangles,
+         cl_uint* stage_exits,
+         const cl_uint adaptive_window_count,
+         const cl_uint coarse_stage_count,
+         CLODStageStatistics* statistics,
+         CLODWeightedRect* matches,
+         cl_uint* match_count)
+{
+    // Setup scale-dependent variables
+    CvSize scaled_window_size;
+    cl_uint scaled_window_area;
+    CvRect equ_rect;
+    CvPoint start_point = cvPoint(0, 0);
+    CvPoint end_point;
+    cl_float step;
+    if(setupScale(current_scale,
+                  image_size,
+                  &cascade->orig_window_size,
+                  min_window_size,
+                  max_window_size,
+                  &equ_rect,
+                  &scaled_window_size,
+                  &scaled_window_area,
+                  &end_point, &step) != CL_SUCCESS) {
+        return;
+    }
+    if(scan_roi != NULL && clipScaleToRect(scan_roi, &scaled_window_size, step, &start_point, &end_point) != CL_SUCCESS)
+        return;
+    if(regions != NULL && clipScaleToRegions(regions, &scaled_window_size, step, &start_point, &end_point) != CL_SUCCESS)
+        return;
+    
+    // Precompute feature rect offset in integral image and square integral image into a new cascade
+    if(flags & CLOD_PRECOMPUTE_FEATURES)
+        precomputeFeatures(integral_image, scaled_window_area, cascade, current_scale, opt_rectangles);
+    
+    if(!(flags & CLOD_PER_STAGE_ITERATIONS)) {
+        // Iterate over windows
+        memset(stage_exits, 0, (cascade->count + 1) * sizeof(cl_uint));
+        cl_uint skipped_count = 0;
+        cl_uint x_incr = 1;
+        for(int y_index = start_point.y; y_index < end_point.y; y_index++) {
+            for(int x_index = start_point.x; x_index < end_point.x; x_index += x_incr) {
+                // Real position
+                CvPoint point = cvPoint((cl_uint)round(x_index * step), (cl_uint)round(y_index * step));
+                
+                // Pruned windows are not part of the statistics
+                if(regions != NULL && !isWindowInRegions(regions, &point, &scaled_window_size)) {
+                    skipped_count++;
+                    continue;
+                }
+                if(edge_integral_image != NULL && isWindowFlat(edge_integral_image, &equ_rect, &point, scaled_window_area, edge_density)) {
+                    x_incr = 2;
+                    continue;
+                }
+                
+                // Sum of window pixels normalized by the window size E(x)
+                cl_float variance = computeVariance(integral_image, square_integral_image, &equ_rect, &point, scaled_window_area);
+                
+                // Run cascade on point x,y
+                cl_int exit_stage = runCascade(integral_image,
+                                          cascade,
+                                          opt_rectangles,
+                                          0, 0,
+                                          &point,
+                                          &scaled_window_size,
+                                          scaled_window_area,
+                                          variance, current_scale, (flags & CLOD_PRECOMPUTE_FEATURES),
+                                          matches, match_count);
+                stage_exits[exit_stage > 0 ? cascade->count : -exit_stage]++;
+                x_incr = windowIncrement(exit_stage, flags);
+            }
+        }
+        recordStageExits(statistics, scale_index, 0, stage_exits);
+        recordSkippedCount(statistics, scale_index, skipped_count);
+    }
+    else {
+        // Allocate windows to be computed by successive stages
+        CLODSubwindowData* input_windows = NULL;
+        cl_uint input_window_count = 0;
+        cl_uint skipped_count = 0;
+        
+        // Precompute windows
+        buildScaleWindows(step, integral_image, square_integral_image,
+                          cascade, (flags & CLOD_PRECOMPUTE_FEATURES) ? opt_rectangles : NULL,
+                          &equ_rect,
+                          &start_point,
+                          &end_point,
+                          &scaled_window_size,
+                          scaled_window_area, current_scale,
+                          regions, edge_integral_image, edge_density, coarse_stage_count,
+                          &input_windows, &input_window_count, &skipped_count);
+        recordWindowCount(statistics, scale_index, input_window_count);
+        recordSkippedCount(statistics, scale_index, skipped_count);
+        
+        // Iterate over stages, windows are added to matches
+        runStages(integral_image, cascade, opt_rectangles, 0,
+                  input_windows, input_window_count,
+                  &scaled_window_size, scaled_window_area, current_scale,
+                  (flags & CLOD_PRECOMPUTE_FEATURES), adaptive_window_count,
+                  statistics, scale_index,
+                  matches, match_count);
+    }
+}
+
 /* Code obtained unfolding function calls. Seems to be more efficient */
 CLODDetectObjectsResult
 clodDetectObjectsBlock(const IplImage* image,
                        const CvHaarClassifierCascade* cascade,
-                       const CLIFEnvironmentData* data,
+                       CLODEnvironmentData* clod_data,
                        const CvSize min_window_size,
                        const CvSize max_window_size,
                        const cl_uint min_neighbors,
                        const clod_flags flags)
 {
     CLODDetectObjectsResult result;
-    float scale_factor = 1.1;
+    float scale_factor = clod_data->scale_factor;
     
     // Setup image
     CvMat* sum, *square_sum;
-    setupImage(image, &sum, &square_sum, CL_FALSE);
+    setupImage(image, clodHasTiltedFeatures(cascade), &sum, &square_sum, CL_FALSE);
     cl_uint* integral_image = (cl_uint*)sum->data.ptr;
     cl_double* square_integral_image = (cl_double*)square_sum->data.ptr;
     cl_uint integral_image_width = image->width + 1;
+    CvMat* edge_sum = setupEdges(image, clod_data->clif, flags, CL_FALSE);
+    const cl_float edge_density = clod_data->edge_density;
     
     // Calculate number of different scales
     cl_uint scale_count = 0;
@@ -849,12 +2465,18 @@ clodDetectObjectsBlock(const IplImage* image,
     // Precompute feature rect offset in integral image and square integral image into a new cascade
     CLODOptimizedRect* opt_rectangles = NULL;
     if(flags & CLOD_PRECOMPUTE_FEATURES)
-        opt_rectangles = (CLODOptimizedRect*)malloc(cascade->count * MAX_STAGE_CLASSIFIER_COUNT * MAX_FEATURE_RECT_COUNT * sizeof(CLODOptimizedRect));
+        opt_rectangles = (CLODOptimizedRect*)malloc(countCascadeNodes(cascade) * MAX_FEATURE_RECT_COUNT * sizeof(CLODOptimizedRect));
     
     // Vector to store positive matches
     CLODWeightedRect* matches = (CLODWeightedRect*)malloc(image->width * image->height * scale_count * sizeof(CLODWeightedRect));
     cl_uint match_count = 0;
     
+    // Stage statistics
+    CLODStageStatistics* statistics = &(clod_data->stage_statistics);
+    beginStageStatistics(statistics, cascade, scale_count, scale_factor);
+    CLOD_COUNT(beginWorkCounters(clod_data));
+    cl_uint* stage_exits = (cl_uint*)malloc((cascade->count + 1) * sizeof(cl_uint));
+    
     // Iterate over scales
     cl_float current_scale = 1;
     for(cl_uint scale_index = 0; scale_index < scale_count; scale_index++, current_scale *= scale_factor) {
@@ -891,55 +2513,26 @@ clodDetectObjectsBlock(const IplImage* image,
         int end_y = (int)lrint((image->height - scaled_window_height) / step);
         
         // Precompute feature rect offset in integral image and square integral image into a new cascade
-        if(flags & CLOD_PRECOMPUTE_FEATURES) {
-            cl_uint opt_rect_index = 0;
-            for(cl_uint stage_index = 0; stage_index < cascade->count; stage_index++) {
-                for(cl_uint classifier_index = 0; classifier_index < cascade->stage_classifier[stage_index].count; classifier_index++) {
-                    // Optimized for stump based classifier (otherwise loop over features)
-                    CvHaarFeature feature = cascade->stage_classifier[stage_index].classifier[classifier_index].haar_feature[0];
-                    
-                    // Normalize rect weight based on window area
-                    cl_float first_rect_area;
-                    cl_uint first_rect_index = opt_rect_index;
-                    cl_float sum_rect_area = 0;
-                    for(cl_uint i = 0; i < MAX_FEATURE_RECT_COUNT; i++) {
-                        opt_rectangles[opt_rect_index].weight = 0;
-                        if(feature.rect[i].weight != 0) {
-                            register CvRect* temp_rect = &feature.rect[i].r;
-                            register CLODOptimizedRect* opt_rect = &opt_rectangles[opt_rect_index];
-                            register cl_uint rect_x = round(temp_rect->x * current_scale);
-                            register cl_uint rect_y = round(temp_rect->y * current_scale);
-                            register cl_uint rect_width = round(temp_rect->width * current_scale);
-                            register cl_uint rect_height = round(temp_rect->height * current_scale);
-                            register cl_float rect_weight = (feature.rect[i].weight) / (float)scaled_window_area;
-                            opt_rect->weight = rect_weight;
-                            opt_rect->sum_left_top = matp(integral_image, integral_image_width, rect_x, rect_y);
-                            opt_rect->sum_right_top = matp(integral_image, integral_image_width, rect_x + rect_width, rect_y);
-                            opt_rect->sum_left_bottom = matp(integral_image, integral_image_width, rect_x, rect_y + rect_height);
-                            opt_rect->sum_right_bottom = matp(integral_image, integral_image_width, rect_x + rect_width, rect_y + rect_height);
-                            
-                            if(i > 0)
-                                sum_rect_area += rect_weight * rect_width * rect_height;
-                            else
-                                first_rect_area = rect_width * rect_height;
-                            
-                            opt_rect_index++;
-                        }
-                    }
-                    opt_rectangles[first_rect_index].weight = (-sum_rect_area/first_rect_area);
-                }
-            }
-        }
+        if(flags & CLOD_PRECOMPUTE_FEATURES)
+            precomputeFeatures(sum, scaled_window_area, cascade, current_scale, opt_rectangles);
         // Precompute end
         
         // Iterate over windows
         if(!(flags & CLOD_PER_STAGE_ITERATIONS)) {
+            memset(stage_exits, 0, (cascade->count + 1) * sizeof(cl_uint));
             cl_uint x_incr = 1;
             for(int y_index = start_y; y_index < end_y; y_index++) {
                 for(int x_index = start_x; x_index < end_x; x_index += x_incr) {
                     // Real position
                     cl_uint x = (cl_uint)lrint(x_index * step);
                     cl_uint y = (cl_uint)lrint(y_index * step);
+                    // Too few edges, skip like a stage 0 exit
+                    if(edge_sum != NULL &&
+                       mats(edge_sum->data.i, integral_image_width, x + equ_rect_x, y + equ_rect_y, equ_rect_width, equ_rect_height) <
+                       edge_density * scaled_window_area) {
+                        x_incr = 2;
+                        continue;
+                    }
                     // Sum of window pixels normalized by the window size E(x)
                     float mean = (float)mats(integral_image, integral_image_width, x + equ_rect_x, y + equ_rect_y, equ_rect_width, equ_rect_height) / (float)scaled_window_area;
                     // E(xˆ2) - Eˆ2(x)
@@ -965,38 +2558,7 @@ clodDetectObjectsBlock(const IplImage* image,
                         float stage_sum = 0;
                         for(cl_uint classifier_index = 0; classifier_index < stage.count; classifier_index++) {
                             CvHaarClassifier classifier = stage.classifier[classifier_index];
-                            
-                            // Compute threshold normalized by window vaiance
-                            float norm_threshold = *classifier.threshold * variance;
-                            
-                            // Iterate over features (optimized for stump)
-                            //for(cl_uint feature_index = 0; feature_index < classifier.count; feature_index++) {
-                            CvHaarFeature feature = classifier.haar_feature[0];
-                            
-                            // Calculation on rectangles (loop unroll)
-                            cl_float rect_sum =
-                            (matsp(opt_rectangles[opt_rect_index].sum_left_top + offset,
-                                   opt_rectangles[opt_rect_index].sum_right_top + offset,
-                                   opt_rectangles[opt_rect_index].sum_left_bottom + offset,
-                                   opt_rectangles[opt_rect_index].sum_right_bottom + offset) * opt_rectangles[opt_rect_index].weight);
-                            opt_rect_index++;
-                            rect_sum +=
-                            (matsp(opt_rectangles[opt_rect_index].sum_left_top + offset,
-                                   opt_rectangles[opt_rect_index].sum_right_top + offset,
-                                   opt_rectangles[opt_rect_index].sum_left_bottom + offset,
-                                   opt_rectangles[opt_rect_index].sum_right_bottom + offset) * opt_rectangles[opt_rect_index].weight);
-                            opt_rect_index++;
-                            if(feature.rect[2].weight != 0) {
-                                rect_sum +=
-                                (matsp(opt_rectangles[opt_rect_index].sum_left_top + offset,
-                                       opt_rectangles[opt_rect_index].sum_right_top + offset,
-                                       opt_rectangles[opt_rect_index].sum_left_bottom + offset,
-                                       opt_rectangles[opt_rect_index].sum_right_bottom + offset) * opt_rectangles[opt_rect_index].weight);
-                                opt_rect_index++;
-                            }
-                            
-                            // If rect sum less than stage_sum updated with threshold left_val else right_val
-                            stage_sum += classifier.alpha[rect_sum >= norm_threshold];
+                            runClassifierWithPrecomputedFeatures(&classifier, opt_rectangles, &opt_rect_index, offset, variance, &stage_sum);
                         }
                         // If stage sum less than threshold exit and continue with next window
                         if(stage_sum < stage.threshold) {
@@ -1005,8 +2567,10 @@ clodDetectObjectsBlock(const IplImage* image,
                         }
                     }
                     
+                    stage_exits[exit_stage > 0 ? cascade->count : -exit_stage]++;
+                    
                     // If exit at first stage increment by 2, else by 1
-                    x_incr = exit_stage != 0 ? 1 : 2;
+                    x_incr = windowIncrement(exit_stage, flags);
                     
                     if(exit_stage > 0) {
                         CLODWeightedRect* r = &matches[match_count];
@@ -1020,6 +2584,7 @@ clodDetectObjectsBlock(const IplImage* image,
                     }
                 }
             }
+            recordStageExits(statistics, scale_index, 0, stage_exits);
         }
         else {
             // Allocate windows to be computed by successive stages
@@ -1033,6 +2598,12 @@ clodDetectObjectsBlock(const IplImage* image,
                     // Real position
                     CvPoint point = cvPoint((cl_uint)round(x_index * step), (cl_uint)round(y_index * step));
                     
+                    // Too few edges
+                    if(edge_sum != NULL &&
+                       mats(edge_sum->data.i, integral_image_width, point.x + equ_rect_x, point.y + equ_rect_y, equ_rect_width, equ_rect_height) <
+                       edge_density * scaled_window_area)
+                        continue;
+                    
                     // Sum of window pixels normalized by the window size E(x)
                     float mean = (float)mats(integral_image, integral_image_width,
                                              point.x + equ_rect_x,
@@ -1062,6 +2633,7 @@ clodDetectObjectsBlock(const IplImage* image,
             }
             cl_uint input_window_count = current_subwindow;
             cl_uint output_window_count = 0;
+            recordWindowCount(statistics, scale_index, input_window_count);
             
             // Iterate over stages
             cl_uint start_rect_index = 0;
@@ -1083,38 +2655,7 @@ clodDetectObjectsBlock(const IplImage* image,
                     cl_uint opt_rect_index = start_rect_index;
                     for(cl_uint classifier_index = 0; classifier_index < stage.count; classifier_index++) {
                         CvHaarClassifier classifier = stage.classifier[classifier_index];
-                        
-                        // Compute threshold normalized by window vaiance
-                        float norm_threshold = *classifier.threshold * subwindow.variance;
-                        
-                        // Iterate over features (optimized for stump)
-                        //for(cl_uint feature_index = 0; feature_index < classifier.count; feature_index++) {
-                        CvHaarFeature feature = classifier.haar_feature[0];
-                        
-                        // Calculation on rectangles (loop unroll)
-                        cl_float rect_sum =
-                        (matsp(opt_rectangles[opt_rect_index].sum_left_top + subwindow.offset,
-                               opt_rectangles[opt_rect_index].sum_right_top + subwindow.offset,
-                               opt_rectangles[opt_rect_index].sum_left_bottom + subwindow.offset,
-                               opt_rectangles[opt_rect_index].sum_right_bottom + subwindow.offset) * opt_rectangles[opt_rect_index].weight);
-                        opt_rect_index++;
-                        rect_sum +=
-                        (matsp(opt_rectangles[opt_rect_index].sum_left_top + subwindow.offset,
-                               opt_rectangles[opt_rect_index].sum_right_top + subwindow.offset,
-                               opt_rectangles[opt_rect_index].sum_left_bottom + subwindow.offset,
-                               opt_rectangles[opt_rect_index].sum_right_bottom + subwindow.offset) * opt_rectangles[opt_rect_index].weight);
-                        opt_rect_index++;
-                        if(feature.rect[2].weight != 0) {
-                            rect_sum +=
-                            (matsp(opt_rectangles[opt_rect_index].sum_left_top + subwindow.offset,
-                                   opt_rectangles[opt_rect_index].sum_right_top + subwindow.offset,
-                                   opt_rectangles[opt_rect_index].sum_left_bottom + subwindow.offset,
-                                   opt_rectangles[opt_rect_index].sum_right_bottom + subwindow.offset) * opt_rectangles[opt_rect_index].weight);
-                            opt_rect_index++;
-                        }
-                        
-                        // If rect sum less than stage_sum updated with threshold left_val else right_val
-                        stage_sum += classifier.alpha[rect_sum >= norm_threshold];
+                        runClassifierWithPrecomputedFeatures(&classifier, opt_rectangles, &opt_rect_index, subwindow.offset, subwindow.variance, &stage_sum);
                     }
                     end_rect_index = opt_rect_index;
                     
@@ -1136,6 +2677,8 @@ clodDetectObjectsBlock(const IplImage* image,
                     // Note that we skip a window (step = 2 instead of 1) if a stage fails, not if the cascade fails (linke in non-per-stage methods)
                 }
                 
+                recordStageSurvivors(statistics, scale_index, stage_index, output_window_count);
+                
                 free(input_windows);
                 input_windows = output_windows;
                 input_window_count = output_window_count;
@@ -1161,229 +2704,600 @@ clodDetectObjectsBlock(const IplImage* image,
         match_count = filterResult(matches, match_count, MAX(min_neighbors, 1), EPS);
     
     // Release
+    free(stage_exits);
     if(flags & CLOD_PRECOMPUTE_FEATURES)
         free(opt_rectangles);
     cvReleaseMat(&sum);
     cvReleaseMat(&square_sum);
+    if(edge_sum != NULL)
+        cvReleaseMat(&edge_sum);
     
     // Return
     result.matches = matches;
     result.match_count = match_count;
+    CLOD_COUNT(endWorkCounters(clod_data, &result.counters));
     return result;
 }
 
-/* Code to run detection using OpenCL */
-CLODDetectObjectsResult
-clodDetectObjectsOpenCL(const IplImage* image,
-                        const CvHaarClassifierCascade* orig_casc,
-                        const CLODEnvironmentData* clod_data,
-                        const CvSize min_window_size,
-                        const CvSize max_window_size,
-                        const cl_uint min_neighbors)
+/* Runs the stages of kernel_cascade on the input_window_count windows written
+ * to window_buffers[0], the two buffers take turns as input and output. Stops
+ * once no window survives or fewer than adaptive_window_count do. Returns the
+ * first stage not run, survivors are in window_buffers[*dst_buffer_index].
+ * Stages are written to stage_buffer. With cascade_count > 1 the cascades are
+ * fused: cascade_buffers hold the cascade of each window and take turns like
+ * window_buffers, a launch runs stage s of kernel_cascade[cascade] on each
+ * window. They must have as many stages (see padKernelCascade). Without
+ * fusion cascade_buffers is NULL
+ */
+cl_uint
+runKernelCascade(CLODEnvironmentData* clod_data,
+                 const KernelCascade* kernel_cascade,
+                 const cl_uint cascade_count,
+                 const cl_mem stage_buffer,
+                 const cl_mem* window_buffers,
+                 const cl_mem* cascade_buffers,
+                 cl_uint input_window_count,
+                 const cl_uint scaled_window_area,
+                 const cl_float current_scale,
+                 const cl_uint adaptive_window_count,
+                 CLODStageStatistics* statistics,
+                 const cl_uint scale_index,
+                 cl_uint* dst_buffer_index,
+                 cl_uint* output_window_count)
 {
-    float scale_factor = 1.1;
-    CLODDetectObjectsResult result;
     cl_int error = CL_SUCCESS;
-    CvSize image_size = cvSize(image->width, image->height);
-    
-    // Setup image
-    CvMat* integral_image, *square_integral_image;
-    setupImage(image, &integral_image, &square_integral_image, CL_FALSE);
     
-    // Write integral image into buffer
-    error = clEnqueueWriteBuffer(clod_data->environment.queue, clod_data->detect_objects_data.buffers[0], CL_FALSE, 0, integral_image->width * integral_image->height * sizeof(cl_uint), integral_image->data.ptr, 0, NULL, NULL);
+    // Set stage arg
+    error = clSetKernelArg(clod_data->environment.kernels[0], 1, sizeof(cl_mem), &stage_buffer);
     clCheckOrExit(error);
     
-    // Calculate number of different scales
-    cl_uint scale_count = 0;
-    for(float current_scale = 1;
-        current_scale * orig_casc->orig_window_size.width < image->width - 10 &&
-        current_scale * orig_casc->orig_window_size.height < image->height - 10;
-        current_scale *= scale_factor) {
-        scale_count++;
-    }
-    
-    // Vector to store positive matches
-    CLODWeightedRect* matches = (CLODWeightedRect*)malloc(image->width * image->height * scale_count * sizeof(CLODWeightedRect));
-    cl_uint match_count = 0;
+    // Set input and output window args, and their cascades (NULL without fusion)
+    error = clSetKernelArg(clod_data->environment.kernels[0], 2, sizeof(cl_mem), &(window_buffers[0]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(clod_data->environment.kernels[0], 3, sizeof(cl_mem), &(window_buffers[1]));
+    clCheckOrExit(error);
+    error = clSetKernelArg(clod_data->environment.kernels[0], 9, sizeof(cl_mem), cascade_buffers != NULL ? &(cascade_buffers[0]) : NULL);
+    clCheckOrExit(error);
+    error = clSetKernelArg(clod_data->environment.kernels[0], 10, sizeof(cl_mem), cascade_buffers != NULL ? &(cascade_buffers[1]) : NULL);
+    clCheckOrExit(error);
     
-    // Iterate over scales
-    cl_float current_scale = 1;
-    for(cl_uint scale_index = 0; scale_index < scale_count; scale_index++, current_scale *= scale_factor) {
-        // Setup scale-dependent variables
-        CvSize scaled_window_size;
-        cl_uint scaled_window_area;
-        CvRect equ_rect;
-        CvPoint start_point = cvPoint(0, 0);
-        CvPoint end_point;
-        cl_float step;
-        if(setupScale(current_scale,
-                      &image_size,
-                      &orig_casc->orig_window_size,
-                      &min_window_size,
-                      &max_window_size,
-                      &equ_rect,
-                      &scaled_window_size,
-                      &scaled_window_area,
-                      &end_point, &step) != CL_SUCCESS) {
-            continue;
-        }
+    // Set scaled window area
+    error = clSetKernelArg(clod_data->environment.kernels[0], 6, sizeof(cl_uint), &(scaled_window_area));
+    clCheckOrExit(error);
+    // Set current scale
+    error = clSetKernelArg(clod_data->environment.kernels[0], 7, sizeof(cl_float), &(current_scale));
+    clCheckOrExit(error);
+
+    // Stage s writes into buffer 1 if s is even, 0 otherwise
+    *dst_buffer_index = 1;
+    *output_window_count = 0;
+    cl_uint stage_index = 0;
+    for(stage_index = 0; stage_index < kernel_cascade->count; stage_index++)
+    {
+        clodProfileTag(clod_data->clif->profile, scale_index, stage_index);
         
-        // Precompute feature rect offset in integral image and square integral image into a new cascade
-        KernelCascade kernel_cascade = precomputeKernelCascade(orig_casc, current_scale, scaled_window_area, integral_image->width);
-    
-        // Allocate windows to be computed by successive stages
-        CLODSubwindowData* input_windows = (CLODSubwindowData*)malloc((end_point.y - start_point.y + 1) * (end_point.x - start_point.x + 1) * sizeof(CLODSubwindowData));
-        CLODSubwindowData* output_windows = NULL;
-        cl_uint input_window_count = 0;
-        cl_uint output_window_count = 0;
+        // Set kernel stage of each cascade (only the used nodes)
+        for(cl_uint c = 0; c < cascade_count; c++) {
+            KernelStage* stage = &kernel_cascade[c].stage[stage_index];
+            error = clEnqueueWriteBuffer(clod_data->environment.queue, stage_buffer, CL_TRUE, c * sizeof(KernelStage), kernelStageSize(stage), stage, 0, NULL, clodProfileEvent(clod_data->clif->profile, "write"));
+            clCheckOrExit(error);
+        }
         
-        // Precompute windows
-        precomputeWindows(step, integral_image, square_integral_image,
-                          &equ_rect,
-                          &start_point,
-                          &end_point,
-                          scaled_window_area, &input_windows, &input_window_count);
+        // Run kernel
+        runKernelStage(clod_data, input_window_count, scaled_window_area, current_scale, stage_index, output_window_count);
+        recordStageSurvivors(statistics, scale_index, stage_index, *output_window_count);
+        *dst_buffer_index = (stage_index & 1) ? 0 : 1;
         
-                
-        // Set input and output window args
-        error = clSetKernelArg(clod_data->environment.kernels[0], 2, sizeof(cl_mem), &(clod_data->detect_objects_data.buffers[2]));
-        clCheckOrExit(error);
-        error = clSetKernelArg(clod_data->environment.kernels[0], 3, sizeof(cl_mem), &(clod_data->detect_objects_data.buffers[3]));
-        clCheckOrExit(error);
+        // If no output windows exit
+        if(*output_window_count == 0)
+            break;
         
-        // Write input windows
-        error = clEnqueueWriteBuffer(clod_data->environment.queue, clod_data->detect_objects_data.buffers[2], CL_TRUE, 0, input_window_count * sizeof(CLODSubwindowData), input_windows, 0, NULL, NULL);
-        clCheckOrExit(error);
+        // Few windows left, a launch per remaining stage costs more than finishing them on the host
+        if(*output_window_count < adaptive_window_count) {
+            stage_index++;
+            break;
+        }
         
-        // Set scaled window area
-        clSetKernelArg(clod_data->environment.kernels[0], 6, sizeof(cl_uint), &(scaled_window_area));
+        // Set output buffer as the input one
+        // If stage even than the output becomes the input and vice-versa, else restore the original association
+        error = clSetKernelArg(clod_data->environment.kernels[0], 2, sizeof(cl_mem), &(window_buffers[*dst_buffer_index]));
         clCheckOrExit(error);
-        // Set current scale
-        clSetKernelArg(clod_data->environment.kernels[0], 7, sizeof(cl_float), &(current_scale));
+        error = clSetKernelArg(clod_data->environment.kernels[0], 3, sizeof(cl_mem), &(window_buffers[1 - *dst_buffer_index]));
         clCheckOrExit(error);
-        
-        // Not useful anymore, written to buffer
-        free(input_windows);
-        input_windows = NULL;
-    
-        cl_uint stage_index = 0;
-        for(stage_index = 0; stage_index < kernel_cascade.count; stage_index++)
-        {
-            KernelStage stage = kernel_cascade.stage[stage_index];
-            
-            // Set kernel stage
-            error = clEnqueueWriteBuffer(clod_data->environment.queue, clod_data->detect_objects_data.buffers[1], CL_TRUE, 0, sizeof(KernelStage), &stage, 0, NULL, NULL);
+        if(cascade_buffers != NULL) {
+            error = clSetKernelArg(clod_data->environment.kernels[0], 9, sizeof(cl_mem), &(cascade_buffers[*dst_buffer_index]));
+            clCheckOrExit(error);
+            error = clSetKernelArg(clod_data->environment.kernels[0], 10, sizeof(cl_mem), &(cascade_buffers[1 - *dst_buffer_index]));
             clCheckOrExit(error);
-            
-            // Run kernel
-            runKernelStage(clod_data, input_window_count, scaled_window_area, current_scale, stage_index, &output_window_count);
-            
-            // If no output windows exit
-            if(output_window_count == 0)
-                break;
-            
-            // Set output buffer as the input one
-            // If stage even than the output becomes the input and vice-versa, else restore the original association
-            if(stage_index & 1) {
-                error = clSetKernelArg(clod_data->environment.kernels[0], 2, sizeof(cl_mem), &(clod_data->detect_objects_data.buffers[2]));
-                clCheckOrExit(error);
-                error = clSetKernelArg(clod_data->environment.kernels[0], 3, sizeof(cl_mem), &(clod_data->detect_objects_data.buffers[3]));
-                clCheckOrExit(error);
-            }
-            else {
-                error = clSetKernelArg(clod_data->environment.kernels[0], 2, sizeof(cl_mem), &(clod_data->detect_objects_data.buffers[3]));
-                clCheckOrExit(error);
-                error = clSetKernelArg(clod_data->environment.kernels[0], 3, sizeof(cl_mem), &(clod_data->detect_objects_data.buffers[2]));
-                clCheckOrExit(error);
-            }
-            
-            input_window_count = output_window_count;
         }
-    
-        cl_uint dst_buffer_index = 3;
-        if(stage_index & 1)
-            dst_buffer_index = 2;
-        
-        output_windows = (CLODSubwindowData*)clEnqueueMapBuffer(clod_data->environment.queue, clod_data->detect_objects_data.buffers[dst_buffer_index], CL_TRUE, CL_MAP_READ, 0, output_window_count * sizeof(CLODSubwindowData), 0, NULL, NULL, &error);
-        clCheckOrExit(error);
         
+        input_window_count = *output_window_count;
+    }
+    clodProfileTag(clod_data->clif->profile, scale_index, -1);
+    return stage_index;
+}
+
+/* OpenCL detection of a single scale, the integral image must already be in
+ * buffers[0]. opt_rectangles is only used when adaptive_window_count != 0.
+ * With device_matches windows passing every stage on the device are appended
+ * to the device matches instead of matches
+ */
+void
+runScaleOpenCL(CLODEnvironmentData* clod_data,
+               const CvMat* integral_image,
+               const CvMat* square_integral_image,
+               const CvMat* edge_integral_image,
+               const CvHaarClassifierCascade* orig_casc,
+               const CvSize* image_size,
+               const CvSize* min_window_size,
+               const CvSize* max_window_size,
+               const CvRect* scan_roi,
+               const CLODScanRegions* regions,
+               const cl_uint scale_index,
+               const cl_float current_scale,
+               CLODOptimizedRect* opt_rectangles,
+               const cl_uint adaptive_window_count,
+               const cl_uint coarse_stage_count,
+               const cl_bool device_matches,
+               CLODStageStatistics* statistics,
+               CLODWeightedRect* matches,
+               cl_uint* match_count)
+{
+    cl_int error = CL_SUCCESS;
+    const cl_float edge_density = clod_data->edge_density;
+    clodProfileTag(clod_data->clif->profile, scale_index, -1);
+    
+    // Setup scale-dependent variables
+    CvSize scaled_window_size;
+    cl_uint scaled_window_area;
+    CvRect equ_rect;
+    CvPoint start_point = cvPoint(0, 0);
+    CvPoint end_point;
+    cl_float step;
+    if(setupScale(current_scale,
+                  image_size,
+                  &orig_casc->orig_window_size,
+                  min_window_size,
+                  max_window_size,
+                  &equ_rect,
+                  &scaled_window_size,
+                  &scaled_window_area,
+                  &end_point, &step) != CL_SUCCESS) {
+        return;
+    }
+    if(scan_roi != NULL && clipScaleToRect(scan_roi, &scaled_window_size, step, &start_point, &end_point) != CL_SUCCESS)
+        return;
+    if(regions != NULL && clipScaleToRegions(regions, &scaled_window_size, step, &start_point, &end_point) != CL_SUCCESS)
+        return;
+    
+    // Allocate windows to be computed by successive stages
+    CLODSubwindowData* input_windows = NULL;
+    CLODSubwindowData* output_windows = NULL;
+    cl_uint input_window_count = 0;
+    cl_uint output_window_count = 0;
+    cl_uint skipped_count = 0;
+    
+    if(adaptive_window_count != 0)
+        precomputeFeatures(integral_image, scaled_window_area, orig_casc, current_scale, opt_rectangles);
+    
+    // Precompute windows, a coarse pass runs on the host
+    buildScaleWindows(step, integral_image, square_integral_image,
+                      orig_casc, adaptive_window_count != 0 ? opt_rectangles : NULL,
+                      &equ_rect,
+                      &start_point,
+                      &end_point,
+                      &scaled_window_size,
+                      scaled_window_area, current_scale,
+                      regions, edge_integral_image, edge_density, coarse_stage_count,
+                      &input_windows, &input_window_count, &skipped_count);
+    recordWindowCount(statistics, scale_index, input_window_count);
+    recordSkippedCount(statistics, scale_index, skipped_count);
+    
+    // Every window skipped (motion, edges, mask or coarse pass), nothing to launch
+    if(input_window_count == 0) {
+        free(input_windows);
+        return;
+    }
+    
+    // Previous frames say too few windows survive stage 0 at this scale to be worth a launch
+    cl_float predicted_survivors = predictStageSurvivors(statistics, scale_index, 0);
+    if(adaptive_window_count != 0 &&
+       (input_window_count < adaptive_window_count ||
+        (predicted_survivors >= 0 && predicted_survivors < adaptive_window_count))) {
+        runStages(integral_image, orig_casc, opt_rectangles, 0,
+                  input_windows, input_window_count,
+                  &scaled_window_size, scaled_window_area, current_scale,
+                  CL_TRUE, adaptive_window_count,
+                  statistics, scale_index,
+                  matches, match_count);
+        return;
+    }
+    
+    // Precompute feature rect offset in integral image and square integral image into a new cascade
+    KernelCascade kernel_cascade = precomputeKernelCascade(orig_casc, current_scale, scaled_window_area, integral_image->width, integral_image->rows * integral_image->cols);
+            
+    // Write input windows
+    error = clEnqueueWriteBuffer(clod_data->environment.queue, clod_data->detect_objects_data.buffers[2], CL_TRUE, 0, input_window_count * sizeof(CLODSubwindowData), input_windows, 0, NULL, clodProfileEvent(clod_data->clif->profile, "write"));
+    clCheckOrExit(error);
+    
+    // Not useful anymore, written to buffer
+    free(input_windows);
+    input_windows = NULL;
+
+    cl_uint dst_buffer_index = 0;
+    cl_uint stage_index = runKernelCascade(clod_data, &kernel_cascade, 1, clod_data->detect_objects_data.buffers[1],
+                                           &(clod_data->detect_objects_data.buffers[2]), NULL,
+                                           input_window_count, scaled_window_area, current_scale,
+                                           adaptive_window_count, statistics, scale_index,
+                                           &dst_buffer_index, &output_window_count);
+    cl_mem output_buffer = clod_data->detect_objects_data.buffers[2 + dst_buffer_index];
+    free(kernel_cascade.stage);
+    
+    // Left on the device for groupDeviceMatches
+    if(device_matches && stage_index == kernel_cascade.count) {
+        appendDeviceMatches(clod_data, output_buffer, output_window_count, &scaled_window_size);
+        return;
+    }
+    
+    // Rejected by a stage, a map of 0 bytes is not valid
+    if(output_window_count == 0)
+        return;
+    
+    output_windows = (CLODSubwindowData*)clEnqueueMapBuffer(clod_data->environment.queue, output_buffer, CL_TRUE, CL_MAP_READ, 0, output_window_count * sizeof(CLODSubwindowData), 0, NULL, clodProfileEvent(clod_data->clif->profile, "map"), &error);
+    clCheckOrExit(error);
+    
+    if(stage_index < kernel_cascade.count) {
+        // Handed over to the host, runStages releases its input
+        input_windows = (CLODSubwindowData*)malloc(output_window_count * sizeof(CLODSubwindowData));
+        memcpy(input_windows, output_windows, output_window_count * sizeof(CLODSubwindowData));
+        runStages(integral_image, orig_casc, opt_rectangles, stage_index,
+                  input_windows, output_window_count,
+                  &scaled_window_size, scaled_window_area, current_scale,
+                  CL_TRUE, adaptive_window_count,
+                  statistics, scale_index,
+                  matches, match_count);
+    }
+    else {
         // Add to matches
         for(cl_uint i = 0; i < output_window_count; i++) {
-            matches[match_count].rect.x = output_windows[i].x;
-            matches[match_count].rect.y = output_windows[i].y;
-            matches[match_count].rect.width = scaled_window_size.width;
-            matches[match_count].rect.height = scaled_window_size.height;
-            match_count++;
+            matches[*match_count].rect.x = output_windows[i].x;
+            matches[*match_count].rect.y = output_windows[i].y;
+            matches[*match_count].rect.width = scaled_window_size.width;
+            matches[*match_count].rect.height = scaled_window_size.height;
+            (*match_count)++;
+        }
+    }
+    
+    error = clEnqueueUnmapMemObject(clod_data->environment.queue, output_buffer, output_windows, 0, NULL, clodProfileEvent(clod_data->clif->profile, "unmap"));
+    clCheckOrExit(error);
+}
+
+/* CLOD_FIND_BIGGEST_OBJECT: scales are visited from the largest down. Once a
+ * group is found the remaining scales only scan the region around it, with
+ * CLOD_ROUGH_SEARCH they stop a few scales later. Returns the number of
+ * matches (0 or 1), the biggest object is written to matches[0]
+ */
+cl_uint
+runBiggestObjectScales(CLODEnvironmentData* clod_data,
+                       const CvMat* integral_image,
+                       const CvMat* square_integral_image,
+                       const CvMat* edge_integral_image,
+                       const CvHaarClassifierCascade* cascade,
+                       const CvSize* image_size,
+                       const CvSize* min_window_size,
+                       const CvSize* max_window_size,
+                       const CLODScanRegions* regions,
+                       const cl_uint scale_count,
+                       const cl_float scale_factor,
+                       const cl_uint min_neighbors,
+                       const clod_flags flags,
+                       CLODOptimizedRect* opt_rectangles,
+                       cl_uint* stage_exits,
+                       const cl_uint adaptive_window_count,
+                       const cl_bool use_opencl,
+                       CLODWeightedRect* matches)
+{
+    CLODStageStatistics* statistics = &(clod_data->stage_statistics);
+    cl_uint coarse_stage_count = (flags & CLOD_COARSE_TO_FINE) ? clod_data->coarse_stage_count : 0;
+    cl_uint match_count = 0;
+    
+    // Same values as the ascending traversal
+    cl_float* scales = (cl_float*)malloc(scale_count * sizeof(cl_float));
+    cl_float current_scale = 1;
+    for(cl_uint scale_index = 0; scale_index < scale_count; scale_index++, current_scale *= scale_factor)
+        scales[scale_index] = current_scale;
+    
+    CLODWeightedRect biggest;
+    CvRect scan_roi;
+    cl_bool found = CL_FALSE;
+    for(cl_int scale_index = (cl_int)scale_count - 1; scale_index >= 0; scale_index--) {
+        // Rough search refines only the scales close to the object
+        if(found && (flags & CLOD_ROUGH_SEARCH) &&
+           scales[scale_index] * cascade->orig_window_size.width < CLOD_ROUGH_SEARCH_RATIO * biggest.rect.width)
+            break;
+        
+        if(use_opencl) {
+            runScaleOpenCL(clod_data, integral_image, square_integral_image, edge_integral_image, cascade,
+                           image_size, min_window_size, max_window_size, found ? &scan_roi : NULL, regions,
+                           scale_index, scales[scale_index],
+                           opt_rectangles, adaptive_window_count, coarse_stage_count, CL_FALSE,
+                           statistics, matches, &match_count);
+        }
+        else {
+            runScale(integral_image, square_integral_image,
+                     edge_integral_image, clod_data->edge_density, cascade,
+                     image_size, min_window_size, max_window_size, found ? &scan_roi : NULL, regions,
+                     scale_index, scales[scale_index], flags,
+                     opt_rectangles, stage_exits, adaptive_window_count, coarse_stage_count,
+                     statistics, matches, &match_count);
         }
         
-        clEnqueueUnmapMemObject(clod_data->environment.queue, clod_data->detect_objects_data.buffers[dst_buffer_index], output_windows, 0, NULL, NULL);
-        clCheckOrExit(error);
+        // First confident hit, the region is enlarged as much as grouping allows
+        if(!found && findBiggestMatch(matches, match_count, min_neighbors, &biggest)) {
+            found = CL_TRUE;
+            cl_int dx = (cl_int)lrint(biggest.rect.width * EPS);
+            cl_int dy = (cl_int)lrint(biggest.rect.height * EPS);
+            scan_roi.x = MAX(biggest.rect.x - dx, 0);
+            scan_roi.y = MAX(biggest.rect.y - dy, 0);
+            scan_roi.width = MIN(biggest.rect.x + biggest.rect.width + dx, image_size->width) - scan_roi.x;
+            scan_roi.height = MIN(biggest.rect.y + biggest.rect.height + dy, image_size->height) - scan_roi.y;
+        }
     }
     
-    // Filter out results
-    if(min_neighbors != 0)
-        match_count = filterResult(matches, match_count, MAX(min_neighbors, 1), EPS);
+    // Group again with the refined matches
+    if(found)
+        found = findBiggestMatch(matches, match_count, min_neighbors, &biggest);
     
     // Release
-    cvReleaseMat(&integral_image);
-    cvReleaseMat(&square_integral_image);
+    free(scales);
+    
+    if(!found)
+        return 0;
+    matches[0] = biggest;
+    return 1;
+}
+
+/* Code to run detection using OpenCL */
+CLODDetectObjectsResult
+clodDetectObjectsIntegral(const CvMat* integral_image,
+                          const CvMat* square_integral_image,
+                          const CvMat* edge_integral_image,
+                          cl_mem integral_buffer,
+                          cl_event integral_event,
+                          const CvHaarClassifierCascade* orig_casc,
+                          CLODEnvironmentData* clod_data,
+                          const CvSize min_window_size,
+                          const CvSize max_window_size,
+                          const cl_uint min_neighbors,
+                          const clod_flags flags,
+                          const CLODScanRegions* regions)
+{
+    float scale_factor = clod_data->scale_factor;
+    CLODDetectObjectsResult result;
+    cl_int error = CL_SUCCESS;
+    CvSize image_size = cvSize(integral_image->width - 1, integral_image->height - 1);
+    clodProfileBeginFrame(clod_data->clif->profile);
+    
+    // Integral image to use
+    error = clSetKernelArg(clod_data->environment.kernels[0], 0, sizeof(cl_mem), &integral_buffer);
+    clCheckOrExit(error);
+    
+    // Calculate number of different scales
+    cl_uint scale_count = 0;
+    for(float current_scale = 1;
+        current_scale * orig_casc->orig_window_size.width < image_size.width - 10 &&
+        current_scale * orig_casc->orig_window_size.height < image_size.height - 10;
+        current_scale *= scale_factor) {
+        scale_count++;
+    }
+    
+    // Vector to store positive matches
+    CLODWeightedRect* matches = (CLODWeightedRect*)malloc(image_size.width * image_size.height * scale_count * sizeof(CLODWeightedRect));
+    cl_uint match_count = 0;
+    
+    // Stage statistics
+    CLODStageStatistics* statistics = &(clod_data->stage_statistics);
+    beginStageStatistics(statistics, orig_casc, scale_count, scale_factor);
+    CLOD_COUNT(beginWorkCounters(clod_data));
+    cl_uint adaptive_window_count = (flags & CLOD_ADAPTIVE_STRATEGY) ? clod_data->adaptive_window_count : 0;
+    cl_uint coarse_stage_count = (flags & CLOD_COARSE_TO_FINE) ? clod_data->coarse_stage_count : 0;
+    
+    // Host side rectangles, needed when windows are handed over to the host
+    CLODOptimizedRect* opt_rectangles = NULL;
+    if(adaptive_window_count != 0)
+        opt_rectangles = (CLODOptimizedRect*)malloc(countCascadeNodes(orig_casc) * MAX_FEATURE_RECT_COUNT * sizeof(CLODOptimizedRect));
+    
+    // Matches can be grouped on the device only if they are grouped at all
+    cl_bool device_grouping = (flags & CLOD_DEVICE_GROUPING) && min_neighbors != 0 && !(flags & CLOD_FIND_BIGGEST_OBJECT);
+    if(device_grouping)
+        resetDeviceMatches(clod_data);
+    
+    // Upload may come from another queue, the first stage launch waits for it
+    clod_data->stage_wait_event = integral_event;
+    
+    // Iterate over scales
+    if(flags & CLOD_FIND_BIGGEST_OBJECT) {
+        match_count = runBiggestObjectScales(clod_data, integral_image, square_integral_image, edge_integral_image, orig_casc,
+                                             &image_size, &min_window_size, &max_window_size, regions,
+                                             scale_count, scale_factor, min_neighbors, flags,
+                                             opt_rectangles, NULL, adaptive_window_count, CL_TRUE,
+                                             matches);
+    }
+    else {
+        cl_float current_scale = 1;
+        for(cl_uint scale_index = 0; scale_index < scale_count; scale_index++, current_scale *= scale_factor) {
+            runScaleOpenCL(clod_data, integral_image, square_integral_image, edge_integral_image, orig_casc,
+                           &image_size, &min_window_size, &max_window_size, NULL, regions,
+                           scale_index, current_scale,
+                           opt_rectangles, adaptive_window_count, coarse_stage_count, device_grouping,
+                           statistics, matches, &match_count);
+        }
+    }
+    clodProfileTag(clod_data->clif->profile, -1, -1);
+    
+    // Filter out results, the biggest object is already grouped
+    if(device_grouping)
+        match_count = groupDeviceMatches(clod_data, matches, match_count, MAX(min_neighbors, 1), EPS);
+    else if(min_neighbors != 0 && !(flags & CLOD_FIND_BIGGEST_OBJECT))
+        match_count = filterResult(matches, match_count, MAX(min_neighbors, 1), EPS);
+    
+    // Release, the event is not used if nothing was launched
+    free(opt_rectangles);
+    clod_data->stage_wait_event = NULL;
+    
+    clodProfileEndFrame(clod_data->clif->profile);
     
     // Return
     result.matches = matches;
     result.match_count = match_count;
+    CLOD_COUNT(endWorkCounters(clod_data, &result.counters));
     return result;
 }
 
-/* Public function. Calls OpenCL or Block depending on arguments */
 CLODDetectObjectsResult
-clodDetectObjects(const IplImage* image,
-                  const CvHaarClassifierCascade* cascade,
-                  const CLODEnvironmentData* clod_data,
-                  const CvSize min_window_size,
-                  const CvSize max_window_size,
-                  const cl_uint min_neighbors,
-                  const clod_flags flags,
-                  const cl_bool use_cl)
+clodDetectObjectsOpenCL(const IplImage* image,
+                        const CvHaarClassifierCascade* orig_casc,
+                        CLODEnvironmentData* clod_data,
+                        const CvSize min_window_size,
+                        const CvSize max_window_size,
+                        const cl_uint min_neighbors,
+                        const clod_flags flags,
+                        const CLODScanRegions* regions)
 {
-    float scale_factor = 1.1;
-    CLODDetectObjectsResult result;
+    clodProfileBeginFrame(clod_data->clif->profile);
     
-    CLIFEnvironmentData* clif_data = clod_data->clif;
-    CvSize image_size = cvSize(image->width, image->height);
+    // Setup image
+    CvMat* integral_image, *square_integral_image;
+    cl_mem integral_buffer = setupDeviceImage(image, clodHasTiltedFeatures(orig_casc), clod_data, &integral_image, &square_integral_image);
+    CvMat* edge_integral_image = setupEdges(image, clod_data->clif, flags, CL_TRUE);
     
-    if(use_cl)
-        return clodDetectObjectsOpenCL(image, cascade, clod_data, min_window_size, max_window_size, min_neighbors);
+    CLODDetectObjectsResult result = clodDetectObjectsIntegral(integral_image, square_integral_image, edge_integral_image,
+                                                               integral_buffer, NULL,
+                                                               orig_casc, clod_data,
+                                                               min_window_size, max_window_size,
+                                                               min_neighbors, flags, regions);
     
-    if(flags & CLOD_BLOCK_IMPLEMENTATION)
-        return clodDetectObjectsBlock(image, cascade, clif_data, min_window_size, max_window_size, min_neighbors, flags);
+    // Release
+    releaseDeviceImage(clod_data, integral_buffer, &integral_image, &square_integral_image);
+    if(edge_integral_image != NULL)
+        cvReleaseMat(&edge_integral_image);
     
-    // Setup image
-    CvMat* integral_image, *square_integral_image;
-    setupImage(image, &integral_image, &square_integral_image, CL_FALSE);
+    clodProfileEndFrame(clod_data->clif->profile);
+    
+    // Return
+    return result;
+}
+
+/* Room for image_count images of image_size in the batch buffers */
+void
+reserveBatchBuffers(CLODEnvironmentData* clod_data,
+                    const CvSize* image_size,
+                    const cl_uint image_count)
+{
+    CLODBatchData* batch_data = &(clod_data->batch_data);
+    if(batch_data->capacity >= image_count &&
+       batch_data->image_size.width == image_size->width &&
+       batch_data->image_size.height == image_size->height)
+        return;
+    for(cl_uint i = 0; i < 3 && batch_data->capacity != 0; i++)
+        clReleaseMemObject(batch_data->buffers[i]);
+    
+    cl_int error = CL_SUCCESS;
+    size_t integral_area = (size_t)(image_size->width + 1) * (image_size->height + 1);
+    size_t window_count = (size_t)(image_size->width / 2) * (image_size->height / 2);
+    size_t sizes[3] = {
+        image_count * 2 * integral_area * sizeof(cl_uint),
+        image_count * window_count * sizeof(CLODSubwindowData),
+        image_count * window_count * sizeof(CLODSubwindowData)
+    };
+    cl_mem_flags mem_flags[3] = {
+        CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY,
+        CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_WRITE,
+        CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_WRITE
+    };
+    for(cl_uint i = 0; i < 3; i++) {
+        batch_data->buffers[i] = clCreateBuffer(clod_data->environment.context, mem_flags[i], sizes[i], NULL, &error);
+        clCheckOrExit(error);
+    }
+    batch_data->capacity = image_count;
+    batch_data->image_size = *image_size;
+}
+
+cl_int
+clodDetectObjectsBatch(const IplImage** images,
+                       const cl_uint image_count,
+                       const CvHaarClassifierCascade* orig_casc,
+                       CLODEnvironmentData* clod_data,
+                       const CvSize min_window_size,
+                       const CvSize max_window_size,
+                       const cl_uint min_neighbors,
+                       const clod_flags flags,
+                       CLODDetectObjectsResult* results)
+{
+    float scale_factor = clod_data->scale_factor;
+    cl_int error = CL_SUCCESS;
+    if(image_count == 0)
+        return CL_SUCCESS;
+    
+    // Integral images are packed with the stride of the clodInitBuffers size
+    CvSize image_size = clod_data->detect_objects_data.image_size;
+    for(cl_uint i = 0; i < image_count; i++) {
+        results[i].matches = NULL;
+        results[i].match_count = 0;
+    }
+    for(cl_uint i = 0; i < image_count; i++) {
+        if(images[i]->width != image_size.width || images[i]->height != image_size.height) {
+            fprintf(stderr, "clodDetectObjectsBatch: image %d is %dx%d, buffers are %dx%d\n",
+                    i, images[i]->width, images[i]->height, image_size.width, image_size.height);
+            return CL_INVALID_IMAGE_SIZE;
+        }
+    }
+    // Each one followed by its tilted sums if the cascade reads them
+    cl_bool tilted = clodHasTiltedFeatures(orig_casc);
+    cl_uint integral_area = (image_size.width + 1) * (image_size.height + 1);
+    cl_uint integral_stride = (tilted ? 2 : 1) * integral_area;
+    reserveBatchBuffers(clod_data, &image_size, image_count);
+    clodProfileBeginFrame(clod_data->clif->profile);
+    CLODBatchData* batch_data = &(clod_data->batch_data);
+    
+    // Integral images on the host (needed for the variance and the coarse pass), packed one after the other on the device
+    CvMat** integral_images = (CvMat**)malloc(image_count * sizeof(CvMat*));
+    CvMat** square_integral_images = (CvMat**)malloc(image_count * sizeof(CvMat*));
+    CvMat** edge_integral_images = (CvMat**)malloc(image_count * sizeof(CvMat*));
+    for(cl_uint i = 0; i < image_count; i++) {
+        setupImage(images[i], tilted, &integral_images[i], &square_integral_images[i], CL_FALSE);
+        edge_integral_images[i] = setupEdges(images[i], clod_data->clif, flags, CL_FALSE);
+        error = clEnqueueWriteBuffer(clod_data->environment.queue, batch_data->buffers[0], CL_FALSE,
+                                     i * integral_stride * sizeof(cl_uint), integral_stride * sizeof(cl_uint),
+                                     integral_images[i]->data.ptr, 0, NULL, clodProfileEvent(clod_data->clif->profile, "write"));
+        clCheckOrExit(error);
+    }
+    error = clSetKernelArg(clod_data->environment.kernels[0], 0, sizeof(cl_mem), &(batch_data->buffers[0]));
+    clCheckOrExit(error);
     
     // Calculate number of different scales
     cl_uint scale_count = 0;
     for(float current_scale = 1;
-        current_scale * cascade->orig_window_size.width < image->width - 10 &&
-        current_scale * cascade->orig_window_size.height < image->height - 10;
+        current_scale * orig_casc->orig_window_size.width < image_size.width - 10 &&
+        current_scale * orig_casc->orig_window_size.height < image_size.height - 10;
         current_scale *= scale_factor) {
         scale_count++;
     }
     
-    // Precompute feature rect offset in integral image and square integral image into a new cascade
-    CLODOptimizedRect* opt_rectangles = NULL;
-    if(flags & CLOD_PRECOMPUTE_FEATURES)
-        opt_rectangles = (CLODOptimizedRect*)malloc(cascade->count * MAX_STAGE_CLASSIFIER_COUNT * MAX_FEATURE_RECT_COUNT * sizeof(CLODOptimizedRect));
+    // Stage statistics count the windows of the whole batch
+    CLODStageStatistics* statistics = &(clod_data->stage_statistics);
+    beginStageStatistics(statistics, orig_casc, scale_count, scale_factor);
+    CLOD_COUNT(beginWorkCounters(clod_data));
+    cl_uint coarse_stage_count = (flags & CLOD_COARSE_TO_FINE) ? clod_data->coarse_stage_count : 0;
     
-    // Vector to store positive matches
-    CLODWeightedRect* matches = (CLODWeightedRect*)malloc(image->width * image->height * scale_count * sizeof(CLODWeightedRect));
-    cl_uint match_count = 0;
+    // Windows of all the images, offsets point into the packed integral images.
+    // A scale has at most (width / 2) * (height / 2) windows per image
+    size_t max_window_count = (size_t)image_count * (image_size.width / 2) * (image_size.height / 2);
+    CLODSubwindowData* batch_windows = (CLODSubwindowData*)malloc(max_window_count * sizeof(CLODSubwindowData));
     
     // Iterate over scales
     cl_float current_scale = 1;
     for(cl_uint scale_index = 0; scale_index < scale_count; scale_index++, current_scale *= scale_factor) {
-        
         // Setup scale-dependent variables
         CvSize scaled_window_size;
         cl_uint scaled_window_area;
@@ -1393,7 +3307,7 @@ clodDetectObjects(const IplImage* image,
         cl_float step;
         if(setupScale(current_scale,
                       &image_size,
-                      &cascade->orig_window_size,
+                      &orig_casc->orig_window_size,
                       &min_window_size,
                       &max_window_size,
                       &equ_rect,
@@ -1402,99 +3316,1034 @@ clodDetectObjects(const IplImage* image,
                       &end_point, &step) != CL_SUCCESS) {
             continue;
         }
+        clodProfileTag(clod_data->clif->profile, scale_index, -1);
         
-        // Precompute feature rect offset in integral image and square integral image into a new cascade
-        if(flags & CLOD_PRECOMPUTE_FEATURES)
-            precomputeFeatures(integral_image, scaled_window_area, cascade, current_scale, opt_rectangles);
-        
-        if(!(flags & CLOD_PER_STAGE_ITERATIONS)) {
-            // Iterate over windows
-            cl_uint x_incr = 1;
-            for(int y_index = start_point.y; y_index < end_point.y; y_index++) {
-                for(int x_index = start_point.x; x_index < end_point.x; x_index += x_incr) {
-                    // Real position
-                    CvPoint point = cvPoint((cl_uint)round(x_index * step), (cl_uint)round(y_index * step));
-                    
-                    // Sum of window pixels normalized by the window size E(x)
-                    cl_float variance = computeVariance(integral_image, square_integral_image, &equ_rect, &point, scaled_window_area);
-                    
-                    // Run cascade on point x,y
-                    cl_int exit_stage = runCascade(integral_image,
-                                              cascade,
-                                              opt_rectangles,
-                                              &point,
-                                              &scaled_window_size,
-                                              scaled_window_area,
-                                              variance, current_scale, (flags & CLOD_PRECOMPUTE_FEATURES),
-                                              matches, &match_count);
-                    x_incr = exit_stage != 0 ? 1 : 2;
-                }
-            }
-        }
-        else {
-            // Allocate windows to be computed by successive stages
-            CLODSubwindowData* input_windows = (CLODSubwindowData*)malloc((end_point.y - start_point.y + 1) * (end_point.x - start_point.x + 1) * sizeof(CLODSubwindowData));
-            CLODSubwindowData* output_windows = NULL;
-            cl_uint input_window_count = 0;
-            cl_uint output_window_count = 0;
-            
-            // Precompute windows
-            precomputeWindows(step, integral_image, square_integral_image,
+        // Concatenate the windows of every image
+        cl_uint window_count = 0;
+        cl_uint skipped_count = 0;
+        for(cl_uint i = 0; i < image_count; i++) {
+            CLODSubwindowData* windows = NULL;
+            cl_uint image_window_count = 0;
+            cl_uint image_skipped_count = 0;
+            buildScaleWindows(step, integral_images[i], square_integral_images[i],
+                              orig_casc, NULL,
                               &equ_rect,
                               &start_point,
                               &end_point,
-                              scaled_window_area, &input_windows, &input_window_count);
-            
-            // Iterate over stages
-            cl_uint start_rect_index = 0;
-            cl_uint end_rect_index = 0;
-            
-            // Write the initial input windows list into buffer            
-            cl_uint stage_index = 0;
-            for(stage_index = 0; stage_index < cascade->count; stage_index++) {
-                CvHaarStageClassifier stage = cascade->stage_classifier[stage_index];
-                // Run stage on GPU for each subwindow
-                runSubwindow(integral_image,
-                             opt_rectangles,
-                             start_rect_index, &end_rect_index,
-                             &stage, stage_index,
-                             input_windows, &output_windows,
-                             input_window_count, &output_window_count,
-                             scaled_window_area, current_scale, (flags & CLOD_PRECOMPUTE_FEATURES));
-                
-                free(input_windows);
-                input_windows = output_windows;
-                input_window_count = output_window_count;
-                start_rect_index = end_rect_index;
-                if(output_window_count == 0)
-                    break;
+                              &scaled_window_size,
+                              scaled_window_area, current_scale,
+                              NULL, edge_integral_images[i], clod_data->edge_density, coarse_stage_count,
+                              &windows, &image_window_count, &image_skipped_count);
+            for(cl_uint w = 0; w < image_window_count; w++) {
+                batch_windows[window_count] = windows[w];
+                batch_windows[window_count].offset += i * integral_stride;
+                window_count++;
             }
-                        
-            // Add to matches
-            for(cl_uint i = 0; i < output_window_count; i++) {
-                matches[match_count].rect.x = output_windows[i].x;
-                matches[match_count].rect.y = output_windows[i].y;
-                matches[match_count].rect.width = scaled_window_size.width;
-                matches[match_count].rect.height = scaled_window_size.height;
-                match_count++;
-            }
-            free(output_windows);
+            skipped_count += image_skipped_count;
+            free(windows);
+            
+            // Every window could match
+            if(image_window_count != 0)
+                results[i].matches = (CLODWeightedRect*)realloc(results[i].matches, (results[i].match_count + image_window_count) * sizeof(CLODWeightedRect));
+        }
+        recordWindowCount(statistics, scale_index, window_count);
+        recordSkippedCount(statistics, scale_index, skipped_count);
+        if(window_count == 0)
+            continue;
+        
+        // Precompute feature rect offset in integral image and square integral image into a new cascade
+        KernelCascade kernel_cascade = precomputeKernelCascade(orig_casc, current_scale, scaled_window_area, integral_images[0]->width, integral_area);
+        
+        // Write input windows
+        error = clEnqueueWriteBuffer(clod_data->environment.queue, batch_data->buffers[1], CL_TRUE, 0, window_count * sizeof(CLODSubwindowData), batch_windows, 0, NULL, clodProfileEvent(clod_data->clif->profile, "write"));
+        clCheckOrExit(error);
+        
+        // One launch per stage for the whole batch
+        cl_uint dst_buffer_index = 0;
+        cl_uint output_window_count = 0;
+        runKernelCascade(clod_data, &kernel_cascade, 1, clod_data->detect_objects_data.buffers[1],
+                         &(batch_data->buffers[1]), NULL,
+                         window_count, scaled_window_area, current_scale,
+                         0, statistics, scale_index,
+                         &dst_buffer_index, &output_window_count);
+        free(kernel_cascade.stage);
+        if(output_window_count == 0)
+            continue;
+        
+        // Survivors go back to their image, found from the offset
+        cl_mem output_buffer = batch_data->buffers[1 + dst_buffer_index];
+        CLODSubwindowData* output_windows = (CLODSubwindowData*)clEnqueueMapBuffer(clod_data->environment.queue, output_buffer, CL_TRUE, CL_MAP_READ, 0, output_window_count * sizeof(CLODSubwindowData), 0, NULL, clodProfileEvent(clod_data->clif->profile, "map"), &error);
+        clCheckOrExit(error);
+        for(cl_uint w = 0; w < output_window_count; w++) {
+            CLODDetectObjectsResult* result = &results[output_windows[w].offset / integral_stride];
+            result->matches[result->match_count].rect.x = output_windows[w].x;
+            result->matches[result->match_count].rect.y = output_windows[w].y;
+            result->matches[result->match_count].rect.width = scaled_window_size.width;
+            result->matches[result->match_count].rect.height = scaled_window_size.height;
+            result->match_count++;
         }
+        error = clEnqueueUnmapMemObject(clod_data->environment.queue, output_buffer, output_windows, 0, NULL, clodProfileEvent(clod_data->clif->profile, "unmap"));
+        clCheckOrExit(error);
     }
     
+    clodProfileTag(clod_data->clif->profile, -1, -1);
+    
     // Filter out results
-    if(min_neighbors != 0) 
-        match_count = filterResult(matches, match_count, MAX(min_neighbors, 1), EPS);
+    for(cl_uint i = 0; i < image_count; i++)
+        if(min_neighbors != 0 && results[i].match_count != 0)
+            results[i].match_count = filterResult(results[i].matches, results[i].match_count, MAX(min_neighbors, 1), EPS);
+    
+#ifdef CLOD_COUNTERS
+    // Work of the whole batch, images share the stage launches so it can not be split
+    endWorkCounters(clod_data, &results[0].counters);
+    for(cl_uint i = 1; i < image_count; i++)
+        memset(&results[i].counters, 0, sizeof(CLODWorkCounters));
+#endif
+    
+    // Restore the integral image of the single image paths
+    error = clSetKernelArg(clod_data->environment.kernels[0], 0, sizeof(cl_mem), &(clod_data->detect_objects_data.buffers[0]));
+    clCheckOrExit(error);
     
     // Release
-    if((flags & CLOD_PER_STAGE_ITERATIONS))
+    for(cl_uint i = 0; i < image_count; i++) {
+        cvReleaseMat(&integral_images[i]);
+        cvReleaseMat(&square_integral_images[i]);
+        if(edge_integral_images[i] != NULL)
+            cvReleaseMat(&edge_integral_images[i]);
+    }
+    free(integral_images);
+    free(square_integral_images);
+    free(edge_integral_images);
+    free(batch_windows);
+    clodProfileEndFrame(clod_data->clif->profile);
+    return CL_SUCCESS;
+}
+
+/* Host half of the hybrid detection, runs on its own thread */
+typedef struct CLODHostScalesData {
+    const CvMat* integral_image;
+    const CvMat* square_integral_image;
+    const CvMat* edge_integral_image;
+    cl_float edge_density;
+    const CLODScanRegions* regions;
+    const CvHaarClassifierCascade* cascade;
+    CvSize image_size;
+    CvSize min_window_size;
+    CvSize max_window_size;
+    cl_uint scale_count;
+    cl_float scale_factor;
+    clod_flags flags;
+    cl_uint adaptive_window_count;
+    cl_uint coarse_stage_count;
+    CLODStageStatistics* statistics;
+    CLODSchedulerData* scheduler;
+    CLODWeightedRect* matches;
+    cl_uint match_count;
+#ifdef CLOD_COUNTERS
+    cl_ulong node_count;                // nodes evaluated, the counter is per thread
+#endif
+} CLODHostScalesData;
+
+void*
+runHostScales(void* arg)
+{
+    CLODHostScalesData* data = (CLODHostScalesData*)arg;
+    ElapseTime t;
+    
+    CLODOptimizedRect* opt_rectangles = NULL;
+    if(data->flags & CLOD_PRECOMPUTE_FEATURES)
+        opt_rectangles = (CLODOptimizedRect*)malloc(countCascadeNodes(data->cascade) * MAX_FEATURE_RECT_COUNT * sizeof(CLODOptimizedRect));
+    cl_uint* stage_exits = (cl_uint*)malloc((data->cascade->count + 1) * sizeof(cl_uint));
+    CLOD_COUNT(cl_ulong host_node_start = host_node_count);
+    
+    cl_float current_scale = 1;
+    for(cl_uint scale_index = 0; scale_index < data->scale_count; scale_index++, current_scale *= data->scale_factor) {
+        if(data->scheduler->on_device[scale_index])
+            continue;
+        t.start();
+        runScale(data->integral_image, data->square_integral_image,
+                 data->edge_integral_image, data->edge_density, data->cascade,
+                 &data->image_size, &data->min_window_size, &data->max_window_size, NULL, data->regions,
+                 scale_index, current_scale, data->flags,
+                 opt_rectangles, stage_exits, data->adaptive_window_count, data->coarse_stage_count,
+                 data->statistics, data->matches, &data->match_count);
+        updateScaleTime(&data->scheduler->host_time[scale_index], t.get());
+    }
+    CLOD_COUNT(data->node_count = host_node_count - host_node_start);
+    
+    free(opt_rectangles);
+    free(stage_exits);
+    return NULL;
+}
+
+/* Scales are split between the device (this thread) and a host thread as
+ * decided by scheduleScales, measured times feed the next frames
+ */
+CLODDetectObjectsResult
+clodDetectObjectsHybrid(const IplImage* image,
+                        const CvHaarClassifierCascade* cascade,
+                        CLODEnvironmentData* clod_data,
+                        const CvSize min_window_size,
+                        const CvSize max_window_size,
+                        const cl_uint min_neighbors,
+                        const clod_flags flags,
+                        const CLODScanRegions* regions)
+{
+    float scale_factor = clod_data->scale_factor;
+    CLODDetectObjectsResult result;
+    cl_int error = CL_SUCCESS;
+    CvSize image_size = cvSize(image->width, image->height);
+    ElapseTime t;
+    clodProfileBeginFrame(clod_data->clif->profile);
+    
+    // Setup image
+    CvMat* integral_image, *square_integral_image;
+    cl_bool tilted = clodHasTiltedFeatures(cascade);
+    setupImage(image, tilted, &integral_image, &square_integral_image, CL_FALSE);
+    CvMat* edge_integral_image = setupEdges(image, clod_data->clif, flags, CL_FALSE);
+    
+    // Calculate number of different scales
+    cl_uint scale_count = 0;
+    for(float current_scale = 1;
+        current_scale * cascade->orig_window_size.width < image->width - 10 &&
+        current_scale * cascade->orig_window_size.height < image->height - 10;
+        current_scale *= scale_factor) {
+        scale_count++;
+    }
+    
+    // Decide where each scale runs
+    CLODSchedulerData* scheduler = &(clod_data->scheduler);
+    scheduleScales(scheduler, scale_count);
+    cl_uint device_scale_count = 0;
+    for(cl_uint scale_index = 0; scale_index < scale_count; scale_index++)
+        device_scale_count += scheduler->on_device[scale_index] ? 1 : 0;
+    
+    // Vector to store positive matches, the host thread fills the part after the device scales
+    CLODWeightedRect* matches = (CLODWeightedRect*)malloc(image->width * image->height * scale_count * sizeof(CLODWeightedRect));
+    cl_uint match_count = 0;
+    
+    // Stage statistics, host and device never touch the same scale
+    CLODStageStatistics* statistics = &(clod_data->stage_statistics);
+    beginStageStatistics(statistics, cascade, scale_count, scale_factor);
+    CLOD_COUNT(beginWorkCounters(clod_data));
+    cl_uint adaptive_window_count = (flags & CLOD_ADAPTIVE_STRATEGY) ? clod_data->adaptive_window_count : 0;
+    cl_uint coarse_stage_count = (flags & CLOD_COARSE_TO_FINE) ? clod_data->coarse_stage_count : 0;
+    
+    // Start host scales
+    CLODHostScalesData host_data;
+    host_data.integral_image = integral_image;
+    host_data.square_integral_image = square_integral_image;
+    host_data.edge_integral_image = edge_integral_image;
+    host_data.edge_density = clod_data->edge_density;
+    host_data.regions = regions;
+    host_data.cascade = cascade;
+    host_data.image_size = image_size;
+    host_data.min_window_size = min_window_size;
+    host_data.max_window_size = max_window_size;
+    host_data.scale_count = scale_count;
+    host_data.scale_factor = scale_factor;
+    host_data.flags = flags;
+    host_data.adaptive_window_count = adaptive_window_count;
+    host_data.coarse_stage_count = coarse_stage_count;
+    host_data.statistics = statistics;
+    host_data.scheduler = scheduler;
+    host_data.matches = matches + (image->width * image->height * device_scale_count);
+    host_data.match_count = 0;
+    
+    pthread_t host_thread;
+    cl_bool host_running = CL_FALSE;
+    if(device_scale_count < scale_count) {
+        if(pthread_create(&host_thread, NULL, runHostScales, &host_data) == 0)
+            host_running = CL_TRUE;
+        else
+            runHostScales(&host_data);
+    }
+    
+    // Run device scales
+    if(device_scale_count > 0) {
+        // Write integral image into buffer
+        error = clSetKernelArg(clod_data->environment.kernels[0], 0, sizeof(cl_mem), &(clod_data->detect_objects_data.buffers[0]));
+        clCheckOrExit(error);
+        error = clEnqueueWriteBuffer(clod_data->environment.queue, clod_data->detect_objects_data.buffers[0], CL_TRUE, 0, (tilted ? 2 : 1) * integral_image->width * integral_image->height * sizeof(cl_uint), integral_image->data.ptr, 0, NULL, clodProfileEvent(clod_data->clif->profile, "write"));
+        clCheckOrExit(error);
+        
+        CLODOptimizedRect* opt_rectangles = NULL;
+        if(adaptive_window_count != 0)
+            opt_rectangles = (CLODOptimizedRect*)malloc(countCascadeNodes(cascade) * MAX_FEATURE_RECT_COUNT * sizeof(CLODOptimizedRect));
+        
+        cl_float current_scale = 1;
+        for(cl_uint scale_index = 0; scale_index < scale_count; scale_index++, current_scale *= scale_factor) {
+            if(!scheduler->on_device[scale_index])
+                continue;
+            t.start();
+            runScaleOpenCL(clod_data, integral_image, square_integral_image, edge_integral_image, cascade,
+                           &image_size, &min_window_size, &max_window_size, NULL, regions,
+                           scale_index, current_scale,
+                           opt_rectangles, adaptive_window_count, coarse_stage_count, CL_FALSE,
+                           statistics, matches, &match_count);
+            updateScaleTime(&scheduler->device_time[scale_index], t.get());
+        }
         free(opt_rectangles);
+    }
+    
+    // Merge host matches after the device ones, nodes of this thread are already counted
+    if(host_running) {
+        pthread_join(host_thread, NULL);
+        CLOD_COUNT(clod_data->node_count += host_data.node_count);
+    }
+    memmove(&matches[match_count], host_data.matches, host_data.match_count * sizeof(CLODWeightedRect));
+    match_count += host_data.match_count;
+    
+    // Filter out results
+    if(min_neighbors != 0)
+        match_count = filterResult(matches, match_count, MAX(min_neighbors, 1), EPS);
+    
+    // Release
     cvReleaseMat(&integral_image);
     cvReleaseMat(&square_integral_image);
+    if(edge_integral_image != NULL)
+        cvReleaseMat(&edge_integral_image);
+    
+    clodProfileEndFrame(clod_data->clif->profile);
     
     // Return
     result.matches = matches;
     result.match_count = match_count;
-    printf("\n");
+    CLOD_COUNT(endWorkCounters(clod_data, &result.counters));
     return result;
 }
+
+/* Public function. Calls OpenCL or Block depending on arguments */
+/* Host detection on precomputed integral images */
+CLODDetectObjectsResult
+detectObjectsHost(const CvMat* integral_image,
+                  const CvMat* square_integral_image,
+                  const CvMat* edge_integral_image,
+                  const CvHaarClassifierCascade* cascade,
+                  CLODEnvironmentData* clod_data,
+                  const CvSize min_window_size,
+                  const CvSize max_window_size,
+                  const cl_uint min_neighbors,
+                  const clod_flags flags,
+                  const CLODScanRegions* regions)
+{
+    float scale_factor = clod_data->scale_factor;
+    CLODDetectObjectsResult result;
+    CvSize image_size = cvSize(integral_image->width - 1, integral_image->height - 1);
+    
+    // Calculate number of different scales
+    cl_uint scale_count = 0;
+    for(float current_scale = 1;
+        current_scale * cascade->orig_window_size.width < image_size.width - 10 &&
+        current_scale * cascade->orig_window_size.height < image_size.height - 10;
+        current_scale *= scale_factor) {
+        scale_count++;
+    }
+    
+    // Precompute feature rect offset in integral image and square integral image into a new cascade
+    CLODOptimizedRect* opt_rectangles = NULL;
+    if(flags & CLOD_PRECOMPUTE_FEATURES)
+        opt_rectangles = (CLODOptimizedRect*)malloc(countCascadeNodes(cascade) * MAX_FEATURE_RECT_COUNT * sizeof(CLODOptimizedRect));
+    
+    // Vector to store positive matches
+    CLODWeightedRect* matches = (CLODWeightedRect*)malloc(image_size.width * image_size.height * scale_count * sizeof(CLODWeightedRect));
+    cl_uint match_count = 0;
+    
+    // Stage statistics
+    CLODStageStatistics* statistics = &(clod_data->stage_statistics);
+    beginStageStatistics(statistics, cascade, scale_count, scale_factor);
+    CLOD_COUNT(beginWorkCounters(clod_data));
+    cl_uint adaptive_window_count = (flags & CLOD_ADAPTIVE_STRATEGY) ? clod_data->adaptive_window_count : 0;
+    cl_uint coarse_stage_count = (flags & CLOD_COARSE_TO_FINE) ? clod_data->coarse_stage_count : 0;
+    cl_uint* stage_exits = (cl_uint*)malloc((cascade->count + 1) * sizeof(cl_uint));
+    
+    // Iterate over scales
+    if(flags & CLOD_FIND_BIGGEST_OBJECT) {
+        match_count = runBiggestObjectScales(clod_data, integral_image, square_integral_image, edge_integral_image, cascade,
+                                             &image_size, &min_window_size, &max_window_size, regions,
+                                             scale_count, scale_factor, min_neighbors, flags,
+                                             opt_rectangles, stage_exits, adaptive_window_count, CL_FALSE,
+                                             matches);
+    }
+    else {
+        cl_float current_scale = 1;
+        for(cl_uint scale_index = 0; scale_index < scale_count; scale_index++, current_scale *= scale_factor) {
+            runScale(integral_image, square_integral_image,
+                     edge_integral_image, clod_data->edge_density, cascade,
+                     &image_size, &min_window_size, &max_window_size, NULL, regions,
+                     scale_index, current_scale, flags,
+                     opt_rectangles, stage_exits, adaptive_window_count, coarse_stage_count,
+                     statistics, matches, &match_count);
+        }
+    }
+    
+    // Filter out results, the biggest object is already grouped
+    if(min_neighbors != 0 && !(flags & CLOD_FIND_BIGGEST_OBJECT))
+        match_count = filterResult(matches, match_count, MAX(min_neighbors, 1), EPS);
+    
+    // Release
+    if(flags & CLOD_PRECOMPUTE_FEATURES)
+        free(opt_rectangles);
+    free(stage_exits);
+    
+    // Return
+    result.matches = matches;
+    result.match_count = match_count;
+    CLOD_COUNT(endWorkCounters(clod_data, &result.counters));
+    return result;
+}
+
+CLODDetectObjectsResult
+clodDetectObjectsInRegions(const IplImage* image,
+                           const CvHaarClassifierCascade* cascade,
+                           CLODEnvironmentData* clod_data,
+                           const CvSize min_window_size,
+                           const CvSize max_window_size,
+                           const cl_uint min_neighbors,
+                           const clod_flags flags,
+                           const CLODScanRegions* regions,
+                           const cl_bool use_cl)
+{
+    if(use_cl && (flags & CLOD_HYBRID_SCHEDULING) && !(flags & CLOD_FIND_BIGGEST_OBJECT))
+        return clodDetectObjectsHybrid(image, cascade, clod_data, min_window_size, max_window_size, min_neighbors, flags, regions);
+    
+    if(use_cl)
+        return clodDetectObjectsOpenCL(image, cascade, clod_data, min_window_size, max_window_size, min_neighbors, flags, regions);
+    
+    if((flags & CLOD_BLOCK_IMPLEMENTATION) && !(flags & CLOD_FIND_BIGGEST_OBJECT) && regions == NULL)
+        return clodDetectObjectsBlock(image, cascade, clod_data, min_window_size, max_window_size, min_neighbors, flags);
+    
+    // Setup image
+    CvMat* integral_image, *square_integral_image;
+    setupImage(image, clodHasTiltedFeatures(cascade), &integral_image, &square_integral_image, CL_FALSE);
+    CvMat* edge_integral_image = setupEdges(image, clod_data->clif, flags, CL_FALSE);
+    
+    CLODDetectObjectsResult result = detectObjectsHost(integral_image, square_integral_image, edge_integral_image,
+                                                       cascade, clod_data, min_window_size, max_window_size,
+                                                       min_neighbors, flags, regions);
+    
+    // Release
+    cvReleaseMat(&integral_image);
+    cvReleaseMat(&square_integral_image);
+    if(edge_integral_image != NULL)
+        cvReleaseMat(&edge_integral_image);
+    
+    // Return
+    return result;
+}
+
+/* Area of a parent match searched by a nested cascade, clamped to the image */
+CvRect
+nestedRegion(const CvRect* parent,
+             const cl_float* area,
+             const CvSize* image_size)
+{
+    CvRect roi;
+    roi.x = MAX(parent->x + (cl_int)lrint(parent->width * area[0]), 0);
+    roi.y = MAX(parent->y + (cl_int)lrint(parent->height * area[1]), 0);
+    roi.width = MIN(parent->x + (cl_int)lrint(parent->width * (area[0] + area[2])), image_size->width) - roi.x;
+    roi.height = MIN(parent->y + (cl_int)lrint(parent->height * (area[1] + area[3])), image_size->height) - roi.y;
+    return roi;
+}
+
+/* True if a later entry is merged into target */
+cl_bool
+isMergeTarget(const CLODCascadeEntry* entries,
+              const cl_uint entry_count,
+              const cl_int target)
+{
+    for(cl_uint i = target + 1; i < entry_count; i++)
+        if(entries[i].merge == target)
+            return CL_TRUE;
+    return CL_FALSE;
+}
+
+/* True if no entry after index is merged into target */
+cl_bool
+isMergeComplete(const CLODCascadeEntry* entries,
+                const cl_uint entry_count,
+                const cl_int target,
+                const cl_uint index)
+{
+    for(cl_uint i = index + 1; i < entry_count; i++)
+        if(entries[i].merge == target)
+            return CL_FALSE;
+    return CL_TRUE;
+}
+
+/* Entries merged into target, target first, if they can run fused on the
+ * device: at most MAX_FUSED_CASCADE_COUNT, none of them nested. Returns their
+ * count, 0 if they run one after the other
+ */
+cl_uint
+findFusedEntries(const CLODCascadeEntry* entries,
+                 const cl_uint entry_count,
+                 const cl_uint target,
+                 const clod_flags flags,
+                 const CLODCascadeEntry** members)
+{
+    if(entries[target].merge >= 0 || entries[target].parent >= 0 || (flags & CLOD_FIND_BIGGEST_OBJECT))
+        return 0;
+    cl_uint member_count = 0;
+    members[member_count++] = &entries[target];
+    for(cl_uint i = target + 1; i < entry_count; i++) {
+        if(entries[i].merge != (cl_int)target)
+            continue;
+        if(entries[i].parent >= 0 || member_count == MAX_FUSED_CASCADE_COUNT)
+            return 0;
+        members[member_count++] = &entries[i];
+    }
+    return member_count > 1 ? member_count : 0;
+}
+
+/* Creates the fused buffers for cascade_count cascades on images of
+ * image_size, unless the current ones are big enough
+ */
+void
+reserveFusedBuffers(CLODEnvironmentData* clod_data,
+                    const CvSize* image_size,
+                    const cl_uint cascade_count)
+{
+    CLODFusedData* fused_data = &(clod_data->fused_data);
+    if(fused_data->capacity >= cascade_count &&
+       fused_data->image_size.width == image_size->width &&
+       fused_data->image_size.height == image_size->height)
+        return;
+    for(cl_uint i = 0; i < 5 && fused_data->capacity != 0; i++)
+        clReleaseMemObject(fused_data->buffers[i]);
+    
+    // A scale has at most (width / 2) * (height / 2) windows per cascade
+    cl_int error = CL_SUCCESS;
+    size_t window_count = (size_t)cascade_count * (image_size->width / 2) * (image_size->height / 2);
+    size_t sizes[5] = {
+        cascade_count * sizeof(KernelStage),
+        window_count * sizeof(CLODSubwindowData),
+        window_count * sizeof(CLODSubwindowData),
+        window_count * sizeof(cl_uint),
+        window_count * sizeof(cl_uint)
+    };
+    cl_mem_flags mem_flags[5] = {
+        CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY,
+        CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_WRITE,
+        CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_WRITE,
+        CL_MEM_READ_WRITE,
+        CL_MEM_READ_WRITE
+    };
+    for(cl_uint i = 0; i < 5; i++) {
+        fused_data->buffers[i] = clCreateBuffer(clod_data->environment.context, mem_flags[i], sizes[i], NULL, &error);
+        clCheckOrExit(error);
+    }
+    fused_data->capacity = cascade_count;
+    fused_data->image_size = *image_size;
+}
+
+/* Matches (not grouped) of member_count merged entries, found together on the
+ * device: at each scale the windows of every cascade are written once and
+ * each stage is a single runStage launch over all of them, running the stage
+ * of the window's cascade (see runKernelCascade). Buffers are the fused ones
+ * (see reserveFusedBuffers), the window of fused_cascades[w] is fused_windows[w]. Cascades shorter than the
+ * longest one let their survivors through the extra stages
+ */
+CLODDetectObjectsResult
+detectFusedObjectsOpenCL(const CvMat* integral_image,
+                         const CvMat* square_integral_image,
+                         const CvMat* edge_integral_image,
+                         cl_mem integral_buffer,
+                         const CLODCascadeEntry** members,
+                         const cl_uint member_count,
+                         CLODEnvironmentData* clod_data,
+                         const clod_flags flags)
+{
+    float scale_factor = clod_data->scale_factor;
+    cl_int error = CL_SUCCESS;
+    CvSize image_size = cvSize(integral_image->width - 1, integral_image->height - 1);
+    
+    // Integral image to use
+    error = clSetKernelArg(clod_data->environment.kernels[0], 0, sizeof(cl_mem), &integral_buffer);
+    clCheckOrExit(error);
+    
+    // Calculate number of different scales of each cascade, stages of the longest one
+    cl_uint scale_count = 0;
+    cl_uint member_scale_count[MAX_FUSED_CASCADE_COUNT];
+    const CvHaarClassifierCascade* longest_cascade = members[0]->cascade;
+    for(cl_uint c = 0; c < member_count; c++) {
+        const CvHaarClassifierCascade* cascade = members[c]->cascade;
+        member_scale_count[c] = 0;
+        for(float current_scale = 1;
+            current_scale * cascade->orig_window_size.width < image_size.width - 10 &&
+            current_scale * cascade->orig_window_size.height < image_size.height - 10;
+            current_scale *= scale_factor) {
+            member_scale_count[c]++;
+        }
+        scale_count = MAX(scale_count, member_scale_count[c]);
+        if(cascade->count > longest_cascade->count)
+            longest_cascade = cascade;
+    }
+    
+    // Stage statistics count the windows of all the cascades
+    CLODStageStatistics* statistics = &(clod_data->stage_statistics);
+    beginStageStatistics(statistics, longest_cascade, scale_count, scale_factor);
+    CLOD_COUNT(beginWorkCounters(clod_data));
+    cl_uint coarse_stage_count = (flags & CLOD_COARSE_TO_FINE) ? clod_data->coarse_stage_count : 0;
+    
+    CLODDetectObjectsResult result;
+    result.matches = (CLODWeightedRect*)malloc(sizeof(CLODWeightedRect));
+    result.match_count = 0;
+    reserveFusedBuffers(clod_data, &image_size, member_count);
+    CLODFusedData* fused_data = &(clod_data->fused_data);
+    size_t max_window_count = (size_t)member_count * (image_size.width / 2) * (image_size.height / 2);
+    CLODSubwindowData* fused_windows = (CLODSubwindowData*)malloc(max_window_count * sizeof(CLODSubwindowData));
+    cl_uint* fused_cascades = (cl_uint*)malloc(max_window_count * sizeof(cl_uint));
+    
+    // Iterate over scales
+    cl_float current_scale = 1;
+    for(cl_uint scale_index = 0; scale_index < scale_count; scale_index++, current_scale *= scale_factor) {
+        clodProfileTag(clod_data->clif->profile, scale_index, -1);
+        
+        // Concatenate the windows of every cascade, a cascade without windows only lets nothing through
+        CvSize scaled_window_size[MAX_FUSED_CASCADE_COUNT];
+        KernelCascade kernel_cascade[MAX_FUSED_CASCADE_COUNT];
+        cl_uint window_count = 0;
+        cl_uint skipped_count = 0;
+        for(cl_uint c = 0; c < member_count; c++) {
+            const CLODCascadeEntry* member = members[c];
+            cl_uint scaled_window_area;
+            CvRect equ_rect;
+            CvPoint start_point = cvPoint(0, 0);
+            CvPoint end_point;
+            cl_float step;
+            kernel_cascade[c].stage = NULL;
+            kernel_cascade[c].count = 0;
+            if(scale_index >= member_scale_count[c] ||
+               setupScale(current_scale,
+                          &image_size,
+                          &member->cascade->orig_window_size,
+                          &member->min_window_size,
+                          &member->max_window_size,
+                          &equ_rect,
+                          &scaled_window_size[c],
+                          &scaled_window_area,
+                          &end_point, &step) != CL_SUCCESS) {
+                continue;
+            }
+            
+            CLODSubwindowData* windows = NULL;
+            cl_uint cascade_window_count = 0;
+            cl_uint cascade_skipped_count = 0;
+            buildScaleWindows(step, integral_image, square_integral_image,
+                              member->cascade, NULL,
+                              &equ_rect,
+                              &start_point,
+                              &end_point,
+                              &scaled_window_size[c],
+                              scaled_window_area, current_scale,
+                              NULL, edge_integral_image, clod_data->edge_density, coarse_stage_count,
+                              &windows, &cascade_window_count, &cascade_skipped_count);
+            for(cl_uint w = 0; w < cascade_window_count; w++) {
+                fused_windows[window_count] = windows[w];
+                fused_cascades[window_count] = c;
+                window_count++;
+            }
+            skipped_count += cascade_skipped_count;
+            free(windows);
+            
+            // Precompute feature rect offset in integral image and square integral image into a new cascade
+            if(cascade_window_count != 0)
+                kernel_cascade[c] = precomputeKernelCascade(member->cascade, current_scale, scaled_window_area, integral_image->width, integral_image->rows * integral_image->cols);
+        }
+        recordWindowCount(statistics, scale_index, window_count);
+        recordSkippedCount(statistics, scale_index, skipped_count);
+        if(window_count == 0)
+            continue;
+        for(cl_uint c = 0; c < member_count; c++)
+            padKernelCascade(&kernel_cascade[c], longest_cascade->count);
+        
+        // Write input windows and their cascades
+        error = clEnqueueWriteBuffer(clod_data->environment.queue, fused_data->buffers[1], CL_FALSE, 0, window_count * sizeof(CLODSubwindowData), fused_windows, 0, NULL, clodProfileEvent(clod_data->clif->profile, "write"));
+        clCheckOrExit(error);
+        error = clEnqueueWriteBuffer(clod_data->environment.queue, fused_data->buffers[3], CL_TRUE, 0, window_count * sizeof(cl_uint), fused_cascades, 0, NULL, clodProfileEvent(clod_data->clif->profile, "write"));
+        clCheckOrExit(error);
+        
+        // One launch per stage for all the cascades, rect weights are already normalized by each window area
+        cl_uint dst_buffer_index = 0;
+        cl_uint output_window_count = 0;
+        runKernelCascade(clod_data, kernel_cascade, member_count, fused_data->buffers[0],
+                         &(fused_data->buffers[1]), &(fused_data->buffers[3]),
+                         window_count, 0, current_scale,
+                         0, statistics, scale_index,
+                         &dst_buffer_index, &output_window_count);
+        for(cl_uint c = 0; c < member_count; c++)
+            free(kernel_cascade[c].stage);
+        if(output_window_count == 0)
+            continue;
+        
+        // Survivors get the window size of their cascade
+        error = clEnqueueReadBuffer(clod_data->environment.queue, fused_data->buffers[3 + dst_buffer_index], CL_FALSE, 0, output_window_count * sizeof(cl_uint), fused_cascades, 0, NULL, clodProfileEvent(clod_data->clif->profile, "read"));
+        clCheckOrExit(error);
+        cl_mem output_buffer = fused_data->buffers[1 + dst_buffer_index];
+        CLODSubwindowData* output_windows = (CLODSubwindowData*)clEnqueueMapBuffer(clod_data->environment.queue, output_buffer, CL_TRUE, CL_MAP_READ, 0, output_window_count * sizeof(CLODSubwindowData), 0, NULL, clodProfileEvent(clod_data->clif->profile, "map"), &error);
+        clCheckOrExit(error);
+        result.matches = (CLODWeightedRect*)realloc(result.matches, (result.match_count + output_window_count) * sizeof(CLODWeightedRect));
+        for(cl_uint w = 0; w < output_window_count; w++) {
+            CLODWeightedRect* match = &result.matches[result.match_count];
+            match->rect.x = output_windows[w].x;
+            match->rect.y = output_windows[w].y;
+            match->rect.width = scaled_window_size[fused_cascades[w]].width;
+            match->rect.height = scaled_window_size[fused_cascades[w]].height;
+            result.match_count++;
+        }
+        error = clEnqueueUnmapMemObject(clod_data->environment.queue, output_buffer, output_windows, 0, NULL, clodProfileEvent(clod_data->clif->profile, "unmap"));
+        clCheckOrExit(error);
+    }
+    clodProfileTag(clod_data->clif->profile, -1, -1);
+    
+    // Release
+    free(fused_windows);
+    free(fused_cascades);
+    CLOD_COUNT(endWorkCounters(clod_data, &result.counters));
+    return result;
+}
+
+/* Prints why entries[index] can not run and returns CL_FALSE */
+cl_bool
+isCascadeEntryValid(const CLODCascadeEntry* entries,
+                    const cl_uint index)
+{
+    const CLODCascadeEntry* entry = &entries[index];
+    if(entry->cascade == NULL || !clodIsCascadeSupported(entry->cascade)) {
+        fprintf(stderr, "clodDetectObjectsMulti: cascade of entry %d is %s\n",
+                index, entry->cascade == NULL ? "missing" : "not supported (see clodIsCascadeSupported)");
+        return CL_FALSE;
+    }
+    if(entry->parent < -1 || entry->parent >= (cl_int)index) {
+        fprintf(stderr, "clodDetectObjectsMulti: parent %d of entry %d is not an earlier entry\n", entry->parent, index);
+        return CL_FALSE;
+    }
+    if(entry->parent >= 0 && entries[entry->parent].merge >= 0) {
+        fprintf(stderr, "clodDetectObjectsMulti: parent %d of entry %d is merged, nest into entry %d\n",
+                entry->parent, index, entries[entry->parent].merge);
+        return CL_FALSE;
+    }
+    if(entry->merge < -1 || entry->merge >= (cl_int)index) {
+        fprintf(stderr, "clodDetectObjectsMulti: merge %d of entry %d is not an earlier entry\n", entry->merge, index);
+        return CL_FALSE;
+    }
+    if(entry->merge >= 0 && entries[entry->merge].merge >= 0) {
+        fprintf(stderr, "clodDetectObjectsMulti: merge %d of entry %d is itself merged, merge into entry %d\n",
+                entry->merge, index, entries[entry->merge].merge);
+        return CL_FALSE;
+    }
+    return CL_TRUE;
+}
+
+cl_int
+clodDetectObjectsMulti(const IplImage* image,
+                       const CLODCascadeEntry* entries,
+                       const cl_uint entry_count,
+                       CLODEnvironmentData* clod_data,
+                       const clod_flags flags,
+                       const cl_bool use_cl,
+                       CLODDetectObjectsResult* results)
+{
+    CvSize image_size = cvSize(image->width, image->height);
+    
+    // Nothing runs unless every entry can, results stay empty
+    for(cl_uint i = 0; i < entry_count; i++) {
+        results[i].matches = NULL;
+        results[i].match_count = 0;
+    }
+    for(cl_uint i = 0; i < entry_count; i++)
+        if(!isCascadeEntryValid(entries, i))
+            return CL_INVALID_VALUE;
+    clodProfileBeginFrame(clod_data->clif->profile);
+    
+    // Setup image, shared by all the cascades (on the device set up once, the queue is in order)
+    cl_bool tilted = CL_FALSE;
+    for(cl_uint i = 0; i < entry_count; i++)
+        tilted = tilted || clodHasTiltedFeatures(entries[i].cascade);
+    CvMat* integral_image, *square_integral_image;
+    cl_mem integral_buffer = NULL;
+    if(use_cl)
+        integral_buffer = setupDeviceImage(image, tilted, clod_data, &integral_image, &square_integral_image);
+    else
+        setupImage(image, tilted, &integral_image, &square_integral_image, CL_FALSE);
+    CvMat* edge_integral_image = setupEdges(image, clod_data->clif, flags, use_cl);
+    
+    // Entries already run fused with their merge target
+    cl_bool* fused = (cl_bool*)calloc(entry_count, sizeof(cl_bool));
+    
+    for(cl_uint i = 0; i < entry_count; i++) {
+        const CLODCascadeEntry* entry = &entries[i];
+        if(fused[i])
+            continue;
+        
+        // A merge target and its members on the device, grouped right away
+        const CLODCascadeEntry* members[MAX_FUSED_CASCADE_COUNT];
+        cl_uint member_count = use_cl ? findFusedEntries(entries, entry_count, i, flags, members) : 0;
+        if(member_count != 0) {
+            results[i] = detectFusedObjectsOpenCL(integral_image, square_integral_image, edge_integral_image,
+                                                  integral_buffer, members, member_count, clod_data, flags);
+            for(cl_uint m = 1; m < member_count; m++)
+                fused[members[m] - entries] = CL_TRUE;
+            if(entry->min_neighbors != 0)
+                results[i].match_count = filterResult(results[i].matches, results[i].match_count, entry->min_neighbors, EPS);
+            continue;
+        }
+        
+        CLODScanRegions regions;
+        regions.rois = NULL;
+        regions.roi_count = 0;
+        regions.mask = NULL;
+        regions.motion = NULL;
+        
+        // The areas of all the parent matches are searched together
+        CvRect* rois = NULL;
+        if(entry->parent >= 0) {
+            const CLODDetectObjectsResult* parent = &results[entry->parent];
+            rois = (CvRect*)malloc(MAX(parent->match_count, 1) * sizeof(CvRect));
+            for(cl_uint j = 0; j < parent->match_count; j++) {
+                CvRect roi = nestedRegion(&parent->matches[j].rect, entry->area, &image_size);
+                if(roi.width > 0 && roi.height > 0)
+                    rois[regions.roi_count++] = roi;
+            }
+            regions.rois = rois;
+        }
+        
+        // Members of a merge are grouped once all of them ran
+        cl_int target = entry->merge >= 0 ? entry->merge : (cl_int)i;
+        cl_bool merged = isMergeTarget(entries, entry_count, target);
+        cl_uint min_neighbors = merged ? 0 : entry->min_neighbors;
+        
+        // A nested entry without roi has nothing to search, no roi would mean the whole image
+        CLODDetectObjectsResult result;
+        if(entry->parent >= 0 && regions.roi_count == 0) {
+            result.matches = (CLODWeightedRect*)malloc(sizeof(CLODWeightedRect));
+            result.match_count = 0;
+            CLOD_COUNT(memset(&result.counters, 0, sizeof(CLODWorkCounters)));
+        }
+        else if(use_cl)
+            result = clodDetectObjectsIntegral(integral_image, square_integral_image, edge_integral_image,
+                                               integral_buffer, NULL,
+                                               entry->cascade, clod_data,
+                                               entry->min_window_size, entry->max_window_size,
+                                               min_neighbors, flags,
+                                               entry->parent >= 0 ? &regions : NULL);
+        else
+            result = detectObjectsHost(integral_image, square_integral_image, edge_integral_image,
+                                       entry->cascade, clod_data,
+                                       entry->min_window_size, entry->max_window_size,
+                                       min_neighbors, flags,
+                                       entry->parent >= 0 ? &regions : NULL);
+        
+        if(target == (cl_int)i)
+            results[i] = result;
+        else {
+            CLODDetectObjectsResult* merge = &results[target];
+            merge->matches = (CLODWeightedRect*)realloc(merge->matches, MAX(merge->match_count + result.match_count, 1) * sizeof(CLODWeightedRect));
+            memcpy(merge->matches + merge->match_count, result.matches, result.match_count * sizeof(CLODWeightedRect));
+            merge->match_count += result.match_count;
+            results[i].matches = result.matches;
+            results[i].match_count = 0;
+        }
+        
+        // Last member of a merge
+        if(merged && isMergeComplete(entries, entry_count, target, i) && entries[target].min_neighbors != 0)
+            results[target].match_count = filterResult(results[target].matches, results[target].match_count, entries[target].min_neighbors, EPS);
+        
+        // Release
+        free(rois);
+    }
+    
+    // Release
+    free(fused);
+    if(use_cl)
+        releaseDeviceImage(clod_data, integral_buffer, &integral_image, &square_integral_image);
+    else {
+        cvReleaseMat(&integral_image);
+        cvReleaseMat(&square_integral_image);
+    }
+    if(edge_integral_image != NULL)
+        cvReleaseMat(&edge_integral_image);
+    clodProfileEndFrame(clod_data->clif->profile);
+    return CL_SUCCESS;
+}
+
+CLODDetectObjectsResult
+clodDetectObjects(const IplImage* image,
+                  const CvHaarClassifierCascade* cascade,
+                  CLODEnvironmentData* clod_data,
+                  const CvSize min_window_size,
+                  const CvSize max_window_size,
+                  const cl_uint min_neighbors,
+                  const clod_flags flags,
+                  const cl_bool use_cl)
+{
+    return clodDetectObjectsInRegions(image, cascade, clod_data,
+                                      min_window_size, max_window_size,
+                                      min_neighbors, flags, NULL, use_cl);
+}
+
+/*** Tuning ***/
+// Candidates, tried in the same runs for every kernel (the kernels do not depend on each other)
+#define TUNING_CANDIDATE_COUNT 8
+#define TUNING_RUN_COUNT 3
+static const size_t tuning_local_sizes[TUNING_CANDIDATE_COUNT] = { 0, 1, 8, 16, 32, 64, 128, 256 };
+static const size_t tuning_local_sizes_2d[TUNING_CANDIDATE_COUNT][2] = { { 0, 0 }, { 16, 1 }, { 32, 1 }, { 64, 1 }, { 128, 1 }, { 256, 1 }, { 8, 8 }, { 16, 16 } };
+static const char* tuning_variants[] = { "", "-cl-mad-enable", "-cl-fast-relaxed-math" };
+#define TUNING_VARIANT_COUNT (sizeof(tuning_variants) / sizeof(const char*))
+
+// Gray, integral rows, integral columns, edges, stage
+#define TUNING_KERNEL_COUNT 5
+static const char* tuning_kernel_functions[TUNING_KERNEL_COUNT] = { "bgrToGrayscale", "integralImageSumRows", "integralImageSumCols",
+                                                                    "sobelEdges", "runStage" };
+
+/* Device time of each tuned kernel over TUNING_RUN_COUNT frames (after a
+ * warm up one). Returns the stage survivors of the last frame per scale and
+ * stage (survivor_count_size of them), free it
+ */
+static cl_uint*
+measureTuning(CLODEnvironmentData* data,
+              const IplImage* frame,
+              const CvHaarClassifierCascade* cascade,
+              cl_double* times,
+              cl_uint* survivor_count_size)
+{
+    CvSize max_window_size = cvSize(frame->width, frame->height);
+    for(cl_uint run = 0; run <= TUNING_RUN_COUNT; run++) {
+        if(run == 1)
+            clodProfileBeginFrame(data->clif->profile);
+        CLODDetectObjectsResult result = clodDetectObjects(frame, cascade, data, cascade->orig_window_size, max_window_size, 0, 0, CL_TRUE);
+        free(result.matches);
+        CLIFEdgeIntegralResult edges = clifEdgeIntegral(frame, data->clif, CL_TRUE);
+        cvReleaseMat(&edges.image);
+    }
+    clodProfileEndFrame(data->clif->profile);
+    
+    for(cl_uint k = 0; k < TUNING_KERNEL_COUNT; k++)
+        times[k] = clodProfileTime(&(data->profile), tuning_kernel_functions[k]);
+    const CLODStageStatistics* statistics = &(data->stage_statistics);
+    *survivor_count_size = statistics->scale_count * statistics->stage_count;
+    cl_uint* survivor_counts = (cl_uint*)malloc(MAX(*survivor_count_size, 1) * sizeof(cl_uint));
+    memcpy(survivor_counts, statistics->last_survivor_count, *survivor_count_size * sizeof(cl_uint));
+    return survivor_counts;
+}
+
+void
+clodTuneEnvironment(CLODEnvironmentData* data,
+                    const CvHaarClassifierCascade* cascade,
+                    const CvSize frame_size,
+                    const cl_bool force)
+{
+    CLODTuning* tuning = &(data->clif->tuning);
+    if(tuning->loaded && !force)
+        return;
+    cl_device_id device;
+    cl_int error = clGetCommandQueueInfo(data->environment.queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, NULL);
+    clCheckOrExit(error);
+    
+    // Synthetic frame, smoothed noise gets some windows past the first stages
+    IplImage* frame = cvCreateImage(frame_size, IPL_DEPTH_8U, 3);
+    CvRNG rng = cvRNG(0x5eed);
+    cvRandArr(&rng, frame, CV_RAND_UNI, cvScalarAll(0), cvScalarAll(256));
+    cvSmooth(frame, frame, CV_GAUSSIAN, 5, 5);
+    
+    // Kernel times come from the profile
+    cl_bool profiling = data->profile.enabled;
+    clodEnableProfiling(data, CL_TRUE);
+    cl_double times[TUNING_KERNEL_COUNT];
+    cl_uint survivor_count_size = 0;
+    
+    // Variants with the current local sizes. The first one is the reference, a
+    // variant changing the survivors of any stage and scale (relaxed math) is
+    // not taken
+    cl_uint* reference_survivor_counts = NULL;
+    cl_uint reference_survivor_count_size = 0;
+    cl_double best_variant_time = -1;
+    cl_uint best_variant = 0;
+    for(cl_uint v = 0; v < TUNING_VARIANT_COUNT; v++) {
+        snprintf(tuning->variant, sizeof(tuning->variant), "%s", tuning_variants[v]);
+        clodFreeDeviceEnvironment(&(data->environment), CLOD_KERNEL_COUNT);
+        createKernels(data);
+        clifInitBuffers(data->clif, frame->width, frame->height, frame->widthStep, 3);
+        clodInitBuffers(data, &frame_size);
+        cl_uint* survivor_counts = measureTuning(data, frame, cascade, times, &survivor_count_size);
+        clodReleaseBuffers(data);
+        if(v == 0) {
+            reference_survivor_counts = survivor_counts;
+            reference_survivor_count_size = survivor_count_size;
+        }
+        cl_bool same_survivors = survivor_count_size == reference_survivor_count_size &&
+                                 memcmp(survivor_counts, reference_survivor_counts, survivor_count_size * sizeof(cl_uint)) == 0;
+        if(same_survivors && (best_variant_time < 0 || times[TUNING_KERNEL_COUNT - 1] < best_variant_time)) {
+            best_variant_time = times[TUNING_KERNEL_COUNT - 1];
+            best_variant = v;
+        }
+        if(v != 0)
+            free(survivor_counts);
+    }
+    snprintf(tuning->variant, sizeof(tuning->variant), "%s", tuning_variants[best_variant]);
+    clodFreeDeviceEnvironment(&(data->environment), CLOD_KERNEL_COUNT);
+    createKernels(data);
+    clifInitBuffers(data->clif, frame->width, frame->height, frame->widthStep, 3);
+    clodInitBuffers(data, &frame_size);
+    
+    // Local sizes. A candidate that does not fit a kernel leaves it at its best
+    // so far, one changing the survivors is not taken at all
+    CLODTuning best = *tuning;
+    cl_double best_times[TUNING_KERNEL_COUNT];
+    for(cl_uint k = 0; k < TUNING_KERNEL_COUNT; k++)
+        best_times[k] = -1;
+    CLIFEnvironmentData* clif = data->clif;
+    size_t stage_global_size = 256;
+    for(cl_uint i = 0; i < TUNING_CANDIDATE_COUNT; i++) {
+        cl_bool fits[TUNING_KERNEL_COUNT] = {
+            clodFitsLocalSize(clif->environment.kernels[0], device, 2, clif->bgr_to_gray_data.global_size, tuning_local_sizes_2d[i]),
+            clodFitsLocalSize(clif->environment.kernels[1], device, 1, &(clif->integral_image_data.global_size[0]), &tuning_local_sizes[i]),
+            clodFitsLocalSize(clif->environment.kernels[2], device, 1, &(clif->integral_image_data.global_size[1]), &tuning_local_sizes[i]),
+            clodFitsLocalSize(clif->environment.kernels[3], device, 2, clif->edge_data.global_size, tuning_local_sizes_2d[i]),
+            clodFitsLocalSize(data->environment.kernels[0], device, 1, &stage_global_size, &tuning_local_sizes[i])
+        };
+        *tuning = best;
+        if(fits[0])
+            memcpy(tuning->gray_local_size, tuning_local_sizes_2d[i], sizeof(tuning->gray_local_size));
+        if(fits[1])
+            tuning->integral_local_size[0] = tuning_local_sizes[i];
+        if(fits[2])
+            tuning->integral_local_size[1] = tuning_local_sizes[i];
+        if(fits[3])
+            memcpy(tuning->edge_local_size, tuning_local_sizes_2d[i], sizeof(tuning->edge_local_size));
+        if(fits[4])
+            tuning->stage_local_size = tuning_local_sizes[i];
+        clifApplyTuning(clif);
+        cl_uint* survivor_counts = measureTuning(data, frame, cascade, times, &survivor_count_size);
+        cl_bool same_survivors = survivor_count_size == reference_survivor_count_size &&
+                                 memcmp(survivor_counts, reference_survivor_counts, survivor_count_size * sizeof(cl_uint)) == 0;
+        free(survivor_counts);
+        if(!same_survivors)
+            continue;
+        
+        for(cl_uint k = 0; k < TUNING_KERNEL_COUNT; k++) {
+            // No time, the kernel did not run (or the queue gives no times)
+            if(!fits[k] || times[k] <= 0 || (best_times[k] >= 0 && times[k] >= best_times[k]))
+                continue;
+            best_times[k] = times[k];
+            if(k == 0)
+                memcpy(best.gray_local_size, tuning->gray_local_size, sizeof(best.gray_local_size));
+            else if(k == 1 || k == 2)
+                best.integral_local_size[k - 1] = tuning->integral_local_size[k - 1];
+            else if(k == 3)
+                memcpy(best.edge_local_size, tuning->edge_local_size, sizeof(best.edge_local_size));
+            else
+                best.stage_local_size = tuning->stage_local_size;
+        }
+    }
+    *tuning = best;
+    tuning->loaded = CL_TRUE;
+    clodSaveTuning(device, tuning);
+    
+    // Release
+    free(reference_survivor_counts);
+    clodReleaseBuffers(data);
+    clodEnableProfiling(data, profiling);
+    cvReleaseImage(&frame);
+}
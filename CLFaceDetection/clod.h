@@ -6,17 +6,56 @@
 //  Copyright (c) 2012 Gabriele Cocco. All rights reserved.
 //
 
+#ifndef OpenCLFaceDetection_object_detection_h
+#define OpenCLFaceDetection_object_detection_h
+
 #include <opencv2/imgproc/imgproc.hpp>
-#include <opencv2/highgui/highgui.hpp>
 #include <opencv/cvaux.hpp>
 #include <sys/time.h>
 #include <limits.h>
-#include <params.h>
 #include "clif.h"
 
 #define CLOD_PRECOMPUTE_FEATURES  (2 << 0)
 #define CLOD_BLOCK_IMPLEMENTATION (2 << 1)
 #define CLOD_PER_STAGE_ITERATIONS (2 << 2)
+#define CLOD_ADAPTIVE_STRATEGY    (2 << 3)
+#define CLOD_HYBRID_SCHEDULING    (2 << 4)
+#define CLOD_DEVICE_GROUPING      (2 << 5)
+#define CLOD_EDGE_PRUNING         (2 << 6)
+#define CLOD_FIND_BIGGEST_OBJECT  (2 << 7)
+#define CLOD_ROUGH_SEARCH         (2 << 8)
+#define CLOD_ADAPTIVE_STEP        (2 << 9)
+#define CLOD_COARSE_TO_FINE       (2 << 10)
+
+// Ratio between the window sizes of consecutive scales. Scheduler times are
+// per scale, clodResetScheduler after changing it
+#define CLOD_DEFAULT_SCALE_FACTOR 1.1f
+
+// Below this many surviving windows the adaptive strategy stops launching a
+// kernel (or compacting a list) per stage and finishes each window on the host
+#define CLOD_DEFAULT_ADAPTIVE_WINDOW_COUNT 64
+
+// With CLOD_EDGE_PRUNING windows whose fraction of edge pixels (see
+// clifEdgeIntegral) is below this are dropped before stage 0. The OpenCL path
+// computes edges on the device and needs clifInitBuffers
+#define CLOD_DEFAULT_EDGE_DENSITY 0.01f
+
+// With CLOD_ROUGH_SEARCH the search around the biggest object stops at
+// windows smaller than this fraction of it
+#define CLOD_ROUGH_SEARCH_RATIO 0.8f
+
+// With CLOD_ADAPTIVE_STEP a window rejected by stage s makes the window loop
+// skip MAX(1, CLOD_ADAPTIVE_STEP_MAX - s) positions (instead of 2 after stage 0)
+#define CLOD_ADAPTIVE_STEP_MAX 3
+
+// With CLOD_COARSE_TO_FINE windows are first placed on a grid twice as sparse
+// and run through this many stages, only the survivors' neighbourhoods are
+// then scanned densely
+#define CLOD_DEFAULT_COARSE_STAGE_COUNT 2
+
+// Frames the hybrid scheduler spends timing every scale on a single engine
+// (device first, host second) before splitting scales between the two
+#define CLOD_SCHEDULER_CALIBRATION_FRAMES 2
 
 typedef cl_uint clod_flags;
 
@@ -41,26 +80,161 @@ typedef struct CLODWeightedRect {
     cl_float weight;
 } CLODWeightedRect;
 
+/* Windows scanned by clodDetectObjectsInRegions: the ones lying inside one of
+ * rois (any window if roi_count is 0) whose centre is non zero in mask (an
+ * 8 bit image sized matrix, ignored if NULL) and that overlap a moving block
+ * of motion (see clifMotionMap, ignored if NULL)
+ */
+typedef struct CLODScanRegions {
+    const CvRect* rois;
+    cl_uint roi_count;
+    const CvMat* mask;
+    const CLIFMotionResult* motion;
+} CLODScanRegions;
+
+/* One cascade of clodDetectObjectsMulti. A nested entry (parent is the index
+ * of an earlier entry, -1 for none) only searches area of each parent match:
+ * x, y, width and height as fractions of the match, e.g. { 0, 0, 1, 0.6 } for
+ * eyes in a face. A merged entry (merge is the index of an earlier entry, -1
+ * for none) adds its raw matches to that entry's before they are grouped, e.g.
+ * frontal, profile and mirrored profile faces (see clodMirrorCascade)
+ */
+typedef struct CLODCascadeEntry {
+    const CvHaarClassifierCascade* cascade;
+    CvSize min_window_size;
+    CvSize max_window_size;
+    cl_uint min_neighbors;
+    cl_int parent;
+    cl_float area[4];
+    cl_int merge;
+} CLODCascadeEntry;
+
+#ifdef CLOD_COUNTERS
+/* Work done by one detection. Only built with -DCLOD_COUNTERS (the whole
+ * project, kernels included), without it the counting code does not exist
+ */
+#define CLOD_COUNTERS_MAX_SCALES 64
+#define CLOD_COUNTERS_MAX_STAGES 64
+
+typedef struct CLODWorkCounters {
+    cl_uint scale_count;
+    cl_uint stage_count;
+    cl_ulong window_count[CLOD_COUNTERS_MAX_SCALES];    // windows entering stage 0
+    cl_ulong survivor_count[CLOD_COUNTERS_MAX_STAGES];  // windows passing the stage, all scales
+    cl_ulong node_count;                                // classifier nodes (features) evaluated
+} CLODWorkCounters;
+#endif
+
 typedef struct CLODDetectObjectsResult {
     CLODWeightedRect* matches;
     cl_uint match_count;
+#ifdef CLOD_COUNTERS
+    CLODWorkCounters counters;
+#endif
 } CLODDetectObjectsResult;
 
 typedef struct CLODDetectsObjectsData {
     cl_mem buffers[5];
     size_t global_size[1];
     size_t local_size[1];
+    CvSize image_size;                  // given to clodInitBuffers
 } CLODDetectObjectsData;
 
+/* Device grouping (CLOD_DEVICE_GROUPING) buffers: matches, labels, per group
+ * sums, groups, counters, next match in the same cell, then the size classes
+ * and the first match of each cell of the grid (see buildRectGrid), grown on
+ * demand. window_sizes are the distinct width + height of the matches
+ */
+typedef struct CLODGroupingData {
+    cl_mem buffers[8];
+    cl_uint capacity;
+    cl_uint match_count;                // grouped by the last detection
+    cl_uint class_capacity;
+    cl_uint cell_capacity;
+    cl_int* window_sizes;
+    cl_uint window_size_count;
+} CLODGroupingData;
+
+/* clodDetectObjectsBatch buffers: packed integral images, input and output
+ * windows, sized for capacity images of image_size and grown on demand
+ */
+typedef struct CLODBatchData {
+    cl_mem buffers[3];
+    cl_uint capacity;
+    CvSize image_size;
+} CLODBatchData;
+
+/* Fused cascades (see clodDetectObjectsMulti) buffers: stages, input and
+ * output windows, then the cascade of each input and output window. Sized for
+ * capacity cascades of image_size and grown on demand
+ */
+typedef struct CLODFusedData {
+    cl_mem buffers[5];
+    cl_uint capacity;
+    CvSize image_size;
+} CLODFusedData;
+
+/* Windows surviving each stage, per scale. The last_* arrays hold the last
+ * detection, total_* arrays the sum over frame_count detections. They are
+ * reset when the cascade or the number of scales changes
+ */
+typedef struct CLODStageStatistics {
+    cl_uint frame_count;
+    cl_uint scale_count;
+    cl_uint stage_count;
+    cl_float* scale;                    // [scale_count]
+    cl_uint* last_window_count;         // [scale_count] windows entering stage 0
+    cl_uint* last_skipped_count;        // [scale_count] windows left out by the scan regions
+    cl_uint* last_survivor_count;       // [scale_count * stage_count]
+    cl_ulong* total_window_count;       // [scale_count]
+    cl_ulong* total_skipped_count;      // [scale_count]
+    cl_ulong* total_survivor_count;     // [scale_count * stage_count]
+} CLODStageStatistics;
+
+/* Hybrid scheduler state. Times are per scale, in ms, smoothed over frames.
+ * A negative time means the scale was never measured on that engine
+ */
+typedef struct CLODSchedulerData {
+    cl_uint frame_count;
+    cl_uint scale_count;
+    cl_double* host_time;               // [scale_count]
+    cl_double* device_time;             // [scale_count]
+    cl_bool* on_device;                 // [scale_count] assignment of the last frame
+} CLODSchedulerData;
+
 typedef struct CLODFEnvironmentData {
     CLIFEnvironmentData* clif;
     CLDeviceEnvironment environment;
     CLODDetectObjectsData detect_objects_data;
+    CLODGroupingData grouping_data;
+    CLODBatchData batch_data;
+    CLODFusedData fused_data;
+    CLODStageStatistics stage_statistics;
+    cl_uint adaptive_window_count;
+    cl_float edge_density;
+    cl_uint coarse_stage_count;
+    cl_float scale_factor;
+    CLODSchedulerData scheduler;
+    CLODProfile profile;
+    cl_event stage_wait_event;          // the next stage launch waits for it, then it is cleared
+#ifdef CLOD_COUNTERS
+    cl_ulong node_count;                // nodes counted on the device and by helper threads
+    cl_ulong host_node_start;
+#endif
 } CLODEnvironmentData;
 
 CLODEnvironmentData*
 clodInitEnvironment(const cl_uint device_index);
 
+// Same on a device (or sub-device) that is not in the platform device list
+CLODEnvironmentData*
+clodInitDeviceEnvironment(cl_device_id device);
+
+// Environment without a device, needs no OpenCL platform. Only for use_opencl
+// CL_FALSE, clodInitBuffers and the device paths must not be called
+CLODEnvironmentData*
+clodInitHostEnvironment();
+
 void
 clodReleaseEnvironment(CLODFEnvironmentData* data);
 
@@ -70,12 +244,152 @@ clodInitBuffers(CLODEnvironmentData* data,
 void
 clodReleaseBuffers(CLODEnvironmentData* data);
 
+// Stump and tree (CART) classifiers, upright and tilted features are
+// supported by every path. Cascades with more than 512 tree nodes in a stage
+// are not, they need to run through cvHaarDetectObjects
+cl_bool
+clodIsCascadeSupported(const CvHaarClassifierCascade* cascade);
+
+// Tilted features (e.g. haarcascade_eye_tree_eyeglasses, mcs_mouth) read a
+// tilted integral image, computed along the integral image only for them
+cl_bool
+clodHasTiltedFeatures(const CvHaarClassifierCascade* cascade);
+
+const CLODStageStatistics*
+clodGetStageStatistics(const CLODEnvironmentData* data);
+
+void
+clodResetStageStatistics(CLODEnvironmentData* data);
+
+// Average survivors per stage and scale, as a tab separated table
+void
+clodPrintStageStatistics(const CLODStageStatistics* statistics,
+                         FILE* file);
+
+const CLODSchedulerData*
+clodGetSchedulerData(const CLODEnvironmentData* data);
+
+// Forget the measured times, the next frames calibrate again
+void
+clodResetScheduler(CLODEnvironmentData* data);
+
+// Device commands of each detection are timed (see clodprofile.h). Queue
+// properties cannot change, so the first enable replaces the queue shared with
+// clif by one with CL_QUEUE_PROFILING_ENABLE. Not during a detection
+void
+clodEnableProfiling(CLODEnvironmentData* data,
+                    const cl_bool enable);
+
+// Timings of the last detection
+const CLODProfile*
+clodGetProfile(const CLODEnvironmentData* data);
+
+// Times the local sizes and variants of clodtune.h on synthetic frame_size
+// frames with cascade, keeps the fastest and saves them for the device. Skipped
+// if the tuning file already had an entry, unless force. Before clifInitBuffers
+// and clodInitBuffers, the buffers it uses are released. Leaves the queue with
+// CL_QUEUE_PROFILING_ENABLE (see clodEnableProfiling)
+void
+clodTuneEnvironment(CLODEnvironmentData* data,
+                    const CvHaarClassifierCascade* cascade,
+                    const CvSize frame_size,
+                    const cl_bool force);
+
+// With use_opencl and CLOD_DEVICE_GROUPING matches are grouped on the device
+// and only the groups are read back (same result as on the host)
+// With use_opencl and CLOD_HYBRID_SCHEDULING each scale runs either on the
+// device or on a host thread, whichever is predicted to finish the frame
+// first. The host side honours CLOD_PRECOMPUTE_FEATURES, CLOD_PER_STAGE_ITERATIONS
+// and CLOD_ADAPTIVE_STRATEGY but not CLOD_BLOCK_IMPLEMENTATION
+// With CLOD_FIND_BIGGEST_OBJECT at most one match, the biggest object, is
+// returned: scales go from the largest down and once an object is found only
+// the region around it is scanned (up to CLOD_ROUGH_SEARCH_RATIO of its size
+// with CLOD_ROUGH_SEARCH). It overrides CLOD_BLOCK_IMPLEMENTATION,
+// CLOD_HYBRID_SCHEDULING and CLOD_DEVICE_GROUPING
 CLODDetectObjectsResult
 clodDetectObjects(const IplImage* image,
                   const CvHaarClassifierCascade* cascade,
-                  const CLODEnvironmentData* data,
+                  CLODEnvironmentData* data,
                   const CvSize min_window_size,
                   const CvSize max_window_size,
                   const cl_uint min_neighbors,
                   const clod_flags flags,
                   const cl_bool use_opencl);
+
+// Same as clodDetectObjects but only the windows selected by regions (NULL for
+// the whole image) are scanned, cost scales with their area. Regions are not
+// supported by CLOD_BLOCK_IMPLEMENTATION, the generic host path is used instead
+CLODDetectObjectsResult
+clodDetectObjectsInRegions(const IplImage* image,
+                           const CvHaarClassifierCascade* cascade,
+                           CLODEnvironmentData* data,
+                           const CvSize min_window_size,
+                           const CvSize max_window_size,
+                           const cl_uint min_neighbors,
+                           const clod_flags flags,
+                           const CLODScanRegions* regions,
+                           const cl_bool use_opencl);
+
+// Runs entry_count cascades on one integral image, computed (and uploaded to
+// the device) once. results[i] holds the matches of entries[i], the caller
+// frees them (a merged entry has none, its matches are in the merge target's).
+// The regions of a nested entry are scanned together, with one launch per
+// scale. Merged entries are grouped with the min_neighbors of their target.
+// On the device up to 3 merged entries without parent (e.g. frontal, profile
+// and mirrored profile) are evaluated together, one launch per stage for the
+// windows of all of them, unless CLOD_FIND_BIGGEST_OBJECT is set.
+// CLOD_BLOCK_IMPLEMENTATION, CLOD_HYBRID_SCHEDULING and, for fused entries,
+// CLOD_ADAPTIVE_STRATEGY are ignored.
+// Any mix of cascades accepted by clodIsCascadeSupported can be combined,
+// e.g. a face with eyes, mouth and nose (haarcascade_mcs_*) nested into it.
+// An entry nests into or merges with an earlier entry that is not itself
+// merged. Otherwise nothing runs, the results are empty and the reason is
+// printed on stderr: returns CL_INVALID_VALUE, CL_SUCCESS if it ran
+cl_int
+clodDetectObjectsMulti(const IplImage* image,
+                       const CLODCascadeEntry* entries,
+                       const cl_uint entry_count,
+                       CLODEnvironmentData* data,
+                       const clod_flags flags,
+                       const cl_bool use_opencl,
+                       CLODDetectObjectsResult* results);
+
+// Same as clodDetectObjects with use_opencl on image_count images of the
+// size given to clodInitBuffers. The integral images are packed in one device
+// buffer and the windows of all images go through each stage together, one
+// launch per stage and scale for the whole batch. results[i] holds the
+// matches of images[i], the caller frees them. Only CLOD_EDGE_PRUNING and
+// CLOD_COARSE_TO_FINE are honoured. Returns CL_INVALID_IMAGE_SIZE (and no
+// matches) if an image is not of that size. With CLOD_COUNTERS results[0]
+// holds the work of the whole batch, the other counters are 0
+cl_int
+clodDetectObjectsBatch(const IplImage** images,
+                       const cl_uint image_count,
+                       const CvHaarClassifierCascade* cascade,
+                       CLODEnvironmentData* data,
+                       const CvSize min_window_size,
+                       const CvSize max_window_size,
+                       const cl_uint min_neighbors,
+                       const clod_flags flags,
+                       CLODDetectObjectsResult* results);
+
+// Same as clodDetectObjects with use_opencl, for callers that compute the
+// integral image themselves (see clodstream). integral_buffer must be at least
+// as big as buffers[0] of clodInitBuffers. If integral_event is not NULL the
+// first stage launch waits for it on the device, the caller is not blocked.
+// edge_integral_image is only needed with CLOD_EDGE_PRUNING
+CLODDetectObjectsResult
+clodDetectObjectsIntegral(const CvMat* integral_image,
+                          const CvMat* square_integral_image,
+                          const CvMat* edge_integral_image,
+                          cl_mem integral_buffer,
+                          cl_event integral_event,
+                          const CvHaarClassifierCascade* cascade,
+                          CLODEnvironmentData* data,
+                          const CvSize min_window_size,
+                          const CvSize max_window_size,
+                          const cl_uint min_neighbors,
+                          const clod_flags flags,
+                          const CLODScanRegions* regions);
+
+#endif
@@ -0,0 +1,164 @@
+//
+//  clodaccuracy.cpp
+//  OpenCLFaceDetection
+//
+//  Accuracy against speed of the window placement strategies on a labelled
+//  image set.
+//  Usage: clodaccuracy cascade.xml labels.txt [opencl]
+//  Without opencl everything runs on the host and no OpenCL device is needed.
+//  Every line of labels.txt is an image path followed by the number of objects
+//  and their x y width height, e.g. "faces/01.jpg 2 10 20 64 64 200 40 80 80"
+//
+
+#include "clod.h"
+#include <opencv2/highgui/highgui.hpp>
+
+// A detection finds a labelled object if their intersection over union is at least this
+#define ACCURACY_MIN_OVERLAP 0.5f
+#define ACCURACY_MAX_OBJECTS 256
+
+typedef struct AccuracyMode {
+    const char* name;
+    clod_flags flags;
+    cl_uint true_positives;
+    cl_uint false_positives;
+    cl_uint false_negatives;
+    double time;
+} AccuracyMode;
+
+cl_float
+rectOverlap(const CvRect* r1,
+            const CvRect* r2)
+{
+    cl_int width = MIN(r1->x + r1->width, r2->x + r2->width) - MAX(r1->x, r2->x);
+    cl_int height = MIN(r1->y + r1->height, r2->y + r2->height) - MAX(r1->y, r2->y);
+    if(width <= 0 || height <= 0)
+        return 0;
+    cl_float intersection = (cl_float)(width * height);
+    return intersection / ((r1->width * r1->height) + (r2->width * r2->height) - intersection);
+}
+
+/* Every label is matched by at most one detection */
+void
+scoreResult(const CLODDetectObjectsResult* result,
+            const CvRect* labels,
+            const cl_uint label_count,
+            AccuracyMode* mode)
+{
+    cl_bool found[ACCURACY_MAX_OBJECTS] = { 0 };
+    for(cl_uint i = 0; i < result->match_count; i++) {
+        cl_int best = -1;
+        cl_float best_overlap = ACCURACY_MIN_OVERLAP;
+        for(cl_uint j = 0; j < label_count; j++) {
+            cl_float overlap = rectOverlap(&result->matches[i].rect, &labels[j]);
+            if(!found[j] && overlap >= best_overlap) {
+                best = j;
+                best_overlap = overlap;
+            }
+        }
+        if(best >= 0) {
+            found[best] = CL_TRUE;
+            mode->true_positives++;
+        }
+        else
+            mode->false_positives++;
+    }
+    for(cl_uint j = 0; j < label_count; j++)
+        mode->false_negatives += found[j] ? 0 : 1;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 3) {
+        printf("Usage: %s cascade.xml labels.txt [opencl]\n", argv[0]);
+        return 1;
+    }
+    cl_bool use_opencl = argc > 3 && strcmp(argv[3], "opencl") == 0;
+
+    CvHaarClassifierCascade* cascade = (CvHaarClassifierCascade*)cvLoad(argv[1], 0, 0, 0);
+    if(cascade == NULL) {
+        printf("%s: cannot load cascade\n", argv[1]);
+        return 1;
+    }
+    FILE* labels_file = fopen(argv[2], "r");
+    if(labels_file == NULL) {
+        printf("%s: cannot open labels\n", argv[2]);
+        cvReleaseHaarClassifierCascade(&cascade);
+        return 1;
+    }
+
+    // Per-window modes run on the host only
+    AccuracyMode modes[] = {
+        { "dense", CLOD_PRECOMPUTE_FEATURES, 0, 0, 0, 0 },
+        { "adaptive step", CLOD_PRECOMPUTE_FEATURES | CLOD_ADAPTIVE_STEP, 0, 0, 0, 0 },
+        { "per-stage", CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS, 0, 0, 0, 0 },
+        { "coarse to fine", CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS | CLOD_COARSE_TO_FINE, 0, 0, 0, 0 }
+    };
+    cl_uint mode_count = sizeof(modes) / sizeof(AccuracyMode);
+
+    CLODEnvironmentData* data = use_opencl ? clodInitEnvironment(0) : clodInitHostEnvironment();
+    CvSize buffers_size = cvSize(0, 0);
+    cl_uint image_count = 0;
+    ElapseTime t;
+
+    char path[4096];
+    while(fscanf(labels_file, "%4095s", path) == 1) {
+        // Labels
+        cl_uint label_count = 0;
+        CvRect labels[ACCURACY_MAX_OBJECTS];
+        if(fscanf(labels_file, "%u", &label_count) != 1 || label_count > ACCURACY_MAX_OBJECTS)
+            break;
+        for(cl_uint i = 0; i < label_count; i++) {
+            if(fscanf(labels_file, "%d %d %d %d", &labels[i].x, &labels[i].y, &labels[i].width, &labels[i].height) != 4)
+                label_count = i;
+        }
+
+        IplImage* image = cvLoadImage(path);
+        if(image == NULL) {
+            printf("%s: cannot load image\n", path);
+            continue;
+        }
+        CvSize image_size = cvSize(image->width, image->height);
+        if(use_opencl && (image_size.width != buffers_size.width || image_size.height != buffers_size.height)) {
+            if(buffers_size.width != 0)
+                clodReleaseBuffers(data);
+            // clodReleaseBuffers releases the clif buffers too
+            clifInitBuffers(data->clif, image->width, image->height, image->widthStep, image->nChannels);
+            clodInitBuffers(data, &image_size);
+            buffers_size = image_size;
+        }
+
+        for(cl_uint m = 0; m < mode_count; m++) {
+            cl_bool mode_opencl = use_opencl && (modes[m].flags & CLOD_PER_STAGE_ITERATIONS);
+            t.start();
+            CLODDetectObjectsResult result = clodDetectObjects(image, cascade, data, cvSize(20, 20), cvSize(0, 0), 3, modes[m].flags, mode_opencl);
+            modes[m].time += t.get();
+            scoreResult(&result, labels, label_count, &modes[m]);
+            free(result.matches);
+        }
+        image_count++;
+        cvReleaseImage(&image);
+    }
+
+    // Report
+    printf("mode\tms/image\trecall\tprecision\n");
+    for(cl_uint m = 0; m < mode_count; m++) {
+        AccuracyMode* mode = &modes[m];
+        cl_uint detections = mode->true_positives + mode->false_positives;
+        cl_uint objects = mode->true_positives + mode->false_negatives;
+        printf("%s\t%8.4f\t%.3f\t%.3f\n", mode->name,
+               mode->time / MAX(image_count, 1),
+               objects != 0 ? (float)mode->true_positives / objects : 0.0f,
+               detections != 0 ? (float)mode->true_positives / detections : 0.0f);
+    }
+
+    // Release
+    if(buffers_size.width != 0)
+        clodReleaseBuffers(data);
+    clodReleaseEnvironment(data);
+    free(data);
+    fclose(labels_file);
+    cvReleaseHaarClassifierCascade(&cascade);
+
+    return 0;
+}
@@ -0,0 +1,325 @@
+//
+//  clodbench.cpp
+//  OpenCLFaceDetection
+//
+//  Latency of every detection mode over a directory of images, for tracking
+//  regressions. Every image is resized to each resolution and detected with
+//  each cascade, scale factor and mode: warmup runs (kernel builds, cold
+//  caches) are dropped, the next iterations are timed one by one.
+//  Usage: clodbench [-n iterations] [-w warmup] [-r WxH]... [-s factor]...
+//                   [-d device|host] [-f csv|json] image_dir cascade...
+//  Cascades are XML or binary (.clod, see clodconvert). Defaults are 10
+//  iterations, 2 warmup runs, 320x240 640x480 1280x720, scale factor 1.1 and
+//  OpenCL device 0. With -d host only the host modes run, no device is needed
+//
+
+#include "clod.h"
+#include "clodcascade.h"
+#include <opencv2/highgui/highgui.hpp>
+#include <dirent.h>
+
+#define BENCH_MAX_SWEEP 16
+
+typedef struct BenchMode {
+    const char* name;
+    clod_flags flags;
+    cl_bool use_opencl;
+} BenchMode;
+
+/* One line of the report */
+typedef struct BenchRecord {
+    const char* cascade;
+    const char* mode;
+    CvSize size;
+    cl_float scale_factor;
+    cl_uint image_count;
+    cl_uint sample_count;
+    double median;
+    double p95;
+    double p99;
+    double mean;
+    double windows_per_second;
+    double stages_per_frame;
+    double matches_per_frame;
+} BenchRecord;
+
+int
+compareDoubles(const void* a,
+               const void* b)
+{
+    double da = *(const double*)a;
+    double db = *(const double*)b;
+    return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+int
+compareNames(const void* a,
+             const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* Nearest rank, samples must be sorted */
+double
+percentile(const double* samples,
+           const cl_uint count,
+           const double p)
+{
+    cl_uint rank = (cl_uint)ceil(p * count);
+    return samples[MIN(MAX(rank, 1), count) - 1];
+}
+
+/* Images of a directory, in name order so runs are comparable */
+IplImage**
+loadImages(const char* directory,
+           cl_uint* image_count)
+{
+    *image_count = 0;
+    DIR* dir = opendir(directory);
+    if(dir == NULL)
+        return NULL;
+
+    char** names = NULL;
+    cl_uint name_count = 0;
+    struct dirent* entry;
+    while((entry = readdir(dir)) != NULL) {
+        if(entry->d_name[0] == '.')
+            continue;
+        names = (char**)realloc(names, (name_count + 1) * sizeof(char*));
+        names[name_count++] = strdup(entry->d_name);
+    }
+    closedir(dir);
+    qsort(names, name_count, sizeof(char*), compareNames);
+
+    IplImage** images = (IplImage**)malloc(MAX(name_count, 1) * sizeof(IplImage*));
+    for(cl_uint i = 0; i < name_count; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", directory, names[i]);
+        IplImage* image = cvLoadImage(path, CV_LOAD_IMAGE_COLOR);
+        if(image != NULL)
+            images[(*image_count)++] = image;
+        free(names[i]);
+    }
+    free(names);
+    return images;
+}
+
+/* Windows entering stage 0 and windows entering any stage in the last detection */
+void
+countWork(const CLODStageStatistics* statistics,
+          cl_ulong* window_count,
+          cl_ulong* stage_count)
+{
+    *window_count = 0;
+    *stage_count = 0;
+    for(cl_uint s = 0; s < statistics->scale_count; s++) {
+        *window_count += statistics->last_window_count[s];
+        *stage_count += statistics->last_window_count[s];
+        for(cl_uint i = 0; i + 1 < statistics->stage_count; i++)
+            *stage_count += statistics->last_survivor_count[(s * statistics->stage_count) + i];
+    }
+}
+
+void
+printRecords(const BenchRecord* records,
+             const cl_uint record_count,
+             const cl_bool json)
+{
+    if(json)
+        printf("[");
+    else
+        printf("cascade,mode,width,height,scale_factor,images,samples,median_ms,p95_ms,p99_ms,mean_ms,windows_per_s,stages_per_frame,matches_per_frame\n");
+    for(cl_uint i = 0; i < record_count; i++) {
+        const BenchRecord* r = &records[i];
+        if(json)
+            printf("%s\n  { \"cascade\": \"%s\", \"mode\": \"%s\", \"width\": %d, \"height\": %d, \"scale_factor\": %.3f, "
+                   "\"images\": %u, \"samples\": %u, \"median_ms\": %.4f, \"p95_ms\": %.4f, \"p99_ms\": %.4f, \"mean_ms\": %.4f, "
+                   "\"windows_per_s\": %.0f, \"stages_per_frame\": %.1f, \"matches_per_frame\": %.2f }",
+                   i != 0 ? "," : "", r->cascade, r->mode, r->size.width, r->size.height, r->scale_factor,
+                   r->image_count, r->sample_count, r->median, r->p95, r->p99, r->mean,
+                   r->windows_per_second, r->stages_per_frame, r->matches_per_frame);
+        else
+            printf("%s,%s,%d,%d,%.3f,%u,%u,%.4f,%.4f,%.4f,%.4f,%.0f,%.1f,%.2f\n",
+                   r->cascade, r->mode, r->size.width, r->size.height, r->scale_factor,
+                   r->image_count, r->sample_count, r->median, r->p95, r->p99, r->mean,
+                   r->windows_per_second, r->stages_per_frame, r->matches_per_frame);
+    }
+    if(json)
+        printf("\n]\n");
+}
+
+int main(int argc, char** argv)
+{
+    cl_uint iterations = 10;
+    cl_uint warmup = 2;
+    cl_bool json = CL_FALSE;
+    CvSize sizes[BENCH_MAX_SWEEP];
+    cl_uint size_count = 0;
+    cl_float scale_factors[BENCH_MAX_SWEEP];
+    cl_uint scale_factor_count = 0;
+    int device_index = 0;               // -1 for host only
+
+    // Options
+    int arg = 1;
+    for(; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+        if(strcmp(argv[arg], "-n") == 0)
+            iterations = MAX(atoi(argv[arg + 1]), 1);
+        else if(strcmp(argv[arg], "-w") == 0)
+            warmup = atoi(argv[arg + 1]);
+        else if(strcmp(argv[arg], "-f") == 0)
+            json = strcmp(argv[arg + 1], "json") == 0;
+        else if(strcmp(argv[arg], "-r") == 0 && size_count < BENCH_MAX_SWEEP &&
+                sscanf(argv[arg + 1], "%dx%d", &sizes[size_count].width, &sizes[size_count].height) == 2)
+            size_count++;
+        else if(strcmp(argv[arg], "-s") == 0 && scale_factor_count < BENCH_MAX_SWEEP)
+            scale_factors[scale_factor_count++] = (cl_float)atof(argv[arg + 1]);
+        else if(strcmp(argv[arg], "-d") == 0)
+            device_index = strcmp(argv[arg + 1], "host") == 0 ? -1 : atoi(argv[arg + 1]);
+        else
+            break;
+    }
+    if(argc - arg < 2) {
+        printf("Usage: %s [-n iterations] [-w warmup] [-r WxH]... [-s factor]... [-d device|host] [-f csv|json] image_dir cascade...\n", argv[0]);
+        return 1;
+    }
+    if(size_count == 0) {
+        sizes[size_count++] = cvSize(320, 240);
+        sizes[size_count++] = cvSize(640, 480);
+        sizes[size_count++] = cvSize(1280, 720);
+    }
+    if(scale_factor_count == 0)
+        scale_factors[scale_factor_count++] = CLOD_DEFAULT_SCALE_FACTOR;
+
+    cl_uint image_count = 0;
+    IplImage** images = loadImages(argv[arg], &image_count);
+    if(image_count == 0) {
+        fprintf(stderr, "%s: no images\n", argv[arg]);
+        free(images);
+        return 1;
+    }
+
+    BenchMode modes[] = {
+        { "cpu", 0, CL_FALSE },
+        { "cpu precomputed", CLOD_PRECOMPUTE_FEATURES, CL_FALSE },
+        { "block", CLOD_PRECOMPUTE_FEATURES | CLOD_BLOCK_IMPLEMENTATION, CL_FALSE },
+        { "per-stage", CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS, CL_FALSE },
+        { "opencl", CLOD_PER_STAGE_ITERATIONS, CL_TRUE },
+        { "opencl adaptive", CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS | CLOD_ADAPTIVE_STRATEGY, CL_TRUE }
+    };
+    cl_uint mode_count = sizeof(modes) / sizeof(BenchMode);
+
+    cl_bool use_device = device_index >= 0;
+    CLODEnvironmentData* data = use_device ? clodInitEnvironment(device_index) : clodInitHostEnvironment();
+    BenchRecord* records = NULL;
+    cl_uint record_count = 0;
+    double* samples = (double*)malloc(image_count * iterations * sizeof(double));
+    ElapseTime t;
+
+    for(int c = arg + 1; c < argc; c++) {
+        // Cascade
+        const char* extension = strrchr(argv[c], '.');
+        CLODCascade* binary_cascade = NULL;
+        CvHaarClassifierCascade* cascade = NULL;
+        if(extension != NULL && strcmp(extension, ".clod") == 0) {
+            binary_cascade = clodLoadCascade(argv[c]);
+            cascade = binary_cascade != NULL ? binary_cascade->cascade : NULL;
+        }
+        else
+            cascade = (CvHaarClassifierCascade*)cvLoad(argv[c], 0, 0, 0);
+        if(cascade == NULL || !clodIsCascadeSupported(cascade)) {
+            fprintf(stderr, "%s: cannot load or not supported, skipped\n", argv[c]);
+            continue;
+        }
+
+        for(cl_uint r = 0; r < size_count; r++) {
+            // Frames and buffers of this resolution
+            IplImage** frames = (IplImage**)malloc(image_count * sizeof(IplImage*));
+            for(cl_uint i = 0; i < image_count; i++) {
+                frames[i] = cvCreateImage(sizes[r], IPL_DEPTH_8U, 3);
+                cvResize(images[i], frames[i]);
+            }
+            if(use_device) {
+                clifInitBuffers(data->clif, sizes[r].width, sizes[r].height, frames[0]->widthStep, 3);
+                clodInitBuffers(data, &sizes[r]);
+            }
+
+            for(cl_uint f = 0; f < scale_factor_count; f++) {
+                data->scale_factor = scale_factors[f];
+                for(cl_uint m = 0; m < mode_count; m++) {
+                    if(modes[m].use_opencl && !use_device)
+                        continue;
+                    clodResetScheduler(data);
+                    cl_ulong window_count = 0;
+                    cl_ulong stage_count = 0;
+                    cl_ulong match_count = 0;
+                    cl_uint sample_count = 0;
+
+                    for(cl_uint i = 0; i < image_count; i++) {
+                        for(cl_uint w = 0; w < warmup + iterations; w++) {
+                            t.start();
+                            CLODDetectObjectsResult result = clodDetectObjects(frames[i], cascade, data,
+                                                                               cascade->orig_window_size, cvSize(0, 0),
+                                                                               3, modes[m].flags, modes[m].use_opencl);
+                            double time = t.get();
+                            if(w >= warmup) {
+                                cl_ulong frame_windows, frame_stages;
+                                countWork(clodGetStageStatistics(data), &frame_windows, &frame_stages);
+                                samples[sample_count++] = time;
+                                window_count += frame_windows;
+                                stage_count += frame_stages;
+                                match_count += result.match_count;
+                            }
+                            free(result.matches);
+                        }
+                    }
+
+                    // Summary
+                    double total = 0;
+                    for(cl_uint i = 0; i < sample_count; i++)
+                        total += samples[i];
+                    qsort(samples, sample_count, sizeof(double), compareDoubles);
+                    records = (BenchRecord*)realloc(records, (record_count + 1) * sizeof(BenchRecord));
+                    BenchRecord* record = &records[record_count++];
+                    record->cascade = argv[c];
+                    record->mode = modes[m].name;
+                    record->size = sizes[r];
+                    record->scale_factor = scale_factors[f];
+                    record->image_count = image_count;
+                    record->sample_count = sample_count;
+                    record->median = percentile(samples, sample_count, 0.5);
+                    record->p95 = percentile(samples, sample_count, 0.95);
+                    record->p99 = percentile(samples, sample_count, 0.99);
+                    record->mean = total / sample_count;
+                    record->windows_per_second = total > 0 ? window_count / (total / 1000.0) : 0;
+                    record->stages_per_frame = (double)stage_count / sample_count;
+                    record->matches_per_frame = (double)match_count / sample_count;
+                }
+            }
+
+            // Release
+            if(use_device)
+                clodReleaseBuffers(data);
+            for(cl_uint i = 0; i < image_count; i++)
+                cvReleaseImage(&frames[i]);
+            free(frames);
+        }
+
+        if(binary_cascade != NULL)
+            clodReleaseCascade(binary_cascade);
+        else
+            cvReleaseHaarClassifierCascade(&cascade);
+    }
+
+    printRecords(records, record_count, json);
+
+    // Release
+    clodReleaseEnvironment(data);
+    free(data);
+    for(cl_uint i = 0; i < image_count; i++)
+        cvReleaseImage(&images[i]);
+    free(images);
+    free(records);
+    free(samples);
+
+    return 0;
+}
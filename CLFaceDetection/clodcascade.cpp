@@ -0,0 +1,355 @@
+//
+//  clodcascade.cpp
+//  OpenCLFaceDetection
+//
+
+#include "clodcascade.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// CvHaarFeature is stored as is, the mapping is only valid if the layout matches
+typedef char CLODCascadeFeatureSizeCheck[(sizeof(CvHaarFeature) == 64) ? 1 : -1];
+
+#define align4(size) (((size) + 3) & ~((size_t)3))
+
+/* FNV-1a over 32 bit words (payload is always 4 bytes aligned) */
+static cl_uint
+computeChecksum(const cl_uint* data,
+                const size_t word_count)
+{
+    cl_uint hash = 2166136261u;
+    for(size_t i = 0; i < word_count; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static size_t
+computePayloadSize(const cl_uint stage_count,
+                   const cl_uint classifier_count,
+                   const cl_uint node_count)
+{
+    return align4(stage_count * sizeof(CLODCascadeFileStage)) +
+           align4(classifier_count * sizeof(CLODCascadeFileClassifier)) +
+           node_count * sizeof(CvHaarFeature) +
+           node_count * sizeof(cl_float) +
+           node_count * sizeof(cl_int) * 2 +
+           (node_count + classifier_count) * sizeof(cl_float);
+}
+
+/* Tree links point to a node of the classifier (> 0) or to one of its
+ * count + 1 alphas (<= 0)
+ */
+static cl_bool
+isTreeLinkValid(const cl_int link,
+                const cl_uint node_count)
+{
+    return link > 0 ? (cl_uint)link < node_count : (cl_uint)(-(cl_long)link) <= node_count;
+}
+
+/* Indices read from the file against the sections they point into. The
+ * checksum only catches accidental corruption
+ */
+static cl_bool
+areSectionsValid(const CLODCascadeFileHeader* header,
+                 const CLODCascadeFileStage* file_stages,
+                 const CLODCascadeFileClassifier* file_classifiers,
+                 const CvHaarFeature* features,
+                 const int* left,
+                 const int* right)
+{
+    if(header->orig_window_width <= 0 || header->orig_window_height <= 0)
+        return CL_FALSE;
+    for(cl_uint s = 0; s < header->stage_count; s++) {
+        const CLODCascadeFileStage* stage = &file_stages[s];
+        if((cl_ulong)stage->first_classifier + stage->classifier_count > header->classifier_count)
+            return CL_FALSE;
+        if(stage->next >= (cl_int)header->stage_count || stage->child >= (cl_int)header->stage_count ||
+           stage->parent >= (cl_int)header->stage_count || stage->next < -1 || stage->child < -1 || stage->parent < -1)
+            return CL_FALSE;
+    }
+    for(cl_uint c = 0; c < header->classifier_count; c++) {
+        const CLODCascadeFileClassifier* classifier = &file_classifiers[c];
+        if((cl_ulong)classifier->first_node + classifier->node_count > header->node_count ||
+           (cl_ulong)classifier->first_alpha + classifier->node_count + 1 > (cl_ulong)header->node_count + header->classifier_count)
+            return CL_FALSE;
+        for(cl_uint n = classifier->first_node; n < classifier->first_node + classifier->node_count; n++) {
+            if(!isTreeLinkValid(left[n], classifier->node_count) || !isTreeLinkValid(right[n], classifier->node_count))
+                return CL_FALSE;
+            // Rects must lie in the window, they are read from the integral images.
+            // A tilted rect spans x - height to x + width and y to y + width + height
+            for(int r = 0; r < CV_HAAR_FEATURE_MAX; r++) {
+                const CvRect* rect = &features[n].rect[r].r;
+                if(features[n].rect[r].weight == 0)
+                    continue;
+                cl_int left_x = features[n].tilted ? rect->x - rect->height : rect->x;
+                cl_int bottom_y = features[n].tilted ? rect->y + rect->width + rect->height : rect->y + rect->height;
+                if(rect->width < 0 || rect->height < 0 || left_x < 0 || rect->y < 0 ||
+                   rect->x + rect->width > header->orig_window_width || bottom_y > header->orig_window_height)
+                    return CL_FALSE;
+            }
+        }
+    }
+    return CL_TRUE;
+}
+
+CLODCascade*
+clodLoadCascade(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return NULL;
+
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CLODCascadeFileHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t mapping_size = (size_t)st.st_size;
+    void* mapping = mmap(NULL, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(mapping == MAP_FAILED)
+        return NULL;
+
+    // Validate header
+    const CLODCascadeFileHeader* header = (const CLODCascadeFileHeader*)mapping;
+    const cl_uchar* payload = (const cl_uchar*)mapping + sizeof(CLODCascadeFileHeader);
+    if(memcmp(header->magic, CLOD_CASCADE_FILE_MAGIC, 4) != 0 ||
+       header->version != CLOD_CASCADE_FILE_VERSION ||
+       header->payload_size != computePayloadSize(header->stage_count, header->classifier_count, header->node_count) ||
+       header->payload_size != mapping_size - sizeof(CLODCascadeFileHeader) ||
+       header->checksum != computeChecksum((const cl_uint*)payload, header->payload_size / sizeof(cl_uint))) {
+        fprintf(stderr, "clodLoadCascade: %s is not a valid version %d cascade\n", path, CLOD_CASCADE_FILE_VERSION);
+        munmap(mapping, mapping_size);
+        return NULL;
+    }
+
+    // Sections
+    const CLODCascadeFileStage* file_stages = (const CLODCascadeFileStage*)payload;
+    payload += align4(header->stage_count * sizeof(CLODCascadeFileStage));
+    const CLODCascadeFileClassifier* file_classifiers = (const CLODCascadeFileClassifier*)payload;
+    payload += align4(header->classifier_count * sizeof(CLODCascadeFileClassifier));
+    CvHaarFeature* features = (CvHaarFeature*)payload;
+    payload += header->node_count * sizeof(CvHaarFeature);
+    float* thresholds = (float*)payload;
+    payload += header->node_count * sizeof(cl_float);
+    int* left = (int*)payload;
+    payload += header->node_count * sizeof(cl_int);
+    int* right = (int*)payload;
+    payload += header->node_count * sizeof(cl_int);
+    float* alpha = (float*)payload;
+    if(!areSectionsValid(header, file_stages, file_classifiers, features, left, right)) {
+        fprintf(stderr, "clodLoadCascade: %s has out of range indices\n", path);
+        munmap(mapping, mapping_size);
+        return NULL;
+    }
+
+    // One block holds the cascade, stage and classifier headers, everything else stays in the mapping
+    CLODCascade* result = (CLODCascade*)malloc(sizeof(CLODCascade) +
+                                               sizeof(CvHaarClassifierCascade) +
+                                               header->stage_count * sizeof(CvHaarStageClassifier) +
+                                               header->classifier_count * sizeof(CvHaarClassifier));
+    CvHaarClassifierCascade* cascade = (CvHaarClassifierCascade*)(result + 1);
+    CvHaarStageClassifier* stages = (CvHaarStageClassifier*)(cascade + 1);
+    CvHaarClassifier* classifiers = (CvHaarClassifier*)(stages + header->stage_count);
+
+    cascade->flags = header->flags;
+    cascade->count = header->stage_count;
+    cascade->orig_window_size = cvSize(header->orig_window_width, header->orig_window_height);
+    cascade->real_window_size = cvSize(0, 0);
+    cascade->scale = 0;
+    cascade->stage_classifier = stages;
+    cascade->hid_cascade = NULL;
+
+    for(cl_uint s = 0; s < header->stage_count; s++) {
+        stages[s].count = file_stages[s].classifier_count;
+        stages[s].threshold = file_stages[s].threshold;
+        stages[s].classifier = &classifiers[file_stages[s].first_classifier];
+        stages[s].next = file_stages[s].next;
+        stages[s].child = file_stages[s].child;
+        stages[s].parent = file_stages[s].parent;
+    }
+
+    for(cl_uint c = 0; c < header->classifier_count; c++) {
+        cl_uint first_node = file_classifiers[c].first_node;
+        classifiers[c].count = file_classifiers[c].node_count;
+        classifiers[c].haar_feature = &features[first_node];
+        classifiers[c].threshold = &thresholds[first_node];
+        classifiers[c].left = &left[first_node];
+        classifiers[c].right = &right[first_node];
+        classifiers[c].alpha = &alpha[file_classifiers[c].first_alpha];
+    }
+
+    result->cascade = cascade;
+    result->mapping = mapping;
+    result->mapping_size = mapping_size;
+    return result;
+}
+
+void
+clodReleaseCascade(CLODCascade* cascade)
+{
+    if(cascade == NULL)
+        return;
+    if(cascade->mapping != NULL)
+        munmap(cascade->mapping, cascade->mapping_size);
+    free(cascade);
+}
+
+CLODCascade*
+clodMirrorCascade(const CvHaarClassifierCascade* source)
+{
+    cl_uint classifier_count = 0;
+    cl_uint node_count = 0;
+    for(int s = 0; s < source->count; s++) {
+        classifier_count += source->stage_classifier[s].count;
+        for(int c = 0; c < source->stage_classifier[s].count; c++)
+            node_count += source->stage_classifier[s].classifier[c].count;
+    }
+
+    // One block holds the headers and the reflected features, trees are shared with source
+    CLODCascade* result = (CLODCascade*)malloc(sizeof(CLODCascade) +
+                                               sizeof(CvHaarClassifierCascade) +
+                                               source->count * sizeof(CvHaarStageClassifier) +
+                                               classifier_count * sizeof(CvHaarClassifier) +
+                                               node_count * sizeof(CvHaarFeature));
+    CvHaarClassifierCascade* cascade = (CvHaarClassifierCascade*)(result + 1);
+    CvHaarStageClassifier* stages = (CvHaarStageClassifier*)(cascade + 1);
+    CvHaarClassifier* classifiers = (CvHaarClassifier*)(stages + source->count);
+    CvHaarFeature* features = (CvHaarFeature*)(classifiers + classifier_count);
+
+    *cascade = *source;
+    cascade->stage_classifier = stages;
+    cascade->hid_cascade = NULL;
+
+    cl_int window_width = source->orig_window_size.width;
+    cl_uint classifier_index = 0;
+    cl_uint node_index = 0;
+    for(int s = 0; s < source->count; s++) {
+        stages[s] = source->stage_classifier[s];
+        stages[s].classifier = &classifiers[classifier_index];
+        for(int c = 0; c < source->stage_classifier[s].count; c++, classifier_index++) {
+            const CvHaarClassifier* classifier = &source->stage_classifier[s].classifier[c];
+            classifiers[classifier_index] = *classifier;
+            classifiers[classifier_index].haar_feature = &features[node_index];
+            for(int n = 0; n < classifier->count; n++, node_index++) {
+                features[node_index] = classifier->haar_feature[n];
+                for(int r = 0; r < CV_HAAR_FEATURE_MAX; r++) {
+                    CvRect* rect = &features[node_index].rect[r].r;
+                    if(features[node_index].rect[r].weight == 0)
+                        continue;
+                    if(!features[node_index].tilted) {
+                        rect->x = window_width - rect->x - rect->width;
+                        continue;
+                    }
+                    // The top corner moves to the column after its reflection, the
+                    // sides swap. Touching the left edge it would leave the window
+                    if(rect->x - rect->height < 1) {
+                        free(result);
+                        return NULL;
+                    }
+                    CvRect tilted_rect = cvRect(window_width - rect->x + 1, rect->y, rect->height, rect->width);
+                    *rect = tilted_rect;
+                }
+            }
+        }
+    }
+
+    result->cascade = cascade;
+    result->mapping = NULL;
+    result->mapping_size = 0;
+    return result;
+}
+
+cl_int
+clodWriteCascade(const CvHaarClassifierCascade* cascade,
+                 const char* path)
+{
+    // Count classifiers and nodes
+    cl_uint classifier_count = 0;
+    cl_uint node_count = 0;
+    for(int s = 0; s < cascade->count; s++) {
+        classifier_count += cascade->stage_classifier[s].count;
+        for(int c = 0; c < cascade->stage_classifier[s].count; c++)
+            node_count += cascade->stage_classifier[s].classifier[c].count;
+    }
+
+    CLODCascadeFileHeader header;
+    memset(&header, 0, sizeof(CLODCascadeFileHeader));
+    memcpy(header.magic, CLOD_CASCADE_FILE_MAGIC, 4);
+    header.version = CLOD_CASCADE_FILE_VERSION;
+    header.flags = cascade->flags;
+    header.orig_window_width = cascade->orig_window_size.width;
+    header.orig_window_height = cascade->orig_window_size.height;
+    header.stage_count = cascade->count;
+    header.classifier_count = classifier_count;
+    header.node_count = node_count;
+    header.payload_size = (cl_uint)computePayloadSize(cascade->count, classifier_count, node_count);
+
+    // Flatten into the payload
+    cl_uchar* payload = (cl_uchar*)calloc(header.payload_size, 1);
+    cl_uchar* p = payload;
+    CLODCascadeFileStage* file_stages = (CLODCascadeFileStage*)p;
+    p += align4(header.stage_count * sizeof(CLODCascadeFileStage));
+    CLODCascadeFileClassifier* file_classifiers = (CLODCascadeFileClassifier*)p;
+    p += align4(classifier_count * sizeof(CLODCascadeFileClassifier));
+    CvHaarFeature* features = (CvHaarFeature*)p;
+    p += node_count * sizeof(CvHaarFeature);
+    cl_float* thresholds = (cl_float*)p;
+    p += node_count * sizeof(cl_float);
+    cl_int* left = (cl_int*)p;
+    p += node_count * sizeof(cl_int);
+    cl_int* right = (cl_int*)p;
+    p += node_count * sizeof(cl_int);
+    cl_float* alpha = (cl_float*)p;
+
+    cl_uint classifier_index = 0;
+    cl_uint node_index = 0;
+    cl_uint alpha_index = 0;
+    for(int s = 0; s < cascade->count; s++) {
+        const CvHaarStageClassifier* stage = &cascade->stage_classifier[s];
+        file_stages[s].threshold = stage->threshold;
+        file_stages[s].first_classifier = classifier_index;
+        file_stages[s].classifier_count = stage->count;
+        file_stages[s].next = stage->next;
+        file_stages[s].child = stage->child;
+        file_stages[s].parent = stage->parent;
+
+        for(int c = 0; c < stage->count; c++, classifier_index++) {
+            const CvHaarClassifier* classifier = &stage->classifier[c];
+            file_classifiers[classifier_index].first_node = node_index;
+            file_classifiers[classifier_index].node_count = classifier->count;
+            file_classifiers[classifier_index].first_alpha = alpha_index;
+
+            for(int n = 0; n < classifier->count; n++, node_index++) {
+                features[node_index] = classifier->haar_feature[n];
+                thresholds[node_index] = classifier->threshold[n];
+                left[node_index] = classifier->left[n];
+                right[node_index] = classifier->right[n];
+            }
+            for(int a = 0; a <= classifier->count; a++, alpha_index++)
+                alpha[alpha_index] = classifier->alpha[a];
+        }
+    }
+    header.checksum = computeChecksum((const cl_uint*)payload, header.payload_size / sizeof(cl_uint));
+
+    // Write
+    cl_int ret = CL_SUCCESS;
+    FILE* file = fopen(path, "wb");
+    if(file == NULL ||
+       fwrite(&header, sizeof(CLODCascadeFileHeader), 1, file) != 1 ||
+       fwrite(payload, header.payload_size, 1, file) != 1)
+        ret = -1;
+    if(file != NULL && fclose(file) != 0)
+        ret = -1;
+
+    // Release
+    free(payload);
+
+    // Return
+    return ret;
+}
@@ -0,0 +1,89 @@
+//
+//  clodcascade.h
+//  OpenCLFaceDetection
+//
+//  Binary cascade format. The XML cascades shipped with OpenCV are flattened
+//  into a single versioned, checksummed file which is mmap'd at load time.
+//  The returned CvHaarClassifierCascade points straight into the mapping, so
+//  loading does not allocate anything per stage, classifier or feature.
+//
+
+#ifndef OpenCLFaceDetection_clodcascade_h
+#define OpenCLFaceDetection_clodcascade_h
+
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv/cvaux.hpp>
+#include "clif.h"
+
+#define CLOD_CASCADE_FILE_MAGIC   "CLOD"
+#define CLOD_CASCADE_FILE_VERSION 1
+
+/* File layout (little endian, every section 4 bytes aligned):
+ *  CLODCascadeFileHeader
+ *  CLODCascadeFileStage      stage[stage_count]
+ *  CLODCascadeFileClassifier classifier[classifier_count]
+ *  CvHaarFeature             feature[node_count]
+ *  cl_float                  threshold[node_count]
+ *  cl_int                    left[node_count]
+ *  cl_int                    right[node_count]
+ *  cl_float                  alpha[node_count + classifier_count]
+ * The checksum covers everything after the header.
+ */
+typedef struct CLODCascadeFileHeader {
+    cl_uchar magic[4];
+    cl_uint version;
+    cl_uint checksum;
+    cl_uint payload_size;
+    cl_int flags;
+    cl_int orig_window_width;
+    cl_int orig_window_height;
+    cl_uint stage_count;
+    cl_uint classifier_count;
+    cl_uint node_count;
+} CLODCascadeFileHeader;
+
+typedef struct CLODCascadeFileStage {
+    cl_float threshold;
+    cl_uint first_classifier;
+    cl_uint classifier_count;
+    cl_int next;
+    cl_int child;
+    cl_int parent;
+} CLODCascadeFileStage;
+
+typedef struct CLODCascadeFileClassifier {
+    cl_uint first_node;
+    cl_uint node_count;
+    cl_uint first_alpha;
+} CLODCascadeFileClassifier;
+
+// mapping is NULL for a cascade built in memory (clodMirrorCascade)
+typedef struct CLODCascade {
+    CvHaarClassifierCascade* cascade;
+    void* mapping;
+    size_t mapping_size;
+} CLODCascade;
+
+// Load a binary cascade. Returns NULL if the file is missing, truncated,
+// of a different version, fails the checksum or has an index (stage,
+// classifier, node, alpha, tree link, feature rect) out of its section
+CLODCascade*
+clodLoadCascade(const char* path);
+
+void
+clodReleaseCascade(CLODCascade* cascade);
+
+// Left-right mirror of a cascade (e.g. haarcascade_profileface for faces
+// looking the other way): every feature rect x is reflected in the window,
+// so the image does not need to be flipped. Trees, thresholds and alphas are
+// shared, source must outlive the mirror. NULL if a tilted rect touches the
+// left edge of the window, its mirror would read the column after the window
+CLODCascade*
+clodMirrorCascade(const CvHaarClassifierCascade* source);
+
+// Write a cascade (usually obtained with cvLoad) in the binary format
+cl_int
+clodWriteCascade(const CvHaarClassifierCascade* cascade,
+                 const char* path);
+
+#endif
@@ -0,0 +1,63 @@
+//
+//  clodconvert.cpp
+//  OpenCLFaceDetection
+//
+//  Converts OpenCV XML cascades to the binary cascade format.
+//  Usage: clodconvert haarcascade_a.xml [haarcascade_b.xml ...]
+//  Each input is written next to itself with the .xml extension replaced by .clod
+//
+
+#include "clod.h"
+#include "clodcascade.h"
+
+int main(int argc, char** argv)
+{
+    if(argc < 2) {
+        printf("Usage: %s cascade.xml [cascade.xml ...]\n", argv[0]);
+        return 1;
+    }
+
+    int failures = 0;
+    for(int i = 1; i < argc; i++) {
+        // Output path
+        char output_path[4096] = { 0 };
+        strncpy(output_path, argv[i], sizeof(output_path) - 6);
+        char* extension = strrchr(output_path, '.');
+        if(extension != NULL && strcmp(extension, ".xml") == 0)
+            *extension = 0;
+        strcat(output_path, ".clod");
+
+        ElapseTime t;
+        t.start();
+        CvHaarClassifierCascade* cascade = (CvHaarClassifierCascade*)cvLoad(argv[i], 0, 0, 0);
+        double xml_time = t.get();
+        if(cascade == NULL) {
+            printf("%s: cannot load cascade\n", argv[i]);
+            failures++;
+            continue;
+        }
+
+        if(clodWriteCascade(cascade, output_path) != CL_SUCCESS) {
+            printf("%s: cannot write %s\n", argv[i], output_path);
+            cvReleaseHaarClassifierCascade(&cascade);
+            failures++;
+            continue;
+        }
+
+        // Check the result loads back and report cold start times
+        t.start();
+        CLODCascade* binary = clodLoadCascade(output_path);
+        double binary_time = t.get();
+        if(binary == NULL || binary->cascade->count != cascade->count) {
+            printf("%s: verification of %s failed\n", argv[i], output_path);
+            failures++;
+        }
+        else
+            printf("%s -> %s (xml %8.4f ms, binary %8.4f ms)\n", argv[i], output_path, xml_time, binary_time);
+
+        clodReleaseCascade(binary);
+        cvReleaseHaarClassifierCascade(&cascade);
+    }
+
+    return failures != 0;
+}
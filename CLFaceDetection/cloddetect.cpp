@@ -0,0 +1,123 @@
+//
+//  cloddetect.cpp
+//  OpenCLFaceDetection
+//
+//  Headless detection, nothing is displayed. Prints the matches of every
+//  image, one per line as "image x y width height".
+//  Usage: cloddetect [-d device|host] [-n min_neighbors] [-m WxH] [-s factor]
+//                    [-f flags] [-t] cascade image...
+//  Cascades are XML or binary (.clod, see clodconvert). Defaults are OpenCL
+//  device 0, 3 neighbours, the cascade window as minimum size and scale factor
+//  1.1. -f takes the clod_flags bits as a number (default per-stage, plus
+//  precomputed features on the host). The first run on a device tunes it
+//  (see clodTuneEnvironment), -t tunes it again
+//
+
+#include "clod.h"
+#include "clodcascade.h"
+#include <opencv2/highgui/highgui.hpp>
+
+#define DETECT_TUNING_SIZE cvSize(640, 480)
+
+int main(int argc, char** argv)
+{
+    int device_index = 0;               // -1 for host only
+    cl_uint min_neighbors = 3;
+    CvSize min_window_size = cvSize(0, 0);
+    cl_float scale_factor = CLOD_DEFAULT_SCALE_FACTOR;
+    int flags = -1;
+    cl_bool retune = CL_FALSE;
+
+    // Options
+    int arg = 1;
+    for(; arg < argc && argv[arg][0] == '-'; arg += 2) {
+        if(strcmp(argv[arg], "-t") == 0) {
+            retune = CL_TRUE;
+            arg--;
+        }
+        else if(arg + 1 >= argc)
+            break;
+        else if(strcmp(argv[arg], "-d") == 0)
+            device_index = strcmp(argv[arg + 1], "host") == 0 ? -1 : atoi(argv[arg + 1]);
+        else if(strcmp(argv[arg], "-n") == 0)
+            min_neighbors = atoi(argv[arg + 1]);
+        else if(strcmp(argv[arg], "-m") == 0)
+            sscanf(argv[arg + 1], "%dx%d", &min_window_size.width, &min_window_size.height);
+        else if(strcmp(argv[arg], "-s") == 0)
+            scale_factor = (cl_float)atof(argv[arg + 1]);
+        else if(strcmp(argv[arg], "-f") == 0)
+            flags = atoi(argv[arg + 1]);
+        else
+            break;
+    }
+    if(argc - arg < 2) {
+        printf("Usage: %s [-d device|host] [-n min_neighbors] [-m WxH] [-s factor] [-f flags] [-t] cascade image...\n", argv[0]);
+        return 1;
+    }
+    cl_bool use_opencl = device_index >= 0;
+    if(flags < 0)
+        flags = use_opencl ? CLOD_PER_STAGE_ITERATIONS : CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS;
+
+    // Cascade
+    const char* extension = strrchr(argv[arg], '.');
+    CLODCascade* binary_cascade = NULL;
+    CvHaarClassifierCascade* cascade = NULL;
+    if(extension != NULL && strcmp(extension, ".clod") == 0) {
+        binary_cascade = clodLoadCascade(argv[arg]);
+        cascade = binary_cascade != NULL ? binary_cascade->cascade : NULL;
+    }
+    else
+        cascade = (CvHaarClassifierCascade*)cvLoad(argv[arg], 0, 0, 0);
+    if(cascade == NULL || !clodIsCascadeSupported(cascade)) {
+        fprintf(stderr, "%s: cannot load or not supported\n", argv[arg]);
+        return 1;
+    }
+    if(min_window_size.width == 0)
+        min_window_size = cascade->orig_window_size;
+
+    CLODEnvironmentData* data = use_opencl ? clodInitEnvironment(device_index) : clodInitHostEnvironment();
+    data->scale_factor = scale_factor;
+    if(use_opencl)
+        clodTuneEnvironment(data, cascade, DETECT_TUNING_SIZE, retune);
+
+    int failures = 0;
+    CvSize buffers_size = cvSize(0, 0);
+    for(int i = arg + 1; i < argc; i++) {
+        IplImage* image = cvLoadImage(argv[i]);
+        if(image == NULL) {
+            fprintf(stderr, "%s: cannot load image\n", argv[i]);
+            failures++;
+            continue;
+        }
+
+        // Buffers follow the image size
+        CvSize image_size = cvSize(image->width, image->height);
+        if(use_opencl && (image_size.width != buffers_size.width || image_size.height != buffers_size.height)) {
+            if(buffers_size.width != 0)
+                clodReleaseBuffers(data);
+            clifInitBuffers(data->clif, image->width, image->height, image->widthStep, image->nChannels);
+            clodInitBuffers(data, &image_size);
+            buffers_size = image_size;
+        }
+
+        CLODDetectObjectsResult result = clodDetectObjects(image, cascade, data, min_window_size, cvSize(0, 0),
+                                                           min_neighbors, (clod_flags)flags, use_opencl);
+        for(cl_uint m = 0; m < result.match_count; m++) {
+            const CLODWeightedRect* match = &result.matches[m];
+            printf("%s %d %d %d %d\n", argv[i], match->rect.x, match->rect.y, match->rect.width, match->rect.height);
+        }
+        free(result.matches);
+        cvReleaseImage(&image);
+    }
+
+    // Release
+    if(buffers_size.width != 0)
+        clodReleaseBuffers(data);
+    clodReleaseEnvironment(data);
+    free(data);
+    if(binary_cascade != NULL)
+        clodReleaseCascade(binary_cascade);
+    else
+        cvReleaseHaarClassifierCascade(&cascade);
+    return failures != 0;
+}
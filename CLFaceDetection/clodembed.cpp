@@ -0,0 +1,69 @@
+//
+//  clodembed.cpp
+//  OpenCLFaceDetection
+//
+//  Writes OpenCL sources as C string constants, so the kernels are built into
+//  the binary instead of being read from a path at startup.
+//  Usage: clodembed clod.cl clif.cl > clodkernels.h
+//  A file named clod.cl becomes clod_cl_source. Run it again after changing
+//  a .cl file.
+//
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+int main(int argc, char** argv)
+{
+    if(argc < 2) {
+        printf("Usage: %s file.cl... > header.h\n", argv[0]);
+        return 1;
+    }
+
+    printf("//\n//  Generated by clodembed from");
+    for(int i = 1; i < argc; i++)
+        printf(" %s", argv[i]);
+    printf(", do not edit\n//\n\n");
+
+    for(int i = 1; i < argc; i++) {
+        FILE* file = fopen(argv[i], "r");
+        if(file == NULL) {
+            fprintf(stderr, "%s: cannot open\n", argv[i]);
+            return 1;
+        }
+
+        // Identifier from the file name, without directories
+        const char* name = strrchr(argv[i], '/');
+        name = name != NULL ? name + 1 : argv[i];
+        printf("static const char ");
+        for(const char* c = name; *c != '\0'; c++)
+            putchar(isalnum((unsigned char)*c) ? *c : '_');
+        printf("_source[] =\n");
+
+        // One literal per line
+        int c;
+        int line_start = 1;
+        while((c = fgetc(file)) != EOF) {
+            if(line_start) {
+                printf("    \"");
+                line_start = 0;
+            }
+            if(c == '\n') {
+                printf("\\n\"\n");
+                line_start = 1;
+            }
+            else if(c == '\\' || c == '"')
+                printf("\\%c", c);
+            else if(c == '\t')
+                printf("\\t");
+            else if(c != '\r')
+                putchar(c);
+        }
+        if(!line_start)
+            printf("\"\n");
+        printf("    \"\";\n\n");
+        fclose(file);
+    }
+
+    return 0;
+}
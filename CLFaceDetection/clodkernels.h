@@ -0,0 +1,643 @@
+//
+//  Generated by clodembed from clod.cl clif.cl, do not edit
+//
+
+static const char clod_cl_source[] =
+    "#pragma OPENCL EXTENSION cl_khr_local_int32_base_atomics : enable\n"
+    "#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable\n"
+    "#pragma OPENCL EXTENSION cl_khr_global_int32_extended_atomics : enable\n"
+    "\n"
+    "// Classifiers are trees (a stump is a one node tree), nodes of a tree are\n"
+    "// stored one after the other starting from the root\n"
+    "\n"
+    "typedef struct KernelOptimizedRect {\n"
+    "    uint left_top_offset;\n"
+    "    uint right_top_offset;\n"
+    "    uint left_bottom_offset;\n"
+    "    uint right_bottom_offset;\n"
+    "    float weight;\n"
+    "} KernelOptimizedRect;\n"
+    "\n"
+    "typedef struct KernelClassifier {\n"
+    "    float alpha[2];\n"
+    "    KernelOptimizedRect rect[3];\n"
+    "    float threshold;\n"
+    "    int left;\n"
+    "    int right;\n"
+    "    uint node_count;\n"
+    "} KernelClassifier;\n"
+    "\n"
+    "typedef struct KernelStage {\n"
+    "    float threshold;\n"
+    "    uint count;\n"
+    "    uint node_count;\n"
+    "    KernelClassifier classifier[MAX_STAGE_NODE_COUNT];\n"
+    "} KernelStage;\n"
+    "\n"
+    "typedef struct KernelSubwindowData {\n"
+    "    uint x;\n"
+    "    uint y;\n"
+    "    uint offset;\n"
+    "    float variance;\n"
+    "} KernelSubwindowData;\n"
+    "    \n"
+    "// stages holds the current stage of each fused cascade, one for a single\n"
+    "// cascade. cascade_src and cascade_dst, the cascade of each window among the\n"
+    "// fused ones, are only given for fused cascades (NULL otherwise)\n"
+    "kernel void runStage(global uint* integral_image,\n"
+    "                     global KernelStage* stages,\n"
+    "                     global KernelSubwindowData* win_src,\n"
+    "                     global KernelSubwindowData* win_dst,\n"
+    "                     uint win_src_count,\n"
+    "                     global uint* win_dst_count,          // [0] windows, [1] nodes (CLOD_COUNTERS)\n"
+    "                     uint scaled_window_area,\n"
+    "                     float current_scale,\n"
+    "                     uint integral_image_width,\n"
+    "                     global uint* cascade_src,\n"
+    "                     global uint* cascade_dst)\n"
+    "{\n"
+    "    uint gid = get_global_id(0);\n"
+    "    \n"
+    "    // Win dst count must be atomic\n"
+    "    if(gid == 0)\n"
+    "        win_dst_count[0] = 0;\n"
+    "    \n"
+    "    if(gid < win_src_count) {\n"
+    "        KernelSubwindowData subwindow = win_src[gid];\n"
+    "        uint cascade = cascade_src != 0 ? cascade_src[gid] : 0;\n"
+    "        global KernelStage* stage = &stages[cascade];\n"
+    "        \n"
+    "        // Iterate over classifiers\n"
+    "        float stage_sum = 0;\n"
+    "        \n"
+    "        uint root = 0;\n"
+    "#ifdef CLOD_COUNTERS\n"
+    "        uint node_count = 0;\n"
+    "#endif\n"
+    "        for(uint classifier_index = 0; classifier_index < stage->count; classifier_index++) {\n"
+    "            // Walk the tree, left and right are node indices or <= 0 for leaves\n"
+    "            int node_index = root;\n"
+    "            int next_index;\n"
+    "            float alpha;\n"
+    "            do {\n"
+    "                global KernelClassifier* classifier = &stage->classifier[node_index];\n"
+    "                \n"
+    "                // Compute threshold normalized by window vaiance\n"
+    "                float norm_threshold = classifier->threshold * subwindow.variance;\n"
+    "                \n"
+    "                float rect_sum = 0;\n"
+    "                \n"
+    "                // Calculation on rectangles (loop unroll)\n"
+    "                rect_sum += (float)(integral_image[subwindow.offset + classifier->rect[0].left_top_offset] -\n"
+    "                                    integral_image[subwindow.offset + classifier->rect[0].right_top_offset] -\n"
+    "                                    integral_image[subwindow.offset + classifier->rect[0].left_bottom_offset] +\n"
+    "                                    integral_image[subwindow.offset + classifier->rect[0].right_bottom_offset]) * classifier->rect[0].weight;\n"
+    "                \n"
+    "                rect_sum += (float)(integral_image[subwindow.offset + classifier->rect[1].left_top_offset] -\n"
+    "                                    integral_image[subwindow.offset + classifier->rect[1].right_top_offset] -\n"
+    "                                    integral_image[subwindow.offset + classifier->rect[1].left_bottom_offset] +\n"
+    "                                    integral_image[subwindow.offset + classifier->rect[1].right_bottom_offset]) * classifier->rect[1].weight;\n"
+    "                \n"
+    "                if(classifier->rect[2].weight != 0) {\n"
+    "                    rect_sum += (float)(integral_image[subwindow.offset + classifier->rect[2].left_top_offset] -\n"
+    "                                        integral_image[subwindow.offset + classifier->rect[2].right_top_offset] -\n"
+    "                                        integral_image[subwindow.offset + classifier->rect[2].left_bottom_offset] +\n"
+    "                                        integral_image[subwindow.offset + classifier->rect[2].right_bottom_offset]) * classifier->rect[2].weight;\n"
+    "                }\n"
+    "                \n"
+    "                // If rect sum less than threshold go left else right (select, no divergence)\n"
+    "                int right = rect_sum >= norm_threshold;\n"
+    "                next_index = select(classifier->left, classifier->right, right);\n"
+    "                alpha = classifier->alpha[right];\n"
+    "                node_index = next_index;\n"
+    "#ifdef CLOD_COUNTERS\n"
+    "                node_count++;\n"
+    "#endif\n"
+    "            } while(next_index > 0);\n"
+    "            \n"
+    "            stage_sum += alpha;\n"
+    "            root += stage->classifier[root].node_count;\n"
+    "        }\n"
+    "#ifdef CLOD_COUNTERS\n"
+    "        atom_add(&win_dst_count[1], node_count);\n"
+    "#endif\n"
+    "        \n"
+    "        // Add subwindow to accepted list\n"
+    "        if(stage_sum >= stage->threshold) {\n"
+    "            uint old_dest_count = atom_inc(win_dst_count);\n"
+    "            win_dst[old_dest_count].x = subwindow.x;\n"
+    "            win_dst[old_dest_count].y = subwindow.y;\n"
+    "            win_dst[old_dest_count].variance = subwindow.variance;\n"
+    "            win_dst[old_dest_count].offset = subwindow.offset;\n"
+    "            if(cascade_dst != 0)\n"
+    "                cascade_dst[old_dest_count] = cascade;\n"
+    "        }\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "/*** Grouping of matches (same result as filterResult on the host) ***/\n"
+    "\n"
+    "typedef struct KernelMatch {\n"
+    "    int x;\n"
+    "    int y;\n"
+    "    int width;\n"
+    "    int height;\n"
+    "} KernelMatch;\n"
+    "\n"
+    "typedef struct KernelGroup {\n"
+    "    int x;\n"
+    "    int y;\n"
+    "    int width;\n"
+    "    int height;\n"
+    "    int weight;\n"
+    "    int root;\n"
+    "} KernelGroup;\n"
+    "\n"
+    "// Uniform grid of the matches of one size class (see buildRectGrid), its\n"
+    "// cells are numbered after the ones of the previous classes\n"
+    "typedef struct KernelGridClass {\n"
+    "    int min_size;\n"
+    "    int cell_size;\n"
+    "    uint column_count;\n"
+    "    uint row_count;\n"
+    "    uint first_cell;\n"
+    "} KernelGridClass;\n"
+    "\n"
+    "// counters[0] matches, counters[1] set if a label changed, counters[2] groups\n"
+    "\n"
+    "int areRectSimilar(KernelMatch r1,\n"
+    "                   KernelMatch r2,\n"
+    "                   float eps)\n"
+    "{\n"
+    "    float delta = eps * (min(r1.width, r2.width) + min(r1.height, r2.height)) * 0.5f;\n"
+    "    return (abs(r1.x - r2.x) <= delta) &&\n"
+    "           (abs(r1.y - r2.y) <= delta) &&\n"
+    "           (abs(r1.x + r1.width - r2.x - r2.width) <= delta) &&\n"
+    "           (abs(r1.y + r1.height - r2.y - r2.height) <= delta);\n"
+    "}\n"
+    "\n"
+    "// Size class of a match of width + height size, classes are sorted by size\n"
+    "uint gridClass(global KernelGridClass* classes,\n"
+    "               uint class_count,\n"
+    "               int size)\n"
+    "{\n"
+    "    uint c = 0;\n"
+    "    while(c + 1 < class_count && size >= classes[c + 1].min_size)\n"
+    "        c++;\n"
+    "    return c;\n"
+    "}\n"
+    "\n"
+    "// Clamped to the grid, clamping never moves two matches further apart\n"
+    "uint gridColumn(KernelGridClass grid_class,\n"
+    "                int x)\n"
+    "{\n"
+    "    return min((uint)(x / grid_class.cell_size), grid_class.column_count - 1);\n"
+    "}\n"
+    "\n"
+    "uint gridRow(KernelGridClass grid_class,\n"
+    "             int y)\n"
+    "{\n"
+    "    return min((uint)(y / grid_class.cell_size), grid_class.row_count - 1);\n"
+    "}\n"
+    "\n"
+    "kernel void appendMatches(global KernelSubwindowData* windows,\n"
+    "                          uint window_count,\n"
+    "                          int window_width,\n"
+    "                          int window_height,\n"
+    "                          global KernelMatch* matches,\n"
+    "                          global uint* counters,\n"
+    "                          uint capacity)\n"
+    "{\n"
+    "    uint gid = get_global_id(0);\n"
+    "    \n"
+    "    if(gid < window_count) {\n"
+    "        // Overflow is detected on the host comparing counters[0] with capacity\n"
+    "        uint index = atom_inc(&counters[0]);\n"
+    "        if(index < capacity) {\n"
+    "            matches[index].x = windows[gid].x;\n"
+    "            matches[index].y = windows[gid].y;\n"
+    "            matches[index].width = window_width;\n"
+    "            matches[index].height = window_height;\n"
+    "        }\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "kernel void initGroups(global int* labels,\n"
+    "                       global int* sums,\n"
+    "                       uint count)\n"
+    "{\n"
+    "    uint gid = get_global_id(0);\n"
+    "    \n"
+    "    if(gid < count) {\n"
+    "        labels[gid] = gid;\n"
+    "        for(uint i = 0; i < 5; i++)\n"
+    "            sums[(gid * 5) + i] = 0;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "kernel void initCells(global int* cell_heads,\n"
+    "                      uint cell_count)\n"
+    "{\n"
+    "    uint gid = get_global_id(0);\n"
+    "    \n"
+    "    if(gid < cell_count)\n"
+    "        cell_heads[gid] = -1;\n"
+    "}\n"
+    "\n"
+    "// Each cell is a list of matches: cell_heads holds the first, next the\n"
+    "// following one of the same cell (-1 ends the list)\n"
+    "kernel void bucketMatches(global KernelMatch* matches,\n"
+    "                          global KernelGridClass* classes,\n"
+    "                          uint class_count,\n"
+    "                          global int* cell_heads,\n"
+    "                          global int* next,\n"
+    "                          uint count)\n"
+    "{\n"
+    "    uint gid = get_global_id(0);\n"
+    "    \n"
+    "    if(gid < count) {\n"
+    "        KernelMatch r = matches[gid];\n"
+    "        KernelGridClass grid_class = classes[gridClass(classes, class_count, r.width + r.height)];\n"
+    "        uint cell = grid_class.first_cell + (gridRow(grid_class, r.y) * grid_class.column_count) + gridColumn(grid_class, r.x);\n"
+    "        next[gid] = atomic_xchg(&cell_heads[cell], (int)gid);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "// Labels only decrease and always point to a match of the same connected\n"
+    "// component, at the fixed point every match is labeled with the smallest index\n"
+    "// of its component (the order partitionData enumerates classes in). Only the\n"
+    "// cells around the match in its size class and in the ones before and after\n"
+    "// it are searched, labels are pulled so both sides of a pair look\n"
+    "kernel void propagateLabels(global KernelMatch* matches,\n"
+    "                            global int* labels,\n"
+    "                            global uint* counters,\n"
+    "                            uint count,\n"
+    "                            float eps,\n"
+    "                            global KernelGridClass* classes,\n"
+    "                            uint class_count,\n"
+    "                            global int* cell_heads,\n"
+    "                            global int* next)\n"
+    "{\n"
+    "    uint gid = get_global_id(0);\n"
+    "    \n"
+    "    if(gid < count) {\n"
+    "        KernelMatch r = matches[gid];\n"
+    "        int label = labels[gid];\n"
+    "        int new_label = labels[label];\n"
+    "        uint own_class = gridClass(classes, class_count, r.width + r.height);\n"
+    "        for(uint c = max(own_class, 1u) - 1; c < min(own_class + 2, class_count); c++) {\n"
+    "            KernelGridClass grid_class = classes[c];\n"
+    "            int column = gridColumn(grid_class, r.x);\n"
+    "            int row = gridRow(grid_class, r.y);\n"
+    "            for(int neighbour_row = max(row - 1, 0); neighbour_row <= min(row + 1, (int)grid_class.row_count - 1); neighbour_row++) {\n"
+    "                for(int neighbour_column = max(column - 1, 0); neighbour_column <= min(column + 1, (int)grid_class.column_count - 1); neighbour_column++) {\n"
+    "                    int j = cell_heads[grid_class.first_cell + (neighbour_row * grid_class.column_count) + neighbour_column];\n"
+    "                    for(; j >= 0; j = next[j]) {\n"
+    "                        if(j != (int)gid && areRectSimilar(r, matches[j], eps))\n"
+    "                            new_label = min(new_label, labels[j]);\n"
+    "                    }\n"
+    "                }\n"
+    "            }\n"
+    "        }\n"
+    "        \n"
+    "        if(new_label < label) {\n"
+    "            // Hook the old root as well, halves the number of iterations\n"
+    "            atom_min(&labels[gid], new_label);\n"
+    "            atom_min(&labels[label], new_label);\n"
+    "            atomic_xchg(&counters[1], 1);\n"
+    "        }\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "kernel void accumulateGroups(global KernelMatch* matches,\n"
+    "                             global int* labels,\n"
+    "                             global int* sums,\n"
+    "                             uint count)\n"
+    "{\n"
+    "    uint gid = get_global_id(0);\n"
+    "    \n"
+    "    if(gid < count) {\n"
+    "        KernelMatch r = matches[gid];\n"
+    "        int root = labels[gid];\n"
+    "        atom_add(&sums[(root * 5) + 0], r.x);\n"
+    "        atom_add(&sums[(root * 5) + 1], r.y);\n"
+    "        atom_add(&sums[(root * 5) + 2], r.width);\n"
+    "        atom_add(&sums[(root * 5) + 3], r.height);\n"
+    "        atom_inc(&sums[(root * 5) + 4]);\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "kernel void compactGroups(global int* labels,\n"
+    "                          global int* sums,\n"
+    "                          global KernelGroup* groups,\n"
+    "                          global uint* counters,\n"
+    "                          uint count,\n"
+    "                          int group_threshold)\n"
+    "{\n"
+    "    uint gid = get_global_id(0);\n"
+    "    \n"
+    "    if(gid < count && labels[gid] == (int)gid) {\n"
+    "        int n = sums[(gid * 5) + 4];\n"
+    "        // Groups at or below the threshold are never part of the result\n"
+    "        if(n > group_threshold) {\n"
+    "            float s = 1.f / (float)n;\n"
+    "            uint index = atom_inc(&counters[2]);\n"
+    "            groups[index].x = (int)min(sums[(gid * 5) + 0] * s, (float)INT_MAX);\n"
+    "            groups[index].y = (int)min(sums[(gid * 5) + 1] * s, (float)INT_MAX);\n"
+    "            groups[index].width = (int)min(sums[(gid * 5) + 2] * s, (float)INT_MAX);\n"
+    "            groups[index].height = (int)min(sums[(gid * 5) + 3] * s, (float)INT_MAX);\n"
+    "            groups[index].weight = n;\n"
+    "            groups[index].root = gid;\n"
+    "        }\n"
+    "    }\n"
+    "}\n"
+    "";
+
+static const char clif_cl_source[] =
+    "constant float rgb_to_grayscale_coeff[4] = { 0.299, 0.587, 0.114, 0 };\n"
+    "constant float4 rgb_to_grayscale_coeff_v = (0.299, 0.587, 0.114, 0);\n"
+    "\n"
+    "kernel void bgrToGrayscale(global uchar* src,\n"
+    "                           global uchar* dst,\n"
+    "                           uint width,\n"
+    "                           uint height,\n"
+    "                           uint stride)\n"
+    "{\n"
+    "    int coord = (get_global_id(1) * stride) + (get_global_id(0) * 3);\n"
+    "    \n"
+    "    // Fixed point coefficients of cvCvtColor (CV_BGR2GRAY), so that device and host integral images match\n"
+    "    uint temp = (src[coord] * 1868 + src[coord + 1] * 9617 + src[coord + 2] * 4899 + (1 << 13)) >> 14;\n"
+    "    \n"
+    "    dst[(get_global_id(1) * width) + get_global_id(0)] = (uchar)temp;\n"
+    "}\n"
+    "\n"
+    "kernel void bgraToGrayscale(global uchar4* src,\n"
+    "                            global uchar* dst,\n"
+    "                            uint width,\n"
+    "                            uint height,\n"
+    "                            uint stride)\n"
+    "{\n"
+    "    int coord = (get_global_id(1) * stride) + (get_global_id(0) * 4);\n"
+    "    uchar4 data = src[coord];\n"
+    "    float result1 = data.x * rgb_to_grayscale_coeff_v.x;\n"
+    "    float result2 = data.y * rgb_to_grayscale_coeff_v.y;\n"
+    "    float result3 = data.z * rgb_to_grayscale_coeff_v.z;\n"
+    "    uint result = clamp((uint)(result1 + result2 + result3), (uint)0, (uint)255);\n"
+    "    dst[(get_global_id(1) * width) + get_global_id(0)] = (uchar)result;\n"
+    "}\n"
+    "\n"
+    "kernel void bgrToGrayscalePerRow(global uchar3* src,\n"
+    "                                 global uchar4* dst,\n"
+    "                                 uint width,\n"
+    "                                 uint stride)\n"
+    "{\n"
+    "    int src_start = (get_global_id(0) * stride);\n"
+    "    int dst_start = (get_global_id(0) * (width >> 2));\n"
+    "    uchar3 src_pixel;\n"
+    "    uchar4 dst_pixels;\n"
+    "    uint temp;\n"
+    "    uint dst_index = 0;\n"
+    "    for(uint i = 0; i < width; i+=4) {\n"
+    "        src_pixel = src[src_start + i];\n"
+    "        temp = (uint)(rgb_to_grayscale_coeff[2] * src_pixel.x +\n"
+    "                      rgb_to_grayscale_coeff[1] * src_pixel.y +\n"
+    "                      rgb_to_grayscale_coeff[0] * src_pixel.z);\n"
+    "        dst_pixels.x = (uchar)clamp((uint)temp, (uint)0, (uint)255);\n"
+    "        \n"
+    "        src_pixel = src[src_start + i + 1];\n"
+    "        temp = (uint)(rgb_to_grayscale_coeff[2] * src_pixel.x +\n"
+    "                      rgb_to_grayscale_coeff[1] * src_pixel.y +\n"
+    "                      rgb_to_grayscale_coeff[0] * src_pixel.z);\n"
+    "        dst_pixels.y = (uchar)clamp((uint)temp, (uint)0, (uint)255);\n"
+    "        \n"
+    "        src_pixel = src[src_start + i + 2];\n"
+    "        temp = (uint)(rgb_to_grayscale_coeff[2] * src_pixel.x +\n"
+    "                      rgb_to_grayscale_coeff[1] * src_pixel.y +\n"
+    "                      rgb_to_grayscale_coeff[0] * src_pixel.z);\n"
+    "        dst_pixels.z = (uchar)clamp((uint)temp, (uint)0, (uint)255);\n"
+    "        \n"
+    "        src_pixel = src[src_start + i + 3];\n"
+    "        temp = (uint)(rgb_to_grayscale_coeff[2] * src_pixel.x +\n"
+    "                      rgb_to_grayscale_coeff[1] * src_pixel.y +\n"
+    "                      rgb_to_grayscale_coeff[0] * src_pixel.z);\n"
+    "        dst_pixels.w = (uchar)clamp((uint)temp, (uint)0, (uint)255);\n"
+    "        \n"
+    "        dst[dst_start + dst_index] = dst_pixels;\n"
+    "        dst_index++;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "\n"
+    "// Input is grayscale 8U image\n"
+    "// Output are the row sums and square row sums of a (width + 1) * (height + 1)\n"
+    "// image, rows 1..height (row 0 is not used by integralImageSumCols)\n"
+    "kernel void integralImageSumRows(global uchar* src,\n"
+    "                                 global uint* dst,\n"
+    "                                 global ulong* dst_square,\n"
+    "                                 uint width,\n"
+    "                                 uint stride)\n"
+    "{\n"
+    "    int src_start = get_global_id(0) * stride;\n"
+    "    int dst_start = (get_global_id(0) + 1) * (width + 1);\n"
+    "    \n"
+    "    dst[dst_start] = 0;\n"
+    "    dst_square[dst_start] = 0;\n"
+    "    uint sum = 0;\n"
+    "    ulong sum_square = 0;\n"
+    "    for(uint col = 0; col < width; col++) {\n"
+    "        uchar src_el = src[src_start + col];\n"
+    "        sum += src_el;\n"
+    "        sum_square += (uint)(src_el * src_el);\n"
+    "        dst[dst_start + col + 1] = sum;\n"
+    "        dst_square[dst_start + col + 1] = sum_square;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "// Input are the row sums of integralImageSumRows, a work item per column 1..width\n"
+    "// Output is the integral image and square integral image (same as cvIntegral),\n"
+    "// first row and column are 0\n"
+    "kernel void integralImageSumCols(global uint* src,\n"
+    "                                 global ulong* src_square,\n"
+    "                                 global uint* dst,\n"
+    "                                 global ulong* dst_square,\n"
+    "                                 uint width,\n"
+    "                                 uint height)\n"
+    "{\n"
+    "    int col = get_global_id(0) + 1;\n"
+    "    \n"
+    "    dst[col] = 0;\n"
+    "    dst_square[col] = 0;\n"
+    "    if(col == 1) {\n"
+    "        for(uint row = 0; row <= height; row++) {\n"
+    "            dst[row * (width + 1)] = 0;\n"
+    "            dst_square[row * (width + 1)] = 0;\n"
+    "        }\n"
+    "    }\n"
+    "    \n"
+    "    uint sum = 0;\n"
+    "    ulong sum_square = 0;\n"
+    "    for(uint row = 1; row <= height; row++) {\n"
+    "        sum += src[col + (row * (width + 1))];\n"
+    "        sum_square += src_square[col + (row * (width + 1))];\n"
+    "        dst[col + (row * (width + 1))] = sum;\n"
+    "        dst_square[col + (row * (width + 1))] = sum_square;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "// Tilted integral image (the tilted sum of cvIntegral), it follows the\n"
+    "// (width + 1) * (height + 1) integral image in dst. Input are the row sums\n"
+    "// of integralImageSumRows. An element is the running sum of the row sums\n"
+    "// along its x + y diagonal minus the one along its x - y diagonal, one work\n"
+    "// item per diagonal (width + height of each)\n"
+    "kernel void tiltedIntegralSumDiagonals(global uint* src,\n"
+    "                                       global uint* dst,\n"
+    "                                       uint width,\n"
+    "                                       uint height)\n"
+    "{\n"
+    "    // x + y - 1 of the diagonal, first row is 0\n"
+    "    int line = get_global_id(0);\n"
+    "    global uint* tilted = dst + ((width + 1) * (height + 1));\n"
+    "    if(line <= (int)width)\n"
+    "        tilted[line] = 0;\n"
+    "\n"
+    "    uint sum = 0;\n"
+    "    for(int y = 1; y <= (int)height; y++) {\n"
+    "        int x = line - y + 1;\n"
+    "        if(x < 0)\n"
+    "            break;\n"
+    "        sum += src[(y * (width + 1)) + min(x, (int)width)];\n"
+    "        if(x <= (int)width)\n"
+    "            tilted[(y * (width + 1)) + x] = sum;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "// After tiltedIntegralSumDiagonals\n"
+    "kernel void tiltedIntegralSubDiagonals(global uint* src,\n"
+    "                                       global uint* dst,\n"
+    "                                       uint width,\n"
+    "                                       uint height)\n"
+    "{\n"
+    "    // x - y of the diagonal\n"
+    "    int line = (int)get_global_id(0) - (int)height;\n"
+    "    global uint* tilted = dst + ((width + 1) * (height + 1));\n"
+    "\n"
+    "    uint sum = 0;\n"
+    "    for(int y = 1; y <= (int)height; y++) {\n"
+    "        int x = line + y;\n"
+    "        if(x > (int)width)\n"
+    "            break;\n"
+    "        if(x > 0)\n"
+    "            sum += src[(y * (width + 1)) + x - 1];\n"
+    "        if(x >= 0)\n"
+    "            tilted[(y * (width + 1)) + x] -= sum;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "\n"
+    "kernel void invert(global uchar* bmp,\n"
+    "                   global uchar* temp,\n"
+    "                   uint width,\n"
+    "                   uint height,\n"
+    "                   uint stride)\n"
+    "{    \n"
+    "    int coord = (get_global_id(1) * stride) + (get_global_id(0) * 3);\n"
+    "    \n"
+    "    uchar pix = bmp[coord];\n"
+    "    temp[coord] = 255 - pix;\n"
+    "    pix = bmp[coord + 1];\n"
+    "    temp[coord + 1] = 255 - pix;\n"
+    "    pix = bmp[coord + 2];\n"
+    "    temp[coord + 2] = 255 - pix;\n"
+    "}\n"
+    "\n"
+    "// Input is grayscale 8U image\n"
+    "// Output is 1 where |dx| + |dy| of the 3x3 sobel is at least threshold, 0 elsewhere (and on borders)\n"
+    "kernel void sobelEdges(global uchar* src,\n"
+    "                       global uchar* dst,\n"
+    "                       uint width,\n"
+    "                       uint height,\n"
+    "                       int threshold)\n"
+    "{\n"
+    "    int x = get_global_id(0);\n"
+    "    int y = get_global_id(1);\n"
+    "    if(x >= width || y >= height)\n"
+    "        return;\n"
+    "    \n"
+    "    uchar edge = 0;\n"
+    "    if(x > 0 && y > 0 && x < width - 1 && y < height - 1) {\n"
+    "        global uchar* above = &src[(y - 1) * width];\n"
+    "        global uchar* row = &src[y * width];\n"
+    "        global uchar* below = &src[(y + 1) * width];\n"
+    "        int dx = (above[x + 1] + 2 * row[x + 1] + below[x + 1]) - (above[x - 1] + 2 * row[x - 1] + below[x - 1]);\n"
+    "        int dy = (below[x - 1] + 2 * below[x] + below[x + 1]) - (above[x - 1] + 2 * above[x] + above[x + 1]);\n"
+    "        edge = (abs(dx) + abs(dy)) >= threshold;\n"
+    "    }\n"
+    "    dst[(y * width) + x] = edge;\n"
+    "}\n"
+    "\n"
+    "// Input is the 8U edge mask\n"
+    "// Output is a (width + 1) * (height + 1) 32U image, rows summed\n"
+    "kernel void edgeIntegralSumRows(global uchar* src,\n"
+    "                                global uint* dst,\n"
+    "                                uint width)\n"
+    "{\n"
+    "    int src_start = get_global_id(0) * width;\n"
+    "    int dst_start = (get_global_id(0) + 1) * (width + 1);\n"
+    "    \n"
+    "    dst[dst_start] = 0;\n"
+    "    uint sum = 0;\n"
+    "    for(uint col = 0; col < width; col++) {\n"
+    "        sum += src[src_start + col];\n"
+    "        dst[dst_start + col + 1] = sum;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "// Input is the row summed 32U image\n"
+    "// Output is the 32U integral image, first row and column are 0\n"
+    "kernel void edgeIntegralSumCols(global uint* src,\n"
+    "                                global uint* dst,\n"
+    "                                uint width,\n"
+    "                                uint height)\n"
+    "{\n"
+    "    int col = get_global_id(0);\n"
+    "    \n"
+    "    dst[col] = 0;\n"
+    "    uint sum = 0;\n"
+    "    for(uint row = 1; row <= height; row++) {\n"
+    "        sum += src[col + (row * (width + 1))];\n"
+    "        dst[col + (row * (width + 1))] = sum;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "// Input is the grayscale 8U image and the previous one, a work item per block\n"
+    "// Output is 1 for blocks where a pixel changed by more than threshold, the previous image is replaced\n"
+    "kernel void motionBlocks(global uchar* src,\n"
+    "                         global uchar* previous,\n"
+    "                         global uchar* motion,\n"
+    "                         uint width,\n"
+    "                         uint height,\n"
+    "                         uint block_size,\n"
+    "                         int threshold)\n"
+    "{\n"
+    "    uint block_x = get_global_id(0);\n"
+    "    uint block_y = get_global_id(1);\n"
+    "    uint block_columns = (width + block_size - 1) / block_size;\n"
+    "    uint block_rows = (height + block_size - 1) / block_size;\n"
+    "    if(block_x >= block_columns || block_y >= block_rows)\n"
+    "        return;\n"
+    "    \n"
+    "    uchar moved = 0;\n"
+    "    uint end_y = min((block_y + 1) * block_size, height);\n"
+    "    uint end_x = min((block_x + 1) * block_size, width);\n"
+    "    for(uint y = block_y * block_size; y < end_y; y++) {\n"
+    "        for(uint x = block_x * block_size; x < end_x; x++) {\n"
+    "            uint i = (y * width) + x;\n"
+    "            if(abs((int)src[i] - (int)previous[i]) > threshold)\n"
+    "                moved = 1;\n"
+    "            previous[i] = src[i];\n"
+    "        }\n"
+    "    }\n"
+    "    motion[(block_y * block_columns) + block_x] = moved;\n"
+    "}\n"
+    "";
+
@@ -0,0 +1,471 @@
+//
+//  clodmicro.cpp
+//  OpenCLFaceDetection
+//
+//  Cost of each pipeline primitive on its own, per backend and image size:
+//  grayscale, integral image, window variance, cascade stages and grouping.
+//  OpenCL cases report kernel time from profiling events (see clodprofile.h),
+//  "opencl total" cases the wall time including transfers.
+//  Usage: clodmicro [-n iterations] [-r WxH]... [-i image] cascade.xml
+//         clodmicro -g hits
+//  Without -i a noise image is used, grouping then usually has nothing to do.
+//  With -g the grid grouping is checked against the pairwise one on random
+//  hit sets of up to hits matches at every scale, nothing else runs.
+//  Prints the median of the iterations as CSV: ns per item (pixel, window,
+//  stage evaluation or match) and GB/s for the primitives with a known
+//  memory traffic
+//
+
+#include "clod.h"
+#include <opencv2/highgui/highgui.hpp>
+
+#define MICRO_MAX_SIZES 16
+
+// Internal to clod.cpp
+cl_float
+computeVariance(const CvMat* integral_image,
+                const CvMat* square_integral_image,
+                const CvRect* equ_rect,
+                const CvPoint* point,
+                const cl_uint scaled_window_area);
+cl_uint
+filterResult(CLODWeightedRect* data,
+             const cl_uint count,
+             const int group_threshold,
+             const cl_float eps);
+cl_uint
+areRectSimilar(const CLODWeightedRect* r1,
+               const CLODWeightedRect* r2,
+               const cl_float eps);
+cl_int
+partitionData(const CLODWeightedRect* data,
+              const cl_uint count,
+              const cl_float eps,
+              int** labels);
+
+typedef struct MicroContext {
+    CLODEnvironmentData* data;
+    const CvHaarClassifierCascade* cascade;
+    IplImage* frame;
+    IplImage* grayscale;
+    CvMat* integral_image;
+    CvMat* square_integral_image;
+    CLODWeightedRect* matches;          // ungrouped matches of frame
+    cl_uint match_count;
+    cl_ulong items;                     // set by every case
+} MicroContext;
+
+/* One run, returns ms */
+typedef double (*MicroCase)(MicroContext* context);
+
+typedef struct MicroEntry {
+    const char* primitive;
+    const char* backend;
+    const char* unit;
+    double bytes_per_item;              // 0 if unknown
+    MicroCase run;
+} MicroEntry;
+
+int
+compareDoubles(const void* a,
+               const void* b)
+{
+    double da = *(const double*)a;
+    double db = *(const double*)b;
+    return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+/* Windows entering any stage in the last detection */
+cl_ulong
+countStageEvaluations(const CLODStageStatistics* statistics)
+{
+    cl_ulong count = 0;
+    for(cl_uint s = 0; s < statistics->scale_count; s++) {
+        count += statistics->last_window_count[s];
+        for(cl_uint i = 0; i + 1 < statistics->stage_count; i++)
+            count += statistics->last_survivor_count[(s * statistics->stage_count) + i];
+    }
+    return count;
+}
+
+/* Device time of the kernels named in names (NULL terminated) */
+double
+profileKernelTime(const CLODProfile* profile,
+                  const char** names)
+{
+    double time = 0;
+    for(cl_uint i = 0; names[i] != NULL; i++)
+        time += clodProfileTime(profile, names[i]);
+    return time;
+}
+
+double
+grayscaleOpenCV(MicroContext* context)
+{
+    ElapseTime t;
+    t.start();
+    cvCvtColor(context->frame, context->grayscale, CV_BGR2GRAY);
+    context->items = context->frame->width * context->frame->height;
+    return t.get();
+}
+
+/* clifGrayscale maps its output, unmapped here */
+double
+runGrayscaleOpenCL(MicroContext* context)
+{
+    CLIFEnvironmentData* clif = context->data->clif;
+    ElapseTime t;
+    t.start();
+    clodProfileBeginFrame(clif->profile);
+    CLIFGrayscaleResult result = clifGrayscale(context->frame, clif, CL_TRUE);
+    clEnqueueUnmapMemObject(clif->environment.queue, clif->bgr_to_gray_data.buffers[1], result.image->imageData, 0, NULL, NULL);
+    clFinish(clif->environment.queue);
+    clodProfileEndFrame(clif->profile);
+    cvReleaseImageHeader(&result.image);
+    context->items = context->frame->width * context->frame->height;
+    return t.get();
+}
+
+double
+grayscaleOpenCLKernel(MicroContext* context)
+{
+    const char* names[] = { "bgrToGrayscale", NULL };
+    runGrayscaleOpenCL(context);
+    return profileKernelTime(clodGetProfile(context->data), names);
+}
+
+double
+integralOpenCV(MicroContext* context)
+{
+    ElapseTime t;
+    t.start();
+    cvIntegral(context->grayscale, context->integral_image, context->square_integral_image);
+    context->items = context->frame->width * context->frame->height;
+    return t.get();
+}
+
+/* clifGrayscaleIntegral maps both integral images, unmapped here */
+double
+runIntegralOpenCL(MicroContext* context)
+{
+    CLIFEnvironmentData* clif = context->data->clif;
+    ElapseTime t;
+    t.start();
+    clodProfileBeginFrame(clif->profile);
+    CLIFIntegralResult result = clifGrayscaleIntegral(context->frame, clif, CL_FALSE, CL_TRUE);
+    clEnqueueUnmapMemObject(clif->environment.queue, clif->integral_image_data.buffers[3], result.image->data.ptr, 0, NULL, NULL);
+    clEnqueueUnmapMemObject(clif->environment.queue, clif->integral_image_data.buffers[4], result.square_image->data.ptr, 0, NULL, NULL);
+    clFinish(clif->environment.queue);
+    clodProfileEndFrame(clif->profile);
+    cvReleaseMat(&result.image);
+    cvReleaseMat(&result.square_image);
+    context->items = context->frame->width * context->frame->height;
+    return t.get();
+}
+
+double
+integralOpenCLKernel(MicroContext* context)
+{
+    const char* names[] = { "integralImageSumRows", "integralImageSumCols", NULL };
+    runIntegralOpenCL(context);
+    return profileKernelTime(clodGetProfile(context->data), names);
+}
+
+/* Every window position of the first scale */
+double
+varianceHost(MicroContext* context)
+{
+    const CvSize window = context->cascade->orig_window_size;
+    CvRect equ_rect = cvRect(1, 1, window.width - 2, window.height - 2);
+    cl_uint area = equ_rect.width * equ_rect.height;
+    volatile cl_float sink = 0;
+    ElapseTime t;
+    t.start();
+    context->items = 0;
+    for(cl_int y = 0; y + window.height < context->frame->height; y++) {
+        for(cl_int x = 0; x + window.width < context->frame->width; x++) {
+            CvPoint point = cvPoint(x, y);
+            sink += computeVariance(context->integral_image, context->square_integral_image, &equ_rect, &point, area);
+            context->items++;
+        }
+    }
+    return t.get();
+}
+
+double
+stageHost(MicroContext* context)
+{
+    ElapseTime t;
+    t.start();
+    CLODDetectObjectsResult result = clodDetectObjects(context->frame, context->cascade, context->data,
+                                                       context->cascade->orig_window_size, cvSize(0, 0), 0,
+                                                       CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS, CL_FALSE);
+    double time = t.get();
+    free(result.matches);
+    context->items = countStageEvaluations(clodGetStageStatistics(context->data));
+    return time;
+}
+
+double
+stageOpenCLKernel(MicroContext* context)
+{
+    const char* names[] = { "runStage", NULL };
+    CLODDetectObjectsResult result = clodDetectObjects(context->frame, context->cascade, context->data,
+                                                       context->cascade->orig_window_size, cvSize(0, 0), 0,
+                                                       CLOD_PER_STAGE_ITERATIONS, CL_TRUE);
+    free(result.matches);
+    context->items = countStageEvaluations(clodGetStageStatistics(context->data));
+    return profileKernelTime(clodGetProfile(context->data), names);
+}
+
+/* Grouping works in place, on a copy of the matches */
+double
+groupingHost(MicroContext* context)
+{
+    CLODWeightedRect* matches = (CLODWeightedRect*)malloc(MAX(context->match_count, 1) * sizeof(CLODWeightedRect));
+    memcpy(matches, context->matches, context->match_count * sizeof(CLODWeightedRect));
+    ElapseTime t;
+    t.start();
+    filterResult(matches, context->match_count, 3, 0.2f);
+    double time = t.get();
+    free(matches);
+    context->items = context->match_count;
+    return time;
+}
+
+double
+groupingOpenCLKernel(MicroContext* context)
+{
+    const char* names[] = { "initGroups", "propagateLabels", "accumulateGroups", "compactGroups", NULL };
+    CLODDetectObjectsResult result = clodDetectObjects(context->frame, context->cascade, context->data,
+                                                       context->cascade->orig_window_size, cvSize(0, 0), 3,
+                                                       CLOD_PER_STAGE_ITERATIONS | CLOD_DEVICE_GROUPING, CL_TRUE);
+    free(result.matches);
+    // The device groups its own matches, not the host ones of context->matches
+    context->items = context->data->grouping_data.match_count;
+    return profileKernelTime(clodGetProfile(context->data), names);
+}
+
+/* Root of i, halving the path */
+int
+findPartitionRoot(int* parent,
+                  int i)
+{
+    while(parent[i] != i)
+        i = parent[i] = parent[parent[i]];
+    return i;
+}
+
+/* partitionData comparing every pair, labels numbered in order of first
+ * appearance as partitionData does
+ */
+cl_int
+partitionPairwise(const CLODWeightedRect* data,
+                  const cl_uint count,
+                  const cl_float eps,
+                  int* labels)
+{
+    int* parent = (int*)malloc(MAX(count, 1) * sizeof(int));
+    for(cl_uint i = 0; i < count; i++)
+        parent[i] = i;
+    for(cl_uint i = 0; i < count; i++)
+        for(cl_uint j = i + 1; j < count; j++)
+            if(areRectSimilar(&data[i], &data[j], eps))
+                parent[findPartitionRoot(parent, i)] = findPartitionRoot(parent, j);
+    
+    int* root_label = (int*)malloc(MAX(count, 1) * sizeof(int));
+    for(cl_uint i = 0; i < count; i++)
+        root_label[i] = -1;
+    cl_int class_count = 0;
+    for(cl_uint i = 0; i < count; i++) {
+        int root = findPartitionRoot(parent, i);
+        if(root_label[root] < 0)
+            root_label[root] = class_count++;
+        labels[i] = root_label[root];
+    }
+    free(parent);
+    free(root_label);
+    return class_count;
+}
+
+/* Grid grouping against the pairwise one, on hits clustered around random
+ * objects of every scale (20 to about 460 pixels) plus scattered ones.
+ * Returns the number of hit sets that differ
+ */
+cl_uint
+checkGrouping(const cl_uint max_hit_count)
+{
+    const cl_float eps_values[] = { 0.2f, 0.05f, 0.5f, 0 };
+    CvRNG rng = cvRNG(0x12345);
+    cl_uint failures = 0;
+    printf("hits,eps,groups,pairwise_ms,grid_ms,result\n");
+    for(cl_uint hit_count = 1; ; hit_count = MIN(hit_count * 4, max_hit_count)) {
+        for(cl_uint e = 0; e < sizeof(eps_values) / sizeof(cl_float); e++) {
+            cl_float eps = eps_values[e];
+            CLODWeightedRect* hits = (CLODWeightedRect*)malloc(hit_count * sizeof(CLODWeightedRect));
+            cl_uint object_count = MAX(hit_count / 40, 1);
+            CvPoint* objects = (CvPoint*)malloc(object_count * sizeof(CvPoint));
+            for(cl_uint o = 0; o < object_count; o++)
+                objects[o] = cvPoint(cvRandInt(&rng) % 1900, cvRandInt(&rng) % 1000);
+            for(cl_uint i = 0; i < hit_count; i++) {
+                int width = (int)lrint(20 * pow(1.1, cvRandInt(&rng) % 33));
+                CvPoint center = (cvRandInt(&rng) % 4) != 0 ? objects[cvRandInt(&rng) % object_count] : cvPoint(cvRandInt(&rng) % 1900, cvRandInt(&rng) % 1000);
+                hits[i].rect = cvRect(center.x + (int)(cvRandInt(&rng) % (width / 4 + 1)) - width / 8,
+                                      center.y + (int)(cvRandInt(&rng) % (width / 4 + 1)) - width / 8,
+                                      width, width + (cvRandInt(&rng) % 3));
+                hits[i].weight = 0;
+            }
+            
+            int* pairwise_labels = (int*)malloc(hit_count * sizeof(int));
+            int* grid_labels;
+            ElapseTime t;
+            t.start();
+            cl_int pairwise_count = partitionPairwise(hits, hit_count, eps, pairwise_labels);
+            double pairwise_time = t.get();
+            t.start();
+            cl_int grid_count = partitionData(hits, hit_count, eps, &grid_labels);
+            double grid_time = t.get();
+            
+            cl_bool same = pairwise_count == grid_count;
+            for(cl_uint i = 0; same && i < hit_count; i++)
+                same = pairwise_labels[i] == grid_labels[i];
+            failures += !same;
+            printf("%u,%.2f,%d,%.3f,%.3f,%s\n", hit_count, eps, grid_count, pairwise_time, grid_time, same ? "same" : "DIFFERENT");
+            
+            // Release
+            free(hits);
+            free(objects);
+            free(pairwise_labels);
+            free(grid_labels);
+        }
+        if(hit_count == max_hit_count)
+            break;
+    }
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    cl_uint iterations = 20;
+    const char* image_path = NULL;
+    CvSize sizes[MICRO_MAX_SIZES];
+    cl_uint size_count = 0;
+
+    // Options
+    int arg = 1;
+    for(; arg + 1 < argc && argv[arg][0] == '-'; arg += 2) {
+        if(strcmp(argv[arg], "-n") == 0)
+            iterations = MAX(atoi(argv[arg + 1]), 1);
+        else if(strcmp(argv[arg], "-i") == 0)
+            image_path = argv[arg + 1];
+        else if(strcmp(argv[arg], "-g") == 0)
+            return checkGrouping(MAX(atoi(argv[arg + 1]), 1)) != 0;
+        else if(strcmp(argv[arg], "-r") == 0 && size_count < MICRO_MAX_SIZES &&
+                sscanf(argv[arg + 1], "%dx%d", &sizes[size_count].width, &sizes[size_count].height) == 2)
+            size_count++;
+        else
+            break;
+    }
+    if(arg >= argc) {
+        printf("Usage: %s [-n iterations] [-r WxH]... [-i image] cascade.xml\n", argv[0]);
+        printf("       %s -g hits\n", argv[0]);
+        return 1;
+    }
+    if(size_count == 0) {
+        sizes[size_count++] = cvSize(320, 240);
+        sizes[size_count++] = cvSize(640, 480);
+        sizes[size_count++] = cvSize(1280, 720);
+        sizes[size_count++] = cvSize(1920, 1080);
+    }
+
+    CvHaarClassifierCascade* cascade = (CvHaarClassifierCascade*)cvLoad(argv[arg], 0, 0, 0);
+    if(cascade == NULL || !clodIsCascadeSupported(cascade)) {
+        printf("%s: cannot load or not supported\n", argv[arg]);
+        return 1;
+    }
+    IplImage* source = image_path != NULL ? cvLoadImage(image_path, CV_LOAD_IMAGE_COLOR) : NULL;
+    if(image_path != NULL && source == NULL) {
+        printf("%s: cannot load image\n", image_path);
+        return 1;
+    }
+
+    // Bytes read and written per item, where they are known
+    MicroEntry entries[] = {
+        { "grayscale", "opencv", "pixel", 4, grayscaleOpenCV },
+        { "grayscale", "opencl", "pixel", 4, grayscaleOpenCLKernel },
+        { "grayscale", "opencl total", "pixel", 4, runGrayscaleOpenCL },
+        { "integral", "opencv", "pixel", 1 + 4 + 8, integralOpenCV },
+        { "integral", "opencl", "pixel", 1 + 4 + 8, integralOpenCLKernel },
+        { "integral", "opencl total", "pixel", 3 + 4 + 8, runIntegralOpenCL },
+        { "variance", "host", "window", 4 * (4 + 8), varianceHost },
+        { "stage", "host", "stage", 0, stageHost },
+        { "stage", "opencl", "stage", 0, stageOpenCLKernel },
+        { "grouping", "host", "match", 0, groupingHost },
+        { "grouping", "opencl", "match", 0, groupingOpenCLKernel }
+    };
+    cl_uint entry_count = sizeof(entries) / sizeof(MicroEntry);
+
+    MicroContext context;
+    context.data = clodInitEnvironment(0);
+    context.cascade = cascade;
+    clodEnableProfiling(context.data, CL_TRUE);
+    double* samples = (double*)malloc(iterations * sizeof(double));
+
+    printf("primitive,backend,width,height,items,unit,median_ms,ns_per_item,gb_per_s\n");
+    for(cl_uint r = 0; r < size_count; r++) {
+        CvSize size = sizes[r];
+        context.frame = cvCreateImage(size, IPL_DEPTH_8U, 3);
+        if(source != NULL)
+            cvResize(source, context.frame);
+        else {
+            CvRNG rng = cvRNG(0x12345);
+            cvRandArr(&rng, context.frame, CV_RAND_UNI, cvScalarAll(0), cvScalarAll(256));
+        }
+        context.grayscale = cvCreateImage(size, IPL_DEPTH_8U, 1);
+        context.integral_image = cvCreateMat(size.height + 1, size.width + 1, CV_32SC1);
+        context.square_integral_image = cvCreateMat(size.height + 1, size.width + 1, CV_64FC1);
+        cvCvtColor(context.frame, context.grayscale, CV_BGR2GRAY);
+        cvIntegral(context.grayscale, context.integral_image, context.square_integral_image);
+        clifInitBuffers(context.data->clif, size.width, size.height, context.frame->widthStep, 3);
+        clodInitBuffers(context.data, &size);
+
+        // Ungrouped matches, the grouping input
+        CLODDetectObjectsResult result = clodDetectObjects(context.frame, cascade, context.data,
+                                                           cascade->orig_window_size, cvSize(0, 0), 0,
+                                                           CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS, CL_FALSE);
+        context.matches = result.matches;
+        context.match_count = result.match_count;
+
+        for(cl_uint e = 0; e < entry_count; e++) {
+            // First run builds and warms up, not counted
+            entries[e].run(&context);
+            for(cl_uint i = 0; i < iterations; i++)
+                samples[i] = entries[e].run(&context);
+            qsort(samples, iterations, sizeof(double), compareDoubles);
+            double median = samples[iterations / 2];
+            double ns_per_item = context.items != 0 ? median * 1000000.0 / context.items : 0;
+            double gb_per_s = median > 0 ? entries[e].bytes_per_item * context.items / (median / 1000.0) / 1e9 : 0;
+            printf("%s,%s,%d,%d,%llu,%s,%.4f,%.3f,%.3f\n",
+                   entries[e].primitive, entries[e].backend, size.width, size.height,
+                   (unsigned long long)context.items, entries[e].unit, median, ns_per_item, gb_per_s);
+        }
+
+        // Release
+        clodReleaseBuffers(context.data);
+        free(context.matches);
+        cvReleaseImage(&context.frame);
+        cvReleaseImage(&context.grayscale);
+        cvReleaseMat(&context.integral_image);
+        cvReleaseMat(&context.square_integral_image);
+    }
+
+    // Release
+    clodReleaseEnvironment(context.data);
+    free(context.data);
+    free(samples);
+    if(source != NULL)
+        cvReleaseImage(&source);
+    cvReleaseHaarClassifierCascade(&cascade);
+
+    return 0;
+}
@@ -0,0 +1,169 @@
+//
+//  clodpool.cpp
+//  OpenCLFaceDetection
+//
+
+#include "clodpool.h"
+#include "clodprogram.h"
+
+/* Appends the devices detectors will run on, CPUs split if asked */
+void
+addPoolDevice(CLODDetectorPool* pool,
+              cl_device_id device,
+              const cl_uint cpu_sub_device_count)
+{
+    cl_device_type type = 0;
+    cl_int error = clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(cl_device_type), &type, NULL);
+    clCheckOrExit(error);
+
+    cl_uint compute_units = 0;
+    error = clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &compute_units, NULL);
+    clCheckOrExit(error);
+
+    // Equal partitions, a device that cannot be split is used as a whole
+    cl_uint sub_device_count = 0;
+    cl_device_id* sub_devices = NULL;
+    if((type & CL_DEVICE_TYPE_CPU) && cpu_sub_device_count > 1 && compute_units >= cpu_sub_device_count) {
+        cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_EQUALLY, (cl_device_partition_property)(compute_units / cpu_sub_device_count), 0 };
+        sub_devices = (cl_device_id*)malloc(cpu_sub_device_count * sizeof(cl_device_id));
+        if(clCreateSubDevices(device, properties, cpu_sub_device_count, sub_devices, &sub_device_count) != CL_SUCCESS)
+            sub_device_count = 0;
+    }
+
+    cl_uint count = MAX(sub_device_count, 1);
+    pool->devices = (CLODPoolDevice*)realloc(pool->devices, (pool->device_count + count) * sizeof(CLODPoolDevice));
+    for(cl_uint i = 0; i < count; i++) {
+        CLODPoolDevice* pool_device = &pool->devices[pool->device_count++];
+        pool_device->device = sub_device_count != 0 ? sub_devices[i] : device;
+        pool_device->is_sub_device = sub_device_count != 0;
+        pool_device->busy_count = 0;
+        pool_device->frame_time = 0;
+        pool_device->frame_count = 0;
+    }
+    free(sub_devices);
+}
+
+CLODDetectorPool*
+clodCreateDetectorPool(const CvSize frame_size,
+                       const cl_uint detectors_per_device,
+                       const cl_uint cpu_sub_device_count)
+{
+    CLODDetectorPool* pool = (CLODDetectorPool*)calloc(1, sizeof(CLODDetectorPool));
+    pool->frame_size = frame_size;
+
+    cl_uint platform_device_count = clodGetDeviceCount();
+    for(cl_uint i = 0; i < platform_device_count; i++)
+        addPoolDevice(pool, clodGetDevice(i), cpu_sub_device_count);
+
+    // Every detector has its own kernels, buffers and queue (IplImage rows of BGR frames are 4 bytes aligned)
+    cl_uint per_device = MAX(detectors_per_device, 1);
+    cl_uint frame_stride = ((frame_size.width * 3) + 3) & ~3;
+    pool->detector_count = pool->device_count * per_device;
+    pool->detectors = (CLODPoolDetector*)calloc(pool->detector_count, sizeof(CLODPoolDetector));
+    for(cl_uint i = 0; i < pool->detector_count; i++) {
+        CLODPoolDetector* detector = &pool->detectors[i];
+        detector->device_index = i / per_device;
+        detector->data = clodInitDeviceEnvironment(pool->devices[detector->device_index].device);
+        clifInitBuffers(detector->data->clif, frame_size.width, frame_size.height, frame_stride, 3);
+        clodInitBuffers(detector->data, &frame_size);
+    }
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->condition, NULL);
+
+    return pool;
+}
+
+/* Predicted time of one more frame on a free detector, unmeasured devices go first */
+cl_double
+predictDetectorTime(const CLODDetectorPool* pool,
+                    const CLODPoolDetector* detector)
+{
+    const CLODPoolDevice* device = &pool->devices[detector->device_index];
+    return (device->busy_count + 1) * MAX(device->frame_time, 1.0);
+}
+
+CLODPoolDetector*
+clodAcquirePoolDetector(CLODDetectorPool* pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    CLODPoolDetector* best = NULL;
+    while(best == NULL) {
+        cl_double best_time = 0;
+        for(cl_uint i = 0; i < pool->detector_count; i++) {
+            CLODPoolDetector* detector = &pool->detectors[i];
+            if(detector->busy)
+                continue;
+            cl_double time = predictDetectorTime(pool, detector);
+            if(best == NULL || time < best_time) {
+                best = detector;
+                best_time = time;
+            }
+        }
+        if(best == NULL)
+            pthread_cond_wait(&pool->condition, &pool->mutex);
+    }
+    best->busy = CL_TRUE;
+    pool->devices[best->device_index].busy_count++;
+    pthread_mutex_unlock(&pool->mutex);
+    return best;
+}
+
+void
+clodReleasePoolDetector(CLODDetectorPool* pool,
+                        CLODPoolDetector* detector,
+                        const cl_double frame_time)
+{
+    pthread_mutex_lock(&pool->mutex);
+    CLODPoolDevice* device = &pool->devices[detector->device_index];
+    if(frame_time > 0) {
+        if(device->frame_count == 0)
+            device->frame_time = frame_time;
+        else
+            device->frame_time += CLOD_POOL_TIME_SMOOTHING * (frame_time - device->frame_time);
+        device->frame_count++;
+    }
+    device->busy_count--;
+    detector->busy = CL_FALSE;
+    pthread_cond_signal(&pool->condition);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+CLODDetectObjectsResult
+clodPoolDetectObjects(CLODDetectorPool* pool,
+                      const IplImage* image,
+                      const CvHaarClassifierCascade* cascade,
+                      const CvSize min_window_size,
+                      const CvSize max_window_size,
+                      const cl_uint min_neighbors,
+                      const clod_flags flags)
+{
+    CLODPoolDetector* detector = clodAcquirePoolDetector(pool);
+    ElapseTime t;
+    t.start();
+    CLODDetectObjectsResult result = clodDetectObjects(image, cascade, detector->data,
+                                                       min_window_size, max_window_size,
+                                                       min_neighbors, flags, CL_TRUE);
+    clodReleasePoolDetector(pool, detector, t.get());
+    return result;
+}
+
+void
+clodReleaseDetectorPool(CLODDetectorPool* pool)
+{
+    for(cl_uint i = 0; i < pool->detector_count; i++) {
+        CLODEnvironmentData* data = pool->detectors[i].data;
+        clodReleaseBuffers(data);
+        clodReleaseEnvironment(data);
+        free(data);
+    }
+    for(cl_uint i = 0; i < pool->device_count; i++)
+        if(pool->devices[i].is_sub_device)
+            clReleaseDevice(pool->devices[i].device);
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->condition);
+    free(pool->detectors);
+    free(pool->devices);
+    free(pool);
+}
@@ -0,0 +1,88 @@
+//
+//  clodpool.h
+//  OpenCLFaceDetection
+//
+//  Detection from many threads at once. A CLODEnvironmentData holds one set
+//  of buffers and kernel arguments, so it can only run one detection at a
+//  time; the pool owns several of them (each with its own kernels, buffers
+//  and queue) spread over all the OpenCL devices, CPUs optionally split into
+//  sub-devices. Every detection takes the free detector of the least busy
+//  device.
+//
+//      CLODDetectorPool* pool = clodCreateDetectorPool(cvSize(640, 480), 2, 0);
+//      ... from any thread:
+//      result = clodPoolDetectObjects(pool, frame, cascade, cvSize(40, 40), cvSize(0, 0), 3, flags);
+//      ...
+//      clodReleaseDetectorPool(pool);
+//
+
+#ifndef OpenCLFaceDetection_clodpool_h
+#define OpenCLFaceDetection_clodpool_h
+
+#include <pthread.h>
+#include "clod.h"
+
+// Weight of the last frame in the smoothed time per frame of a device
+#define CLOD_POOL_TIME_SMOOTHING 0.2
+
+typedef struct CLODPoolDevice {
+    cl_device_id device;
+    cl_bool is_sub_device;
+    cl_uint busy_count;
+    cl_double frame_time;               // ms, 0 until a frame completes
+    cl_ulong frame_count;
+} CLODPoolDevice;
+
+typedef struct CLODPoolDetector {
+    CLODEnvironmentData* data;
+    cl_uint device_index;
+    cl_bool busy;
+} CLODPoolDetector;
+
+typedef struct CLODDetectorPool {
+    CvSize frame_size;
+    CLODPoolDevice* devices;
+    cl_uint device_count;
+    CLODPoolDetector* detectors;
+    cl_uint detector_count;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+} CLODDetectorPool;
+
+// detectors_per_device environments are created on every device for frames of
+// frame_size (clodInitBuffers and clifInitBuffers are done). With
+// cpu_sub_device_count > 1 every CPU device is split in that many sub-devices
+// (clCreateSubDevices), each getting detectors_per_device detectors
+CLODDetectorPool*
+clodCreateDetectorPool(const CvSize frame_size,
+                       const cl_uint detectors_per_device,
+                       const cl_uint cpu_sub_device_count);
+
+// Waits for a free detector. Its environment data must not be used by anyone
+// else until clodReleasePoolDetector
+CLODPoolDetector*
+clodAcquirePoolDetector(CLODDetectorPool* pool);
+
+// frame_time (ms) updates the load estimate of the detector device, 0 to skip it
+void
+clodReleasePoolDetector(CLODDetectorPool* pool,
+                        CLODPoolDetector* detector,
+                        const cl_double frame_time);
+
+// clodDetectObjects on the device of an acquired detector, safe from any
+// thread. The caller frees result.matches
+CLODDetectObjectsResult
+clodPoolDetectObjects(CLODDetectorPool* pool,
+                      const IplImage* image,
+                      const CvHaarClassifierCascade* cascade,
+                      const CvSize min_window_size,
+                      const CvSize max_window_size,
+                      const cl_uint min_neighbors,
+                      const clod_flags flags);
+
+// No detection may be running
+void
+clodReleaseDetectorPool(CLODDetectorPool* pool);
+
+#endif
@@ -0,0 +1,184 @@
+//
+//  clodprofile.cpp
+//  OpenCLFaceDetection
+//
+
+#include "clodprofile.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+static cl_double
+hostTime()
+{
+    struct timeval time;
+    gettimeofday(&time, NULL);
+    return (cl_double)(time.tv_sec * 1000) + ((cl_double)time.tv_usec / 1000.0);
+}
+
+/* Queued time of the first command, the origin of printed times */
+static cl_ulong
+profileOrigin(const CLODProfile* profile)
+{
+    cl_ulong origin = 0;
+    for(cl_uint i = 0; i < profile->event_count; i++)
+        if(profile->events[i].queued != 0 && (origin == 0 || profile->events[i].queued < origin))
+            origin = profile->events[i].queued;
+    return origin;
+}
+
+/* Releases the events of the frame, their times are read first if resolve */
+static void
+clearEvents(CLODProfile* profile,
+            const cl_bool resolve)
+{
+    for(cl_uint i = 0; i < profile->event_count; i++) {
+        CLODProfileEvent* event = &profile->events[i];
+        if(event->event == NULL)
+            continue;
+        // Queues without CL_QUEUE_PROFILING_ENABLE give no times, left at 0
+        if(resolve && clWaitForEvents(1, &event->event) == CL_SUCCESS) {
+            clGetEventProfilingInfo(event->event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &event->queued, NULL);
+            clGetEventProfilingInfo(event->event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &event->start, NULL);
+            clGetEventProfilingInfo(event->event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &event->end, NULL);
+        }
+        clReleaseEvent(event->event);
+        event->event = NULL;
+    }
+}
+
+void
+clodInitProfile(CLODProfile* profile)
+{
+    memset(profile, 0, sizeof(CLODProfile));
+    profile->scale_index = profile->stage_index = -1;
+}
+
+void
+clodReleaseProfile(CLODProfile* profile)
+{
+    clearEvents(profile, CL_FALSE);
+    free(profile->events);
+    clodInitProfile(profile);
+}
+
+void
+clodProfileBeginFrame(CLODProfile* profile)
+{
+    if(profile == NULL || !profile->enabled || profile->depth++ != 0)
+        return;
+    clearEvents(profile, CL_FALSE);
+    profile->event_count = 0;
+    profile->scale_index = profile->stage_index = -1;
+    profile->frame_start = hostTime();
+}
+
+void
+clodProfileEndFrame(CLODProfile* profile)
+{
+    if(profile == NULL || profile->depth == 0 || --profile->depth != 0)
+        return;
+    clearEvents(profile, CL_TRUE);
+    profile->host_time = hostTime() - profile->frame_start;
+    profile->scale_index = profile->stage_index = -1;
+    profile->frame_count++;
+}
+
+void
+clodProfileTag(CLODProfile* profile,
+               const cl_int scale_index,
+               const cl_int stage_index)
+{
+    if(profile == NULL)
+        return;
+    profile->scale_index = scale_index;
+    profile->stage_index = stage_index;
+}
+
+cl_event*
+clodProfileEvent(CLODProfile* profile,
+                 const char* name)
+{
+    if(profile == NULL || !profile->enabled || profile->depth == 0)
+        return NULL;
+    if(profile->event_count == profile->capacity) {
+        profile->capacity = profile->capacity != 0 ? profile->capacity * 2 : 256;
+        profile->events = (CLODProfileEvent*)realloc(profile->events, profile->capacity * sizeof(CLODProfileEvent));
+    }
+    CLODProfileEvent* event = &profile->events[profile->event_count++];
+    memset(event, 0, sizeof(CLODProfileEvent));
+    event->name = name;
+    event->scale_index = profile->scale_index;
+    event->stage_index = profile->stage_index;
+    return &event->event;
+}
+
+cl_double
+clodProfileTime(const CLODProfile* profile,
+                const char* name)
+{
+    cl_ulong time = 0;
+    for(cl_uint i = 0; i < profile->event_count; i++) {
+        const CLODProfileEvent* event = &profile->events[i];
+        if(event->end > event->start && (name == NULL || strcmp(event->name, name) == 0))
+            time += event->end - event->start;
+    }
+    return time / 1000000.0;
+}
+
+void
+clodPrintProfileJSON(const CLODProfile* profile,
+                     FILE* file)
+{
+    cl_ulong origin = profileOrigin(profile);
+    fprintf(file, "{\n  \"frame\": %u,\n  \"host_ms\": %.4f,\n  \"device_ms\": %.4f,\n",
+            profile->frame_count, profile->host_time, clodProfileTime(profile, NULL));
+
+    // Totals, in order of first appearance
+    fprintf(file, "  \"totals\": [");
+    cl_uint printed = 0;
+    for(cl_uint i = 0; i < profile->event_count; i++) {
+        const char* name = profile->events[i].name;
+        cl_bool seen = CL_FALSE;
+        for(cl_uint j = 0; j < i && !seen; j++)
+            seen = strcmp(profile->events[j].name, name) == 0;
+        if(seen)
+            continue;
+        cl_uint count = 0;
+        for(cl_uint j = i; j < profile->event_count; j++)
+            count += strcmp(profile->events[j].name, name) == 0;
+        fprintf(file, "%s\n    { \"name\": \"%s\", \"count\": %u, \"ms\": %.4f }",
+                printed++ != 0 ? "," : "", name, count, clodProfileTime(profile, name));
+    }
+    fprintf(file, "\n  ],\n");
+
+    fprintf(file, "  \"events\": [");
+    for(cl_uint i = 0; i < profile->event_count; i++) {
+        const CLODProfileEvent* event = &profile->events[i];
+        fprintf(file, "%s\n    { \"name\": \"%s\", \"scale\": %d, \"stage\": %d, \"queued_ms\": %.4f, \"start_ms\": %.4f, \"end_ms\": %.4f }",
+                i != 0 ? "," : "", event->name, event->scale_index, event->stage_index,
+                event->queued >= origin ? (event->queued - origin) / 1000000.0 : 0,
+                event->start >= origin ? (event->start - origin) / 1000000.0 : 0,
+                event->end >= origin ? (event->end - origin) / 1000000.0 : 0);
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+void
+clodPrintProfileTrace(const CLODProfile* profile,
+                      FILE* file)
+{
+    cl_ulong origin = profileOrigin(profile);
+    fprintf(file, "{\"traceEvents\": [");
+    cl_uint printed = 0;
+    for(cl_uint i = 0; i < profile->event_count; i++) {
+        const CLODProfileEvent* event = &profile->events[i];
+        if(event->end == 0 || event->start < origin || event->end < event->start)
+            continue;
+        fprintf(file, "%s\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"scale\": %d, \"stage\": %d}}",
+                printed++ != 0 ? "," : "", event->name,
+                (event->start - origin) / 1000.0, (event->end - event->start) / 1000.0,
+                event->scale_index, event->stage_index);
+    }
+    fprintf(file, "\n],\n\"displayTimeUnit\": \"ms\"}\n");
+}
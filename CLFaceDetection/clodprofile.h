@@ -0,0 +1,93 @@
+//
+//  clodprofile.h
+//  OpenCLFaceDetection
+//
+//  Device timings of a detection. With profiling on (see clodEnableProfiling)
+//  every write, read, map, unmap and kernel launch of a frame gets a cl_event,
+//  tagged with the scale and stage it belongs to. When the outermost
+//  detection call returns the events are resolved into queued, start and end
+//  times (ns, device clock) and the profile holds that frame until the next.
+//
+//      clodEnableProfiling(data, CL_TRUE);
+//      result = clodDetectObjects(...);
+//      clodPrintProfileTrace(clodGetProfile(data), file);  // chrome://tracing
+//
+
+#ifndef OpenCLFaceDetection_clodprofile_h
+#define OpenCLFaceDetection_clodprofile_h
+
+extern "C" {
+#include "CLEnvironment.h"
+#include "CLDevice.h"
+}
+#include <stdio.h>
+
+typedef struct CLODProfileEvent {
+    const char* name;                   // kernel function or command ("write", "map", ...)
+    cl_int scale_index;                 // -1 outside the scale loop
+    cl_int stage_index;                 // -1 if not a stage launch
+    cl_event event;                     // released once the frame is resolved
+    cl_ulong queued;
+    cl_ulong start;
+    cl_ulong end;
+} CLODProfileEvent;
+
+typedef struct CLODProfile {
+    cl_bool enabled;
+    cl_uint depth;                      // nested frame calls, events are resolved at 0
+    cl_uint frame_count;
+    cl_int scale_index;
+    cl_int stage_index;
+    CLODProfileEvent* events;           // [event_count] of the last frame
+    cl_uint event_count;
+    cl_uint capacity;
+    cl_double frame_start;              // ms, host clock
+    cl_double host_time;                // ms, wall time of the last frame
+} CLODProfile;
+
+// Everything off, no events
+void
+clodInitProfile(CLODProfile* profile);
+
+void
+clodReleaseProfile(CLODProfile* profile);
+
+// Frames nest, only the outermost begin clears the events and only the
+// outermost end waits for and resolves them. profile may be NULL
+void
+clodProfileBeginFrame(CLODProfile* profile);
+
+void
+clodProfileEndFrame(CLODProfile* profile);
+
+// Tags the following commands, -1 for none
+void
+clodProfileTag(CLODProfile* profile,
+               const cl_int scale_index,
+               const cl_int stage_index);
+
+// Event argument of an enqueue. NULL (no event) if profile is NULL, disabled
+// or outside a frame. name must outlive the profile
+cl_event*
+clodProfileEvent(CLODProfile* profile,
+                 const char* name);
+
+// ms spent on the device (start to end) by commands called name, by all of
+// them if name is NULL
+cl_double
+clodProfileTime(const CLODProfile* profile,
+                const char* name);
+
+// Per command totals and every event of the last frame, times in ms from the
+// first queued command
+void
+clodPrintProfileJSON(const CLODProfile* profile,
+                     FILE* file);
+
+// Chrome trace event format (chrome://tracing, Perfetto), one complete event
+// per command, timestamps in us from the first queued command
+void
+clodPrintProfileTrace(const CLODProfile* profile,
+                      FILE* file);
+
+#endif
@@ -0,0 +1,286 @@
+//
+//  clodprogram.cpp
+//  OpenCLFaceDetection
+//
+
+#include "clodprogram.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* FNV-1a, 64 bit, continued from hash */
+static cl_ulong
+hashBytes(cl_ulong hash,
+          const void* data,
+          const size_t size)
+{
+    const cl_uchar* bytes = (const cl_uchar*)data;
+    for(size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static cl_ulong
+hashDeviceString(cl_ulong hash,
+                 cl_device_id device,
+                 cl_device_info param)
+{
+    char value[1024] = { 0 };
+    cl_int error = clGetDeviceInfo(device, param, sizeof(value) - 1, value, NULL);
+    clCheckOrExit(error);
+    return hashBytes(hash, value, strlen(value) + 1);
+}
+
+/* Cache file of a program, empty if there is no cache directory */
+static void
+getCachePath(cl_device_id device,
+             const char* source,
+             const char* build_options,
+             char* path,
+             const size_t path_size)
+{
+    cl_ulong key = 14695981039346656037ull;
+    key = hashDeviceString(key, device, CL_DEVICE_VENDOR);
+    key = hashDeviceString(key, device, CL_DEVICE_NAME);
+    key = hashDeviceString(key, device, CL_DEVICE_VERSION);
+    key = hashDeviceString(key, device, CL_DRIVER_VERSION);
+    key = hashBytes(key, build_options, strlen(build_options) + 1);
+    key = hashBytes(key, source, strlen(source) + 1);
+
+    path[0] = '\0';
+    const char* directory = getenv(CLOD_PROGRAM_CACHE_ENV);
+    const char* home = getenv("HOME");
+    if(directory != NULL)
+        snprintf(path, path_size, "%s", directory);
+    else if(home != NULL)
+        snprintf(path, path_size, "%s/%s", home, CLOD_PROGRAM_CACHE_DIR);
+    else
+        return;
+    mkdir(path, 0755);
+    size_t length = strlen(path);
+    snprintf(path + length, path_size - length, "/%016llx.bin", (unsigned long long)key);
+}
+
+/* Program from a cached binary, NULL if missing or rejected by the driver */
+static cl_program
+loadProgramBinary(cl_context context,
+                  cl_device_id device,
+                  const char* build_options,
+                  const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if(file == NULL)
+        return NULL;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if(size <= 0) {
+        fclose(file);
+        return NULL;
+    }
+    cl_uchar* binary = (cl_uchar*)malloc(size);
+    size_t read_size = fread(binary, 1, size, file);
+    fclose(file);
+
+    cl_program program = NULL;
+    if(read_size == (size_t)size) {
+        size_t binary_size = size;
+        const cl_uchar* binaries[] = { binary };
+        cl_int binary_status = CL_SUCCESS;
+        cl_int error = CL_SUCCESS;
+        program = clCreateProgramWithBinary(context, 1, &device, &binary_size, binaries, &binary_status, &error);
+        if(error != CL_SUCCESS || binary_status != CL_SUCCESS)
+            program = NULL;
+        else if(clBuildProgram(program, 1, &device, build_options, NULL, NULL) != CL_SUCCESS) {
+            clReleaseProgram(program);
+            program = NULL;
+        }
+    }
+
+    // Release
+    free(binary);
+    return program;
+}
+
+/* Written to a temporary file first, concurrent processes never read half a binary */
+static void
+saveProgramBinary(cl_program program,
+                  const char* path)
+{
+    size_t binary_size = 0;
+    cl_int error = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, NULL);
+    if(error != CL_SUCCESS || binary_size == 0)
+        return;
+    cl_uchar* binary = (cl_uchar*)malloc(binary_size);
+    cl_uchar* binaries[] = { binary };
+    error = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL);
+
+    char temp_path[1024];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int)getpid());
+    FILE* file = error == CL_SUCCESS ? fopen(temp_path, "wb") : NULL;
+    if(file != NULL) {
+        size_t written = fwrite(binary, 1, binary_size, file);
+        fclose(file);
+        if(written != binary_size || rename(temp_path, path) != 0)
+            unlink(temp_path);
+    }
+
+    // Release
+    free(binary);
+}
+
+/* Kernels keep the program alive */
+static void
+createKernels(cl_device_id device,
+              const char* source,
+              const char** kernel_functions,
+              const cl_uint kernel_count,
+              const char* build_options,
+              CLDeviceEnvironment* environment)
+{
+    cl_int error = CL_SUCCESS;
+    cl_program program = clodBuildProgram(environment->context, device, source, build_options);
+    environment->kernels = (cl_kernel*)malloc(kernel_count * sizeof(cl_kernel));
+    for(cl_uint i = 0; i < kernel_count; i++) {
+        environment->kernels[i] = clCreateKernel(program, kernel_functions[i], &error);
+        clCheckOrExit(error);
+    }
+    clReleaseProgram(program);
+}
+
+cl_device_id
+clodGetDevice(const cl_uint device_index)
+{
+    cl_uint platform_count = 0;
+    cl_int error = clGetPlatformIDs(0, NULL, &platform_count);
+    clCheckOrExit(error);
+    cl_platform_id* platforms = (cl_platform_id*)malloc((platform_count + 1) * sizeof(cl_platform_id));
+    error = clGetPlatformIDs(platform_count, platforms, NULL);
+    clCheckOrExit(error);
+
+    cl_device_id device = NULL;
+    cl_uint first_index = 0;
+    for(cl_uint p = 0; p < platform_count && device == NULL; p++) {
+        cl_uint device_count = 0;
+        if(clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &device_count) != CL_SUCCESS)
+            continue;
+        if(device_index < first_index + device_count) {
+            cl_device_id* devices = (cl_device_id*)malloc(device_count * sizeof(cl_device_id));
+            error = clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, device_count, devices, NULL);
+            clCheckOrExit(error);
+            device = devices[device_index - first_index];
+            free(devices);
+        }
+        first_index += device_count;
+    }
+    free(platforms);
+
+    if(device == NULL)
+        clCheckOrExit(CL_DEVICE_NOT_FOUND);
+    return device;
+}
+
+cl_uint
+clodGetDeviceCount()
+{
+    cl_uint platform_count = 0;
+    cl_int error = clGetPlatformIDs(0, NULL, &platform_count);
+    clCheckOrExit(error);
+    cl_platform_id* platforms = (cl_platform_id*)malloc((platform_count + 1) * sizeof(cl_platform_id));
+    error = clGetPlatformIDs(platform_count, platforms, NULL);
+    clCheckOrExit(error);
+
+    cl_uint count = 0;
+    for(cl_uint p = 0; p < platform_count; p++) {
+        cl_uint device_count = 0;
+        if(clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 0, NULL, &device_count) == CL_SUCCESS)
+            count += device_count;
+    }
+    free(platforms);
+    return count;
+}
+
+cl_program
+clodBuildProgram(cl_context context,
+                 cl_device_id device,
+                 const char* source,
+                 const char* build_options)
+{
+    char path[1024];
+    getCachePath(device, source, build_options, path, sizeof(path));
+    cl_program program = NULL;
+    if(path[0] != '\0')
+        program = loadProgramBinary(context, device, build_options, path);
+    if(program != NULL)
+        return program;
+
+    // Cold start
+    cl_int error = CL_SUCCESS;
+    program = clCreateProgramWithSource(context, 1, &source, NULL, &error);
+    clCheckOrExit(error);
+    error = clBuildProgram(program, 1, &device, build_options, NULL, NULL);
+    if(error != CL_SUCCESS) {
+        size_t log_size = 0;
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+        char* log = (char*)calloc(log_size + 1, 1);
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, log_size, log, NULL);
+        fprintf(stderr, "clodBuildProgram: %s\n", log);
+        free(log);
+        clCheckOrExit(error);
+    }
+    if(path[0] != '\0')
+        saveProgramBinary(program, path);
+    return program;
+}
+
+void
+clodCreateDeviceEnvironment(cl_device_id device,
+                            const char* source,
+                            const char** kernel_functions,
+                            const cl_uint kernel_count,
+                            const char* build_options,
+                            CLDeviceEnvironment* environment)
+{
+    cl_int error = CL_SUCCESS;
+
+    environment->context = clCreateContext(NULL, 1, &device, NULL, NULL, &error);
+    clCheckOrExit(error);
+    environment->queue = clCreateCommandQueue(environment->context, device, 0, &error);
+    clCheckOrExit(error);
+    createKernels(device, source, kernel_functions, kernel_count, build_options, environment);
+}
+
+void
+clodCreateSharedDeviceEnvironment(const CLDeviceEnvironment* shared,
+                                  const char* source,
+                                  const char** kernel_functions,
+                                  const cl_uint kernel_count,
+                                  const char* build_options,
+                                  CLDeviceEnvironment* environment)
+{
+    cl_device_id device;
+    cl_int error = clGetCommandQueueInfo(shared->queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, NULL);
+    clCheckOrExit(error);
+
+    environment->context = shared->context;
+    environment->queue = shared->queue;
+    error = clRetainContext(environment->context);
+    clCheckOrExit(error);
+    error = clRetainCommandQueue(environment->queue);
+    clCheckOrExit(error);
+    createKernels(device, source, kernel_functions, kernel_count, build_options, environment);
+}
+
+void
+clodFreeDeviceEnvironment(CLDeviceEnvironment* environment,
+                          const cl_uint kernel_count)
+{
+    for(cl_uint i = 0; i < kernel_count; i++)
+        clReleaseKernel(environment->kernels[i]);
+    free(environment->kernels);
+    clReleaseCommandQueue(environment->queue);
+    clReleaseContext(environment->context);
+}
@@ -0,0 +1,64 @@
+//
+//  clodprogram.h
+//  OpenCLFaceDetection
+//
+//  Device environments built from embedded kernel sources (see clodembed and
+//  clodkernels.h). Compiled programs are cached on disk, keyed by device,
+//  driver version, build options and source, so a warm start loads the binary
+//  with clCreateProgramWithBinary instead of compiling.
+//
+//  The cache lives in $CLOD_PROGRAM_CACHE (if set) or $HOME/.clod_cache. A
+//  binary the driver refuses is rebuilt from source and written again.
+//
+
+#ifndef OpenCLFaceDetection_clodprogram_h
+#define OpenCLFaceDetection_clodprogram_h
+
+extern "C" {
+#include "CLEnvironment.h"
+#include "CLDevice.h"
+}
+#include <stdio.h>
+
+#define CLOD_PROGRAM_CACHE_ENV "CLOD_PROGRAM_CACHE"
+#define CLOD_PROGRAM_CACHE_DIR ".clod_cache"
+
+// device_index counts the devices of all platforms, in platform order
+cl_device_id
+clodGetDevice(const cl_uint device_index);
+
+cl_uint
+clodGetDeviceCount();
+
+// Built program, from the cache if possible. Exits on build errors (the log is printed)
+cl_program
+clodBuildProgram(cl_context context,
+                 cl_device_id device,
+                 const char* source,
+                 const char* build_options);
+
+// Context, queue and kernel_count kernels of source on a device
+void
+clodCreateDeviceEnvironment(cl_device_id device,
+                            const char* source,
+                            const char** kernel_functions,
+                            const cl_uint kernel_count,
+                            const char* build_options,
+                            CLDeviceEnvironment* environment);
+
+// Same as clodCreateDeviceEnvironment on the context and queue of shared, which
+// are retained. Buffers of either environment can be bound to kernels of the
+// other and commands of both are ordered on the one queue
+void
+clodCreateSharedDeviceEnvironment(const CLDeviceEnvironment* shared,
+                                  const char* source,
+                                  const char** kernel_functions,
+                                  const cl_uint kernel_count,
+                                  const char* build_options,
+                                  CLDeviceEnvironment* environment);
+
+void
+clodFreeDeviceEnvironment(CLDeviceEnvironment* environment,
+                          const cl_uint kernel_count);
+
+#endif
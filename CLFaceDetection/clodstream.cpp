@@ -0,0 +1,308 @@
+//
+//  clodstream.cpp
+//  OpenCLFaceDetection
+//
+
+#include "clodstream.h"
+
+/* Grayscale, integral image and upload of submitted frames */
+void*
+runUploadThread(void* arg)
+{
+    CLODStream* stream = (CLODStream*)arg;
+    cl_int error = CL_SUCCESS;
+
+    pthread_mutex_lock(&stream->mutex);
+    while(CL_TRUE) {
+        while(!stream->stop && stream->upload_count == stream->submit_count)
+            pthread_cond_wait(&stream->condition, &stream->mutex);
+        if(stream->stop)
+            break;
+        CLODStreamSlot* slot = &stream->slot[stream->upload_count % stream->slot_count];
+        pthread_mutex_unlock(&stream->mutex);
+
+        cl_bool tilted = clodHasTiltedFeatures(stream->cascade);
+        CLIFIntegralResult integral = clifGrayscaleIntegral(slot->frame, NULL, tilted, CL_FALSE);
+        slot->integral_image = integral.image;
+        slot->square_integral_image = integral.square_image;
+        slot->motion.map = NULL;
+        // On the host like the integral image, the clif queue and buffers
+        // belong to the detection
+        if(stream->motion_gating)
+            slot->motion = clifMotionMap(slot->frame, stream->data->clif, CL_FALSE);
+        slot->edge_integral_image = NULL;
+        if(stream->flags & CLOD_EDGE_PRUNING)
+            slot->edge_integral_image = clifEdgeIntegral(slot->frame, NULL, CL_FALSE).image;
+
+        // Non blocking, the first stage launch of the detection waits on the event
+        error = clEnqueueWriteBuffer(stream->upload_queue, slot->integral_buffer, CL_FALSE, 0,
+                                     (tilted ? 2 : 1) * slot->integral_image->width * slot->integral_image->height * sizeof(cl_uint),
+                                     slot->integral_image->data.ptr, 0, NULL, &slot->upload_event);
+        clCheckOrExit(error);
+        error = clFlush(stream->upload_queue);
+        clCheckOrExit(error);
+
+        pthread_mutex_lock(&stream->mutex);
+        stream->upload_count++;
+        pthread_cond_broadcast(&stream->condition);
+    }
+    pthread_mutex_unlock(&stream->mutex);
+    return NULL;
+}
+
+/* Adds the previous objects lying on static blocks to the result of a motion
+ * gated detection and keeps a copy of it for the next frame
+ */
+void
+reuseStaticMatches(CLODStream* stream,
+                   CLODStreamSlot* slot)
+{
+    const CLODStageStatistics* statistics = clodGetStageStatistics(stream->data);
+    for(cl_uint scale_index = 0; scale_index < statistics->scale_count; scale_index++)
+        stream->skipped_window_count += statistics->last_skipped_count[scale_index];
+
+    CLODDetectObjectsResult* result = &slot->result;
+    cl_uint detected_count = result->match_count;
+    result->matches = (CLODWeightedRect*)realloc(result->matches, MAX(result->match_count + stream->previous.match_count, 1) * sizeof(CLODWeightedRect));
+    for(cl_uint i = 0; i < stream->previous.match_count; i++) {
+        const CvRect* r = &stream->previous.matches[i].rect;
+        if(clifIsRectMoving(&slot->motion, r))
+            continue;
+
+        // Found again by a window reaching a moving block
+        cl_int x = r->x + r->width / 2;
+        cl_int y = r->y + r->height / 2;
+        cl_uint j = 0;
+        for(; j < detected_count; j++) {
+            const CvRect* d = &result->matches[j].rect;
+            if(x >= d->x && x < d->x + d->width && y >= d->y && y < d->y + d->height)
+                break;
+        }
+        if(j < detected_count)
+            continue;
+
+        result->matches[result->match_count] = stream->previous.matches[i];
+        result->match_count++;
+        stream->reused_match_count++;
+    }
+
+    stream->previous.matches = (CLODWeightedRect*)realloc(stream->previous.matches, MAX(result->match_count, 1) * sizeof(CLODWeightedRect));
+    memcpy(stream->previous.matches, result->matches, result->match_count * sizeof(CLODWeightedRect));
+    stream->previous.match_count = result->match_count;
+}
+
+/* Cascade evaluation of uploaded frames */
+void*
+runDetectThread(void* arg)
+{
+    CLODStream* stream = (CLODStream*)arg;
+
+    pthread_mutex_lock(&stream->mutex);
+    while(CL_TRUE) {
+        while(!stream->stop && stream->detect_count == stream->upload_count)
+            pthread_cond_wait(&stream->condition, &stream->mutex);
+        if(stream->stop)
+            break;
+        CLODStreamSlot* slot = &stream->slot[stream->detect_count % stream->slot_count];
+        pthread_mutex_unlock(&stream->mutex);
+
+        CLODScanRegions regions;
+        regions.rois = NULL;
+        regions.roi_count = 0;
+        regions.mask = NULL;
+        regions.motion = &slot->motion;
+        slot->result = clodDetectObjectsIntegral(slot->integral_image, slot->square_integral_image, slot->edge_integral_image,
+                                                 slot->integral_buffer, slot->upload_event,
+                                                 stream->cascade, stream->data,
+                                                 stream->min_window_size, stream->max_window_size,
+                                                 stream->min_neighbors, stream->flags,
+                                                 slot->motion.map != NULL ? &regions : NULL);
+        if(slot->motion.map != NULL)
+            reuseStaticMatches(stream, slot);
+
+        // Release
+        clReleaseEvent(slot->upload_event);
+        slot->upload_event = NULL;
+        cvReleaseMat(&slot->integral_image);
+        cvReleaseMat(&slot->square_integral_image);
+        if(slot->edge_integral_image != NULL)
+            cvReleaseMat(&slot->edge_integral_image);
+        if(slot->motion.map != NULL)
+            cvReleaseMat(&slot->motion.map);
+
+        if(stream->callback != NULL)
+            stream->callback(slot->result, slot->frame_data, stream->callback_data);
+
+        pthread_mutex_lock(&stream->mutex);
+        stream->detect_count++;
+        if(stream->callback != NULL)
+            stream->poll_count++;
+        pthread_cond_broadcast(&stream->condition);
+    }
+    pthread_mutex_unlock(&stream->mutex);
+    return NULL;
+}
+
+CLODStream*
+clodCreateStream(CLODEnvironmentData* data,
+                 const CvHaarClassifierCascade* cascade,
+                 const CvSize frame_size,
+                 const CvSize min_window_size,
+                 const CvSize max_window_size,
+                 const cl_uint min_neighbors,
+                 const clod_flags flags,
+                 const cl_uint frames_in_flight)
+{
+    cl_int error = CL_SUCCESS;
+
+    CLODStream* stream = (CLODStream*)calloc(1, sizeof(CLODStream));
+    stream->data = data;
+    stream->cascade = cascade;
+    stream->frame_size = frame_size;
+    stream->min_window_size = min_window_size;
+    stream->max_window_size = max_window_size;
+    stream->min_neighbors = min_neighbors;
+    stream->flags = flags;
+
+    // Uploads get their own queue so they are not serialized behind the cascade
+    cl_device_id device;
+    error = clGetCommandQueueInfo(data->environment.queue, CL_QUEUE_DEVICE, sizeof(cl_device_id), &device, NULL);
+    clCheckOrExit(error);
+    stream->upload_queue = clCreateCommandQueue(data->environment.context, device, 0, &error);
+    clCheckOrExit(error);
+
+    // One integral image buffer (and its tilted sums) per frame in flight
+    stream->slot_count = MAX(frames_in_flight, 1);
+    stream->slot = (CLODStreamSlot*)calloc(stream->slot_count, sizeof(CLODStreamSlot));
+    for(cl_uint i = 0; i < stream->slot_count; i++) {
+        stream->slot[i].integral_buffer =
+        clCreateBuffer(data->environment.context,
+                       CL_MEM_ALLOC_HOST_PTR | CL_MEM_READ_ONLY,
+                       2 * (frame_size.width + 1) * (frame_size.height + 1) * sizeof(cl_uint),
+                       NULL, &error);
+        clCheckOrExit(error);
+    }
+
+    pthread_mutex_init(&stream->mutex, NULL);
+    pthread_cond_init(&stream->condition, NULL);
+    pthread_create(&stream->upload_thread, NULL, runUploadThread, stream);
+    pthread_create(&stream->detect_thread, NULL, runDetectThread, stream);
+
+    return stream;
+}
+
+void
+clodSetStreamCallback(CLODStream* stream,
+                      clod_stream_callback callback,
+                      void* user_data)
+{
+    pthread_mutex_lock(&stream->mutex);
+    stream->callback = callback;
+    stream->callback_data = user_data;
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+void
+clodSetStreamMotionGating(CLODStream* stream,
+                          const cl_bool enable)
+{
+    pthread_mutex_lock(&stream->mutex);
+    stream->motion_gating = enable;
+    stream->previous.match_count = 0;
+    clifResetMotion(stream->data->clif);
+    pthread_mutex_unlock(&stream->mutex);
+}
+
+cl_int
+clodSubmitFrame(CLODStream* stream,
+                const IplImage* frame,
+                void* frame_data,
+                const cl_bool wait)
+{
+    if(frame->width != stream->frame_size.width || frame->height != stream->frame_size.height)
+        return -1;
+
+    // Wait for a free slot
+    pthread_mutex_lock(&stream->mutex);
+    while(stream->submit_count - stream->poll_count == stream->slot_count) {
+        if(!wait) {
+            pthread_mutex_unlock(&stream->mutex);
+            return -1;
+        }
+        pthread_cond_wait(&stream->condition, &stream->mutex);
+    }
+    CLODStreamSlot* slot = &stream->slot[stream->submit_count % stream->slot_count];
+    pthread_mutex_unlock(&stream->mutex);
+
+    // Copy frame, the caller (e.g. cvQueryFrame) may reuse it
+    if(slot->frame != NULL && (slot->frame->depth != frame->depth || slot->frame->nChannels != frame->nChannels))
+        cvReleaseImage(&slot->frame);
+    if(slot->frame == NULL)
+        slot->frame = cvCreateImage(stream->frame_size, frame->depth, frame->nChannels);
+    cvCopy(frame, slot->frame);
+    slot->frame_data = frame_data;
+
+    pthread_mutex_lock(&stream->mutex);
+    stream->submit_count++;
+    pthread_cond_broadcast(&stream->condition);
+    pthread_mutex_unlock(&stream->mutex);
+
+    return CL_SUCCESS;
+}
+
+cl_int
+clodPollResult(CLODStream* stream,
+               CLODDetectObjectsResult* result,
+               void** frame_data,
+               const cl_bool wait)
+{
+    pthread_mutex_lock(&stream->mutex);
+    while(stream->poll_count == stream->detect_count) {
+        // Nothing will ever come
+        if(!wait || stream->callback != NULL || stream->poll_count == stream->submit_count) {
+            pthread_mutex_unlock(&stream->mutex);
+            return -1;
+        }
+        pthread_cond_wait(&stream->condition, &stream->mutex);
+    }
+    CLODStreamSlot* slot = &stream->slot[stream->poll_count % stream->slot_count];
+    *result = slot->result;
+    if(frame_data != NULL)
+        *frame_data = slot->frame_data;
+    stream->poll_count++;
+    pthread_cond_broadcast(&stream->condition);
+    pthread_mutex_unlock(&stream->mutex);
+
+    return CL_SUCCESS;
+}
+
+void
+clodReleaseStream(CLODStream* stream)
+{
+    // Let submitted frames complete, then stop the threads
+    pthread_mutex_lock(&stream->mutex);
+    while(stream->detect_count != stream->submit_count)
+        pthread_cond_wait(&stream->condition, &stream->mutex);
+    stream->stop = CL_TRUE;
+    pthread_cond_broadcast(&stream->condition);
+    pthread_mutex_unlock(&stream->mutex);
+    pthread_join(stream->upload_thread, NULL);
+    pthread_join(stream->detect_thread, NULL);
+
+    // Results never polled
+    for(; stream->poll_count != stream->detect_count; stream->poll_count++)
+        free(stream->slot[stream->poll_count % stream->slot_count].result.matches);
+
+    // Release
+    for(cl_uint i = 0; i < stream->slot_count; i++) {
+        if(stream->slot[i].frame != NULL)
+            cvReleaseImage(&stream->slot[i].frame);
+        clReleaseMemObject(stream->slot[i].integral_buffer);
+    }
+    free(stream->slot);
+    free(stream->previous.matches);
+    clReleaseCommandQueue(stream->upload_queue);
+    pthread_mutex_destroy(&stream->mutex);
+    pthread_cond_destroy(&stream->condition);
+    free(stream);
+}
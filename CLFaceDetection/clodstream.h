@@ -0,0 +1,130 @@
+//
+//  clodstream.h
+//  OpenCLFaceDetection
+//
+//  Asynchronous detection on a stream of frames. Up to frames_in_flight frames
+//  are queued: while the cascade runs on frame k, frame k+1 is converted to an
+//  integral image and uploaded on a separate command queue.
+//
+//      CLODStream* stream = clodCreateStream(data, cascade, cvSize(640, 480), ...);
+//      while(frame = cvQueryFrame(capture)) {
+//          clodSubmitFrame(stream, frame, NULL, CL_TRUE);
+//          while(clodPollResult(stream, &result, NULL, CL_FALSE) == CL_SUCCESS) {
+//              ... draw result.matches, free(result.matches)
+//          }
+//      }
+//      clodReleaseStream(stream);
+//
+//  The environment data must not be used for other detections while the
+//  stream exists.
+//
+//  With motion gating (clodSetStreamMotionGating) windows over blocks that did
+//  not change since the previous frame are skipped, and the previous objects
+//  lying on those blocks are reported again.
+//
+
+#ifndef OpenCLFaceDetection_clodstream_h
+#define OpenCLFaceDetection_clodstream_h
+
+#include <pthread.h>
+#include "clod.h"
+
+#define CLOD_DEFAULT_FRAMES_IN_FLIGHT 2
+
+// Called on the detection thread, in submission order. matches belongs to the callback
+typedef void (*clod_stream_callback)(CLODDetectObjectsResult result,
+                                     void* frame_data,
+                                     void* user_data);
+
+typedef struct CLODStreamSlot {
+    IplImage* frame;
+    void* frame_data;
+    CvMat* integral_image;
+    CvMat* square_integral_image;
+    CvMat* edge_integral_image;
+    cl_mem integral_buffer;
+    cl_event upload_event;
+    CLIFMotionResult motion;
+    CLODDetectObjectsResult result;
+} CLODStreamSlot;
+
+/* Slots form a ring. The counters only grow and the slot of counter i is
+ * slot[i % slot_count]: submit_count >= upload_count >= detect_count >= poll_count
+ */
+typedef struct CLODStream {
+    CLODEnvironmentData* data;
+    const CvHaarClassifierCascade* cascade;
+    CvSize frame_size;
+    CvSize min_window_size;
+    CvSize max_window_size;
+    cl_uint min_neighbors;
+    clod_flags flags;
+
+    cl_command_queue upload_queue;
+    cl_uint slot_count;
+    CLODStreamSlot* slot;
+    cl_uint submit_count;
+    cl_uint upload_count;
+    cl_uint detect_count;
+    cl_uint poll_count;
+
+    clod_stream_callback callback;
+    void* callback_data;
+
+    // Motion gating, previous holds the objects of the last detected frame
+    cl_bool motion_gating;
+    CLODDetectObjectsResult previous;
+    cl_ulong skipped_window_count;
+    cl_ulong reused_match_count;
+
+    pthread_t upload_thread;
+    pthread_t detect_thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t condition;
+    cl_bool stop;
+} CLODStream;
+
+// Frames must have frame_size, clodInitBuffers must have been called with the same size
+CLODStream*
+clodCreateStream(CLODEnvironmentData* data,
+                 const CvHaarClassifierCascade* cascade,
+                 const CvSize frame_size,
+                 const CvSize min_window_size,
+                 const CvSize max_window_size,
+                 const cl_uint min_neighbors,
+                 const clod_flags flags,
+                 const cl_uint frames_in_flight);
+
+// Results are delivered to callback instead of clodPollResult. Set it before submitting
+void
+clodSetStreamCallback(CLODStream* stream,
+                      clod_stream_callback callback,
+                      void* user_data);
+
+// Skip static blocks (see clifMotionMap, computed on the host by the upload
+// thread, clifInitBuffers must have been called). Set it before submitting
+void
+clodSetStreamMotionGating(CLODStream* stream,
+                          const cl_bool enable);
+
+// The frame is copied. Returns -1 if frames_in_flight frames are pending and
+// wait is false, otherwise waits for a free slot
+cl_int
+clodSubmitFrame(CLODStream* stream,
+                const IplImage* frame,
+                void* frame_data,
+                const cl_bool wait);
+
+// Oldest completed result. Returns -1 if none is ready and wait is false or
+// if nothing is pending. The caller frees result->matches
+cl_int
+clodPollResult(CLODStream* stream,
+               CLODDetectObjectsResult* result,
+               void** frame_data,
+               const cl_bool wait);
+
+// Pending frames are completed, results not yet polled are discarded
+void
+clodReleaseStream(CLODStream* stream);
+
+#endif
@@ -0,0 +1,171 @@
+//
+//  clodtrack.cpp
+//  OpenCLFaceDetection
+//
+
+#include "clodtrack.h"
+
+/* Neighbourhood of a tracked object clamped to the frame */
+CvRect
+trackRegion(const CLODWeightedRect* track,
+            const cl_float margin,
+            const IplImage* frame)
+{
+    cl_int dx = (cl_int)lrint(track->rect.width * margin);
+    cl_int dy = (cl_int)lrint(track->rect.height * margin);
+    CvRect roi;
+    roi.x = MAX(track->rect.x - dx, 0);
+    roi.y = MAX(track->rect.y - dy, 0);
+    roi.width = MIN(track->rect.x + track->rect.width + dx, frame->width) - roi.x;
+    roi.height = MIN(track->rect.y + track->rect.height + dy, frame->height) - roi.y;
+    return roi;
+}
+
+/* Match closest to the track centre among the ones inside its region, -1 if none */
+cl_int
+findTrackMatch(const CLODWeightedRect* track,
+               const CvRect* roi,
+               const CLODDetectObjectsResult* result)
+{
+    cl_int best = -1;
+    cl_int best_distance = INT_MAX;
+    cl_int track_x = track->rect.x + track->rect.width / 2;
+    cl_int track_y = track->rect.y + track->rect.height / 2;
+    for(cl_uint i = 0; i < result->match_count; i++) {
+        const CvRect* r = &result->matches[i].rect;
+        if(r->x < roi->x || r->y < roi->y ||
+           r->x + r->width > roi->x + roi->width || r->y + r->height > roi->y + roi->height)
+            continue;
+        cl_int distance = abs(r->x + r->width / 2 - track_x) + abs(r->y + r->height / 2 - track_y);
+        if(distance < best_distance) {
+            best = i;
+            best_distance = distance;
+        }
+    }
+    return best;
+}
+
+/* Tracks are replaced by the result, up to max_tracks */
+void
+setTracks(CLODTracker* tracker,
+          const CLODDetectObjectsResult* result)
+{
+    tracker->track_count = MIN(result->match_count, tracker->max_tracks);
+    tracker->tracks = (CLODWeightedRect*)realloc(tracker->tracks, MAX(tracker->track_count, 1) * sizeof(CLODWeightedRect));
+    memcpy(tracker->tracks, result->matches, tracker->track_count * sizeof(CLODWeightedRect));
+}
+
+CLODTracker*
+clodCreateTracker(CLODEnvironmentData* data,
+                  const CvHaarClassifierCascade* cascade,
+                  const CvSize min_window_size,
+                  const CvSize max_window_size,
+                  const cl_uint min_neighbors,
+                  const clod_flags flags,
+                  const cl_bool use_opencl)
+{
+    CLODTracker* tracker = (CLODTracker*)calloc(1, sizeof(CLODTracker));
+    tracker->data = data;
+    tracker->cascade = cascade;
+    tracker->min_window_size = min_window_size;
+    tracker->max_window_size = max_window_size;
+    tracker->min_neighbors = min_neighbors;
+    tracker->flags = flags;
+    tracker->use_opencl = use_opencl;
+
+    tracker->full_scan_interval = CLOD_DEFAULT_FULL_SCAN_INTERVAL;
+    tracker->margin = CLOD_DEFAULT_TRACK_MARGIN;
+    tracker->scale_band = CLOD_DEFAULT_TRACK_SCALE_BAND;
+    tracker->max_tracks = CLOD_DEFAULT_MAX_TRACKS;
+
+    return tracker;
+}
+
+CLODDetectObjectsResult
+clodTrackObjects(CLODTracker* tracker,
+                 const IplImage* frame)
+{
+    CLODDetectObjectsResult result;
+    tracker->frame_count++;
+
+    // Scan around the tracked objects
+    if(tracker->track_count != 0 && tracker->frames_since_full_scan + 1 < tracker->full_scan_interval) {
+        CvRect* rois = (CvRect*)malloc(tracker->track_count * sizeof(CvRect));
+        CvSize min_window_size = cvSize(INT_MAX, INT_MAX);
+        CvSize max_window_size = cvSize(0, 0);
+        for(cl_uint i = 0; i < tracker->track_count; i++) {
+            const CvRect* r = &tracker->tracks[i].rect;
+            rois[i] = trackRegion(&tracker->tracks[i], tracker->margin, frame);
+            min_window_size.width = MIN(min_window_size.width, (int)(r->width / tracker->scale_band));
+            min_window_size.height = MIN(min_window_size.height, (int)(r->height / tracker->scale_band));
+            max_window_size.width = MAX(max_window_size.width, (int)ceil(r->width * tracker->scale_band));
+            max_window_size.height = MAX(max_window_size.height, (int)ceil(r->height * tracker->scale_band));
+        }
+
+        // Never outside the user range
+        min_window_size.width = MAX(min_window_size.width, tracker->min_window_size.width);
+        min_window_size.height = MAX(min_window_size.height, tracker->min_window_size.height);
+        if(tracker->max_window_size.width != 0)
+            max_window_size.width = MIN(max_window_size.width, tracker->max_window_size.width);
+        if(tracker->max_window_size.height != 0)
+            max_window_size.height = MIN(max_window_size.height, tracker->max_window_size.height);
+
+        CLODScanRegions regions;
+        regions.rois = rois;
+        regions.roi_count = tracker->track_count;
+        regions.mask = NULL;
+        regions.motion = NULL;
+        result = clodDetectObjectsInRegions(frame, tracker->cascade, tracker->data,
+                                            min_window_size, max_window_size,
+                                            tracker->min_neighbors, tracker->flags,
+                                            &regions, tracker->use_opencl);
+
+        // Every track must be found again
+        cl_bool lost = CL_FALSE;
+        for(cl_uint i = 0; i < tracker->track_count && !lost; i++) {
+            cl_int match = findTrackMatch(&tracker->tracks[i], &rois[i], &result);
+            if(match < 0)
+                lost = CL_TRUE;
+            else
+                tracker->tracks[i] = result.matches[match];
+        }
+
+        // Release
+        free(rois);
+
+        if(!lost) {
+            tracker->frames_since_full_scan++;
+
+            // Return the tracks, matches not bound to a track wait for the next full scan
+            result.matches = (CLODWeightedRect*)realloc(result.matches, MAX(tracker->track_count, 1) * sizeof(CLODWeightedRect));
+            memcpy(result.matches, tracker->tracks, tracker->track_count * sizeof(CLODWeightedRect));
+            result.match_count = tracker->track_count;
+            return result;
+        }
+        free(result.matches);
+    }
+
+    // Whole frame
+    result = clodDetectObjects(frame, tracker->cascade, tracker->data,
+                               tracker->min_window_size, tracker->max_window_size,
+                               tracker->min_neighbors, tracker->flags, tracker->use_opencl);
+    setTracks(tracker, &result);
+    tracker->frames_since_full_scan = 0;
+    tracker->full_scan_count++;
+
+    return result;
+}
+
+void
+clodResetTracker(CLODTracker* tracker)
+{
+    tracker->track_count = 0;
+    tracker->frames_since_full_scan = 0;
+}
+
+void
+clodReleaseTracker(CLODTracker* tracker)
+{
+    free(tracker->tracks);
+    free(tracker);
+}
@@ -0,0 +1,77 @@
+//
+//  clodtrack.h
+//  OpenCLFaceDetection
+//
+//  Detection on video that follows the objects found in previous frames. Only
+//  a neighbourhood and a band of scales around each tracked object are
+//  scanned; the whole frame is scanned every full_scan_interval frames, when
+//  nothing is tracked or when a tracked object is lost.
+//
+//      CLODTracker* tracker = clodCreateTracker(data, cascade, cvSize(40, 40), cvSize(0, 0), 3, flags, CL_TRUE);
+//      while(frame = cvQueryFrame(capture)) {
+//          result = clodTrackObjects(tracker, frame);
+//          ... draw result.matches, free(result.matches)
+//      }
+//      clodReleaseTracker(tracker);
+//
+
+#ifndef OpenCLFaceDetection_clodtrack_h
+#define OpenCLFaceDetection_clodtrack_h
+
+#include "clod.h"
+
+// Frames between two scans of the whole frame
+#define CLOD_DEFAULT_FULL_SCAN_INTERVAL 15
+// Searched neighbourhood, as a fraction of the object size added on each side
+#define CLOD_DEFAULT_TRACK_MARGIN 0.5f
+// Windows from size / band to size * band are tried around an object
+#define CLOD_DEFAULT_TRACK_SCALE_BAND 1.25f
+// At most this many objects are tracked, the others wait for a full scan
+#define CLOD_DEFAULT_MAX_TRACKS 8
+
+typedef struct CLODTracker {
+    CLODEnvironmentData* data;
+    const CvHaarClassifierCascade* cascade;
+    CvSize min_window_size;
+    CvSize max_window_size;
+    cl_uint min_neighbors;
+    clod_flags flags;
+    cl_bool use_opencl;
+
+    // Settings, may be changed between frames
+    cl_uint full_scan_interval;
+    cl_float margin;
+    cl_float scale_band;
+    cl_uint max_tracks;
+
+    CLODWeightedRect* tracks;
+    cl_uint track_count;
+    cl_uint frames_since_full_scan;
+
+    // Counters
+    cl_uint frame_count;
+    cl_uint full_scan_count;
+} CLODTracker;
+
+CLODTracker*
+clodCreateTracker(CLODEnvironmentData* data,
+                  const CvHaarClassifierCascade* cascade,
+                  const CvSize min_window_size,
+                  const CvSize max_window_size,
+                  const cl_uint min_neighbors,
+                  const clod_flags flags,
+                  const cl_bool use_opencl);
+
+// Objects in frame, the caller frees result.matches
+CLODDetectObjectsResult
+clodTrackObjects(CLODTracker* tracker,
+                 const IplImage* frame);
+
+// The next frame is scanned as a whole
+void
+clodResetTracker(CLODTracker* tracker);
+
+void
+clodReleaseTracker(CLODTracker* tracker);
+
+#endif
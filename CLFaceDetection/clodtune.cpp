@@ -0,0 +1,152 @@
+//
+//  clodtune.cpp
+//  OpenCLFaceDetection
+//
+
+#include "clodtune.h"
+#include "clodprogram.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* Tuning file, empty if there is no place for it */
+static void
+getTuningPath(char* path,
+              const size_t path_size)
+{
+    path[0] = '\0';
+    const char* file = getenv(CLOD_TUNING_FILE_ENV);
+    const char* home = getenv("HOME");
+    if(file != NULL)
+        snprintf(path, path_size, "%s", file);
+    else if(home != NULL) {
+        snprintf(path, path_size, "%s/%s", home, CLOD_PROGRAM_CACHE_DIR);
+        mkdir(path, 0755);
+        size_t length = strlen(path);
+        snprintf(path + length, path_size - length, "/%s", CLOD_TUNING_FILE_NAME);
+    }
+}
+
+/* "name\tdriver\t", the start of the lines of device */
+static void
+getTuningKey(cl_device_id device,
+             char* key,
+             const size_t key_size)
+{
+    char name[256] = { 0 };
+    char driver[256] = { 0 };
+    cl_int error = clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+    clCheckOrExit(error);
+    error = clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver) - 1, driver, NULL);
+    clCheckOrExit(error);
+    snprintf(key, key_size, "%s\t%s\t", name, driver);
+}
+
+void
+clodDefaultTuning(CLODTuning* tuning)
+{
+    memset(tuning, 0, sizeof(CLODTuning));
+    tuning->gray_local_size[0] = 64;
+    tuning->gray_local_size[1] = 1;
+    tuning->integral_local_size[0] = 32;
+    tuning->integral_local_size[1] = 64;
+    tuning->edge_local_size[0] = 64;
+    tuning->edge_local_size[1] = 1;
+    tuning->stage_local_size = 1;
+}
+
+cl_bool
+clodLoadTuning(cl_device_id device,
+               CLODTuning* tuning)
+{
+    char path[1024];
+    getTuningPath(path, sizeof(path));
+    FILE* file = path[0] != '\0' ? fopen(path, "r") : NULL;
+    if(file == NULL)
+        return CL_FALSE;
+    char key[512];
+    getTuningKey(device, key, sizeof(key));
+    size_t key_length = strlen(key);
+
+    // key gray_x gray_y integral_rows integral_cols edge_x edge_y stage variant
+    char line[1024];
+    cl_bool found = CL_FALSE;
+    while(!found && fgets(line, sizeof(line), file) != NULL) {
+        unsigned long sizes[7];
+        int length = 0;
+        if(strncmp(line, key, key_length) != 0 ||
+           sscanf(line + key_length, "%lu %lu %lu %lu %lu %lu %lu %n",
+                  &sizes[0], &sizes[1], &sizes[2], &sizes[3], &sizes[4], &sizes[5], &sizes[6], &length) != 7)
+            continue;
+        tuning->gray_local_size[0] = sizes[0];
+        tuning->gray_local_size[1] = sizes[1];
+        tuning->integral_local_size[0] = sizes[2];
+        tuning->integral_local_size[1] = sizes[3];
+        tuning->edge_local_size[0] = sizes[4];
+        tuning->edge_local_size[1] = sizes[5];
+        tuning->stage_local_size = sizes[6];
+        snprintf(tuning->variant, sizeof(tuning->variant), "%s", line + key_length + length);
+        tuning->variant[strcspn(tuning->variant, "\r\n")] = '\0';
+        tuning->loaded = found = CL_TRUE;
+    }
+    fclose(file);
+    return found;
+}
+
+/* Lines of other devices are copied to a temporary file, renamed over the old one */
+void
+clodSaveTuning(cl_device_id device,
+               const CLODTuning* tuning)
+{
+    char path[1024];
+    getTuningPath(path, sizeof(path));
+    if(path[0] == '\0')
+        return;
+    char key[512];
+    getTuningKey(device, key, sizeof(key));
+    size_t key_length = strlen(key);
+
+    char temp_path[1024];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int)getpid());
+    FILE* file = fopen(temp_path, "w");
+    if(file == NULL)
+        return;
+    FILE* old_file = fopen(path, "r");
+    if(old_file != NULL) {
+        char line[1024];
+        while(fgets(line, sizeof(line), old_file) != NULL)
+            if(strncmp(line, key, key_length) != 0)
+                fputs(line, file);
+        fclose(old_file);
+    }
+    fprintf(file, "%s%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%s\n", key,
+            (unsigned long)tuning->gray_local_size[0], (unsigned long)tuning->gray_local_size[1],
+            (unsigned long)tuning->integral_local_size[0], (unsigned long)tuning->integral_local_size[1],
+            (unsigned long)tuning->edge_local_size[0], (unsigned long)tuning->edge_local_size[1],
+            (unsigned long)tuning->stage_local_size, tuning->variant);
+    if(fclose(file) != 0 || rename(temp_path, path) != 0)
+        unlink(temp_path);
+}
+
+cl_bool
+clodFitsLocalSize(cl_kernel kernel,
+                  cl_device_id device,
+                  const cl_uint dimensions,
+                  const size_t* global_size,
+                  const size_t* local_size)
+{
+    if(local_size[0] == 0)
+        return CL_TRUE;
+    size_t max_group_size = 0;
+    cl_int error = clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &max_group_size, NULL);
+    clCheckOrExit(error);
+    size_t group_size = 1;
+    for(cl_uint i = 0; i < dimensions; i++) {
+        if(local_size[i] == 0 || global_size[i] % local_size[i] != 0)
+            return CL_FALSE;
+        group_size *= local_size[i];
+    }
+    return group_size <= max_group_size;
+}
@@ -0,0 +1,59 @@
+//
+//  clodtune.h
+//  OpenCLFaceDetection
+//
+//  Work-group sizes and kernel variant of a device. The defaults are the
+//  fixed sizes the kernels always ran with, clodTuneEnvironment (clod.h)
+//  measures candidates on synthetic frames and saves the fastest in the
+//  tuning file, one line per device name and driver version, loaded by
+//  clifInitDeviceEnvironment.
+//
+//  The file is $CLOD_TUNING_FILE (if set) or $HOME/.clod_cache/tuning.
+//
+
+#ifndef OpenCLFaceDetection_clodtune_h
+#define OpenCLFaceDetection_clodtune_h
+
+extern "C" {
+#include "CLEnvironment.h"
+#include "CLDevice.h"
+}
+
+#define CLOD_TUNING_FILE_ENV "CLOD_TUNING_FILE"
+#define CLOD_TUNING_FILE_NAME "tuning"
+#define CLOD_TUNING_VARIANT_SIZE 64
+
+// A local size of 0 lets the driver choose
+typedef struct CLODTuning {
+    cl_bool loaded;                             // found in the tuning file
+    size_t gray_local_size[2];                  // bgrToGrayscale
+    size_t integral_local_size[2];              // integralImageSumRows, integralImageSumCols
+    size_t edge_local_size[2];                  // sobelEdges
+    size_t stage_local_size;                    // runStage
+    char variant[CLOD_TUNING_VARIANT_SIZE];     // extra build options of clod.cl
+} CLODTuning;
+
+void
+clodDefaultTuning(CLODTuning* tuning);
+
+// CL_TRUE (and tuning->loaded) if the file has an entry for device, tuning is
+// left untouched otherwise
+cl_bool
+clodLoadTuning(cl_device_id device,
+               CLODTuning* tuning);
+
+// Replaces the entry of device
+void
+clodSaveTuning(cl_device_id device,
+               const CLODTuning* tuning);
+
+// True if local_size can run kernel over global_size: it divides every
+// dimension and fits the work-group size of the kernel. A local size of 0 always fits
+cl_bool
+clodFitsLocalSize(cl_kernel kernel,
+                  cl_device_id device,
+                  const cl_uint dimensions,
+                  const size_t* global_size,
+                  const size_t* local_size);
+
+#endif
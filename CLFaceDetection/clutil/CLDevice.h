@@ -0,0 +1,20 @@
+//
+//  CLDevice.h
+//  OpenCLFaceDetection
+//
+//  Stand-in for the CLUtil header of the same name (see CLEnvironment.h).
+//  Environments are created by clodCreateDeviceEnvironment (clodprogram.h).
+//
+
+#ifndef OpenCLFaceDetection_CLDevice_h
+#define OpenCLFaceDetection_CLDevice_h
+
+#include "CLEnvironment.h"
+
+typedef struct CLDeviceEnvironment {
+    cl_context context;
+    cl_command_queue queue;
+    cl_kernel* kernels;
+} CLDeviceEnvironment;
+
+#endif
@@ -0,0 +1,23 @@
+//
+//  CLEnvironment.h
+//  OpenCLFaceDetection
+//
+//  Stand-in for the CLUtil header of the same name, used by the CMake build
+//  (CLUtil is only available to the Xcode project). It has what the detector
+//  uses and nothing else.
+//
+
+#ifndef OpenCLFaceDetection_CLEnvironment_h
+#define OpenCLFaceDetection_CLEnvironment_h
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+// Prints the error and exits unless it is CL_SUCCESS
+void
+clCheckOrExit(cl_int error);
+
+#endif
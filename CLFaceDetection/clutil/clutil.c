@@ -0,0 +1,17 @@
+//
+//  clutil.c
+//  OpenCLFaceDetection
+//
+
+#include "CLEnvironment.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+void
+clCheckOrExit(cl_int error)
+{
+    if(error == CL_SUCCESS)
+        return;
+    fprintf(stderr, "OpenCL error %d\n", error);
+    exit(EXIT_FAILURE);
+}
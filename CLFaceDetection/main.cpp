@@ -7,7 +7,21 @@
 //
 
 #include "clod.h"
+#include "clodcascade.h"
+#include <opencv2/highgui/highgui.hpp>
+
+// Built with -DCLOD_HEADLESS (no display) the samples are not shown
+#ifdef CLOD_HEADLESS
+#define showImage(name, image)
+#else
+#define showImage(name, image) cvShowImage(name, image)
+#endif
 char file_xml[] = "/Users/Gabriele/Documents/Projects/CLFaceDetection/CLFaceDetection/haarcascade_frontalface_default.xml";
+char file_clod[] = "/Users/Gabriele/Documents/Projects/CLFaceDetection/CLFaceDetection/haarcascade_frontalface_default.clod";
+char file_eye_xml[] = "/Users/Gabriele/Documents/Projects/CLFaceDetection/CLFaceDetection/haarcascade_eye.xml";
+char file_mouth_xml[] = "/Users/Gabriele/Documents/Projects/CLFaceDetection/CLFaceDetection/haarcascade_mcs_mouth.xml";
+char file_nose_xml[] = "/Users/Gabriele/Documents/Projects/CLFaceDetection/CLFaceDetection/haarcascade_mcs_nose.xml";
+char file_profile_xml[] = "/Users/Gabriele/Documents/Projects/CLFaceDetection/CLFaceDetection/haarcascade_profileface.xml";
 
 char win_face[] = "FaceDetect";
 static CvMemStorage* storage = 0;
@@ -15,6 +29,8 @@ static CvHaarClassifierCascade* cascade = 0;
 
 void find_faces_rect_opencv(IplImage* img, CvSize min_window_size, CvSize max_window_size);
 void find_faces_rect_opencl(IplImage* img, CLODEnvironmentData* data, CvSize min_window_size, CvSize max_window_size, clod_flags, cl_bool);
+void find_faces_features_opencl(IplImage* img, CLODEnvironmentData* data, CvHaarClassifierCascade* eye_cascade, CvHaarClassifierCascade* mouth_cascade, CvHaarClassifierCascade* nose_cascade, CvSize min_window_size, CvSize max_window_size, clod_flags flags);
+void find_faces_profiles_opencl(IplImage* img, CLODEnvironmentData* data, CvHaarClassifierCascade* profile_cascade, CvSize min_window_size, CvSize max_window_size, clod_flags flags);
 
 int main( int argc, char** argv )
 {
@@ -24,16 +40,26 @@ int main( int argc, char** argv )
 	IplImage *frame_resized = 0;
 	IplImage *frame_resized2 = 0;
 	
+    ElapseTime t;
     CvSize min_window_size, max_window_size;
     min_window_size.width = 40;
     min_window_size.height = 40;
     max_window_size.width = 0;
     max_window_size.height = 0;
     
+#ifndef CLOD_HEADLESS
 	cvNamedWindow(win_face, 1);
+#endif
     
 	// Carico il file con le informazioni su cosa trovare
-	cascade = (CvHaarClassifierCascade*)cvLoad(file_xml, 0, 0, 0);
+    // Use the binary cascade (see clodconvert) if available, the XML otherwise
+    t.start();
+    CLODCascade* binary_cascade = clodLoadCascade(file_clod);
+    if(binary_cascade != NULL)
+        cascade = binary_cascade->cascade;
+    else
+        cascade = (CvHaarClassifierCascade*)cvLoad(file_xml, 0, 0, 0);
+    printf("Cascade load (%s): %8.4f ms\n", binary_cascade != NULL ? "binary" : "xml", t.get());
     
 	// Alloco la memoria per elaborare i dati
 	storage = cvCreateMemStorage(0);
@@ -51,11 +77,11 @@ int main( int argc, char** argv )
     cvResize(frame, frame_resized);
     
     CLODEnvironmentData* data = clodInitEnvironment(0);
+    // The first run on a device tunes its local sizes, later runs load them
+    clodTuneEnvironment(data, cascade, window_size, CL_FALSE);
     clifInitBuffers(data->clif, frame_resized->width, frame_resized->height, frame_resized->widthStep, 3);
     clodInitBuffers(data, &window_size);
     
-    ElapseTime t;;
-    
     /* Test grayscale */    
     IplImage* grayscale = cvCreateImage(cvSize(frame_resized->width, frame_resized->height), IPL_DEPTH_8U, 1);
     cvCvtColor(frame_resized, grayscale, CV_BGR2GRAY);
@@ -63,39 +89,105 @@ int main( int argc, char** argv )
     CvMat* sim = cvCreateMat(frame_resized->height + 1, frame_resized->width + 1, CV_32SC1);
     CvMat* sqim = cvCreateMat(frame_resized->height + 1, frame_resized->width + 1, CV_64FC1);
     cvIntegral(grayscale, sim, sqim);
-    double temp = sqim->data.db[2000];
     
-    CLIFIntegralResult r = clifIntegral(frame_resized, data->clif, CL_TRUE);
-    cl_ulong temp2 = ((unsigned long*)r.square_image->data.db)[2000];
+    // Device integral against cvIntegral
+    CLIFIntegralResult r = clifIntegral(grayscale, data->clif, CL_TRUE);
+    cl_uint integral_mismatches = 0;
+    for(int i = 0; i < sim->rows * sim->cols; i++)
+        if(r.image->data.i[i] != sim->data.i[i] || (double)((cl_ulong*)r.square_image->data.ptr)[i] != sqim->data.db[i])
+            integral_mismatches++;
+    printf("Device integral: %u mismatches\n", integral_mismatches);
+    clEnqueueUnmapMemObject(data->clif->environment.queue, data->clif->integral_image_data.buffers[3], r.image->data.ptr, 0, NULL, NULL);
+    clEnqueueUnmapMemObject(data->clif->environment.queue, data->clif->integral_image_data.buffers[4], r.square_image->data.ptr, 0, NULL, NULL);
     
+    // Single cold runs for a visual check, clodbench measures (warmup, percentiles, sweeps)
     cvCopyImage(frame_resized, frame_resized2);
     t.start();
     find_faces_rect_opencv(frame_resized2, min_window_size, max_window_size);
     printf("OpenCV: %8.4f ms\n", t.get());
-    cvShowImage("Sample OpenCV", frame_resized2);
+    showImage("Sample OpenCV", frame_resized2);
         
     cvCopyImage(frame_resized, frame_resized2);
     t.start();
     find_faces_rect_opencl(frame_resized2, data, min_window_size, max_window_size, CLOD_PER_STAGE_ITERATIONS | CLOD_PRECOMPUTE_FEATURES, CL_FALSE);
     printf("OpenCL (optimized): %8.4f ms\n", t.get());
-    cvShowImage("Sample OpenCL (optimized)", frame_resized2);
+    showImage("Sample OpenCL (optimized)", frame_resized2);
     cvCopyImage(frame_resized, frame_resized2);
     t.start();
     find_faces_rect_opencl(frame_resized2, data, min_window_size, max_window_size, CLOD_PRECOMPUTE_FEATURES, CL_TRUE);
     printf("                    %8.4f ms (block)\n", t.get());
-    cvShowImage("Sample OpenCL (optimized, block)", frame_resized2);
+    showImage("Sample OpenCL (optimized, block)", frame_resized2);
     
     cvCopyImage(frame_resized, frame_resized2);
     t.start();
     find_faces_rect_opencl(frame_resized2, data, min_window_size, max_window_size, CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS, CL_FALSE);
     printf("OpenCL (per-stage): %8.4f ms\n", t.get());
-    cvShowImage("Sample OpenCL (per-stage)", frame_resized2);
+    showImage("Sample OpenCL (per-stage)", frame_resized2);
     cvCopyImage(frame_resized, frame_resized2);
     t.start();
     find_faces_rect_opencl(frame_resized2, data, min_window_size, max_window_size, CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS, CL_TRUE);
     printf("                    %8.4f ms (block)\n", t.get());
-    cvShowImage("Sample OpenCL (per-stage, block)", frame_resized2);
-    
+    showImage("Sample OpenCL (per-stage, block)", frame_resized2);
+
+    cvCopyImage(frame_resized, frame_resized2);
+    t.start();
+    find_faces_rect_opencl(frame_resized2, data, min_window_size, max_window_size, CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS | CLOD_ADAPTIVE_STRATEGY, CL_FALSE);
+    printf("OpenCL (adaptive):  %8.4f ms\n", t.get());
+    showImage("Sample OpenCL (adaptive)", frame_resized2);
+    clodPrintStageStatistics(clodGetStageStatistics(data), stdout);
+
+    cvCopyImage(frame_resized, frame_resized2);
+    t.start();
+    find_faces_rect_opencl(frame_resized2, data, min_window_size, max_window_size, CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS | CLOD_HYBRID_SCHEDULING, CL_FALSE);
+    printf("OpenCL (hybrid):    %8.4f ms\n", t.get());
+    showImage("Sample OpenCL (hybrid)", frame_resized2);
+
+    cvCopyImage(frame_resized, frame_resized2);
+    t.start();
+    find_faces_rect_opencl(frame_resized2, data, min_window_size, max_window_size, CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS | CLOD_EDGE_PRUNING, CL_FALSE);
+    printf("OpenCL (edges):     %8.4f ms\n", t.get());
+    showImage("Sample OpenCL (edges)", frame_resized2);
+
+    cvCopyImage(frame_resized, frame_resized2);
+    t.start();
+    find_faces_rect_opencl(frame_resized2, data, min_window_size, max_window_size, CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS | CLOD_FIND_BIGGEST_OBJECT | CLOD_ROUGH_SEARCH, CL_FALSE);
+    printf("OpenCL (biggest):   %8.4f ms\n", t.get());
+    showImage("Sample OpenCL (biggest)", frame_resized2);
+
+    // Same per-stage run with device timings, written as a Chrome trace
+    clodEnableProfiling(data, CL_TRUE);
+    cvCopyImage(frame_resized, frame_resized2);
+    find_faces_rect_opencl(frame_resized2, data, min_window_size, max_window_size, CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS, CL_FALSE);
+    const CLODProfile* profile = clodGetProfile(data);
+    printf("OpenCL (profiled):  %8.4f ms (device %8.4f ms, runStage %8.4f ms)\n",
+           profile->host_time, clodProfileTime(profile, NULL), clodProfileTime(profile, "runStage"));
+    FILE* trace_file = fopen("clod_trace.json", "w");
+    if(trace_file != NULL) {
+        clodPrintProfileTrace(profile, trace_file);
+        fclose(trace_file);
+    }
+    clodEnableProfiling(data, CL_FALSE);
+
+    CvHaarClassifierCascade* eye_cascade = (CvHaarClassifierCascade*)cvLoad(file_eye_xml, 0, 0, 0);
+    CvHaarClassifierCascade* mouth_cascade = (CvHaarClassifierCascade*)cvLoad(file_mouth_xml, 0, 0, 0);
+    CvHaarClassifierCascade* nose_cascade = (CvHaarClassifierCascade*)cvLoad(file_nose_xml, 0, 0, 0);
+    cvCopyImage(frame_resized, frame_resized2);
+    t.start();
+    find_faces_features_opencl(frame_resized2, data, eye_cascade, mouth_cascade, nose_cascade, min_window_size, max_window_size, CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS);
+    printf("OpenCL (features):  %8.4f ms\n", t.get());
+    showImage("Sample OpenCL (features)", frame_resized2);
+    cvReleaseHaarClassifierCascade(&eye_cascade);
+    cvReleaseHaarClassifierCascade(&mouth_cascade);
+    cvReleaseHaarClassifierCascade(&nose_cascade);
+
+    CvHaarClassifierCascade* profile_cascade = (CvHaarClassifierCascade*)cvLoad(file_profile_xml, 0, 0, 0);
+    cvCopyImage(frame_resized, frame_resized2);
+    t.start();
+    find_faces_profiles_opencl(frame_resized2, data, profile_cascade, min_window_size, max_window_size, CLOD_PRECOMPUTE_FEATURES | CLOD_PER_STAGE_ITERATIONS);
+    printf("OpenCL (profiles):  %8.4f ms\n", t.get());
+    showImage("Sample OpenCL (profiles)", frame_resized2);
+    cvReleaseHaarClassifierCascade(&profile_cascade);
+
     //frame_resized->imageData =
     //printf("OpenCL (per-stage, optimized): %8.4f ms\n", t.get());
     //cvShowImage("Sample OpenCL (per-stage, optimized)", frame2);
@@ -127,10 +219,17 @@ int main( int argc, char** argv )
     clodReleaseEnvironment(data);
     free(data);
     
+    if(binary_cascade != NULL)
+        clodReleaseCascade(binary_cascade);
+    else
+        cvReleaseHaarClassifierCascade(&cascade);
+    
 	cvReleaseImage(&frame);
 	cvReleaseImage(&frame_resized);
 	cvReleaseCapture(&capture);
+#ifndef CLOD_HEADLESS
 	cvDestroyWindow(win_face);
+#endif
     
 	return 0;
 }
@@ -183,5 +282,53 @@ void find_faces_rect_opencl(IplImage* img, CLODEnvironmentData* data, CvSize min
     free(result.matches);
 }
 
+void find_faces_features_opencl(IplImage* img, CLODEnvironmentData* data, CvHaarClassifierCascade* eye_cascade, CvHaarClassifierCascade* mouth_cascade, CvHaarClassifierCascade* nose_cascade, CvSize min_window_size, CvSize max_window_size, clod_flags flags)
+{
+    // Eyes are searched in the upper part of the faces, the nose in the middle, the mouth in the lower part
+    CLODCascadeEntry entries[4] = {
+        { cascade, min_window_size, max_window_size, 3, -1, { 0, 0, 0, 0 }, -1 },
+        { eye_cascade, cvSize(20, 20), cvSize(0, 0), 3, 0, { 0, 0.1f, 1, 0.5f }, -1 },
+        { mouth_cascade, cvSize(25, 15), cvSize(0, 0), 3, 0, { 0.15f, 0.6f, 0.7f, 0.4f }, -1 },
+        { nose_cascade, cvSize(18, 15), cvSize(0, 0), 3, 0, { 0.25f, 0.3f, 0.5f, 0.5f }, -1 }
+    };
+    CvScalar colors[4] = { CV_RGB(255,0,0), CV_RGB(0,255,0), CV_RGB(0,0,255), CV_RGB(255,255,0) };
+    CLODDetectObjectsResult results[4];
+    if(clodDetectObjectsMulti(img, entries, 4, data, flags, CL_TRUE, results) != CL_SUCCESS)
+        return;
+    
+    for(cl_uint e = 0; e < 4; e++) {
+        for(cl_uint i = 0; i < results[e].match_count; i++) {
+            CvRect r = results[e].matches[i].rect;
+            cvRectangle(img, cvPoint(r.x, r.y), cvPoint(r.x + r.width, r.y + r.height), colors[e], 3, 8, 0);
+        }
+        free(results[e].matches);
+    }
+}
 
-
+void find_faces_profiles_opencl(IplImage* img, CLODEnvironmentData* data, CvHaarClassifierCascade* profile_cascade, CvSize min_window_size, CvSize max_window_size, clod_flags flags)
+{
+    // Profiles facing both ways are grouped with the frontal faces, only one
+    // way if the profile cascade can not be mirrored
+    CLODCascade* mirrored = clodMirrorCascade(profile_cascade);
+    if(mirrored == NULL)
+        fprintf(stderr, "Profile cascade can not be mirrored, only profiles facing one way are searched\n");
+    CLODCascadeEntry entries[3] = {
+        { cascade, min_window_size, max_window_size, 3, -1, { 0, 0, 0, 0 }, -1 },
+        { profile_cascade, min_window_size, max_window_size, 3, -1, { 0, 0, 0, 0 }, 0 },
+        { mirrored != NULL ? mirrored->cascade : NULL, min_window_size, max_window_size, 3, -1, { 0, 0, 0, 0 }, 0 }
+    };
+    cl_uint entry_count = mirrored != NULL ? 3 : 2;
+    CLODDetectObjectsResult results[3];
+    if(clodDetectObjectsMulti(img, entries, entry_count, data, flags, CL_TRUE, results) != CL_SUCCESS) {
+        clodReleaseCascade(mirrored);
+        return;
+    }
+    
+    for(cl_uint i = 0; i < results[0].match_count; i++) {
+        CvRect r = results[0].matches[i].rect;
+        cvRectangle(img, cvPoint(r.x, r.y), cvPoint(r.x + r.width, r.y + r.height), CV_RGB(255,0,0), 3, 8, 0);
+    }
+    for(cl_uint e = 0; e < entry_count; e++)
+        free(results[e].matches);
+    clodReleaseCascade(mirrored);
+}